@@ -22,6 +22,7 @@
 #include "config.h"
 #endif
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -38,9 +39,11 @@
 #include "cfg.h"
 #include "pcqueue.h"
 #include "lwthread.h"
+#include "clocks.h"
 #include "datapack.h"
 #include "massert.h"
 
+#include "bgjobs.h"
 #include "mainserv.h"
 #include "hddspacemgr.h"
 #include "replicator.h"
@@ -49,6 +52,25 @@
 #define JHASHSIZE 0x400
 #define JHASHPOS(id) ((id)&0x3FF)
 
+#define JFHASHSIZE 0x40
+#define JFHASHPOS(fkey) ((((uintptr_t)(fkey))>>4)&0x3F)
+
+#define JSTRIDE 0x10000
+
+// scheduling classes (highest priority first) - order is the same as in job_class_stats
+enum {
+	JCLASS_CLIENT,		// client reads and writes (csserv)
+	JCLASS_CHUNKOP,		// chunk operations requested by master
+	JCLASS_REPLICATE,	// replication
+	JCLASS_MOVE,		// internal rebalance
+	JCLASS_SCRUB		// chunk tests requested by master
+};
+
+// class weights - each folder queue serves classes proportionally to them
+static const uint32_t jclass_weight[JOB_CLASSES] = {16,8,4,2,1};
+// deadlines in microseconds - job waiting longer is served before anything else (aging)
+static const uint64_t jclass_deadline[JOB_CLASSES] = {20000,100000,1000000,2000000,5000000};
+
 enum {
 	JSTATE_DISABLED,	//禁用状态，当cs与master或client断开连接时会将所有的还未处理的job设置为该状态
 	JSTATE_ENABLED,		//使能状态，新建job时会设置该状态，表示job还未处理
@@ -60,10 +82,11 @@ enum {
 	OP_INVAL,
 //	OP_MAINSERV,
 	OP_CHUNKOP,
-//	OP_OPEN,
-//	OP_CLOSE,
-//	OP_READ,
-//	OP_WRITE,
+	OP_OPEN,
+	OP_CLOSE,
+	OP_READ,
+	OP_WRITE,
+	OP_SENDFILE,
 	OP_SERV_READ,
 	OP_SERV_WRITE,
 	OP_REPLICATE,
@@ -71,6 +94,7 @@ enum {
 	OP_GETCHECKSUM,
 	OP_GETCHECKSUMTAB,
 	OP_CHUNKMOVE,
+	OP_CHUNKOPS,
 };//块操作类型，实际会记录到队列元素中,即queue. op，在线程处理块操作时，会从队列中取出job的同时取出该值以确定块操作的类型
 
 // for OP_CHUNKOP
@@ -81,11 +105,11 @@ typedef struct _chunk_op_args {
 	uint32_t version,newversion,copyversion;
 	uint32_t length;
 } chunk_op_args;
-/*
 // for OP_OPEN and OP_CLOSE
 typedef struct _chunk_oc_args {
 	uint64_t chunkid;
 	uint32_t version;
+	uint32_t offset,size;	// OP_OPEN: data to be precached
 } chunk_oc_args;
 
 // for OP_READ
@@ -93,9 +117,8 @@ typedef struct _chunk_rd_args {
 	uint64_t chunkid;
 	uint32_t version;
 	uint32_t offset,size;
-	uint16_t blocknum;
-	uint8_t *buffer;
-	uint8_t *crcbuff;
+	uint8_t * const *buffers;
+	uint8_t * const *crcbuffs;
 } chunk_rd_args;
 
 // for OP_WRITE
@@ -107,7 +130,16 @@ typedef struct _chunk_wr_args {
 	const uint8_t *buffer;
 	const uint8_t *crcbuff;
 } chunk_wr_args;
-*/
+
+// for OP_SENDFILE
+typedef struct _chunk_sf_args {
+	uint64_t chunkid;
+	uint32_t version;
+	uint16_t blocknum;
+	int *fd;
+	uint64_t *fileoffset;
+	uint8_t *crcbuff;
+} chunk_sf_args;
 
 // for OP_SERV_READ and OP_SERV_WRITE
 typedef struct _chunk_rw_args {
@@ -137,6 +169,13 @@ typedef struct _chunk_mv_args {
 	void *fdst;
 } chunk_mv_args;
 
+// for OP_CHUNKOPS
+typedef struct _chunk_bo_args {
+	uint8_t *reply;	// N * [ op:8 chunkid:64 status:8 ] - statuses are filled by worker
+	uint32_t cnt;
+	uint32_t versions[1];
+} chunk_bo_args;
+
 typedef struct _job {
 	uint32_t jobid;//id，由jobpoo. nextjobid++获得，（0值除外）
 	void (*callback)(uint8_t status,void *extra);//回调函数，一般是用于组织和发送返回信息
@@ -146,9 +185,25 @@ typedef struct _job {
 	// JSTATE_DISABLED,	//禁用状态
 	// JSTATE_ENABLED,		//使能状态
 	// JSTATE_INPROGRESS	//运行状态
+	uint8_t jclass;	// scheduling class (JCLASS_*)
+	uint32_t op;	// operation (OP_*)
+	void *fkey;	// folder queue key (folder pointer used only as an identifier, NULL when unknown)
+	uint64_t qtime;	// time of putting job into folder queue
+	struct _job *qnext;	// next job in folder queue
 	struct _job *next;//指向下一个job结构
 } job;//job,保存了一个块操作所需要的参数和返回信息处理
 
+// per folder job queue - one fifo per class, classes are served using stride scheduling
+typedef struct _jfqueue {
+	void *fkey;
+	job *head[JOB_CLASSES],**tail[JOB_CLASSES];
+	uint64_t pass[JOB_CLASSES];
+	uint64_t vtime;
+	uint32_t elements;
+	struct _jfqueue *anext;	// next folder in round robin list (only folders with queued jobs)
+	struct _jfqueue *hnext,**hprev;
+} jfqueue;
+
 typedef struct _jobpool {
 	int rpipe,wpipe;//一个管道的读写描述符，用于激活消息请求的响应（返回status）
 	int32_t fdpdescpos;
@@ -162,7 +217,18 @@ typedef struct _jobpool {
 	pthread_cond_t worker_term_cond;
 	pthread_mutex_t pipelock;//rpipe,wpipe的互斥锁
 	pthread_mutex_t jobslock;//job的互斥锁，更具体是job. jstate的互斥锁
-	void *jobqueue;//指向job的队列（queue）指针
+	// job scheduler (replaces single fifo) - folders with queued jobs are served round robin
+	pthread_mutex_t schedlock;
+	pthread_cond_t schedcond;
+	uint8_t sched_closed;
+	uint32_t sched_maxsize;
+	uint32_t sched_elements;
+	jfqueue *fqhash[JFHASHSIZE];
+	jfqueue *fqhead,**fqtail;
+	uint32_t cqueued[JOB_CLASSES];
+	uint32_t cqueued_max[JOB_CLASSES];
+	uint64_t cwaitsum[JOB_CLASSES];
+	uint32_t cwaitcnt[JOB_CLASSES];
 	void *statusqueue;//指向status的队列（queue）指针
 	job* jobhash[JHASHSIZE];//job的hash链表数组，所有job的存储结构
 	uint32_t nextjobid;//保存下一个job的id
@@ -185,6 +251,21 @@ void job_stats(uint32_t *maxjobscnt) {
 	stats_maxjobscnt = 0;
 }
 
+void job_class_stats(uint32_t maxqueued[JOB_CLASSES],uint32_t avgwait[JOB_CLASSES]) {
+	jobpool* jp = globalpool;
+	uint32_t cl;
+
+	zassert(pthread_mutex_lock(&(jp->schedlock)));
+	for (cl=0 ; cl<JOB_CLASSES ; cl++) {
+		maxqueued[cl] = jp->cqueued_max[cl];
+		avgwait[cl] = (jp->cwaitcnt[cl]>0)?(jp->cwaitsum[cl]/jp->cwaitcnt[cl]):0;
+		jp->cqueued_max[cl] = jp->cqueued[cl];
+		jp->cwaitsum[cl] = 0;
+		jp->cwaitcnt[cl] = 0;
+	}
+	zassert(pthread_mutex_unlock(&(jp->schedlock)));
+}
+
 uint32_t job_getload(void) {
 	return last_maxjobscnt;
 }
@@ -213,6 +294,157 @@ static inline int job_receive_status(jobpool *jp,uint32_t *jobid,uint8_t *status
 	return 1;	// not last
 }
 
+static inline jfqueue* job_sched_fqueue(jobpool *jp,void *fkey) {
+	uint32_t hpos = JFHASHPOS(fkey);
+	uint32_t cl;
+	jfqueue *fq;
+
+	for (fq=jp->fqhash[hpos] ; fq ; fq=fq->hnext) {
+		if (fq->fkey==fkey) {
+			return fq;
+		}
+	}
+	fq = malloc(sizeof(jfqueue));
+	passert(fq);
+	fq->fkey = fkey;
+	for (cl=0 ; cl<JOB_CLASSES ; cl++) {
+		fq->head[cl] = NULL;
+		fq->tail[cl] = &(fq->head[cl]);
+		fq->pass[cl] = 0;
+	}
+	fq->vtime = 0;
+	fq->elements = 0;
+	fq->anext = NULL;
+	fq->hnext = jp->fqhash[hpos];
+	if (fq->hnext) {
+		fq->hnext->hprev = &(fq->hnext);
+	}
+	fq->hprev = jp->fqhash+hpos;
+	jp->fqhash[hpos] = fq;
+	return fq;
+}
+
+static inline int job_sched_put(jobpool *jp,job *jptr) {
+	jfqueue *fq;
+	uint8_t cl = jptr->jclass;
+	uint64_t now = monotonic_useconds();
+
+	zassert(pthread_mutex_lock(&(jp->schedlock)));
+	if (jp->sched_closed || (jp->sched_maxsize>0 && jp->sched_elements>=jp->sched_maxsize)) {
+		zassert(pthread_mutex_unlock(&(jp->schedlock)));
+		return -1;
+	}
+	fq = job_sched_fqueue(jp,jptr->fkey);
+	if (fq->head[cl]==NULL && fq->pass[cl]<fq->vtime) { // idle class can't save credit for later
+		fq->pass[cl] = fq->vtime;
+	}
+	jptr->qtime = now;
+	jptr->qnext = NULL;
+	*(fq->tail[cl]) = jptr;
+	fq->tail[cl] = &(jptr->qnext);
+	if (fq->elements==0) {
+		fq->anext = NULL;
+		*(jp->fqtail) = fq;
+		jp->fqtail = &(fq->anext);
+	}
+	fq->elements++;
+	jp->sched_elements++;
+	jp->cqueued[cl]++;
+	if (jp->cqueued[cl]>jp->cqueued_max[cl]) {
+		jp->cqueued_max[cl] = jp->cqueued[cl];
+	}
+	zassert(pthread_cond_signal(&(jp->schedcond)));
+	zassert(pthread_mutex_unlock(&(jp->schedlock)));
+	return 0;
+}
+
+/* takes job from next folder (round robin), inside folder job waiting longer than its class deadline goes first, then class with lowest pass value */
+static inline job* job_sched_get(jobpool *jp) {
+	jfqueue *fq;
+	job *jptr;
+	uint64_t now,wait,overdue,maxoverdue;
+	uint8_t cl,bestcl;
+
+	zassert(pthread_mutex_lock(&(jp->schedlock)));
+	while (jp->sched_elements==0 && jp->sched_closed==0) {
+		zassert(pthread_cond_wait(&(jp->schedcond),&(jp->schedlock)));
+	}
+	if (jp->sched_closed) {
+		zassert(pthread_mutex_unlock(&(jp->schedlock)));
+		return NULL;
+	}
+	now = monotonic_useconds();
+	fq = jp->fqhead;
+	jp->fqhead = fq->anext;
+	if (jp->fqhead==NULL) {
+		jp->fqtail = &(jp->fqhead);
+	}
+	bestcl = JOB_CLASSES;
+	maxoverdue = 0;
+	for (cl=0 ; cl<JOB_CLASSES ; cl++) {
+		if (fq->head[cl]!=NULL) {
+			wait = (now>fq->head[cl]->qtime)?(now-fq->head[cl]->qtime):0;
+			if (wait>jclass_deadline[cl]) {
+				overdue = wait - jclass_deadline[cl];
+				if (overdue>maxoverdue) {
+					maxoverdue = overdue;
+					bestcl = cl;
+				}
+			}
+		}
+	}
+	if (bestcl==JOB_CLASSES) {
+		for (cl=0 ; cl<JOB_CLASSES ; cl++) {
+			if (fq->head[cl]!=NULL && (bestcl==JOB_CLASSES || fq->pass[cl]<fq->pass[bestcl])) {
+				bestcl = cl;
+			}
+		}
+	}
+	cl = bestcl;
+	jptr = fq->head[cl];
+	fq->head[cl] = jptr->qnext;
+	if (fq->head[cl]==NULL) {
+		fq->tail[cl] = &(fq->head[cl]);
+	}
+	if (fq->pass[cl]>fq->vtime) {
+		fq->vtime = fq->pass[cl];
+	}
+	fq->pass[cl] += JSTRIDE / jclass_weight[cl];
+	fq->elements--;
+	jp->sched_elements--;
+	jp->cqueued[cl]--;
+	jp->cwaitsum[cl] += (now>jptr->qtime)?(now-jptr->qtime):0;
+	jp->cwaitcnt[cl]++;
+	if (fq->elements>0) {
+		fq->anext = NULL;
+		*(jp->fqtail) = fq;
+		jp->fqtail = &(fq->anext);
+	} else {
+		*(fq->hprev) = fq->hnext;
+		if (fq->hnext) {
+			fq->hnext->hprev = fq->hprev;
+		}
+		free(fq);
+	}
+	zassert(pthread_mutex_unlock(&(jp->schedlock)));
+	return jptr;
+}
+
+static inline uint32_t job_sched_elements(jobpool *jp) {
+	uint32_t res;
+	zassert(pthread_mutex_lock(&(jp->schedlock)));
+	res = jp->sched_elements;
+	zassert(pthread_mutex_unlock(&(jp->schedlock)));
+	return res;
+}
+
+static inline void job_sched_close(jobpool *jp) {
+	zassert(pthread_mutex_lock(&(jp->schedlock)));
+	jp->sched_closed = 1;
+	zassert(pthread_cond_broadcast(&(jp->schedcond)));
+	zassert(pthread_mutex_unlock(&(jp->schedlock)));
+}
+
 void* job_worker(void *arg);
 
 static uint32_t lastnotify = 0;
@@ -253,13 +485,38 @@ static inline void job_close_worker(worker *w) {
 }
 
 #define opargs ((chunk_op_args*)(jptr->args))
-// #define ocargs ((chunk_oc_args*)(jptr->args))
-// #define rdargs ((chunk_rd_args*)(jptr->args))
-// #define wrargs ((chunk_wr_args*)(jptr->args))
+#define ocargs ((chunk_oc_args*)(jptr->args))
+#define rdargs ((chunk_rd_args*)(jptr->args))
+#define wrargs ((chunk_wr_args*)(jptr->args))
+#define sfargs ((chunk_sf_args*)(jptr->args))
 #define rwargs ((chunk_rw_args*)(jptr->args))
 #define rpargs ((chunk_rp_args*)(jptr->args))
 #define ijargs ((chunk_ij_args*)(jptr->args))
 #define mvargs ((chunk_mv_args*)(jptr->args))
+#define boargs ((chunk_bo_args*)(jptr->args))
+
+// executes batch of create/delete operations (all chunks from one folder)
+static uint8_t job_chunkops_run(chunk_bo_args *args) {
+	uint8_t *rptr;
+	const uint8_t *ptr;
+	uint64_t chunkid;
+	uint32_t i;
+	uint8_t op;
+
+	rptr = args->reply;
+	for (i=0 ; i<args->cnt ; i++) {
+		ptr = rptr;
+		op = get8bit(&ptr);
+		chunkid = get64bit(&ptr);
+		if (op==CHUNKOPS_DELETE || op==CHUNKOPS_CREATE) {
+			rptr[9] = hdd_chunkop(chunkid,args->versions[i],0,0,0,op);
+		} else {
+			rptr[9] = MFS_ERROR_EINVAL;
+		}
+		rptr += 10;
+	}
+	return MFS_STATUS_OK;
+}
 /**
  * job_worker函数是各类块操作的线程实体，它内部实际是一个死循环，
  * 主要工作流程是：
@@ -274,18 +531,14 @@ void* job_worker(void *arg) {
 	worker *w = (worker*)arg;
 	jobpool *jp = w->jp;
 	job *jptr;
-	uint8_t *jptrarg;
 	uint8_t status,jstate;
 	uint32_t jobid;
 	uint32_t op;
 
-//	syslog(LOG_NOTICE,"worker %p started (jobqueue: %p ; jptr:%p ; jptrarg:%p ; status:%p )",(void*)pthread_self(),jp->jobqueue,(void*)&jptr,(void*)&jptrarg,(void*)&status);
 	for (;;) {
-		queue_get(jp->jobqueue,&jobid,&op,&jptrarg,NULL);
-//		syslog(LOG_NOTICE,"job worker got job: %"PRIu32",%"PRIu32,jobid,op);
-		jptr = (job*)jptrarg;
+		jptr = job_sched_get(jp);
 		zassert(pthread_mutex_lock(&(jp->jobslock)));
-		if (jobid==0 && op==0 && jptrarg==NULL) { // queue has been closed
+		if (jptr==NULL) { // queue has been closed
 			job_close_worker(w);
 			zassert(pthread_mutex_unlock(&(jp->jobslock)));
 			return NULL;
@@ -294,13 +547,11 @@ void* job_worker(void *arg) {
 		if (jp->workers_avail==0 && jp->workers_total<jp->workers_max) {
 			job_spawn_worker(jp);
 		}
-		if (jptr!=NULL) {
-			jstate=jptr->jstate;
-			if (jptr->jstate==JSTATE_ENABLED) {
-				jptr->jstate=JSTATE_INPROGRESS;
-			}
-		} else {
-			jstate=JSTATE_DISABLED;
+		jobid = jptr->jobid;
+		op = jptr->op;
+		jstate=jptr->jstate;
+		if (jptr->jstate==JSTATE_ENABLED) {
+			jptr->jstate=JSTATE_INPROGRESS;
 		}
 		zassert(pthread_mutex_unlock(&(jp->jobslock)));
 		switch (op) {
@@ -324,12 +575,14 @@ void* job_worker(void *arg) {
 					status = hdd_chunkop(opargs->chunkid,opargs->version,opargs->newversion,opargs->copychunkid,opargs->copyversion,opargs->length);
 				}
 				break;
-/*
 			case OP_OPEN:
 				if (jstate==JSTATE_DISABLED) {
 					status = MFS_ERROR_NOTDONE;
 				} else {
 					status = hdd_open(ocargs->chunkid,ocargs->version);
+					if (status==MFS_STATUS_OK && ocargs->size>0) {
+						hdd_precache_data(ocargs->chunkid,ocargs->offset,ocargs->size);
+					}
 				}
 				break;
 			case OP_CLOSE:
@@ -343,7 +596,7 @@ void* job_worker(void *arg) {
 				if (jstate==JSTATE_DISABLED) {
 					status = MFS_ERROR_NOTDONE;
 				} else {
-					status = hdd_read(rdargs->chunkid,rdargs->version,rdargs->blocknum,rdargs->buffer,rdargs->offset,rdargs->size,rdargs->crcbuff);
+					status = hdd_read_range(rdargs->chunkid,rdargs->version,rdargs->offset,rdargs->size,rdargs->buffers,rdargs->crcbuffs);
 				}
 				break;
 			case OP_WRITE:
@@ -353,7 +606,13 @@ void* job_worker(void *arg) {
 					status = hdd_write(wrargs->chunkid,wrargs->version,wrargs->blocknum,wrargs->buffer,wrargs->offset,wrargs->size,wrargs->crcbuff);
 				}
 				break;
-*/
+			case OP_SENDFILE:
+				if (jstate==JSTATE_DISABLED) {
+					status = MFS_ERROR_NOTDONE;
+				} else {
+					status = hdd_read_sendfile_prepare(sfargs->chunkid,sfargs->version,sfargs->blocknum,sfargs->fd,sfargs->fileoffset,sfargs->crcbuff);
+				}
+				break;
 			case OP_SERV_READ:
 				if (jstate==JSTATE_DISABLED) {
 					status = MFS_ERROR_NOTDONE;
@@ -403,8 +662,14 @@ void* job_worker(void *arg) {
 					status = hdd_move(mvargs->fsrc,mvargs->fdst);
 				}
 				break;
+			case OP_CHUNKOPS:
+				if (jstate==JSTATE_DISABLED) {
+					status = MFS_ERROR_NOTDONE;
+				} else {
+					status = job_chunkops_run(boargs);
+				}
+				break;
 			default: // OP_EXIT
-//				syslog(LOG_NOTICE,"worker %p exiting (jobqueue: %p)",(void*)pthread_self(),jp->jobqueue);
 				zassert(pthread_mutex_lock(&(jp->jobslock)));
 				job_close_worker(w);
 				zassert(pthread_mutex_unlock(&(jp->jobslock)));
@@ -431,7 +696,7 @@ void* job_worker(void *arg) {
  * 调整jobpool的nextjobid++，
  * 返回jobid。
  * */
-static inline uint32_t job_new(jobpool *jp,uint32_t op,void *args,void (*callback)(uint8_t status,void *extra),void *extra,uint8_t errstatus,uint8_t returnonfull) {
+static inline uint32_t job_new(jobpool *jp,uint32_t op,uint8_t jclass,void *fkey,void *args,void (*callback)(uint8_t status,void *extra),void *extra,uint8_t errstatus,uint8_t returnonfull) {
 //	jobpool* jp = (jobpool*)jpool;
 /*
 	if (exiting) {
@@ -463,11 +728,13 @@ static inline uint32_t job_new(jobpool *jp,uint32_t op,void *args,void (*callbac
 		jptr->extra = extra;
 		jptr->args = args;
 		jptr->jstate = JSTATE_ENABLED;
+		jptr->jclass = jclass;
+		jptr->op = op;
+		jptr->fkey = fkey;
 		jptr->next = jp->jobhash[jhpos];
 		jp->jobhash[jhpos] = jptr;
 		zassert(pthread_mutex_unlock(&(jp->jobslock)));
-//		queue_put(jp->jobqueue,jobid,op,(uint8_t*)jptr,1);
-		if (queue_tryput(jp->jobqueue,jobid,op,(uint8_t*)jptr,1)<0) {
+		if (job_sched_put(jp,jptr)<0) {
 			if (returnonfull) {
 				// remove this job from data structures
 				zassert(pthread_mutex_lock(&(jp->jobslock)));
@@ -516,8 +783,22 @@ void* job_pool_new(uint32_t jobs) {
 	zassert(pthread_cond_init(&(jp->worker_term_cond),NULL));
 	zassert(pthread_mutex_init(&(jp->pipelock),NULL));
 	zassert(pthread_mutex_init(&(jp->jobslock),NULL));
-	jp->jobqueue = queue_new(jobs);
-//	syslog(LOG_WARNING,"new jobqueue: %p",jp->jobqueue);
+	zassert(pthread_mutex_init(&(jp->schedlock),NULL));
+	zassert(pthread_cond_init(&(jp->schedcond),NULL));
+	jp->sched_closed = 0;
+	jp->sched_maxsize = jobs;
+	jp->sched_elements = 0;
+	for (i=0 ; i<JFHASHSIZE ; i++) {
+		jp->fqhash[i] = NULL;
+	}
+	jp->fqhead = NULL;
+	jp->fqtail = &(jp->fqhead);
+	for (i=0 ; i<JOB_CLASSES ; i++) {
+		jp->cqueued[i] = 0;
+		jp->cqueued_max[i] = 0;
+		jp->cwaitsum[i] = 0;
+		jp->cwaitcnt[i] = 0;
+	}
 	jp->statusqueue = queue_new(0);
 	zassert(pthread_mutex_lock(&(jp->jobslock)));
 	for (i=0 ; i<JHASHSIZE ; i++) {
@@ -533,7 +814,7 @@ uint32_t job_pool_jobs_count(void) {
 	jobpool* jp = globalpool;
 	uint32_t res;
 	zassert(pthread_mutex_lock(&(jp->jobslock)));
-	res = (jp->workers_total - jp->workers_avail) + queue_elements(jp->jobqueue);
+	res = (jp->workers_total - jp->workers_avail) + job_sched_elements(jp);
 	zassert(pthread_mutex_unlock(&(jp->jobslock)));
 	return res;
 }
@@ -595,32 +876,38 @@ void job_pool_check_jobs(uint8_t cb) {
 	int notlast;
 	job **jhandle,*jptr;
 
-	zassert(pthread_mutex_lock(&(jp->jobslock)));
 	do {
 		notlast = job_receive_status(jp,&jobid,&status);
 		jhpos = JHASHPOS(jobid);
+		// job is removed from hash under lock, but callback is called without it (callbacks may start new jobs)
+		zassert(pthread_mutex_lock(&(jp->jobslock)));
 		jhandle = jp->jobhash+jhpos;
 		while ((jptr = *jhandle)) {
 			if (jptr->jobid==jobid) {
-				if (jptr->callback && cb) {
-					jptr->callback(status,jptr->extra);
-				}
 				*jhandle = jptr->next;
-				if (jptr->args) {
-					free(jptr->args);
-				}
-				free(jptr);
 				break;
 			} else {
 				jhandle = &(jptr->next);
 			}
 		}
+		zassert(pthread_mutex_unlock(&(jp->jobslock)));
+		if (jptr) {
+			if (jptr->callback && cb) {
+				jptr->callback(status,jptr->extra);
+			}
+			if (jptr->args) {
+				free(jptr->args);
+			}
+			free(jptr);
+		}
 	} while (notlast);
-	zassert(pthread_mutex_unlock(&(jp->jobslock)));
 }
 
 void job_pool_delete(jobpool* jp) {
-	queue_close(jp->jobqueue);
+	jfqueue *fq;
+	uint32_t i;
+
+	job_sched_close(jp);
 	zassert(pthread_mutex_lock(&(jp->jobslock)));
 	while (jp->workers_total>0) {
 		jp->workers_term_waiting++;
@@ -631,9 +918,15 @@ void job_pool_delete(jobpool* jp) {
 		syslog(LOG_WARNING,"not empty job queue !!!");
 		job_pool_check_jobs(0);
 	}
-//	syslog(LOG_NOTICE,"deleting jobqueue: %p",jp->jobqueue);
-	queue_delete(jp->jobqueue);
+	for (i=0 ; i<JFHASHSIZE ; i++) {
+		while ((fq = jp->fqhash[i])) {
+			jp->fqhash[i] = fq->hnext;
+			free(fq);
+		}
+	}
 	queue_delete(jp->statusqueue);
+	zassert(pthread_cond_destroy(&(jp->schedcond)));
+	zassert(pthread_mutex_destroy(&(jp->schedlock)));
 	zassert(pthread_cond_destroy(&(jp->worker_term_cond)));
 	zassert(pthread_mutex_destroy(&(jp->pipelock)));
 	zassert(pthread_mutex_destroy(&(jp->jobslock)));
@@ -644,7 +937,7 @@ void job_pool_delete(jobpool* jp) {
 
 uint32_t job_inval(void (*callback)(uint8_t status,void *extra),void *extra) {
 	jobpool* jp = globalpool;
-	return job_new(jp,OP_INVAL,NULL,callback,extra,MFS_ERROR_EINVAL,0);
+	return job_new(jp,OP_INVAL,JCLASS_CHUNKOP,NULL,NULL,callback,extra,MFS_ERROR_EINVAL,0);
 }
 
 /*
@@ -669,17 +962,31 @@ uint32_t job_chunkop(void (*callback)(uint8_t status,void *extra),void *extra,ui
 	args->copychunkid = copychunkid;
 	args->copyversion = copyversion;
 	args->length = length;
-	return job_new(jp,OP_CHUNKOP,args,callback,extra,MFS_ERROR_NOTDONE,0);
+	return job_new(jp,OP_CHUNKOP,(length==2 && newversion==0 && copychunkid==0)?JCLASS_SCRUB:JCLASS_CHUNKOP,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
-/*
-uint32_t job_open(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version) {
+
+/* reply: N * [ op:8 chunkid:64 status:8 ] with statuses set to MFS_ERROR_NOTDONE, fkey: common folder of all chunks */
+uint32_t job_chunkops(void (*callback)(uint8_t status,void *extra),void *extra,void *fkey,uint32_t cnt,const uint32_t *versions,uint8_t *reply) {
+	jobpool* jp = globalpool;
+	chunk_bo_args *args;
+	args = malloc(offsetof(chunk_bo_args,versions)+sizeof(uint32_t)*cnt);
+	passert(args);
+	args->reply = reply;
+	args->cnt = cnt;
+	memcpy(args->versions,versions,sizeof(uint32_t)*cnt);
+	return job_new(jp,OP_CHUNKOPS,JCLASS_CHUNKOP,fkey,args,callback,extra,MFS_ERROR_NOTDONE,0);
+}
+
+uint32_t job_open(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint32_t offset,uint32_t size) {
 	jobpool* jp = globalpool;
 	chunk_oc_args *args;
 	args = malloc(sizeof(chunk_oc_args));
 	passert(args);
 	args->chunkid = chunkid;
 	args->version = version;
-	return job_new(jp,OP_OPEN,args,callback,extra);
+	args->offset = offset;
+	args->size = size;
+	return job_new(jp,OP_OPEN,JCLASS_CLIENT,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 uint32_t job_close(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid) {
@@ -689,22 +996,23 @@ uint32_t job_close(void (*callback)(uint8_t status,void *extra),void *extra,uint
 	passert(args);
 	args->chunkid = chunkid;
 	args->version = 0;
-	return job_new(jp,OP_CLOSE,args,callback,extra);
+	args->offset = 0;
+	args->size = 0;
+	return job_new(jp,OP_CLOSE,JCLASS_CLIENT,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
-uint32_t job_read(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint16_t blocknum,uint8_t *buffer,uint32_t offset,uint32_t size,uint8_t *crcbuff) {
+uint32_t job_read(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint32_t offset,uint32_t size,uint8_t * const *buffers,uint8_t * const *crcbuffs) {
 	jobpool* jp = globalpool;
 	chunk_rd_args *args;
 	args = malloc(sizeof(chunk_rd_args));
 	passert(args);
 	args->chunkid = chunkid;
 	args->version = version;
-	args->blocknum = blocknum;
-	args->buffer = buffer;
 	args->offset = offset;
 	args->size = size;
-	args->crcbuff = crcbuff;
-	return job_new(jp,OP_READ,args,callback,extra);
+	args->buffers = buffers;
+	args->crcbuffs = crcbuffs;
+	return job_new(jp,OP_READ,JCLASS_CLIENT,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 uint32_t job_write(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t *buffer,uint32_t offset,uint32_t size,const uint8_t *crcbuff) {
@@ -719,9 +1027,31 @@ uint32_t job_write(void (*callback)(uint8_t status,void *extra),void *extra,uint
 	args->offset = offset;
 	args->size = size;
 	args->crcbuff = crcbuff;
-	return job_new(jp,OP_WRITE,args,callback,extra);
+	return job_new(jp,OP_WRITE,JCLASS_CLIENT,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
+}
+
+uint32_t job_read_sendfile(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint16_t blocknum,int *fd,uint64_t *fileoffset,uint8_t *crcbuff) {
+	jobpool* jp = globalpool;
+	chunk_sf_args *args;
+	args = malloc(sizeof(chunk_sf_args));
+	passert(args);
+	args->chunkid = chunkid;
+	args->version = version;
+	args->blocknum = blocknum;
+	args->fd = fd;
+	args->fileoffset = fileoffset;
+	args->crcbuff = crcbuff;
+	return job_new(jp,OP_SENDFILE,JCLASS_CLIENT,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
+}
+
+/* client read/write packets start with optional protocol version and chunkid */
+static inline void* job_serv_folder_key(const uint8_t *packet,uint32_t length) {
+	const uint8_t *ptr = packet + (length&1);
+	if (length<12) {
+		return NULL;
+	}
+	return hdd_chunk_folder_key(get64bit(&ptr));
 }
-*/
 
 uint32_t job_serv_read(void (*callback)(uint8_t status,void *extra),void *extra,int sock,const uint8_t *packet,uint32_t length) {
 	jobpool* jp = globalpool;
@@ -731,7 +1061,7 @@ uint32_t job_serv_read(void (*callback)(uint8_t status,void *extra),void *extra,
 	args->sock = sock;
 	args->packet = packet;
 	args->length = length;
-	return job_new(jp,OP_SERV_READ,args,callback,extra,0,1);
+	return job_new(jp,OP_SERV_READ,JCLASS_CLIENT,job_serv_folder_key(packet,length),args,callback,extra,0,1);
 }
 /**
  * 调用：job_serv_write(csserv_iothread_finished,eptr,eptr->sock,data,length);
@@ -751,7 +1081,7 @@ uint32_t job_serv_write(void (*callback)(uint8_t status,void *extra),void *extra
 	args->packet = packet;
 	args->length = length;
 	//往globalpool中添加一个新的job，返回一个jpbid
-	return job_new(jp,OP_SERV_WRITE,args,callback,extra,0,1);
+	return job_new(jp,OP_SERV_WRITE,JCLASS_CLIENT,job_serv_folder_key(packet,length),args,callback,extra,0,1);
 }
 
 uint32_t job_replicate_raid(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint8_t srccnt,const uint32_t xormasks[4],const uint8_t *srcs) {
@@ -770,7 +1100,7 @@ uint32_t job_replicate_raid(void (*callback)(uint8_t status,void *extra),void *e
 	args->xormasks[2] = xormasks[2];
 	args->xormasks[3] = xormasks[3];
 	memcpy(ptr,srcs,srccnt*18);
-	return job_new(jp,OP_REPLICATE,args,callback,extra,MFS_ERROR_NOTDONE,0);
+	return job_new(jp,OP_REPLICATE,JCLASS_REPLICATE,NULL,args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 uint32_t job_replicate_simple(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint32_t ip,uint16_t port) {
@@ -792,7 +1122,7 @@ uint32_t job_replicate_simple(void (*callback)(uint8_t status,void *extra),void
 	put32bit(&ptr,version);
 	put32bit(&ptr,ip);
 	put16bit(&ptr,port);
-	return job_new(jp,OP_REPLICATE,args,callback,extra,MFS_ERROR_NOTDONE,0);
+	return job_new(jp,OP_REPLICATE,JCLASS_REPLICATE,NULL,args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 uint32_t job_get_chunk_blocks(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint8_t *blocks) {
@@ -803,7 +1133,7 @@ uint32_t job_get_chunk_blocks(void (*callback)(uint8_t status,void *extra),void
 	args->chunkid = chunkid;
 	args->version = version;
 	args->pointer = blocks;
-	return job_new(jp,OP_GETBLOCKS,args,callback,extra,MFS_ERROR_NOTDONE,0);
+	return job_new(jp,OP_GETBLOCKS,JCLASS_CHUNKOP,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 uint32_t job_get_chunk_checksum(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint8_t *checksum) {
@@ -814,7 +1144,7 @@ uint32_t job_get_chunk_checksum(void (*callback)(uint8_t status,void *extra),voi
 	args->chunkid = chunkid;
 	args->version = version;
 	args->pointer = checksum;
-	return job_new(jp,OP_GETCHECKSUM,args,callback,extra,MFS_ERROR_NOTDONE,0);
+	return job_new(jp,OP_GETCHECKSUM,JCLASS_CHUNKOP,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 uint32_t job_get_chunk_checksum_tab(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint8_t *checksum_tab) {
@@ -825,7 +1155,7 @@ uint32_t job_get_chunk_checksum_tab(void (*callback)(uint8_t status,void *extra)
 	args->chunkid = chunkid;
 	args->version = version;
 	args->pointer = checksum_tab;
-	return job_new(jp,OP_GETCHECKSUMTAB,args,callback,extra,MFS_ERROR_NOTDONE,0);
+	return job_new(jp,OP_GETCHECKSUMTAB,JCLASS_CHUNKOP,hdd_chunk_folder_key(chunkid),args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 uint32_t job_chunk_move(void (*callback)(uint8_t status,void *extra),void *extra,void *fsrc,void *fdst) {
@@ -835,7 +1165,7 @@ uint32_t job_chunk_move(void (*callback)(uint8_t status,void *extra),void *extra
 	passert(args);
 	args->fsrc = fsrc;
 	args->fdst = fdst;
-	return job_new(jp,OP_CHUNKMOVE,args,callback,extra,MFS_ERROR_NOTDONE,0);
+	return job_new(jp,OP_CHUNKMOVE,JCLASS_MOVE,fsrc,args,callback,extra,MFS_ERROR_NOTDONE,0);
 }
 
 void job_desc(struct pollfd *pdesc,uint32_t *ndesc) {
@@ -877,7 +1207,7 @@ void job_heavyload_test(void) {
 		hlstatus = 1;
 	}
 	if (hlstatus) {
-		load = (jp->workers_total - jp->workers_avail) + queue_elements(jp->jobqueue);
+		load = (jp->workers_total - jp->workers_avail) + job_sched_elements(jp);
 	}
 	zassert(pthread_mutex_unlock(&(jp->jobslock)));
 
@@ -23,7 +23,11 @@
 
 #include <inttypes.h>
 
+/* job scheduling classes: client i/o, master chunk ops, replication, rebalance, scrub (chunk tests) */
+#define JOB_CLASSES 5
+
 void job_stats(uint32_t *maxjobscnt);
+void job_class_stats(uint32_t maxqueued[JOB_CLASSES],uint32_t avgwait[JOB_CLASSES]);
 uint32_t job_getload(void);
 
 void job_pool_disable_job(uint32_t jobid);
@@ -41,10 +45,15 @@ uint32_t job_chunkop(void (*callback)(uint8_t status,void *extra),void *extra,ui
 #define job_duplicate(_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion) (((_newversion>0)&&(_copychunkid)>0)?job_chunkop(_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion,0xFFFFFFFF):job_inval(_cb,_ex))
 #define job_duptrunc(_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion,_length) (((_newversion>0)&&(_copychunkid)>0&&(_length)!=0xFFFFFFFF)?job_chunkop(_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion,_length):job_inval(_cb,_ex))
 
-// uint32_t job_open(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version);
-// uint32_t job_close(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid);
-// uint32_t job_read(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint16_t blocknum,uint8_t *buffer,uint32_t offset,uint32_t size,uint8_t *crcbuff);
-// uint32_t job_write(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t *buffer,uint32_t offset,uint32_t size,const uint8_t *crcbuff);
+/* batch of create/delete operations (MATOCS_CHUNKOPS) on chunks from one folder */
+uint32_t job_chunkops(void (*callback)(uint8_t status,void *extra),void *extra,void *fkey,uint32_t cnt,const uint32_t *versions,uint8_t *reply);
+
+/* single i/o operations for event driven csserv - offset:size in job_open is precached */
+uint32_t job_open(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint32_t offset,uint32_t size);
+uint32_t job_close(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid);
+uint32_t job_read(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint32_t offset,uint32_t size,uint8_t * const *buffers,uint8_t * const *crcbuffs);
+uint32_t job_write(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t *buffer,uint32_t offset,uint32_t size,const uint8_t *crcbuff);
+uint32_t job_read_sendfile(void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid,uint32_t version,uint16_t blocknum,int *fd,uint64_t *fileoffset,uint8_t *crcbuff);
 
 uint32_t job_serv_read(void (*callback)(uint8_t status,void *extra),void *extra,int sock,const uint8_t *packet,uint32_t length);
 uint32_t job_serv_write(void (*callback)(uint8_t status,void *extra),void *extra,int sock,const uint8_t *packet,uint32_t length);
@@ -53,9 +53,15 @@ static const estatdef estatdefs[]=ESTATDEFS
 void chartsdata_refresh(void) {
 	uint64_t data[CHARTS];
 	uint64_t bin,bout;
-	uint32_t i,opr,opw,dbr,dbw,dopr,dopw,movl,movh,repl;
+	uint32_t i,opr,opw,copr,copw,dbr,dbw,dopr,dopw,movl,movh,repl;
 	uint32_t op_cr,op_de,op_ve,op_du,op_tr,op_dt,op_te;
+	uint32_t hlwait;
+	uint32_t bchit,bcmiss,bcblocks;
+	uint32_t rchit,rcmiss,rcpromote,rcevict;
+	uint32_t fdhit,fdmiss,fdevict,fdopen;
+	uint64_t holepunch,holeskip;
 	uint32_t jobs;
+	uint32_t jqueued[JOB_CLASSES],jwait[JOB_CLASSES];
 	uint64_t scpu,ucpu;
 	uint64_t rss,virt;
 
@@ -81,15 +87,21 @@ void chartsdata_refresh(void) {
 
 	job_stats(&jobs);
 	data[CHARTS_LOAD]=jobs;
+	//max number of queued jobs and average job wait time (in microseconds) per scheduling class
+	job_class_stats(jqueued,jwait);
+	for (i=0 ; i<JOB_CLASSES ; i++) {
+		data[CHARTS_QCLIENT+i]=jqueued[i];
+		data[CHARTS_WCLIENT+i]=jwait[i];
+	}
 
 	//
-	csserv_stats(data+CHARTS_CSSERVIN,data+CHARTS_CSSERVOUT);
+	csserv_stats(data+CHARTS_CSSERVIN,data+CHARTS_CSSERVOUT,&copr,&copw);
 	mainserv_stats(&bin,&bout,&opr,&opw);
 	data[CHARTS_CSSERVIN]+=bin;
 	data[CHARTS_CSSERVOUT]+=bout;
 
-	data[CHARTS_HLOPR]=opr;
-	data[CHARTS_HLOPW]=opw;
+	data[CHARTS_HLOPR]=opr+copr;
+	data[CHARTS_HLOPW]=opw+copw;
 	hdd_stats(&bin,&bout,&opr,&opw,&dbr,&dbw,&dopr,&dopw,&movl,&movh,data+CHARTS_RTIME,data+CHARTS_WTIME);
 	data[CHARTS_HDRBYTESR]=bin;
 	data[CHARTS_HDRBYTESW]=bout;
@@ -120,6 +132,32 @@ void chartsdata_refresh(void) {
 	data[CHARTS_TEST]=op_te;
 	//number of chunk internal operations (duplicate,truncate,etc.) per minute 
 	data[CHARTS_CHANGE]=op_ve+op_du+op_tr+op_dt;
+	hdd_lock_stats(&hlwait);
+	//number of contended chunk hash lock acquisitions per minute
+	data[CHARTS_HLWAIT]=hlwait;
+	hdd_bcache_stats(&bchit,&bcmiss,&bcblocks);
+	//number of block cache hits and misses per minute
+	data[CHARTS_BCHIT]=bchit;
+	data[CHARTS_BCMISS]=bcmiss;
+	//number of blocks in block cache
+	data[CHARTS_BCBLOCKS]=bcblocks;
+	hdd_rcache_stats(&rchit,&rcmiss,&rcpromote,&rcevict);
+	//number of read requests served from read cache folders (and not), chunks copied to and removed from read cache per minute
+	data[CHARTS_RCHIT]=rchit;
+	data[CHARTS_RCMISS]=rcmiss;
+	data[CHARTS_RCPROMOTE]=rcpromote;
+	data[CHARTS_RCEVICT]=rcevict;
+	hdd_fdcache_stats(&fdhit,&fdmiss,&fdevict,&fdopen);
+	//number of chunk opens that found descriptor still open (and not), descriptors closed because of open files limit per minute
+	data[CHARTS_FDHIT]=fdhit;
+	data[CHARTS_FDMISS]=fdmiss;
+	data[CHARTS_FDEVICT]=fdevict;
+	//number of open chunk descriptors
+	data[CHARTS_FDOPEN]=fdopen;
+	hdd_hole_stats(&holepunch,&holeskip);
+	//bytes of zero blocks punched out of chunk files and not read because they are holes
+	data[CHARTS_HOLEPUNCH]=holepunch;
+	data[CHARTS_HOLESKIP]=holeskip;
 
 	charts_add(data,main_time()-60);
 }
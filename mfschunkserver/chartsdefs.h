@@ -61,8 +61,32 @@
 #define CHARTS_MOVELS 31
 #define CHARTS_MOVEHS 32
 #define CHARTS_CHANGE 33
+#define CHARTS_HLWAIT 34
+#define CHARTS_BCHIT 35
+#define CHARTS_BCMISS 36
+#define CHARTS_BCBLOCKS 37
+#define CHARTS_QCLIENT 38
+#define CHARTS_QCHUNKOP 39
+#define CHARTS_QREPL 40
+#define CHARTS_QMOVE 41
+#define CHARTS_QSCRUB 42
+#define CHARTS_WCLIENT 43
+#define CHARTS_WCHUNKOP 44
+#define CHARTS_WREPL 45
+#define CHARTS_WMOVE 46
+#define CHARTS_WSCRUB 47
+#define CHARTS_RCHIT 48
+#define CHARTS_RCMISS 49
+#define CHARTS_RCPROMOTE 50
+#define CHARTS_RCEVICT 51
+#define CHARTS_FDHIT 52
+#define CHARTS_FDMISS 53
+#define CHARTS_FDEVICT 54
+#define CHARTS_FDOPEN 55
+#define CHARTS_HOLEPUNCH 56
+#define CHARTS_HOLESKIP 57
 
-#define CHARTS 34
+#define CHARTS 58
 
 #define STRID(a,b,c,d) (((((uint8_t)a)*256U+(uint8_t)b)*256U+(uint8_t)c)*256U+(uint8_t)d)
 
@@ -102,6 +126,30 @@
 	{"movels"       ,STRID('M','O','V','L'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
 	{"movehs"       ,STRID('M','O','V','H'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
 	{"change"       ,STRID('C','H','G','C'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"hlwait"       ,STRID('H','L','W','T'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"bchit"        ,STRID('B','C','H','T'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"bcmiss"       ,STRID('B','C','M','S'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"bcblocks"     ,STRID('B','C','B','L'),CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"qclient"      ,STRID('Q','C','L','I'),CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"qchunkop"     ,STRID('Q','C','O','P'),CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"qrepl"        ,STRID('Q','R','E','P'),CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"qmove"        ,STRID('Q','M','O','V'),CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"qscrub"       ,STRID('Q','S','C','R'),CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"wclient"      ,STRID('W','C','L','I'),CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1,    1}, \
+	{"wchunkop"     ,STRID('W','C','O','P'),CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1,    1}, \
+	{"wrepl"        ,STRID('W','R','E','P'),CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1,    1}, \
+	{"wmove"        ,STRID('W','M','O','V'),CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1,    1}, \
+	{"wscrub"       ,STRID('W','S','C','R'),CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1,    1}, \
+	{"rchit"        ,STRID('R','C','H','T'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"rcmiss"       ,STRID('R','C','M','S'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"rcpromote"    ,STRID('R','C','P','R'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"rcevict"      ,STRID('R','C','E','V'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"fdhit"        ,STRID('F','D','H','T'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"fdmiss"       ,STRID('F','D','M','S'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"fdevict"      ,STRID('F','D','E','V'),CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"fdopen"       ,STRID('F','D','O','P'),CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1,    1}, \
+	{"holepunch"    ,STRID('H','L','P','N'),CHARTS_MODE_ADD,0,CHARTS_SCALE_MILI ,1000,   60}, \
+	{"holeskip"     ,STRID('H','L','S','K'),CHARTS_MODE_ADD,0,CHARTS_SCALE_MILI ,1000,   60}, \
 	{NULL           ,0                     ,0              ,0,0                 ,   0,    0}  \
 };
 
@@ -45,18 +45,34 @@
 #include "charts.h"
 #include "slogger.h"
 #include "bgjobs.h"
+#include "conncache.h"
 #include "massert.h"
 
 // connection timeout in seconds
 #define CSSERV_TIMEOUT 5
 
+// max number of blocks read by one disk job (event driven mode)
+#define CSSERV_READ_BLOCKS 16
+// max number of not finished writes in one connection - above this limit data from client is not read
+#define CSSERV_WRITE_QUEUE 32
+
+#define CONNECT_RETRIES 10
+// connect timeout in seconds
+#define CONNECT_TIMEOUT(cnt) (((cnt)%2)?(0.3*(1<<((cnt)>>1))):(0.2*(1<<((cnt)>>1))))
+
 #define MaxPacketSize CSTOCS_MAXPACKETSIZE
 
 //csserventry.mode
 enum {HEADER,DATA};
 
-//csserventry.state
-enum {IDLE,READ,WRITE,CLOSE};
+//csserventry.state (READ,WRITE - threaded mode ; READING,WRITEINIT,WRITING,WRITEFINISH - event driven mode)
+enum {IDLE,READ,WRITE,READING,WRITEINIT,WRITING,WRITEFINISH,CLOSE,CLOSEWAIT};
+
+//csserventry.chunkopen
+enum {CHUNK_CLOSED,CHUNK_OPENING,CHUNK_OPENED};
+
+//csserventry.fwdstate
+enum {FWD_NONE,FWD_CONNECTING,FWD_CONNECTED,FWD_FAILED};
 
 struct csserventry;
 
@@ -77,8 +93,36 @@ typedef struct packetstruct {
 	uint8_t *startptr;
 	uint32_t bytesleft;
 	uint8_t *packet;
+	uint8_t borrowed;	// packet belongs to write entry (forwarded without copying) - don't free it here
+	int fd;			// packet==NULL - send bytesleft bytes from file fd (sendfile) - own copy of chunk descriptor, closed by hdd_read_sendfile_end
+	uint64_t foffset;
+	uint64_t chunkid;	// packet==NULL - chunk kept unmodified until block is sent
 } packetstruct;
 
+typedef struct readjob {
+	struct csserventry *eptr;
+	uint32_t rsize;
+	uint16_t blocks;
+	uint8_t sendfile;
+	int fd;
+	uint64_t foffset;
+	packetstruct *packets[CSSERV_READ_BLOCKS];
+	uint8_t *dataptrs[CSSERV_READ_BLOCKS];
+	uint8_t *crcptrs[CSSERV_READ_BLOCKS];
+} readjob;
+
+typedef struct writeentry {
+	uint32_t writeid;
+	uint16_t blocknum;
+	uint16_t offset;
+	uint32_t size;
+	uint8_t *packet;	// whole CLTOCS_WRITE_DATA packet (with header) - shared with forward queue
+	uint8_t hddstatus;
+	uint8_t netstatus;
+	uint8_t ack;		// 1 - written to disk, 2 - confirmed by next chunkserver
+	struct writeentry *next;
+} writeentry;
+
 typedef struct csserventry {
 	uint8_t state;
 	uint8_t mode;
@@ -93,6 +137,40 @@ typedef struct csserventry {
 
 	uint32_t jobid;
 
+	// event driven read/write session
+	uint8_t protover;
+	uint8_t chunkopen;
+	uint8_t rsendfile;
+	uint8_t rstatus;
+	uint8_t wfailed;
+	uint32_t jobs;		// number of own jobs in progress - entry can't be freed before they finish
+	uint32_t openjobid;
+	uint32_t rwjobid;
+	uint64_t chunkid;
+	uint32_t version;
+	uint32_t offset,size;	// part of chunk not read yet
+	readjob *rjob;
+	writeentry *whead,**wtail;
+	writeentry *hddhead,*nethead,*wjob;
+	uint32_t wcnt;
+	uint32_t outputcnt;
+	uint32_t sendfilecnt;
+	double lastnop;
+
+	// connection to next chunkserver in chain
+	uint8_t fwdstate;
+	uint8_t fwdmode;
+	uint8_t connretrycnt;
+	int fwdsock;
+	int32_t fwdpdescpos;
+	uint32_t fwdip;
+	uint16_t fwdport;
+	double fwdconnstart;
+	double fwdlastread;
+	uint8_t fwdhdrbuff[8];
+	packetstruct fwdinputpacket;
+	packetstruct *fwdoutputhead,**fwdoutputtail;
+
 	struct idlejob *idlejobs;
 
 	struct csserventry *next;
@@ -107,19 +185,26 @@ static uint16_t mylistenport;
 
 static uint64_t stats_bytesin=0;
 static uint64_t stats_bytesout=0;
+static uint32_t stats_hlopr=0;
+static uint32_t stats_hlopw=0;
 
 // from config
 static char *ListenHost;
 static char *ListenPort;
+static uint8_t EventIO;
 
-void csserv_stats(uint64_t *bin,uint64_t *bout) {
+void csserv_stats(uint64_t *bin,uint64_t *bout,uint32_t *hlopr,uint32_t *hlopw) {
 	*bin = stats_bytesin;
 	*bout = stats_bytesout;
+	*hlopr = stats_hlopr;
+	*hlopw = stats_hlopw;
 	stats_bytesin = 0;
 	stats_bytesout = 0;
+	stats_hlopr = 0;
+	stats_hlopw = 0;
 }
 
-uint8_t* csserv_create_packet(csserventry *eptr,uint32_t type,uint32_t size) {
+static packetstruct* csserv_new_packet(uint32_t type,uint32_t size,uint8_t **wptr) {
 	packetstruct *outpacket;
 	uint8_t *ptr;
 	uint32_t psize;
@@ -136,13 +221,45 @@ uint8_t* csserv_create_packet(csserventry *eptr,uint32_t type,uint32_t size) {
 	// clang analyzer has problem with testing for (void*)(-1) which is needed for memory allocated by mmap
 #endif
 	outpacket->bytesleft = psize;
+	outpacket->borrowed = 0;
+	outpacket->fd = -1;
+	outpacket->foffset = 0;
 	ptr = outpacket->packet;
 	put32bit(&ptr,type);
 	put32bit(&ptr,size);
 	outpacket->startptr = (uint8_t*)(outpacket->packet);
 	outpacket->next = NULL;
+	*wptr = ptr;
+	return outpacket;
+}
+
+static inline void csserv_append_packet(csserventry *eptr,packetstruct *outpacket) {
 	*(eptr->outputtail) = outpacket;
 	eptr->outputtail = &(outpacket->next);
+	eptr->outputcnt++;
+}
+
+static void csserv_free_packets(packetstruct *pptr) {
+	packetstruct *paptr;
+
+	while (pptr) {
+		if (pptr->packet==NULL) {
+			hdd_read_sendfile_end(pptr->chunkid,pptr->fd);
+		} else if (pptr->borrowed==0) {
+			free(pptr->packet);
+		}
+		paptr = pptr;
+		pptr = pptr->next;
+		free(paptr);
+	}
+}
+
+uint8_t* csserv_create_packet(csserventry *eptr,uint32_t type,uint32_t size) {
+	packetstruct *outpacket;
+	uint8_t *ptr;
+
+	outpacket = csserv_new_packet(type,size,&ptr);
+	csserv_append_packet(eptr,outpacket);
 	return ptr;
 }
 
@@ -272,6 +389,736 @@ void csserv_write_init(csserventry *eptr,const uint8_t *data,uint32_t length) {
 	}
 }
 
+/* event driven READ/WRITE - socket i/o in main loop, disk i/o in bgjobs */
+
+static void csserv_evread_continue(csserventry *eptr);
+static void csserv_evwrite_continue(csserventry *eptr);
+
+void csserv_open_finished(uint8_t status,void *e) {
+	csserventry *eptr = (csserventry*)e;
+
+	eptr->jobs--;
+	eptr->openjobid = 0;
+	if (status==MFS_STATUS_OK) {
+		eptr->chunkopen = CHUNK_OPENED;
+	} else {
+		eptr->chunkopen = CHUNK_CLOSED;
+		eptr->rstatus = status;
+	}
+	if (eptr->state==READING) {
+		csserv_evread_continue(eptr);
+	} else if (eptr->state==WRITEINIT || eptr->state==WRITEFINISH) {
+		csserv_evwrite_continue(eptr);
+	}
+}
+
+static void csserv_evread_end(csserventry *eptr) {
+	uint8_t *ptr;
+
+	ptr = csserv_create_packet(eptr,CSTOCL_READ_STATUS,8+1);
+	put64bit(&ptr,eptr->chunkid);
+	put8bit(&ptr,eptr->rstatus);
+	if (eptr->chunkopen==CHUNK_OPENED) {
+		job_close(NULL,NULL,eptr->chunkid);
+		eptr->chunkopen = CHUNK_CLOSED;
+		stats_hlopr++;
+	}
+	eptr->state = IDLE;
+}
+
+void csserv_readjob_finished(uint8_t status,void *r) {
+	readjob *rj = (readjob*)r;
+	csserventry *eptr = rj->eptr;
+	packetstruct *pp;
+	uint16_t b;
+
+	eptr->jobs--;
+	eptr->rjob = NULL;
+	eptr->rwjobid = 0;
+	if (eptr->state==READING && status==MFS_STATUS_OK) {
+		for (b=0 ; b<rj->blocks ; b++) {
+			csserv_append_packet(eptr,rj->packets[b]);
+		}
+		if (rj->sendfile) {
+			pp = malloc(sizeof(packetstruct));
+			passert(pp);
+			pp->packet = NULL;
+			pp->borrowed = 0;
+			pp->startptr = NULL;
+			pp->bytesleft = rj->rsize;
+			pp->fd = rj->fd;
+			pp->foffset = rj->foffset;
+			pp->chunkid = eptr->chunkid;
+			pp->next = NULL;
+			csserv_append_packet(eptr,pp);
+			eptr->sendfilecnt++;
+		}
+		eptr->offset += rj->rsize;
+		eptr->size -= rj->rsize;
+	} else {
+		for (b=0 ; b<rj->blocks ; b++) {
+			free(rj->packets[b]->packet);
+			free(rj->packets[b]);
+		}
+		if (rj->sendfile && status==MFS_STATUS_OK) {
+			hdd_read_sendfile_end(eptr->chunkid,rj->fd); // prepared block won't be sent
+		} else if (rj->sendfile && status==MFS_ERROR_ENOTSUP) {
+			eptr->rsendfile = 0; // block can't be sent directly from file - use standard reads from now on
+		} else {
+			eptr->rstatus = status;
+		}
+	}
+	free(rj);
+	if (eptr->state==READING) {
+		csserv_evread_continue(eptr);
+	}
+}
+
+static void csserv_evread_next(csserventry *eptr) {
+	readjob *rj;
+	uint8_t *ptr;
+	uint16_t blocknum,blockoffset,b;
+	uint32_t blocksize,left;
+
+	blocknum = eptr->offset>>MFSBLOCKBITS;
+	blockoffset = eptr->offset&MFSBLOCKMASK;
+	rj = malloc(sizeof(readjob));
+	passert(rj);
+	rj->eptr = eptr;
+	rj->fd = -1;
+	rj->foffset = 0;
+	if (eptr->rsendfile && blockoffset==0 && eptr->size>=MFSBLOCKSIZE) {
+		rj->sendfile = 1;
+		rj->blocks = 1;
+		rj->rsize = MFSBLOCKSIZE;
+		rj->packets[0] = csserv_new_packet(CSTOCL_READ_DATA,8+2+2+4+4,&ptr);
+		ptr -= 4;
+		put32bit(&ptr,8+2+2+4+4+MFSBLOCKSIZE); // block data is sent directly from chunk file
+		put64bit(&ptr,eptr->chunkid);
+		put16bit(&ptr,blocknum);
+		put16bit(&ptr,0);
+		put32bit(&ptr,MFSBLOCKSIZE);
+		rj->crcptrs[0] = ptr;
+		rj->dataptrs[0] = NULL;
+		eptr->jobs++;
+		eptr->rjob = rj;
+		eptr->rwjobid = job_read_sendfile(csserv_readjob_finished,rj,eptr->chunkid,eptr->version,blocknum,&(rj->fd),&(rj->foffset),rj->crcptrs[0]);
+		return;
+	}
+	rj->sendfile = 0;
+	rj->rsize = CSSERV_READ_BLOCKS*MFSBLOCKSIZE - blockoffset;
+	if (rj->rsize > eptr->size) {
+		rj->rsize = eptr->size;
+	}
+	rj->blocks = ((eptr->offset+rj->rsize-1)>>MFSBLOCKBITS) - blocknum + 1;
+	left = rj->rsize;
+	for (b=0 ; b<rj->blocks ; b++) {
+		if (b==0 && blockoffset+left>MFSBLOCKSIZE) {
+			blocksize = MFSBLOCKSIZE-blockoffset;
+		} else if (left>MFSBLOCKSIZE) {
+			blocksize = MFSBLOCKSIZE;
+		} else {
+			blocksize = left;
+		}
+		rj->packets[b] = csserv_new_packet(CSTOCL_READ_DATA,8+2+2+4+4+blocksize,&ptr);
+		put64bit(&ptr,eptr->chunkid);
+		put16bit(&ptr,blocknum+b);
+		put16bit(&ptr,(b==0)?blockoffset:0);
+		put32bit(&ptr,blocksize);
+		rj->crcptrs[b] = ptr;
+		rj->dataptrs[b] = ptr+4;
+		left -= blocksize;
+	}
+	eptr->jobs++;
+	eptr->rjob = rj;
+	eptr->rwjobid = job_read(csserv_readjob_finished,rj,eptr->chunkid,eptr->version,eptr->offset,rj->rsize,rj->dataptrs,rj->crcptrs);
+}
+
+static void csserv_evread_continue(csserventry *eptr) {
+	if (eptr->rjob!=NULL || eptr->chunkopen==CHUNK_OPENING) {
+		return;
+	}
+	if (eptr->chunkopen==CHUNK_OPENED && eptr->size>0 && eptr->rstatus==MFS_STATUS_OK) {
+		if (eptr->outputcnt<CSSERV_READ_BLOCKS) { // keep at most two batches of blocks in memory
+			csserv_evread_next(eptr);
+		}
+		return;
+	}
+	if (eptr->sendfilecnt>0) { // queued blocks are still read from chunk file
+		return;
+	}
+	csserv_evread_end(eptr);
+}
+
+void csserv_evread_init(csserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint8_t *ptr;
+	uint8_t status;
+
+	if (length!=20 && length!=21) {
+		syslog(LOG_NOTICE,"CLTOCS_READ - wrong size (%"PRIu32"/20|21)",length);
+		eptr->state = CLOSE;
+		return;
+	}
+	if (length==21) {
+		eptr->protover = get8bit(&data);
+	} else {
+		eptr->protover = 0;
+	}
+	eptr->chunkid = get64bit(&data);
+	eptr->version = get32bit(&data);
+	eptr->offset = get32bit(&data);
+	eptr->size = get32bit(&data);
+	if (eptr->size==0) {
+		status = MFS_STATUS_OK;
+	} else if (eptr->size>MFSCHUNKSIZE) {
+		status = MFS_ERROR_WRONGSIZE;
+	} else if (eptr->offset>=MFSCHUNKSIZE || eptr->offset+eptr->size>MFSCHUNKSIZE) {
+		status = MFS_ERROR_WRONGOFFSET;
+	} else {
+		eptr->state = READING;
+		eptr->rstatus = MFS_STATUS_OK;
+		eptr->rsendfile = hdd_sendfile_enabled();
+		eptr->lastnop = monotonic_seconds();
+		eptr->chunkopen = CHUNK_OPENING;
+		eptr->jobs++;
+		eptr->openjobid = job_open(csserv_open_finished,eptr,eptr->chunkid,eptr->version,eptr->offset,eptr->size);
+		return;
+	}
+	ptr = csserv_create_packet(eptr,CSTOCL_READ_STATUS,8+1);
+	put64bit(&ptr,eptr->chunkid);
+	put8bit(&ptr,status);
+}
+
+static uint8_t* csserv_fwd_create_packet(csserventry *eptr,uint32_t type,uint32_t size) {
+	packetstruct *outpacket;
+	uint8_t *ptr;
+
+	outpacket = csserv_new_packet(type,size,&ptr);
+	*(eptr->fwdoutputtail) = outpacket;
+	eptr->fwdoutputtail = &(outpacket->next);
+	return ptr;
+}
+
+/* forward received packet to next chunkserver using its buffer - packet has to live until it is sent */
+static void csserv_fwd_append_shared(csserventry *eptr,uint8_t *packet,uint32_t size) {
+	packetstruct *outpacket;
+
+	outpacket = malloc(sizeof(packetstruct));
+	passert(outpacket);
+	outpacket->packet = packet;
+	outpacket->borrowed = 1;
+	outpacket->startptr = packet;
+	outpacket->bytesleft = size+8;
+	outpacket->fd = -1;
+	outpacket->foffset = 0;
+	outpacket->next = NULL;
+	*(eptr->fwdoutputtail) = outpacket;
+	eptr->fwdoutputtail = &(outpacket->next);
+}
+
+static void csserv_fwd_close(csserventry *eptr,uint8_t cache) {
+	if (eptr->fwdsock>=0) {
+		if (cache && eptr->fwdstate==FWD_CONNECTED && eptr->fwdoutputhead==NULL && eptr->fwdmode==HEADER && eptr->fwdinputpacket.bytesleft==8) {
+			conncache_insert(eptr->fwdip,eptr->fwdport,eptr->fwdsock);
+		} else {
+			tcpclose(eptr->fwdsock);
+		}
+	}
+	eptr->fwdsock = -1;
+	eptr->fwdstate = FWD_NONE;
+	if (eptr->fwdinputpacket.packet) {
+		free(eptr->fwdinputpacket.packet);
+	}
+	eptr->fwdinputpacket.packet = NULL;
+	csserv_free_packets(eptr->fwdoutputhead);
+	eptr->fwdoutputhead = NULL;
+	eptr->fwdoutputtail = &(eptr->fwdoutputhead);
+}
+
+static void csserv_fwd_connect(csserventry *eptr) {
+	int status;
+
+	if (eptr->connretrycnt==0) {
+		eptr->fwdsock = conncache_get(eptr->fwdip,eptr->fwdport);
+		if (eptr->fwdsock>=0) {
+			eptr->fwdstate = FWD_CONNECTED;
+			eptr->fwdlastread = monotonic_seconds();
+			return;
+		}
+	}
+	while (eptr->connretrycnt<CONNECT_RETRIES) {
+		eptr->connretrycnt++;
+		eptr->fwdsock = tcpsocket();
+		if (eptr->fwdsock<0) {
+			mfs_errlog(LOG_WARNING,"create socket, error");
+			continue;
+		}
+		if (tcpnonblock(eptr->fwdsock)<0) {
+			mfs_errlog(LOG_WARNING,"set nonblock, error");
+			tcpclose(eptr->fwdsock);
+			eptr->fwdsock = -1;
+			continue;
+		}
+		status = tcpnumconnect(eptr->fwdsock,eptr->fwdip,eptr->fwdport);
+		if (status<0) {
+			mfs_arg_errlog(LOG_WARNING,"connect to %u.%u.%u.%u:%u failed, error",(eptr->fwdip>>24)&0xFF,(eptr->fwdip>>16)&0xFF,(eptr->fwdip>>8)&0xFF,eptr->fwdip&0xFF,eptr->fwdport);
+			tcpclose(eptr->fwdsock);
+			eptr->fwdsock = -1;
+			continue;
+		}
+		eptr->fwdmode = HEADER;
+		eptr->fwdinputpacket.bytesleft = 8;
+		eptr->fwdinputpacket.startptr = eptr->fwdhdrbuff;
+		if (status==0) {
+			tcpnodelay(eptr->fwdsock);
+			eptr->fwdstate = FWD_CONNECTED;
+			eptr->fwdlastread = monotonic_seconds();
+		} else {
+			eptr->fwdstate = FWD_CONNECTING;
+			eptr->fwdconnstart = monotonic_seconds();
+		}
+		return;
+	}
+	eptr->fwdstate = FWD_FAILED;
+}
+
+static void csserv_fwd_connecttest(csserventry *eptr,short revents,double now) {
+	if (revents & (POLLOUT|POLLHUP|POLLERR)) {
+		if (tcpgetstatus(eptr->fwdsock)) {
+			mfs_errlog_silent(LOG_NOTICE,"connection to next chunkserver failed, error");
+		} else {
+			tcpnodelay(eptr->fwdsock);
+			eptr->fwdstate = FWD_CONNECTED;
+			eptr->fwdlastread = now;
+			return;
+		}
+	} else if (eptr->fwdconnstart+CONNECT_TIMEOUT(eptr->connretrycnt-1)>=now) {
+		return;
+	}
+	tcpclose(eptr->fwdsock);
+	eptr->fwdsock = -1;
+	csserv_fwd_connect(eptr);
+	if (eptr->fwdstate==FWD_FAILED) {
+		csserv_evwrite_continue(eptr);
+	}
+}
+
+static void csserv_evwrite_error(csserventry *eptr,uint32_t writeid,uint8_t status) {
+	uint8_t *ptr;
+
+	ptr = csserv_create_packet(eptr,CSTOCL_WRITE_STATUS,8+4+1);
+	put64bit(&ptr,eptr->chunkid);
+	put32bit(&ptr,writeid);
+	put8bit(&ptr,status);
+	eptr->wfailed = 1;
+	eptr->state = WRITEFINISH;
+}
+
+/* connection to next chunkserver is lost - writes not confirmed yet are reported as failed in proper order */
+static void csserv_fwd_failed(csserventry *eptr) {
+	writeentry *we;
+
+	csserv_fwd_close(eptr,0);
+	if (eptr->nethead==NULL) {
+		if (eptr->wfailed==0) {
+			csserv_evwrite_error(eptr,0,MFS_ERROR_DISCONNECTED);
+		}
+		return;
+	}
+	for (we=eptr->nethead ; we ; we=we->next) {
+		we->netstatus = MFS_ERROR_DISCONNECTED;
+		we->ack |= 2;
+	}
+	eptr->nethead = NULL;
+	eptr->fwdstate = FWD_FAILED;
+}
+
+static void csserv_free_writes(csserventry *eptr) {
+	writeentry *we,*nwe;
+
+	for (we=eptr->whead ; we ; we=nwe) {
+		nwe = we->next;
+		free(we->packet);
+		free(we);
+	}
+	eptr->whead = NULL;
+	eptr->wtail = &(eptr->whead);
+	eptr->hddhead = NULL;
+	eptr->nethead = NULL;
+	eptr->wcnt = 0;
+}
+
+static void csserv_evwrite_end(csserventry *eptr) {
+	csserv_fwd_close(eptr,(eptr->wfailed==0 && eptr->protover>0)?1:0);
+	csserv_free_writes(eptr);
+	if (eptr->chunkopen==CHUNK_OPENED) {
+		job_close(NULL,NULL,eptr->chunkid);
+		eptr->chunkopen = CHUNK_CLOSED;
+		stats_hlopw++;
+	}
+	eptr->state = IDLE;
+}
+
+void csserv_writejob_finished(uint8_t status,void *e) {
+	csserventry *eptr = (csserventry*)e;
+	writeentry *we;
+
+	eptr->jobs--;
+	eptr->rwjobid = 0;
+	we = eptr->wjob;
+	eptr->wjob = NULL;
+	we->hddstatus = status;
+	we->ack |= 1;
+	eptr->hddhead = we->next;
+	if (eptr->state==WRITING || eptr->state==WRITEFINISH) {
+		csserv_evwrite_continue(eptr);
+	}
+}
+
+static void csserv_evwrite_continue(csserventry *eptr) {
+	writeentry *we;
+	uint8_t *ptr;
+	uint8_t status;
+
+	if (eptr->state==WRITEINIT) {
+		if (eptr->chunkopen==CHUNK_OPENING || eptr->fwdstate==FWD_CONNECTING) {
+			return;
+		}
+		if (eptr->chunkopen==CHUNK_CLOSED) {
+			csserv_evwrite_error(eptr,0,eptr->rstatus);
+		} else if (eptr->fwdstate==FWD_FAILED) {
+			csserv_evwrite_error(eptr,0,MFS_ERROR_CANTCONNECT);
+		} else {
+			if (eptr->fwdsock<0) { // last in chain - confirm session, in the middle of chain this status comes from next chunkserver
+				ptr = csserv_create_packet(eptr,CSTOCL_WRITE_STATUS,8+4+1);
+				put64bit(&ptr,eptr->chunkid);
+				put32bit(&ptr,0);
+				put8bit(&ptr,MFS_STATUS_OK);
+			}
+			eptr->state = WRITING;
+			eptr->lastread = monotonic_seconds();
+			eptr->fwdlastread = eptr->lastread;
+		}
+	}
+	if (eptr->state!=WRITING && eptr->state!=WRITEFINISH) {
+		return;
+	}
+	if (eptr->wfailed==0) {
+		// disk writes in one chunk are done one by one in order of arrival
+		if (eptr->wjob==NULL && eptr->hddhead!=NULL) {
+			we = eptr->hddhead;
+			eptr->wjob = we;
+			eptr->jobs++;
+			eptr->rwjobid = job_write(csserv_writejob_finished,eptr,eptr->chunkid,eptr->version,we->blocknum,we->packet+8+8+4+2+2+4+4,we->offset,we->size,we->packet+8+8+4+2+2+4);
+		}
+		while ((we=eptr->whead)!=NULL) {
+			if ((we->ack&1) && we->hddstatus!=MFS_STATUS_OK) {
+				status = we->hddstatus;
+			} else if ((we->ack&2) && we->netstatus!=MFS_STATUS_OK) {
+				status = we->netstatus;
+			} else if (we->ack==3) {
+				status = MFS_STATUS_OK;
+			} else {
+				break;
+			}
+			if (status!=MFS_STATUS_OK) {
+				csserv_evwrite_error(eptr,we->writeid,status);
+				break;
+			}
+			ptr = csserv_create_packet(eptr,CSTOCL_WRITE_STATUS,8+4+1);
+			put64bit(&ptr,eptr->chunkid);
+			put32bit(&ptr,we->writeid);
+			put8bit(&ptr,MFS_STATUS_OK);
+			eptr->whead = we->next;
+			if (eptr->whead==NULL) {
+				eptr->wtail = &(eptr->whead);
+			}
+			free(we->packet);
+			free(we);
+			eptr->wcnt--;
+		}
+	}
+	if (eptr->state==WRITEFINISH && eptr->wjob==NULL && eptr->chunkopen!=CHUNK_OPENING) {
+		if (eptr->wfailed ? (eptr->outputhead==NULL) : (eptr->whead==NULL && eptr->fwdoutputhead==NULL)) { // error status has to be sent before any new packet from client is read
+			csserv_evwrite_end(eptr);
+		}
+	}
+}
+
+void csserv_evwrite_init(csserventry *eptr,const uint8_t *data,uint32_t length) {
+	uint8_t *ptr;
+	uint32_t hdrsize;
+
+	if (length&1) {
+		if (length<13 || ((length-13)%6)!=0) {
+			syslog(LOG_NOTICE,"CLTOCS_WRITE - wrong size (%"PRIu32"/13+N*6)",length);
+			eptr->state = CLOSE;
+			return;
+		}
+		eptr->protover = get8bit(&data);
+		hdrsize = 13;
+	} else {
+		if (length<12 || ((length-12)%6)!=0) {
+			syslog(LOG_NOTICE,"CLTOCS_WRITE - wrong size (%"PRIu32"/12+N*6)",length);
+			eptr->state = CLOSE;
+			return;
+		}
+		eptr->protover = 0;
+		hdrsize = 12;
+	}
+	eptr->chunkid = get64bit(&data);
+	eptr->version = get32bit(&data);
+	eptr->state = WRITEINIT;
+	eptr->wfailed = 0;
+	eptr->lastnop = 0.0;
+	eptr->connretrycnt = 0;
+	if (length>hdrsize) { // forward to the rest of chain
+		eptr->fwdip = get32bit(&data);
+		eptr->fwdport = get16bit(&data);
+		ptr = csserv_fwd_create_packet(eptr,CLTOCS_WRITE,length-6);
+		if (eptr->protover) {
+			put8bit(&ptr,eptr->protover);
+		}
+		put64bit(&ptr,eptr->chunkid);
+		put32bit(&ptr,eptr->version);
+		memcpy(ptr,data,length-hdrsize-6);
+		csserv_fwd_connect(eptr);
+	}
+	eptr->chunkopen = CHUNK_OPENING;
+	eptr->jobs++;
+	eptr->openjobid = job_open(csserv_open_finished,eptr,eptr->chunkid,eptr->version,0,0);
+}
+
+static void csserv_evwrite_gotpacket(csserventry *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
+	writeentry *we;
+	uint8_t *ptr;
+	uint64_t chunkid;
+	uint32_t version;
+	double now;
+
+	// everything goes also to next chunkserver in chain - data packets without copying
+	if (eptr->fwdsock>=0 && type!=CLTOCS_WRITE_DATA) {
+		ptr = csserv_fwd_create_packet(eptr,type,length);
+		if (length>0) {
+			memcpy(ptr,data,length);
+		}
+	}
+	switch (type) {
+	case ANTOAN_NOP:
+		now = monotonic_seconds();
+		if (eptr->lastnop+0.5<now) {
+			csserv_create_packet(eptr,ANTOAN_NOP,0);
+			eptr->lastnop = now;
+		}
+		break;
+	case CLTOCS_WRITE_DATA:
+		if (length<8+4+2+2+4+4) {
+			syslog(LOG_NOTICE,"CLTOCS_WRITE_DATA - wrong size (%"PRIu32"/24+size)",length);
+			eptr->state = CLOSE;
+			return;
+		}
+		we = malloc(sizeof(writeentry));
+		passert(we);
+		chunkid = get64bit(&data);
+		we->writeid = get32bit(&data);
+		we->blocknum = get16bit(&data);
+		we->offset = get16bit(&data);
+		we->size = get32bit(&data);
+		if (length!=8+4+2+2+4+4+we->size) {
+			syslog(LOG_NOTICE,"CLTOCS_WRITE_DATA - wrong size (%"PRIu32"/24+%"PRIu32")",length,we->size);
+			free(we);
+			eptr->state = CLOSE;
+			return;
+		}
+		if (chunkid!=eptr->chunkid) {
+			csserv_evwrite_error(eptr,we->writeid,MFS_ERROR_WRONGCHUNKID);
+			free(we);
+			return;
+		}
+		we->packet = eptr->inputpacket.packet; // take over input buffer
+		eptr->inputpacket.packet = NULL;
+		if (eptr->fwdsock>=0) {
+			csserv_fwd_append_shared(eptr,we->packet,length);
+		}
+		we->hddstatus = MFS_STATUS_OK;
+		we->netstatus = MFS_STATUS_OK;
+		if (eptr->fwdsock>=0) {
+			we->ack = 0;
+		} else {
+			if (eptr->fwdstate==FWD_FAILED) {
+				we->netstatus = MFS_ERROR_DISCONNECTED;
+			}
+			we->ack = 2;
+		}
+		we->next = NULL;
+		*(eptr->wtail) = we;
+		eptr->wtail = &(we->next);
+		eptr->wcnt++;
+		if (eptr->hddhead==NULL) {
+			eptr->hddhead = we;
+		}
+		if (eptr->fwdsock>=0 && eptr->nethead==NULL) {
+			eptr->nethead = we;
+			eptr->fwdlastread = monotonic_seconds();
+		}
+		csserv_evwrite_continue(eptr);
+		break;
+	case CLTOCS_WRITE_FINISH:
+		if (length<8+4) {
+			syslog(LOG_NOTICE,"CLTOCS_WRITE_FINISH - wrong size (%"PRIu32"/12)",length);
+			eptr->state = CLOSE;
+			return;
+		}
+		chunkid = get64bit(&data);
+		version = get32bit(&data);
+		if (chunkid!=eptr->chunkid || version!=eptr->version) {
+			csserv_evwrite_error(eptr,0,MFS_ERROR_WRONGCHUNKID);
+		} else {
+			eptr->state = WRITEFINISH;
+		}
+		csserv_evwrite_continue(eptr);
+		break;
+	default:
+		syslog(LOG_NOTICE,"got unknown message during write (type:%"PRIu32")",type);
+		eptr->state = CLOSE;
+	}
+}
+
+static void csserv_fwd_gotpacket(csserventry *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
+	writeentry *we;
+	uint8_t *ptr;
+	uint64_t chunkid;
+	uint32_t writeid;
+	uint8_t status;
+
+	if (type!=CSTOCL_WRITE_STATUS) { // NOP's from next chunkserver
+		return;
+	}
+	if (length!=8+4+1) {
+		syslog(LOG_NOTICE,"CSTOCL_WRITE_STATUS - wrong size (%"PRIu32"/13)",length);
+		csserv_fwd_failed(eptr);
+		return;
+	}
+	chunkid = get64bit(&data);
+	writeid = get32bit(&data);
+	status = get8bit(&data);
+	if (writeid==0) { // session status from the rest of chain
+		ptr = csserv_create_packet(eptr,CSTOCL_WRITE_STATUS,8+4+1);
+		put64bit(&ptr,chunkid);
+		put32bit(&ptr,0);
+		put8bit(&ptr,status);
+		if (status!=MFS_STATUS_OK) {
+			eptr->wfailed = 1;
+			eptr->state = WRITEFINISH;
+		}
+		return;
+	}
+	we = eptr->nethead;
+	if (we==NULL || chunkid!=eptr->chunkid || writeid!=we->writeid) {
+		syslog(LOG_NOTICE,"CSTOCL_WRITE_STATUS - unexpected status from next chunkserver (chunkid:%016"PRIX64",writeid:%"PRIu32")",chunkid,writeid);
+		csserv_fwd_failed(eptr);
+		return;
+	}
+	we->netstatus = status;
+	we->ack |= 2;
+	eptr->nethead = we->next;
+}
+
+static void csserv_fwd_read(csserventry *eptr,double now) {
+	int32_t i;
+	uint32_t type,size;
+	const uint8_t *ptr;
+
+	for (;;) {
+		if (eptr->fwdinputpacket.bytesleft>0) {
+			i=read(eptr->fwdsock,eptr->fwdinputpacket.startptr,eptr->fwdinputpacket.bytesleft);
+			if (i==0 || (i<0 && ERRNO_ERROR)) {
+				if (i<0) {
+					mfs_errlog_silent(LOG_NOTICE,"(fwd read) read error");
+				}
+				csserv_fwd_failed(eptr);
+				return;
+			}
+			if (i<0) {
+				return;
+			}
+			eptr->fwdlastread = now;
+			eptr->fwdinputpacket.startptr+=i;
+			eptr->fwdinputpacket.bytesleft-=i;
+			if (eptr->fwdinputpacket.bytesleft>0) {
+				return;
+			}
+		}
+		ptr = eptr->fwdhdrbuff;
+		type = get32bit(&ptr);
+		size = get32bit(&ptr);
+		if (eptr->fwdmode==HEADER && size>0) {
+			if (size>MaxPacketSize) {
+				syslog(LOG_WARNING,"(fwd read) packet too long (%"PRIu32"/%u) ; command:%"PRIu32,size,MaxPacketSize,type);
+				csserv_fwd_failed(eptr);
+				return;
+			}
+			eptr->fwdinputpacket.packet = malloc(size);
+			passert(eptr->fwdinputpacket.packet);
+			eptr->fwdinputpacket.startptr = eptr->fwdinputpacket.packet;
+			eptr->fwdinputpacket.bytesleft = size;
+			eptr->fwdmode = DATA;
+			continue;
+		}
+		eptr->fwdmode = HEADER;
+		eptr->fwdinputpacket.bytesleft = 8;
+		eptr->fwdinputpacket.startptr = eptr->fwdhdrbuff;
+		csserv_fwd_gotpacket(eptr,type,eptr->fwdinputpacket.packet,size);
+		if (eptr->fwdinputpacket.packet) {
+			free(eptr->fwdinputpacket.packet);
+		}
+		eptr->fwdinputpacket.packet = NULL;
+		if (eptr->fwdsock<0 || eptr->wfailed) {
+			return;
+		}
+	}
+}
+
+static void csserv_fwd_write(csserventry *eptr) {
+	packetstruct *pack;
+	int32_t i;
+
+	while ((pack=eptr->fwdoutputhead)!=NULL) {
+		i=write(eptr->fwdsock,pack->startptr,pack->bytesleft);
+		if (i<0 && ERRNO_ERROR==0) {
+			return;
+		}
+		if (i<=0) {
+			mfs_errlog_silent(LOG_NOTICE,"(fwd write) write error");
+			csserv_fwd_failed(eptr);
+			return;
+		}
+		pack->startptr+=i;
+		pack->bytesleft-=i;
+		if (pack->bytesleft>0) {
+			return;
+		}
+		if (pack->borrowed==0) {
+			free(pack->packet);
+		}
+		eptr->fwdoutputhead = pack->next;
+		if (eptr->fwdoutputhead==NULL) {
+			eptr->fwdoutputtail = &(eptr->fwdoutputhead);
+		}
+		free(pack);
+	}
+}
+
+/* free everything left after event driven session - all jobs have to be finished */
+static void csserv_evsession_free(csserventry *eptr) {
+	csserv_fwd_close(eptr,0);
+	csserv_free_writes(eptr);
+	if (eptr->chunkopen==CHUNK_OPENED) {
+		job_close(NULL,NULL,eptr->chunkid);
+		eptr->chunkopen = CHUNK_CLOSED;
+	}
+}
+
 /* IDLE operations */
 
 void csserv_idlejob_finished(uint8_t status,void *ijp) {
@@ -390,16 +1237,21 @@ void csserv_get_chunk_checksum_tab(csserventry *eptr,const uint8_t *data,uint32_
 void csserv_hdd_list(csserventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t l;
 	uint8_t *ptr;
+	uint8_t extended;
 
-	(void)data;
-	if (length!=0) {
-		syslog(LOG_NOTICE,"CLTOCS_HDD_LIST - wrong size (%"PRIu32"/0)",length);
+	if (length!=0 && length!=1) {
+		syslog(LOG_NOTICE,"CLTOCS_HDD_LIST - wrong size (%"PRIu32"/0|1)",length);
 		eptr->state = CLOSE;
 		return;
 	}
-	l = hdd_diskinfo_size();	// lock
+	if (length==1) {
+		extended = (get8bit(&data)>=1)?1:0;
+	} else {
+		extended = 0;
+	}
+	l = hdd_diskinfo_size(extended);	// lock
 	ptr = csserv_create_packet(eptr,CSTOCL_HDD_LIST,l);
-	hdd_diskinfo_data(ptr);	// unlock
+	hdd_diskinfo_data(ptr,extended);	// unlock
 }
 
 void csserv_chart(csserventry *eptr,const uint8_t *data,uint32_t length) {
@@ -500,6 +1352,13 @@ void csserv_close(csserventry *eptr) {
 		job_pool_disable_job(eptr->jobid);
 		job_pool_change_callback(eptr->jobid,NULL,NULL);
 	}
+	// event driven jobs still have to call back - entry is freed after the last one
+	if (eptr->openjobid>0) {
+		job_pool_disable_job(eptr->openjobid);
+	}
+	if (eptr->rwjobid>0) {
+		job_pool_disable_job(eptr->rwjobid);
+	}
 
 	for (ij=eptr->idlejobs ; ij ; ij=nij) {
 		nij = ij->next;
@@ -512,7 +1371,7 @@ void csserv_close(csserventry *eptr) {
 
 void csserv_gotpacket(csserventry *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
 //	syslog(LOG_NOTICE,"packet %u:%u",type,length);
-	if (type==ANTOAN_NOP) {
+	if (type==ANTOAN_NOP && eptr->state!=WRITING) {
 		return;
 	}
 	if (type==ANTOAN_UNKNOWN_COMMAND) { // for future use
@@ -530,10 +1389,18 @@ void csserv_gotpacket(csserventry *eptr,uint32_t type,const uint8_t *data,uint32
 			csserv_get_config(eptr,data,length);
 			break;
 		case CLTOCS_READ:
-			csserv_read_init(eptr,data,length);
+			if (EventIO) {
+				csserv_evread_init(eptr,data,length);
+			} else {
+				csserv_read_init(eptr,data,length);
+			}
 			break;
 		case CLTOCS_WRITE:
-			csserv_write_init(eptr,data,length);
+			if (EventIO) {
+				csserv_evwrite_init(eptr,data,length);
+			} else {
+				csserv_write_init(eptr,data,length);
+			}
 			break;
 		case ANTOCS_GET_CHUNK_BLOCKS:
 			csserv_get_chunk_blocks(eptr,data,length);
@@ -567,6 +1434,8 @@ void csserv_gotpacket(csserventry *eptr,uint32_t type,const uint8_t *data,uint32
 			syslog(LOG_NOTICE,"got unknown message (type:%"PRIu32")",type);
 			eptr->state = CLOSE;
 		}
+	} else if (eptr->state==WRITING) {
+		csserv_evwrite_gotpacket(eptr,type,data,length);
 	} else {
 		syslog(LOG_NOTICE,"got unknown message (type:%"PRIu32")",type);
 		eptr->state = CLOSE;
@@ -581,7 +1450,6 @@ void csserv_wantexit(void) {
 
 void csserv_term(void) {
 	csserventry *eptr,*eaptr;
-	packetstruct *pptr,*paptr;
 
 	eptr = csservhead;
 	while (eptr) {
@@ -589,15 +1457,15 @@ void csserv_term(void) {
 		if (eptr->inputpacket.packet) {
 			free(eptr->inputpacket.packet);
 		}
-		pptr = eptr->outputhead;
-		while (pptr) {
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
-			paptr = pptr;
-			pptr = pptr->next;
-			free(paptr);
+		csserv_free_packets(eptr->outputhead);
+		if (eptr->fwdsock>=0) {
+			tcpclose(eptr->fwdsock);
 		}
+		if (eptr->fwdinputpacket.packet) {
+			free(eptr->fwdinputpacket.packet);
+		}
+		csserv_free_packets(eptr->fwdoutputhead);
+		csserv_free_writes(eptr);
 		eaptr = eptr;
 		eptr = eptr->next;
 		free(eaptr);
@@ -644,9 +1512,11 @@ void csserv_read(csserventry *eptr) {
 				eptr->state = CLOSE;
 				return;
 			}
-			eptr->inputpacket.packet = malloc(size);
+			// packet is kept together with its header, so it can be forwarded as is
+			eptr->inputpacket.packet = malloc(size+8);
 			passert(eptr->inputpacket.packet);
-			eptr->inputpacket.startptr = eptr->inputpacket.packet;
+			memcpy(eptr->inputpacket.packet,eptr->hdrbuff,8);
+			eptr->inputpacket.startptr = eptr->inputpacket.packet+8;
 		}
 		eptr->inputpacket.bytesleft = size;
 		eptr->mode = DATA;
@@ -682,9 +1552,9 @@ void csserv_read(csserventry *eptr) {
 		eptr->inputpacket.bytesleft = 8;
 		eptr->inputpacket.startptr = eptr->hdrbuff;
 
-		csserv_gotpacket(eptr,type,eptr->inputpacket.packet,size);
+		csserv_gotpacket(eptr,type,(eptr->inputpacket.packet)?(eptr->inputpacket.packet+8):NULL,size);
 
-		if (eptr->state != READ && eptr->state != WRITE) {
+		if (eptr->state != READ && eptr->state != WRITE) { // in WRITING state data packets are taken over by write entries
 			if (eptr->inputpacket.packet) {
 				free(eptr->inputpacket.packet);
 			}
@@ -701,8 +1571,15 @@ void csserv_write(csserventry *eptr) {
 		if (pack==NULL) {
 			return;
 		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
+		if (pack->packet==NULL) {
+			i=tcpsendfile(eptr->sock,pack->fd,pack->foffset,pack->bytesleft);
+		} else {
+			i=write(eptr->sock,pack->startptr,pack->bytesleft);
+		}
 		if (i==0) {
+			if (pack->packet==NULL) { // chunk file is shorter than expected
+				syslog(LOG_WARNING,"(write) sendfile: chunk %016"PRIX64" - unexpected end of file",pack->chunkid);
+			}
 //			syslog(LOG_NOTICE,"(write) connection closed");
 			eptr->state = CLOSE;
 			return;
@@ -715,16 +1592,26 @@ void csserv_write(csserventry *eptr) {
 			return;
 		}
 		stats_bytesout+=i;
-		pack->startptr+=i;
+		if (pack->packet==NULL) {
+			pack->foffset+=i;
+		} else {
+			pack->startptr+=i;
+		}
 		pack->bytesleft-=i;
 		if (pack->bytesleft>0) {
 			return;
 		}
-		free(pack->packet);
+		if (pack->packet==NULL) {
+			eptr->sendfilecnt--;
+			hdd_read_sendfile_end(pack->chunkid,pack->fd);
+		} else {
+			free(pack->packet);
+		}
 		eptr->outputhead = pack->next;
 		if (eptr->outputhead==NULL) {
 			eptr->outputtail = &(eptr->outputhead);
 		}
+		eptr->outputcnt--;
 		free(pack);
 	}
 }
@@ -743,14 +1630,40 @@ void csserv_desc(struct pollfd *pdesc,uint32_t *ndesc) {
 	}
 	for (eptr=csservhead ; eptr ; eptr=eptr->next) {
 		eptr->pdescpos = -1;
-		if (eptr->state==IDLE) {
-			pdesc[pos].events = POLLIN;
-			if (eptr->outputhead!=NULL) {
-				pdesc[pos].events |= POLLOUT;
-			}
-			eptr->pdescpos = pos;
-			pdesc[pos].fd = eptr->sock;
-			pos++;
+		eptr->fwdpdescpos = -1;
+		switch (eptr->state) {
+			case IDLE:
+			case READING:
+			case WRITEINIT:
+			case WRITING:
+			case WRITEFINISH:
+				pdesc[pos].events = 0;
+				if (eptr->state==IDLE || (eptr->state==WRITING && eptr->wcnt<CSSERV_WRITE_QUEUE)) {
+					pdesc[pos].events |= POLLIN;
+				}
+				if (eptr->outputhead!=NULL) {
+					pdesc[pos].events |= POLLOUT;
+				}
+				eptr->pdescpos = pos;
+				pdesc[pos].fd = eptr->sock;
+				pos++;
+				if (eptr->fwdsock>=0) {
+					pdesc[pos].events = 0;
+					if (eptr->fwdstate==FWD_CONNECTING) {
+						pdesc[pos].events |= POLLOUT;
+					} else {
+						if (eptr->state!=WRITEINIT) {
+							pdesc[pos].events |= POLLIN;
+						}
+						if (eptr->fwdoutputhead!=NULL) {
+							pdesc[pos].events |= POLLOUT;
+						}
+					}
+					eptr->fwdpdescpos = pos;
+					pdesc[pos].fd = eptr->fwdsock;
+					pos++;
+				}
+				break;
 		}
 	}
 	*ndesc = pos;
@@ -759,7 +1672,6 @@ void csserv_desc(struct pollfd *pdesc,uint32_t *ndesc) {
 void csserv_serve(struct pollfd *pdesc) {
 	double now;
 	csserventry *eptr,**kptr;
-	packetstruct *pptr,*paptr;
 	int ns;
 
 	now = monotonic_seconds();
@@ -788,6 +1700,32 @@ void csserv_serve(struct pollfd *pdesc) {
 			eptr->outputtail = &(eptr->outputhead);
 			eptr->jobid = 0;
 
+			eptr->protover = 0;
+			eptr->chunkopen = CHUNK_CLOSED;
+			eptr->wfailed = 0;
+			eptr->jobs = 0;
+			eptr->openjobid = 0;
+			eptr->rwjobid = 0;
+			eptr->rjob = NULL;
+			eptr->whead = NULL;
+			eptr->wtail = &(eptr->whead);
+			eptr->hddhead = NULL;
+			eptr->nethead = NULL;
+			eptr->wjob = NULL;
+			eptr->wcnt = 0;
+			eptr->outputcnt = 0;
+			eptr->sendfilecnt = 0;
+			eptr->lastnop = now;
+			eptr->fwdstate = FWD_NONE;
+			eptr->fwdmode = HEADER;
+			eptr->fwdsock = -1;
+			eptr->fwdpdescpos = -1;
+			eptr->fwdinputpacket.bytesleft = 8;
+			eptr->fwdinputpacket.startptr = eptr->fwdhdrbuff;
+			eptr->fwdinputpacket.packet = NULL;
+			eptr->fwdoutputhead = NULL;
+			eptr->fwdoutputtail = &(eptr->fwdoutputhead);
+
 			eptr->idlejobs = NULL;
 		}
 	}
@@ -796,46 +1734,90 @@ void csserv_serve(struct pollfd *pdesc) {
 		if (eptr->pdescpos>=0 && (pdesc[eptr->pdescpos].revents & (POLLERR|POLLHUP))) {
 			eptr->state = CLOSE;
 		}
-		if (eptr->pdescpos>=0 && (pdesc[eptr->pdescpos].revents & POLLIN) && eptr->state==IDLE) {
+		if (eptr->fwdpdescpos>=0 && eptr->fwdsock>=0) {
+			if (eptr->fwdstate==FWD_CONNECTING) {
+				csserv_fwd_connecttest(eptr,pdesc[eptr->fwdpdescpos].revents,now);
+			} else if ((pdesc[eptr->fwdpdescpos].revents & (POLLERR|POLLHUP)) && eptr->state==WRITEINIT) {
+				csserv_fwd_failed(eptr);
+			} else {
+				if ((pdesc[eptr->fwdpdescpos].revents & (POLLIN|POLLERR|POLLHUP)) && eptr->state!=WRITEINIT) { // read statuses received before disconnection
+					csserv_fwd_read(eptr,now);
+				}
+				if ((pdesc[eptr->fwdpdescpos].revents & POLLOUT) && eptr->fwdsock>=0) {
+					csserv_fwd_write(eptr);
+				}
+			}
+		} else if (eptr->fwdstate==FWD_CONNECTING && eptr->fwdsock>=0) {
+			csserv_fwd_connecttest(eptr,0,now);
+		}
+		if (eptr->pdescpos>=0 && (pdesc[eptr->pdescpos].revents & POLLIN) && (eptr->state==IDLE || eptr->state==WRITING)) {
 			eptr->lastread = now;
 			csserv_read(eptr);
 		}
 		if (eptr->state==IDLE && eptr->lastwrite+(CSSERV_TIMEOUT/3.0)<now && eptr->outputhead==NULL) {
 			csserv_create_packet(eptr,ANTOAN_NOP,0);
 		}
-		if (eptr->pdescpos>=0 && (pdesc[eptr->pdescpos].revents & POLLOUT) && eptr->state==IDLE) {
+		if (eptr->state==READING && eptr->protover>0 && eptr->outputhead==NULL && eptr->lastnop+1.0<now) { // slow disk - keep client informed
+			csserv_create_packet(eptr,ANTOAN_NOP,0);
+			eptr->lastnop = now;
+		}
+		if (eptr->pdescpos>=0 && (pdesc[eptr->pdescpos].revents & POLLOUT) && eptr->state!=CLOSE && eptr->state!=CLOSEWAIT) {
 			eptr->lastwrite = now;
+			if (eptr->state==READING) {
+				eptr->lastnop = now;
+			}
 			csserv_write(eptr);
 		}
+		if (eptr->state==READING) {
+			csserv_evread_continue(eptr);
+		} else if (eptr->state==WRITEINIT || eptr->state==WRITING || eptr->state==WRITEFINISH) {
+			if (eptr->state==WRITING && eptr->wcnt>=CSSERV_WRITE_QUEUE) {
+				eptr->lastread = now; // client is not read - it can't be timed out
+			}
+			csserv_evwrite_continue(eptr);
+		}
 		if (eptr->state==IDLE && eptr->lastread+CSSERV_TIMEOUT<now) {
 //			syslog(LOG_NOTICE,"csserv: connection timed out");
 			eptr->state = CLOSE;
 		}
+		if (eptr->state==READING || eptr->state==WRITEINIT || eptr->state==WRITING || eptr->state==WRITEFINISH) {
+			if (eptr->outputhead==NULL) {
+				eptr->lastwrite = now;
+			} else if (eptr->lastwrite+CSSERV_TIMEOUT<now) {
+				eptr->state = CLOSE;
+			}
+		}
+		if (eptr->state==WRITING && eptr->lastread+CSSERV_TIMEOUT<now) {
+			eptr->state = CLOSE;
+		}
+		if ((eptr->state==WRITING || eptr->state==WRITEFINISH) && eptr->fwdsock>=0 && eptr->nethead!=NULL && eptr->wfailed==0 && eptr->fwdlastread+CSSERV_TIMEOUT<now) {
+			syslog(LOG_NOTICE,"csserv: next chunkserver in chain timed out");
+			csserv_fwd_failed(eptr);
+		}
 	}
 
 	kptr = &csservhead;
 	while ((eptr=*kptr)) {
 		if (eptr->state == CLOSE) {
 			tcpclose(eptr->sock);
+			csserv_free_packets(eptr->outputhead); // before closing chunk - releases blocks queued for sendfile
+			eptr->outputhead = NULL;
+			eptr->outputtail = &(eptr->outputhead);
 			csserv_close(eptr);
 			if (eptr->inputpacket.packet) {
 				free(eptr->inputpacket.packet);
 			}
+			eptr->inputpacket.packet = NULL;
 //			wptr = eptr->todolist;
 //			while (wptr) {
 //				waptr = wptr;
 //				wptr = wptr->next;
 //				free(waptr);
 //			}
-			pptr = eptr->outputhead;
-			while (pptr) {
-				if (pptr->packet) {
-					free(pptr->packet);
-				}
-				paptr = pptr;
-				pptr = pptr->next;
-				free(paptr);
-			}
+			eptr->state = CLOSEWAIT;
+		}
+		if (eptr->state == CLOSEWAIT && eptr->jobs==0) {
+			csserv_evsession_free(eptr);
 			*kptr = eptr->next;
 			free(eptr);
 		} else {
@@ -860,6 +1842,7 @@ void csserv_reload(void) {
 		return ;
 	}
 //	ThreadedServer = 1-ThreadedServer;
+	EventIO = cfg_getuint8("CSSERV_EVENT_IO",1);
 
 	oldListenHost = ListenHost;
 	oldListenPort = ListenPort;
@@ -909,6 +1892,7 @@ void csserv_reload(void) {
 int csserv_init(void) {
 	ListenHost = cfg_getstr("CSSERV_LISTEN_HOST","*");
 	ListenPort = cfg_getstr("CSSERV_LISTEN_PORT",DEFAULT_CS_DATA_PORT);
+	EventIO = cfg_getuint8("CSSERV_EVENT_IO",1);
 	//初始化创建一个tcp socket，返回一个socket描述符
 	lsock = tcpsocket();
 	if (lsock<0) {
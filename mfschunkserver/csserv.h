@@ -23,7 +23,7 @@
 
 #include <inttypes.h>
 
-void csserv_stats(uint64_t *bin,uint64_t *bout);
+void csserv_stats(uint64_t *bin,uint64_t *bout,uint32_t *hlopr,uint32_t *hlopw);
 // void csserv_cstocs_connected(void *e,void *cptr);
 // void csserv_cstocs_gotstatus(void *e,uint64_t chunkid,uint32_t writeid,uint8_t s);
 // void csserv_cstocs_disconnected(void *e);
@@ -63,8 +63,9 @@
 #include "lwthread.h"
 #include "sockets.h"
 #include "bgjobs.h"
+#include "buckets.h"
+#include "tcounters.h"
 
-#define PRESERVE_BLOCK 1
 
 // #define HDD_TESTER_DEBUG 1
 
@@ -72,8 +73,41 @@
 #define USE_PIO 1
 #endif
 
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+# if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#  include <linux/io_uring.h>
+#  define HAVE_IO_URING 1
+# endif
+/* group commit of pending fsyncs with one syncfs (optional) and writeback started during writes */
+# define HDD_FSYNC_GROUP 1
+# include <sys/utsname.h>
+# ifdef SYNC_FILE_RANGE_WRITE
+#  define HDD_WRITEBACK_PUSH 1
+# endif
+/* chunk data copied inside the kernel (shared extents or copy_file_range) during duplicate/duptrunc */
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+# ifdef FICLONERANGE
+#  define HDD_REFLINK 1
+# endif
+# ifdef __NR_copy_file_range
+#  define HDD_COPY_RANGE 1
+# endif
+/* all-zero blocks stored as holes - punched with fallocate, skipped on reads found by SEEK_DATA (fallocate syscall takes offsets as single arguments only on 64-bit platforms) */
+# include <linux/falloc.h>
+# if defined(__NR_fallocate) && defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE) && defined(SEEK_DATA) && defined(__LP64__)
+#  define HDD_HOLES 1
+# endif
+#endif
+
 #define DUPLICATES_DELETE_LIMIT 100
 
+/* max number of blocks in one hdd_read_range call */
+#define HDD_READ_RANGE_MAXBLOCKS 64
+
 /* usec's to wait after last rebalance before choosing disk for new chunk */
 #define REBALANCE_GRACE_PERIOD 10000000
 
@@ -81,15 +115,51 @@
 #define REBALANCE_DST_MAX_USAGE 0.99
 #define REBALANCE_DIFF_MAX 0.01
 
-/* system every DELAYEDSTEP seconds searches opened/crc_loaded chunk list for chunks to be closed/free crc */
+/* number of blocks read by one call when chunk is moved between folders or tested */
+#define MOVE_BATCH_BLOCKS 16
+
+/* max time writer (write/truncate) waits for blocks of its chunk queued for sendfile - after that it goes on and reader with stale block gets crc mismatch and reads it again */
+#define SENDFILE_WAIT_USEC 200000
+
+/* chunk tester: max number of chunks skipped (used during current pass) while looking for chunk to test */
+#define TEST_SKIP_MAX 1000
+
+/* chunk tester: how often client latency is checked, maximum back off (budget divided by 2^TEST_MAX_BACKOFF) and minimum number of client operations needed to judge latency */
+#define TEST_LATENCY_CHECK_USEC 5000000
+#define TEST_MAX_BACKOFF 4
+#define TEST_LATENCY_MIN_OPS 16
+
+/* test times are persisted only by checkpoints, so checkpoint is forced at least that often (seconds) */
+#define INDEX_CHECKPOINT_INTERVAL 3600
+
+/* file times with full precision (nanoseconds) - used to check if index files are newer than data subfolders */
+#if defined(__linux__)
+# define STAT_ATIME_NS(sb) ((uint64_t)((sb).st_atim.tv_sec)*UINT64_C(1000000000)+(uint64_t)((sb).st_atim.tv_nsec))
+# define STAT_MTIME_NS(sb) ((uint64_t)((sb).st_mtim.tv_sec)*UINT64_C(1000000000)+(uint64_t)((sb).st_mtim.tv_nsec))
+#elif defined(__APPLE__)
+# define STAT_ATIME_NS(sb) ((uint64_t)((sb).st_atimespec.tv_sec)*UINT64_C(1000000000)+(uint64_t)((sb).st_atimespec.tv_nsec))
+# define STAT_MTIME_NS(sb) ((uint64_t)((sb).st_mtimespec.tv_sec)*UINT64_C(1000000000)+(uint64_t)((sb).st_mtimespec.tv_nsec))
+#else
+# define STAT_ATIME_NS(sb) ((uint64_t)((sb).st_atime)*UINT64_C(1000000000))
+# define STAT_MTIME_NS(sb) ((uint64_t)((sb).st_mtime)*UINT64_C(1000000000))
+#endif
+
+/* every DELAYEDUSTEP microseconds idle chunks from descriptor cache are synced, closed and their crc blocks are freed */
 #define DELAYEDUSTEP 100000
 
 #define OPEN_DELAY 0.5
 #define CRC_DELAY 100
 
-#ifdef PRESERVE_BLOCK
-#define BLOCK_DELAY 10
-#endif
+/* max number of chunks taken from descriptor cache lists at once (lists are unlocked while chunks are processed) */
+#define FDCACHE_BATCH 256
+#define FDCACHE_EVICT_TRIES 8
+
+/* max number of chunks kept locked for one fsync group */
+#define FSYNC_GROUP_MAX 1024
+
+/* number of buckets in per folder fsync time histogram - bucket 0: < 256us, bucket i: < 256us*2^i, last: everything above */
+#define FSYNCHISTSIZE 16
+
 
 #define LOSTCHUNKSBLOCKSIZE 1024
 #define NEWCHUNKSBLOCKSIZE 4096
@@ -109,8 +179,8 @@
 #define HASHSIZE (0x1000000)
 #define HASHPOS(chunkid) ((chunkid)&0xFFFFFF)
 
-#define DHASHSIZE 64
-#define DHASHPOS(chunkid) ((chunkid)&0x3F)
+#define HASHLOCKS 256
+#define HASHLOCKPOS(chunkid) ((chunkid)&(HASHLOCKS-1))
 
 #define CH_NEW_NONE 0
 #define CH_NEW_AUTO 1
@@ -130,6 +200,27 @@
 #define mypwrite(a,b,c,d) (lseek((a),(d),SEEK_SET),write((a),(b),(c)))
 #endif
 
+#if defined(USE_PIO) && (defined(__linux__) || defined(__FreeBSD__))
+#define mypreadv preadv
+#else
+static inline ssize_t mypreadv(int fd,const struct iovec *iov,int iovcnt,off_t offset) {
+	ssize_t ret,tot;
+	int i;
+	tot = 0;
+	for (i=0 ; i<iovcnt ; i++) {
+		ret = mypread(fd,iov[i].iov_base,iov[i].iov_len,offset+tot);
+		if (ret<0) {
+			return (tot>0)?tot:ret;
+		}
+		tot += ret;
+		if ((size_t)ret<iov[i].iov_len) {
+			break;
+		}
+	}
+	return tot;
+}
+#endif
+
 #define WFR_ENTRIES_IN_BLOCK ((4096 / (8+4+2)) - 2)
 
 typedef struct waitforremoval {
@@ -172,42 +263,53 @@ typedef struct ioerror {
 	int errornumber;
 } ioerror;
 
+/* condition for threads waiting for locked chunk - kept in per stripe list (cclist), bound to chunk while wcnt>0 */
 typedef struct _cntcond {
 	pthread_cond_t cond;
 	uint32_t wcnt;
+	struct chunk *owner;	// valid only when wcnt>0
 	struct _cntcond *next;
 } cntcond;
 
+/* state of open chunk (descriptor, crc block, delayed close timers) - allocated only while chunk is used and freed by delayed ops */
+typedef struct chunkopen {
+	double opento;
+	double crcto;
+	uint8_t *crc;
+	int fd;
+	int cfd;	// descriptor of copy in read cache (-1 - not opened)
+	uint32_t wbpending;	// bytes written since writeback was started last time
+	uint16_t crcrefcount;
+	uint8_t crcchanged;
+	uint8_t fsyncneeded;
+	uint32_t sfreaders;	// blocks queued for sendfile (hashlock) - writers wait (up to SENDFILE_WAIT_USEC) until they are sent
+	struct chunk *fdnext,**fdprev;	// descriptor cache lists (fdcachelock) - only idle chunks, prev==NULL means not on list
+	struct chunk *crcnext,**crcprev;
+} chunkopen;
+
+/* chunk record - kept for every chunk, so it has to be as small as possible */
 typedef struct chunk {
 	uint64_t chunkid;
 	struct folder *owner;
 	uint32_t ownerindx;
 	uint32_t version;
+	uint32_t testtime;	// at start use max(atime,mtime) if possible then every operation set it to current time
 	uint16_t blocks;
-	uint16_t crcrefcount;
 	uint16_t pathid;
 	uint16_t hdrsize;
-	double opento;
-	double crcto;
-	uint8_t crcchanged;
-	uint8_t fsyncneeded;
-	uint8_t damaged;
 #define CH_AVAIL 0
 #define CH_LOCKED 1
 #define CH_DELETED 2
 	uint8_t state;	// CH_AVAIL,CH_LOCKED,CH_DELETED
-	cntcond *ccond;
-	uint8_t *crc;
-	int fd;
-
-#ifdef PRESERVE_BLOCK
-	double blockto;
-	uint8_t *block;
-	uint16_t blockno;	// 0xFFFF == invalid
-#endif
+	uint8_t damaged;
 	uint8_t validattr;
-	uint32_t testtime;	// at start use max(atime,mtime) if possible then every operation set it to current time
-	struct chunk *testnext,**testprev;
+	uint8_t heat;	// client read requests - halved every read cache period (lazily - using heatepoch)
+	uint8_t heatepoch;
+#define RCS_NONE 0
+#define RCS_QUEUED 1
+#define RCS_CACHED 2
+	uint8_t cachestate;	// only a hint - read cache entries are authoritative
+	chunkopen *op;	// NULL when chunk is closed
 	struct chunk *next;
 } chunk;
 
@@ -225,6 +327,18 @@ typedef struct hddstats {
 	uint64_t nsecfsyncmax;
 } hddstats;
 
+// per folder counters - folder with stats slot 'n' uses ids starting from HSC_FOLDERID(n)
+#define HSF_RBYTES 0
+#define HSF_WBYTES 1
+#define HSF_NSECREADSUM 2
+#define HSF_NSECWRITESUM 3
+#define HSF_ROPS 4
+#define HSF_WOPS 5
+#define HSF_SUMCNT 6
+#define HSF_NSECREADMAX 6
+#define HSF_NSECWRITEMAX 7
+#define HSF_SIZE 8
+
 typedef struct folder {
 	char *path;
 #define SCST_SCANNEEDED 0
@@ -261,8 +375,12 @@ typedef struct folder {
 	uint64_t total;
 	fsblkcnt_t lastblocks;
 	uint8_t isro;
-	hddstats cstat;
+	hddstats cstat;	// current minute - only operations not counted per thread (fsyncs and folders without stats slot)
+	uint32_t statsslot;	// per thread counters slot (HSC_NOSLOT - none)
+	uint64_t tcbase[HSF_SUMCNT];	// per thread counter sums already moved to 'stats' (statslock)
+	uint64_t plbase[HSF_SUMCNT];	// per thread counter sums already used by placement update (statslock)
 	hddstats monotonic;
+	uint32_t fsynchist[FSYNCHISTSIZE];	// monotonic
 	hddstats stats[STATSHISTORY];
 	uint32_t statspos;
 	ioerror lasterrtab[LASTERRSIZE];
@@ -283,10 +401,19 @@ typedef struct folder {
 	uint8_t write_first;
 	uint8_t rebalance_in_progress;
 	uint64_t rebalance_last_usec;
+	uint64_t move_start_usec;	// start of current moving out session (0 - folder is not a rebalance source)
+	uint64_t move_bytes;	// bytes moved out during current session
+	uint64_t move_remaining;	// estimated bytes left to move out (0 - unknown)
 //	double carry;
 	pthread_t scanthread;
-	struct chunk *testhead,**testtail;
+	uint32_t testpos;	// chunktab[0..testpos-1] already tested in current pass (folderlock)
+	uint32_t testpasstime;	// main_time at start of current pass - chunks used since then are skipped
 	uint64_t nexttest;
+	uint64_t testpassstart;	// start of current test pass (0 - not started yet)
+	uint32_t testpasscnt;	// chunks tested during current pass
+	uint32_t testlastpass;	// duration of last complete pass in seconds (0 - none yet)
+	uint64_t testlatcheck;	// next client latency check
+	uint8_t testbackoff;	// test budget is divided by 2^testbackoff when client latency is too high
 	uint32_t min_count;
 	uint16_t min_pathid;
 	uint16_t current_pathid;
@@ -295,6 +422,27 @@ typedef struct folder {
 	double wfrlast;
 	uint32_t wfrcount;
 	waitforremoval *wfrchunks;
+	uint32_t fsyncgroupcnt;	// used only by delayed ops
+	uint8_t fsyncgroupdone;
+	int fsyncgrouperr;
+	int jfd;	// chunk index journal ('.chunkjournal') - -1 when index is not maintained
+	uint64_t jsize;
+	uint64_t ckptid;	// lineage id - journal is valid only with checkpoint of this id (or next one)
+	uint32_t ckpttime;	// time of last checkpoint (test times are stored only in checkpoints)
+	uint8_t jdirty;
+	uint8_t needcheckpoint;
+	uint8_t indexbusy;	// folder is being handled by index thread
+	pthread_mutex_t jlock;
+	uint8_t noreflink;	// set when file system refused FICLONERANGE
+	uint8_t nocopyrange;	// set when file system refused copy_file_range
+	uint8_t nopunch;	// set when file system refused FALLOC_FL_PUNCH_HOLE
+	uint64_t plbusy;	// nsec spent in data i/o not counted per thread since last placement update (statslock)
+	uint64_t plwnsec;	// nsec spent in data writes and fsyncs not counted per thread since last placement update (statslock)
+	uint32_t plwops;
+	uint64_t plusec;	// time of last placement update
+	double wlatavg;	// smoothed write latency in usec (0.0 - no writes yet)
+	double qdepthavg;	// smoothed average number of data i/o operations in progress
+	double placefactor;	// share of new chunks compared to placement by space only (1.0 - no penalty)
 	struct folder *next;
 } folder;
 
@@ -324,15 +472,28 @@ static pthread_mutex_t cfglock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 //static uint8_t AllowStartingWithInvalidDisks;
 static uint8_t Sparsification;
+static uint8_t PunchHoles;
+static uint8_t UseIoUring = 0;
+static uint8_t SendfileMode = 0;
+static uint8_t CloneMode = 2;
+static uint8_t ScanThreads = 4;
+static uint32_t PageSize = 0;
 static double HDDTestMBPS = 1.0;
+static uint32_t HDDTestIOPS = 0;
+static uint32_t HDDTestMaxLatency = 20;	// ms
 static uint32_t HDDRebalancePerc = 20;
 static uint32_t HSRebalanceLimit = 0;
+static uint32_t MoveBandwidth = 0;	// MiB/s
 static uint32_t HDDErrorCount = 2;
 static uint32_t HDDErrorTime = 600;
 static uint32_t HDDRoundRobinChunkCount = 10000;
+static uint32_t HDDPlacementLatencyWeight = 100;	// percent
 static uint32_t HDDKeepDuplicatesHours = 7*24;
 static uint64_t LeaveFree;
+static uint64_t BlockCacheSize;
 static uint8_t DoFsyncBeforeClose = 0;
+static uint32_t FsyncGroupMin = 0;
+static uint32_t WritebackPush = 0;
 static uint32_t MinTimeBetweenTests = 86400;
 static int32_t MinFlushCacheTime = 86400;
 
@@ -344,11 +505,8 @@ static folder *folderhead = NULL;
 
 /* chunk hash */
 static chunk* hashtab[HASHSIZE];
-
-/* extra chunk info */
-static dopchunk *dophashtab[DHASHSIZE];
-//static dopchunk *dopchunks = NULL;
-static dopchunk *newdopchunks = NULL;
+CREATE_BUCKET_ALLOCATOR(chunkrec,chunk,10000000/sizeof(chunk))
+static pthread_mutex_t chunkreclock = PTHREAD_MUTEX_INITIALIZER;
 
 // master reports
 static damagedchunk *damagedchunks = NULL;
@@ -358,7 +516,7 @@ static uint32_t errorcounter = 0;
 static uint8_t hddspacechanged = 0;
 static uint8_t global_rebalance_is_on = 0;
 
-static pthread_t hsrebalancethread,rebalancethread,foldersthread,delayedthread,testerthread;
+static pthread_t hsrebalancethread,rebalancethread,foldersthread,delayedthread,testerthread,indexthread,rcachethread;
 static uint8_t term = 0;
 static uint8_t folderactions = 0;
 static pthread_mutex_t termlock = PTHREAD_MUTEX_INITIALIZER;
@@ -366,16 +524,18 @@ static pthread_mutex_t termlock = PTHREAD_MUTEX_INITIALIZER;
 // stats_X
 static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
 
-// newdopchunks + dophashtab
+// delayed ops round (fsync options can't be changed in the middle of it)
 static pthread_mutex_t doplock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t ndoplock = PTHREAD_MUTEX_INITIALIZER;
 
 // master reports = damaged chunks, lost chunks, errorcounter, hddspacechanged, global_rebalance_is_on
 static pthread_mutex_t dclock = PTHREAD_MUTEX_INITIALIZER;
 
 // hashtab - only hash tab, chunks have their own separate locks
-static pthread_mutex_t hashlock = PTHREAD_MUTEX_INITIALIZER;
-static cntcond *cclist = NULL;
+// hashtab is striped - bucket 'hashpos' is guarded by hashlock[HASHLOCKPOS(hashpos)] (each stripe has its own cclist)
+// when more than one stripe is needed then always lock them in ascending order
+static pthread_mutex_t hashlock[HASHLOCKS];
+static pthread_cond_t sendfilecond[HASHLOCKS];	// signaled when chunk has no more blocks queued for sendfile
+static cntcond *cclist[HASHLOCKS];
 
 // folderhead + all data in structures
 static pthread_mutex_t folderlock = PTHREAD_MUTEX_INITIALIZER;
@@ -385,10 +545,10 @@ static pthread_mutex_t testlock = PTHREAD_MUTEX_INITIALIZER;
 
 static pthread_cond_t highspeed_cond = PTHREAD_COND_INITIALIZER;
 
-#ifndef PRESERVE_BLOCK
 static pthread_key_t hdrbufferkey;
 static pthread_key_t blockbufferkey;
-#endif
+static pthread_key_t rangebufferkey;
+static pthread_key_t batchbufferkey;
 
 /*
 static uint8_t wait_for_scan = 0;
@@ -400,18 +560,33 @@ static pthread_cond_t scanprogresscond = PTHREAD_COND_INITIALIZER;
 static uint32_t emptyblockcrc;
 static uint8_t *emptychunkcrc;
 
-static uint64_t stats_bytesr = 0;
-static uint64_t stats_bytesw = 0;
-static uint32_t stats_opr = 0;
-static uint32_t stats_opw = 0;
-static uint32_t stats_databytesr = 0;
-static uint32_t stats_databytesw = 0;
-static uint32_t stats_dataopr = 0;
-static uint32_t stats_dataopw = 0;
+// per block statistics are counted per thread (tcounters) and summed only when collected
+#define HSC_BYTESR 0
+#define HSC_BYTESW 1
+#define HSC_OPR 2
+#define HSC_OPW 3
+#define HSC_DATABYTESR 4
+#define HSC_DATABYTESW 5
+#define HSC_DATAOPR 6
+#define HSC_DATAOPW 7
+#define HSC_RTIME 8
+#define HSC_WTIME 9
+#define HSC_GLOBALCNT 10
+#define HSC_HOLEPUNCH 10	// bytes of zero blocks punched out of chunk files
+#define HSC_HOLESKIP 11	// bytes of zero blocks not read because they are holes
+#define HSC_HOLECNT 2
+#define HSC_FOLDERID(n) (TC_BLOCKSIZE+(n)*HSF_SIZE)
+#define HSC_FOLDERSLOTS ((TC_MAXBLOCKS-1)*(TC_BLOCKSIZE/HSF_SIZE))
+#define HSC_NOSLOT 0xFFFFFFFF
+
+static void *iostats;
+static uint64_t iostatsbase[HSC_GLOBALCNT];	// sums already returned by hdd_stats (statslock)
+static uint8_t iostatsslots[HSC_FOLDERSLOTS];	// used folder slots (statslock)
+static uint64_t holestatsbase[HSC_HOLECNT];	// sums already returned by hdd_hole_stats (statslock)
+
 static uint32_t stats_movels = 0;
 static uint32_t stats_movehs = 00;
-static uint64_t stats_rtime = 0;
-static uint64_t stats_wtime = 0;
+static uint64_t stats_wtime = 0;	// fsync time (not counted per thread)
 
 static uint32_t stats_create = 0;
 static uint32_t stats_delete = 0;
@@ -644,244 +819,1361 @@ void hdd_get_new_chunk_data(uint8_t *buff,uint32_t limit) {
 	zassert(pthread_mutex_unlock(&dclock));
 }
 
-uint32_t hdd_errorcounter(void) {
-	uint32_t result;
-	zassert(pthread_mutex_lock(&dclock));
-	result = errorcounter;
-	errorcounter = 0;
-	zassert(pthread_mutex_unlock(&dclock));
-	return result;
+static uint32_t stats_hashlockwait = 0;
+
+void hdd_lock_stats(uint32_t *hlwait) {
+#ifdef HAVE___SYNC_FETCH_AND_OP
+	*hlwait = __sync_fetch_and_and(&stats_hashlockwait,0);
+#else
+	zassert(pthread_mutex_lock(&statslock));
+	*hlwait = stats_hashlockwait;
+	stats_hashlockwait = 0;
+	zassert(pthread_mutex_unlock(&statslock));
+#endif
 }
 
-uint8_t hdd_spacechanged(void) {
+static inline void hdd_hashlock_lock(uint32_t lockpos) {
+	if (pthread_mutex_trylock(hashlock+lockpos)!=0) {
 #ifdef HAVE___SYNC_FETCH_AND_OP
-	return __sync_fetch_and_and(&hddspacechanged,0);
+		__sync_fetch_and_add(&stats_hashlockwait,1);
 #else
-	uint8_t res;
-	zassert(pthread_mutex_lock(&dclock));
-	res = hddspacechanged;
-	hddspacechanged = 0;
-	zassert(pthread_mutex_unlock(&dclock));
-	return res;
+		zassert(pthread_mutex_lock(&statslock));
+		stats_hashlockwait++;
+		zassert(pthread_mutex_unlock(&statslock));
 #endif
+		zassert(pthread_mutex_lock(hashlock+lockpos));
+	}
 }
 
-void hdd_stats(uint64_t *br,uint64_t *bw,uint32_t *opr,uint32_t *opw,uint32_t *dbr,uint32_t *dbw,uint32_t *dopr,uint32_t *dopw,uint32_t *movl,uint32_t *movh,uint64_t *rtime,uint64_t *wtime) {
-	zassert(pthread_mutex_lock(&statslock));
-	*br = stats_bytesr;
-	*bw = stats_bytesw;
-	*opr = stats_opr;
-	*opw = stats_opw;
-	*dbr = stats_databytesr;
-	*dbw = stats_databytesw;
-	*dopr = stats_dataopr;
-	*dopw = stats_dataopw;
-	*movl = stats_movels;
-	*movh = stats_movehs;
-	*rtime = stats_rtime;
-	*wtime = stats_wtime;
-	stats_bytesr = 0;
-	stats_bytesw = 0;
-	stats_opr = 0;
-	stats_opw = 0;
-	stats_databytesr = 0;
-	stats_databytesw = 0;
-	stats_dataopr = 0;
-	stats_dataopw = 0;
-	stats_movels = 0;
-	stats_movehs = 0;
-	stats_rtime = 0;
-	stats_wtime = 0;
-	zassert(pthread_mutex_unlock(&statslock));
+static inline void hdd_hashlock_unlock(uint32_t lockpos) {
+	zassert(pthread_mutex_unlock(hashlock+lockpos));
 }
 
-void hdd_op_stats(uint32_t *op_create,uint32_t *op_delete,uint32_t *op_version,uint32_t *op_duplicate,uint32_t *op_truncate,uint32_t *op_duptrunc,uint32_t *op_test) {
-	zassert(pthread_mutex_lock(&statslock));
-	*op_create = stats_create;
-	*op_delete = stats_delete;
-	*op_version = stats_version;
-	*op_duplicate = stats_duplicate;
-	*op_truncate = stats_truncate;
-	*op_duptrunc = stats_duptrunc;
-	*op_test = stats_test;
-	stats_create = 0;
-	stats_delete = 0;
-	stats_version = 0;
-	stats_duplicate = 0;
-	stats_truncate = 0;
-	stats_duptrunc = 0;
-	stats_test = 0;
-	zassert(pthread_mutex_unlock(&statslock));
+static inline void hdd_hashlock_all(void) {
+	uint32_t lockpos;
+	for (lockpos=0 ; lockpos<HASHLOCKS ; lockpos++) {
+		hdd_hashlock_lock(lockpos);
+	}
 }
 
-static inline void hdd_stats_move(uint8_t hsflag) {
-	zassert(pthread_mutex_lock(&statslock));
-	if (hsflag) {
-		stats_movehs++;
-	} else {
-		stats_movels++;
+static inline void hdd_hashunlock_all(void) {
+	uint32_t lockpos;
+	for (lockpos=0 ; lockpos<HASHLOCKS ; lockpos++) {
+		hdd_hashlock_unlock(lockpos);
 	}
-	zassert(pthread_mutex_unlock(&statslock));
 }
 
-static inline void hdd_stats_read(uint32_t size) {
-	zassert(pthread_mutex_lock(&statslock));
-	stats_opr++;
-	stats_bytesr += size;
-	zassert(pthread_mutex_unlock(&statslock));
+// verified block cache - shared by all chunks, keyed by (chunkid,version,blocknum)
+// contains only blocks that passed crc check, eviction by CLOCK (entries used by readers are never evicted)
+// cache is striped by chunkid like chunk hash - every stripe has its own lock, hash, clock ring and share of the limit
+// block data is copied outside the lock (entry is referenced)
+
+#define BCACHE_STRIPES 64
+#define BCACHE_STRIPEPOS(chunkid) ((chunkid)&(BCACHE_STRIPES-1))
+#define BCACHE_HASHSIZE 1024
+#define BCACHE_HASHPOS(chunkid,blocknum) ((((uint32_t)((chunkid)/BCACHE_STRIPES))*MFSBLOCKSINCHUNK+(blocknum))&(BCACHE_HASHSIZE-1))
+
+typedef struct bcentry {
+	uint64_t chunkid;
+	uint32_t version;
+	uint16_t blocknum;
+	uint8_t refbit;
+	uint8_t unlinked;
+	uint32_t refcnt;
+	uint8_t *data;
+	struct bcentry *hnext,**hprev;
+	struct bcentry *cnext,*cprev;
+} bcentry;
+
+typedef struct bcstripe {
+	pthread_mutex_t lock;
+	bcentry *hash[BCACHE_HASHSIZE];
+	bcentry *hand;
+	uint32_t entries;
+	uint32_t limit;
+	uint32_t hits;
+	uint32_t misses;
+} bcstripe;
+
+static bcstripe bcache[BCACHE_STRIPES];
+
+void hdd_bcache_stats(uint32_t *hits,uint32_t *misses,uint32_t *blocks) {
+	bcstripe *bs;
+	uint32_t i;
+	*hits = 0;
+	*misses = 0;
+	*blocks = 0;
+	for (i=0 ; i<BCACHE_STRIPES ; i++) {
+		bs = bcache + i;
+		zassert(pthread_mutex_lock(&(bs->lock)));
+		*hits += bs->hits;
+		*misses += bs->misses;
+		*blocks += bs->entries;
+		bs->hits = 0;
+		bs->misses = 0;
+		zassert(pthread_mutex_unlock(&(bs->lock)));
+	}
 }
 
-static inline void hdd_stats_write(uint32_t size) {
-	zassert(pthread_mutex_lock(&statslock));
-	stats_opw++;
-	stats_bytesw += size;
-	zassert(pthread_mutex_unlock(&statslock));
+static inline void hdd_bcache_entry_free(bcentry *e) {
+#ifdef MMAP_ALLOC
+	munmap((void*)(e->data),MFSBLOCKSIZE);
+#else
+	free(e->data);
+#endif
+	free(e);
 }
 
-static inline void hdd_stats_dataread(folder *f,uint32_t size,int64_t rtime) {
-	if (rtime<=0) {
-		return;
+// removes entry from hash and from clock ring (entry still used by reader is freed on release)
+static inline void hdd_bcache_unlink(bcstripe *bs,bcentry *e) {
+	*(e->hprev) = e->hnext;
+	if (e->hnext) {
+		e->hnext->hprev = e->hprev;
 	}
-	zassert(pthread_mutex_lock(&statslock));
-	stats_dataopr++;
-	stats_databytesr += size;
-	stats_rtime += rtime;
-	f->cstat.rops++;
-	f->cstat.rbytes += size;
-	f->cstat.nsecreadsum += rtime;
-	if (rtime>(int64_t)(f->cstat.nsecreadmax)) {
-		f->cstat.nsecreadmax = rtime;
+	if (e->cnext==e) {
+		bs->hand = NULL;
+	} else {
+		e->cnext->cprev = e->cprev;
+		e->cprev->cnext = e->cnext;
+		if (bs->hand==e) {
+			bs->hand = e->cnext;
+		}
+	}
+	bs->entries--;
+	if (e->refcnt>0) {
+		e->unlinked = 1;
+	} else {
+		hdd_bcache_entry_free(e);
 	}
-	zassert(pthread_mutex_unlock(&statslock));
 }
 
-static inline void hdd_stats_datawrite(folder *f,uint32_t size,int64_t wtime) {
-	if (wtime<=0) {
-		return;
+// returns referenced entry or NULL (hdd_bcache_release has to be called after use)
+static inline bcentry* hdd_bcache_get(uint64_t chunkid,uint32_t version,uint16_t blocknum) {
+	bcstripe *bs = bcache + BCACHE_STRIPEPOS(chunkid);
+	bcentry *e;
+	zassert(pthread_mutex_lock(&(bs->lock)));
+	if (bs->limit==0) {
+		zassert(pthread_mutex_unlock(&(bs->lock)));
+		return NULL;
 	}
-	zassert(pthread_mutex_lock(&statslock));
-	stats_dataopw++;
-	stats_databytesw += size;
-	stats_wtime += wtime;
-	f->cstat.wops++;
-	f->cstat.wbytes += size;
-	f->cstat.nsecwritesum += wtime;
-	if (wtime>(int64_t)(f->cstat.nsecwritemax)) {
-		f->cstat.nsecwritemax = wtime;
+	for (e=bs->hash[BCACHE_HASHPOS(chunkid,blocknum)] ; e ; e=e->hnext) {
+		if (e->chunkid==chunkid && e->blocknum==blocknum && e->version==version) {
+			e->refcnt++;
+			e->refbit = 1;
+			bs->hits++;
+			zassert(pthread_mutex_unlock(&(bs->lock)));
+			return e;
+		}
 	}
-	zassert(pthread_mutex_unlock(&statslock));
+	bs->misses++;
+	zassert(pthread_mutex_unlock(&(bs->lock)));
+	return NULL;
 }
 
-static inline void hdd_stats_datafsync(folder *f,int64_t fsynctime) {
-	if (fsynctime<=0) {
-		return;
-	}
-	zassert(pthread_mutex_lock(&statslock));
-	stats_wtime += fsynctime;
-	f->cstat.fsyncops++;
-	f->cstat.nsecfsyncsum += fsynctime;
-	if (fsynctime>(int64_t)(f->cstat.nsecfsyncmax)) {
-		f->cstat.nsecfsyncmax = fsynctime;
+static inline void hdd_bcache_release(bcentry *e) {
+	bcstripe *bs = bcache + BCACHE_STRIPEPOS(e->chunkid);
+	zassert(pthread_mutex_lock(&(bs->lock)));
+	e->refcnt--;
+	if (e->refcnt==0 && e->unlinked) {
+		hdd_bcache_entry_free(e);
 	}
-	zassert(pthread_mutex_unlock(&statslock));
+	zassert(pthread_mutex_unlock(&(bs->lock)));
 }
 
-uint32_t hdd_diskinfo_size(void) {
-	cfgline *cl;
-	uint32_t s,sl;
+// stores copy of verified block (replaces previous copy of this block)
+static void hdd_bcache_put(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t *data) {
+	bcstripe *bs = bcache + BCACHE_STRIPEPOS(chunkid);
+	bcentry *e,*victim;
+	uint32_t hashpos,scan;
 
-	s = 0;
-	zassert(pthread_mutex_lock(&folderlock));
-	for (cl=cfglinehead ; cl!=NULL ; cl=cl->next ) {
-		sl = strlen(cl->path);
-		if (sl>255) {
-			sl = 255;
+	hashpos = BCACHE_HASHPOS(chunkid,blocknum);
+	zassert(pthread_mutex_lock(&(bs->lock)));
+	if (bs->limit==0) {
+		zassert(pthread_mutex_unlock(&(bs->lock)));
+		return;
+	}
+	for (e=bs->hash[hashpos] ; e ; e=e->hnext) {
+		if (e->chunkid==chunkid && e->blocknum==blocknum) {
+			hdd_bcache_unlink(bs,e);
+			break;
 		}
-		s += 2+34+3*64+sl;
 	}
-	return s;
+	victim = NULL;
+	// limit could have been decreased - evict more than one entry then
+	scan = 2*bs->entries;
+	while (bs->hand!=NULL && bs->entries>=bs->limit && scan>0) {
+		e = bs->hand;
+		bs->hand = e->cnext;
+		scan--;
+		if (e->refcnt>0) {
+			continue;
+		}
+		if (e->refbit) {
+			e->refbit = 0;
+			continue;
+		}
+		if (victim!=NULL) {
+			victim->refcnt = 0;
+			hdd_bcache_entry_free(victim);
+		}
+		// detach data buffer from evicted entry and reuse it
+		e->refcnt = 1;
+		hdd_bcache_unlink(bs,e);
+		victim = e;
+	}
+	if (bs->entries>=bs->limit) { // everything is in use
+		if (victim!=NULL) {
+			victim->refcnt = 0;
+			hdd_bcache_entry_free(victim);
+		}
+		zassert(pthread_mutex_unlock(&(bs->lock)));
+		return;
+	}
+	if (victim==NULL) {
+		victim = malloc(sizeof(bcentry));
+		passert(victim);
+#ifdef MMAP_ALLOC
+		victim->data = (uint8_t*)mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
+#else
+		victim->data = (uint8_t*)malloc(MFSBLOCKSIZE);
+#endif
+		passert(victim->data);
+	}
+	bs->entries++; // reserve place for new entry
+	zassert(pthread_mutex_unlock(&(bs->lock)));
+
+	e = victim;
+	e->chunkid = chunkid;
+	e->version = version;
+	e->blocknum = blocknum;
+	e->refbit = 0;
+	e->unlinked = 0;
+	e->refcnt = 0;
+	memcpy(e->data,data,MFSBLOCKSIZE);
+
+	zassert(pthread_mutex_lock(&(bs->lock)));
+	if (bs->limit==0) { // cache disabled in the meantime
+		bs->entries--;
+		hdd_bcache_entry_free(e);
+		zassert(pthread_mutex_unlock(&(bs->lock)));
+		return;
+	}
+	e->hnext = bs->hash[hashpos];
+	if (e->hnext) {
+		e->hnext->hprev = &(e->hnext);
+	}
+	e->hprev = bs->hash + hashpos;
+	bs->hash[hashpos] = e;
+	if (bs->hand==NULL) {
+		e->cnext = e;
+		e->cprev = e;
+		bs->hand = e;
+	} else { // insert just behind the hand - it will be checked last
+		e->cnext = bs->hand;
+		e->cprev = bs->hand->cprev;
+		e->cprev->cnext = e;
+		bs->hand->cprev = e;
+	}
+	zassert(pthread_mutex_unlock(&(bs->lock)));
 }
 
-void hdd_diskinfo_data(uint8_t *buff) {
-	cfgline *cl;
-	folder *f;
-	hddstats s;
-	uint32_t sl;
-	uint32_t ei;
-	uint32_t pos;
-	if (buff) {
-		zassert(pthread_mutex_lock(&statslock));
-		for (cl=cfglinehead ; cl!=NULL ; cl=cl->next ) {
-			f = cl->f;
-			sl = strlen(cl->path);
-			if (sl>255) {
-				put16bit(&buff,34+3*64+255);	// size of this entry
-				put8bit(&buff,255);
-				memcpy(buff,"(...)",5);
-				memcpy(buff+5,cl->path+(sl-250),250);
-				buff += 255;
-			} else {
-				put16bit(&buff,34+3*64+sl);	// size of this entry
-				put8bit(&buff,sl);
-				if (sl>0) {
-					memcpy(buff,cl->path,sl);
-					buff += sl;
-				}
-			}
-			if (f!=NULL) {
-				put8bit(&buff,((f->markforremoval)?1:0)+((f->damaged)?2:0)+((f->scanstate==SCST_SCANINPROGRESS)?4:0));
-				ei = (f->lasterrindx+(LASTERRSIZE-1))%LASTERRSIZE;
-				put64bit(&buff,f->lasterrtab[ei].chunkid);
-				put32bit(&buff,f->lasterrtab[ei].timestamp);
-				if (f->scanstate==SCST_SCANINPROGRESS) {
-					put64bit(&buff,f->scanprogress);
-					put64bit(&buff,0);
-				} else {
-					put64bit(&buff,f->total-f->avail);
-					put64bit(&buff,f->total);
-				}
-				put32bit(&buff,f->chunkcount);
-				s = f->stats[f->statspos];
-				hdd_stats_binary_pack(&buff,&s);	// 64B
-				for (pos=1 ; pos<60 ; pos++) {
-					hdd_stats_add(&s,&(f->stats[(f->statspos+pos)%STATSHISTORY]));
-				}
-				hdd_stats_binary_pack(&buff,&s);	// 64B
-				for (pos=60 ; pos<24*60 ; pos++) {
-					hdd_stats_add(&s,&(f->stats[(f->statspos+pos)%STATSHISTORY]));
-				}
-				hdd_stats_binary_pack(&buff,&s);	// 64B
-			} else {
-				put8bit(&buff,2+8);
-				memset(buff,0,32+3*64);
-				buff+=32+3*64;
+static void hdd_bcache_invalidate_block(uint64_t chunkid,uint16_t blocknum) {
+	bcstripe *bs = bcache + BCACHE_STRIPEPOS(chunkid);
+	bcentry *e;
+	zassert(pthread_mutex_lock(&(bs->lock)));
+	if (bs->entries>0) {
+		for (e=bs->hash[BCACHE_HASHPOS(chunkid,blocknum)] ; e ; e=e->hnext) {
+			if (e->chunkid==chunkid && e->blocknum==blocknum) {
+				hdd_bcache_unlink(bs,e);
+				break;
 			}
 		}
-		zassert(pthread_mutex_unlock(&statslock));
 	}
-	zassert(pthread_mutex_unlock(&folderlock));
+	zassert(pthread_mutex_unlock(&(bs->lock)));
 }
 
-uint32_t hdd_diskinfo_monotonic_size(void) {
-	folder *f;
-	uint32_t s,sl;
+static void hdd_bcache_invalidate_chunk(uint64_t chunkid) {
+	bcstripe *bs = bcache + BCACHE_STRIPEPOS(chunkid);
+	bcentry *e,*ne;
+	uint32_t blocknum;
+	zassert(pthread_mutex_lock(&(bs->lock)));
+	for (blocknum=0 ; blocknum<MFSBLOCKSINCHUNK && bs->entries>0 ; blocknum++) {
+		for (e=bs->hash[BCACHE_HASHPOS(chunkid,blocknum)] ; e ; e=ne) {
+			ne = e->hnext;
+			if (e->chunkid==chunkid && e->blocknum==blocknum) {
+				hdd_bcache_unlink(bs,e);
+			}
+		}
+	}
+	zassert(pthread_mutex_unlock(&(bs->lock)));
+}
 
-	s = 2;
-	zassert(pthread_mutex_lock(&folderlock));
-	for (f=folderhead ; f ; f=f->next ) {
-		sl = strlen(f->path);
-		if (sl>255) {
-			sl = 255;
+// limit (in blocks) is divided evenly between stripes
+static void hdd_bcache_set_limit(uint32_t limit) {
+	bcstripe *bs;
+	uint32_t i;
+	for (i=0 ; i<BCACHE_STRIPES ; i++) {
+		bs = bcache + i;
+		zassert(pthread_mutex_lock(&(bs->lock)));
+		bs->limit = (limit+BCACHE_STRIPES-1)/BCACHE_STRIPES;
+		while (bs->hand!=NULL && bs->entries>bs->limit && bs->hand->refcnt==0) {
+			hdd_bcache_unlink(bs,bs->hand);
 		}
-		s += 2+34+64+sl;
+		zassert(pthread_mutex_unlock(&(bs->lock)));
 	}
-	return s;
 }
 
-void hdd_diskinfo_monotonic_data(uint8_t *buff) {
+// read cache - copies of hot chunks kept on fast devices ('$' lines in mfshdd.cfg), readers use them instead of hdd files
+// copies contain only data blocks (offset of block in copy is blocknum*MFSBLOCKSIZE) and are checked against chunk crc by readers, like hdd data
+// copies are volatile (files left from previous run are removed) and keyed by (chunkid,version) - writes and chunk operations remove them
+// cachelock guards everything below, chunk records keep only a hint (cachestate) changed under chunk lock
+
+#define RCACHE_HASHSIZE 65536
+#define RCACHE_HASHPOS(chunkid) (((uint32_t)(chunkid))&(RCACHE_HASHSIZE-1))
+#define RCACHE_QUEUESIZE 1024
+#define RCACHE_LEAVEFREE_DEFAULT 0x10000000
+
+typedef struct cachefolder {
+	char *path;
+	uint64_t leavefree;
+	uint64_t sizelimit;	// 0 - whole device
+	uint64_t used;	// bytes in copies (including the one being copied)
+	uint64_t avail;	// free space on device (refreshed every second)
+	uint32_t entries;
+	uint8_t toremove;
+	uint8_t needwipe;	// files from previous run have to be removed before folder is used
+	int lfd;
+	struct cachefolder *next;
+} cachefolder;
+
+typedef struct cacheentry {
+	uint64_t chunkid;
+	uint32_t version;
+	uint32_t size;
+	uint8_t valid;	// 0 - still being copied
+	cachefolder *cf;
+	struct cacheentry *hnext,**hprev;
+	struct cacheentry *lrunext,**lruprev;	// only valid entries - least recently used first
+} cacheentry;
+
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+static cachefolder *cachefolderhead = NULL;
+static cacheentry *cachehash[RCACHE_HASHSIZE];
+static cacheentry *cachelruhead = NULL,**cachelrutail = &cachelruhead;
+static uint64_t cachequeue[RCACHE_QUEUESIZE];
+static uint32_t cachequeuepos = 0;
+static uint32_t cachequeuecnt = 0;
+static uint32_t RCacheMinReads = 0;	// read requests needed to promote chunk (0 - read cache is not used)
+static uint32_t RCachePeriod = 300;
+static uint32_t RCacheSpeed = 50;	// MiB/s
+static uint8_t cacheepoch = 0;
+static uint8_t cacheactive = 0;	// at least one read cache folder is ready
+static uint32_t stats_rcachehit = 0;
+static uint32_t stats_rcachemiss = 0;
+static uint32_t stats_rcachepromote = 0;
+static uint32_t stats_rcacheevict = 0;
+
+void hdd_rcache_stats(uint32_t *hits,uint32_t *misses,uint32_t *promotions,uint32_t *evictions) {
+	zassert(pthread_mutex_lock(&cachelock));
+	*hits = stats_rcachehit;
+	*misses = stats_rcachemiss;
+	*promotions = stats_rcachepromote;
+	*evictions = stats_rcacheevict;
+	stats_rcachehit = 0;
+	stats_rcachemiss = 0;
+	stats_rcachepromote = 0;
+	stats_rcacheevict = 0;
+	zassert(pthread_mutex_unlock(&cachelock));
+}
+
+static inline uint32_t hdd_rcache_minreads(void) {
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	return __sync_or_and_fetch(&RCacheMinReads,0);
+#else
+	uint32_t r;
+	zassert(pthread_mutex_lock(&cachelock));
+	r = RCacheMinReads;
+	zassert(pthread_mutex_unlock(&cachelock));
+	return r;
+#endif
+}
+
+static inline uint8_t hdd_rcache_epoch(void) {
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	return __sync_or_and_fetch(&cacheepoch,0);
+#else
+	uint8_t r;
+	zassert(pthread_mutex_lock(&cachelock));
+	r = cacheepoch;
+	zassert(pthread_mutex_unlock(&cachelock));
+	return r;
+#endif
+}
+
+static inline void hdd_rcache_filename(char fname[PATH_MAX],const char *path,uint64_t chunkid,uint32_t version) {
+	snprintf(fname,PATH_MAX,"%s%02"PRIX8"/chunk_%016"PRIX64"_%08"PRIX32".mfs",path,(uint8_t)(chunkid),chunkid,version);
+}
+
+// removes entry from hash and lru list and unlinks its file (cachelock locked)
+static inline void hdd_rcache_entry_remove(cacheentry *e) {
+	char fname[PATH_MAX];
+	*(e->hprev) = e->hnext;
+	if (e->hnext) {
+		e->hnext->hprev = e->hprev;
+	}
+	if (e->valid) {
+		*(e->lruprev) = e->lrunext;
+		if (e->lrunext) {
+			e->lrunext->lruprev = e->lruprev;
+		} else {
+			cachelrutail = e->lruprev;
+		}
+	}
+	e->cf->used -= e->size;
+	e->cf->avail += e->size;
+	e->cf->entries--;
+	hdd_rcache_filename(fname,e->cf->path,e->chunkid,e->version);
+	unlink(fname);
+	free(e);
+}
+
+// removes all copies of given chunk
+static void hdd_rcache_invalidate(uint64_t chunkid) {
+	cacheentry *e,*ne;
+	zassert(pthread_mutex_lock(&cachelock));
+	for (e=cachehash[RCACHE_HASHPOS(chunkid)] ; e ; e=ne) {
+		ne = e->hnext;
+		if (e->chunkid==chunkid) {
+			hdd_rcache_entry_remove(e);
+		}
+	}
+	zassert(pthread_mutex_unlock(&cachelock));
+}
+
+static inline uint8_t hdd_rcache_active(void) {
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	return __sync_or_and_fetch(&cacheactive,0);
+#else
+	uint8_t r;
+	zassert(pthread_mutex_lock(&cachelock));
+	r = cacheactive;
+	zassert(pthread_mutex_unlock(&cachelock));
+	return r;
+#endif
+}
+
+// moves entry to the end of lru list (cachelock locked)
+static inline void hdd_rcache_entry_touch(cacheentry *e) {
+	if (e->lrunext) {
+		*(e->lruprev) = e->lrunext;
+		e->lrunext->lruprev = e->lruprev;
+		e->lrunext = NULL;
+		e->lruprev = cachelrutail;
+		*(e->lruprev) = e;
+		cachelrutail = &(e->lrunext);
+	}
+}
+
+static inline cacheentry* hdd_rcache_entry_find(uint64_t chunkid,uint32_t version) {
+	cacheentry *e;
+	for (e=cachehash[RCACHE_HASHPOS(chunkid)] ; e ; e=e->hnext) {
+		if (e->chunkid==chunkid && e->version==version && e->valid) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+// called once per client read request - returns 1 when valid copy exists (hit), otherwise optionally queues chunk for promotion
+static uint8_t hdd_rcache_lookup(uint64_t chunkid,uint32_t version,uint8_t cached,uint8_t *enqueue) {
+	cacheentry *e;
+	uint8_t hit;
+	hit = 0;
+	zassert(pthread_mutex_lock(&cachelock));
+	if (cached) {
+		e = hdd_rcache_entry_find(chunkid,version);
+		if (e!=NULL) {
+			hdd_rcache_entry_touch(e);
+			hit = 1;
+		}
+	}
+	if (hit) {
+		stats_rcachehit++;
+	} else {
+		stats_rcachemiss++;
+		if (*enqueue) {
+			if (cachequeuecnt<RCACHE_QUEUESIZE) {
+				cachequeue[(cachequeuepos+cachequeuecnt)%RCACHE_QUEUESIZE] = chunkid;
+				cachequeuecnt++;
+			} else {
+				*enqueue = 0;
+			}
+		}
+	}
+	zassert(pthread_mutex_unlock(&cachelock));
+	return hit;
+}
+
+// opens valid copy - returns descriptor or -1
+static int hdd_rcache_open(uint64_t chunkid,uint32_t version) {
+	char fname[PATH_MAX];
+	cacheentry *e;
+	zassert(pthread_mutex_lock(&cachelock));
+	e = hdd_rcache_entry_find(chunkid,version);
+	if (e==NULL) {
+		zassert(pthread_mutex_unlock(&cachelock));
+		return -1;
+	}
+	hdd_rcache_filename(fname,e->cf->path,chunkid,version);
+	zassert(pthread_mutex_unlock(&cachelock));
+	return open(fname,O_RDONLY);
+}
+
+// called from hdd_parseline for lines starting with '$' (path already ends with '/')
+static int hdd_rcache_folder_add(const char *path,uint8_t lmode,uint64_t limit) {
+	cachefolder *cf;
+	char *lockfname;
+	uint32_t l;
+	int lfd;
+
+	zassert(pthread_mutex_lock(&cachelock));
+	for (cf=cachefolderhead ; cf ; cf=cf->next) {
+		if (strcmp(cf->path,path)==0) {
+			cf->toremove = 0;
+			cf->leavefree = (lmode==1)?limit:RCACHE_LEAVEFREE_DEFAULT;
+			cf->sizelimit = (lmode==2)?limit:0;
+			zassert(pthread_mutex_unlock(&cachelock));
+			return 0;
+		}
+	}
+	zassert(pthread_mutex_unlock(&cachelock));
+
+	l = strlen(path);
+	lockfname = (char*)malloc(l+6);
+	passert(lockfname);
+	memcpy(lockfname,path,l);
+	memcpy(lockfname+l,".lock",6);
+	lfd = open(lockfname,O_RDWR|O_CREAT|O_TRUNC,0640);
+	if (lfd<0) {
+		mfs_arg_errlog(LOG_ERR,"hdd space manager: can't create lock file '%s'",lockfname);
+		free(lockfname);
+		return -1;
+	}
+	if (lockf(lfd,F_TLOCK,0)<0) {
+		if (ERRNO_ERROR) {
+			mfs_arg_errlog(LOG_NOTICE,"hdd space manager: lockf '%s' error",lockfname);
+		} else {
+			mfs_arg_syslog(LOG_ERR,"hdd space manager: read cache folder '%s' already locked by another process",path);
+		}
+		free(lockfname);
+		close(lfd);
+		return -1;
+	}
+	free(lockfname);
+
+	cf = (cachefolder*)malloc(sizeof(cachefolder));
+	passert(cf);
+	cf->path = strdup(path);
+	passert(cf->path);
+	cf->leavefree = (lmode==1)?limit:RCACHE_LEAVEFREE_DEFAULT;
+	cf->sizelimit = (lmode==2)?limit:0;
+	cf->used = 0;
+	cf->avail = 0;
+	cf->entries = 0;
+	cf->toremove = 0;
+	cf->needwipe = 1;
+	cf->lfd = lfd;
+	zassert(pthread_mutex_lock(&cachelock));
+	cf->next = cachefolderhead;
+	cachefolderhead = cf;
+	zassert(pthread_mutex_unlock(&cachelock));
+	mfs_arg_syslog(LOG_NOTICE,"hdd space manager: read cache folder '%s' added",path);
+	return 0;
+}
+
+// removes copies left from previous run (only read cache thread)
+static void hdd_rcache_folder_wipe(cachefolder *cf) {
+	char dname[PATH_MAX];
+	DIR *dd;
+	struct dirent *de;
+	uint32_t i,l;
+
+	for (i=0 ; i<256 ; i++) {
+		snprintf(dname,PATH_MAX,"%s%02"PRIX32,cf->path,i);
+		dd = opendir(dname);
+		if (dd==NULL) {
+			continue;
+		}
+		while ((de = readdir(dd))!=NULL) {
+			l = strlen(de->d_name);
+			if (l>10 && memcmp(de->d_name,"chunk_",6)==0 && memcmp(de->d_name+l-4,".mfs",4)==0) {
+				unlinkat(dirfd(dd),de->d_name,0);
+			}
+		}
+		closedir(dd);
+	}
+}
+
+// refreshes free space, wipes new folders and removes folders deleted from configuration (only read cache thread)
+static void hdd_rcache_folders_check(void) {
+	cachefolder *cf,**cfp;
+	cacheentry *e,*ne;
+	struct statvfs fsinfo;
+	uint64_t avail;
+	uint32_t i;
+	uint8_t active;
+
+	zassert(pthread_mutex_lock(&cachelock));
+	cfp = &cachefolderhead;
+	while ((cf=*cfp)!=NULL) {
+		if (cf->toremove) {
+			for (i=0 ; i<RCACHE_HASHSIZE ; i++) {
+				for (e=cachehash[i] ; e ; e=ne) {
+					ne = e->hnext;
+					if (e->cf==cf) {
+						hdd_rcache_entry_remove(e);
+					}
+				}
+			}
+			*cfp = cf->next;
+			mfs_arg_syslog(LOG_NOTICE,"hdd space manager: read cache folder '%s' removed",cf->path);
+			close(cf->lfd);
+			free(cf->path);
+			free(cf);
+		} else {
+			cfp = &(cf->next);
+		}
+	}
+	cf = cachefolderhead;
+	zassert(pthread_mutex_unlock(&cachelock));
+
+	// new folders are added at the beginning of the list and only this thread removes them, so the list can be traversed without lock
+	active = 0;
+	for ( ; cf ; cf=cf->next) {
+		if (cf->needwipe) {
+			hdd_rcache_folder_wipe(cf);
+		}
+		if (statvfs(cf->path,&fsinfo)<0) {
+			avail = 0;
+		} else {
+			avail = (uint64_t)(fsinfo.f_frsize)*(uint64_t)(fsinfo.f_bavail);
+		}
+		zassert(pthread_mutex_lock(&cachelock));
+		cf->needwipe = 0;
+		cf->avail = avail;
+		zassert(pthread_mutex_unlock(&cachelock));
+		active = 1;
+	}
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	__sync_and_and_fetch(&cacheactive,0);
+	__sync_or_and_fetch(&cacheactive,active);
+#else
+	zassert(pthread_mutex_lock(&cachelock));
+	cacheactive = active;
+	zassert(pthread_mutex_unlock(&cachelock));
+#endif
+}
+
+// space that can be used in folder for new copies (cachelock locked)
+static inline uint64_t hdd_rcache_folder_free(cachefolder *cf) {
+	uint64_t fspace,lspace;
+	if (cf->toremove || cf->needwipe) {
+		return 0;
+	}
+	fspace = (cf->avail>cf->leavefree)?(cf->avail-cf->leavefree):0;
+	if (cf->sizelimit>0) {
+		lspace = (cf->sizelimit>cf->used)?(cf->sizelimit-cf->used):0;
+		if (lspace<fspace) {
+			fspace = lspace;
+		}
+	}
+	return fspace;
+}
+
+// reserves space for new copy (evicting least recently used copies when necessary) and inserts entry in 'copying' state
+static cacheentry* hdd_rcache_entry_create(uint64_t chunkid,uint32_t version,uint32_t size) {
+	cachefolder *cf,*bcf;
+	cacheentry *e;
+	uint64_t fspace,bspace;
+
+	zassert(pthread_mutex_lock(&cachelock));
+	for (;;) {
+		bcf = NULL;
+		bspace = 0;
+		for (cf=cachefolderhead ; cf ; cf=cf->next) {
+			fspace = hdd_rcache_folder_free(cf);
+			if (bcf==NULL || fspace>bspace) {
+				bcf = cf;
+				bspace = fspace;
+			}
+		}
+		if (bcf==NULL || bcf->toremove || bcf->needwipe) {
+			zassert(pthread_mutex_unlock(&cachelock));
+			return NULL;
+		}
+		if (bspace>=size) {
+			break;
+		}
+		if (cachelruhead==NULL) {
+			zassert(pthread_mutex_unlock(&cachelock));
+			return NULL;
+		}
+		hdd_rcache_entry_remove(cachelruhead);
+		stats_rcacheevict++;
+	}
+	e = (cacheentry*)malloc(sizeof(cacheentry));
+	passert(e);
+	e->chunkid = chunkid;
+	e->version = version;
+	e->size = size;
+	e->valid = 0;
+	e->cf = bcf;
+	e->lrunext = NULL;
+	e->lruprev = NULL;
+	e->hnext = cachehash[RCACHE_HASHPOS(chunkid)];
+	if (e->hnext) {
+		e->hnext->hprev = &(e->hnext);
+	}
+	e->hprev = cachehash+RCACHE_HASHPOS(chunkid);
+	cachehash[RCACHE_HASHPOS(chunkid)] = e;
+	bcf->used += size;
+	bcf->avail = (bcf->avail>size)?(bcf->avail-size):0;
+	bcf->entries++;
+	zassert(pthread_mutex_unlock(&cachelock));
+	return e;
+}
+
+// checks if entry still exists (it is removed when chunk is modified during copying)
+static inline uint8_t hdd_rcache_entry_exists(cacheentry *ce) {
+	cacheentry *e;
+	for (e=cachehash[RCACHE_HASHPOS(ce->chunkid)] ; e ; e=e->hnext) {
+		if (e==ce) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// copies are left on disk (they are removed when folder is added again)
+static void hdd_rcache_free(void) {
+	cachefolder *cf,*cfn;
+	cacheentry *e,*en;
+	uint32_t i;
+	for (i=0 ; i<RCACHE_HASHSIZE ; i++) {
+		for (e=cachehash[i] ; e ; e=en) {
+			en = e->hnext;
+			free(e);
+		}
+		cachehash[i] = NULL;
+	}
+	cachelruhead = NULL;
+	cachelrutail = &cachelruhead;
+	for (cf=cachefolderhead ; cf ; cf=cfn) {
+		cfn = cf->next;
+		close(cf->lfd);
+		free(cf->path);
+		free(cf);
+	}
+	cachefolderhead = NULL;
+}
+
+// hottest chunks (reported to master) - small set-associative table, so memory does not depend on number of chunks
+#define HOT_HASHSIZE 1024
+#define HOT_WAYS 4
+#define HOT_MINHEAT 4
+
+typedef struct hotentry {
+	uint64_t chunkid;
+	uint8_t heat;
+	uint8_t epoch;
+} hotentry;
+
+static pthread_mutex_t hotlock = PTHREAD_MUTEX_INITIALIZER;
+static hotentry hottab[HOT_HASHSIZE];
+static hotentry hotsorted[HOT_HASHSIZE];
+
+static inline uint8_t hdd_heat_decay(uint8_t heat,uint8_t heatepoch,uint8_t epoch) {
+	uint8_t age = epoch - heatepoch;
+	return (age>=8)?0:(heat>>age);
+}
+
+// remembers chunk heat - replaces the coldest entry in chunk's set when chunk is not there yet
+static void hdd_hot_update(uint64_t chunkid,uint8_t heat,uint8_t epoch) {
+	hotentry *he,*coldest;
+	uint8_t coldheat,h;
+	uint32_t i;
+
+	he = hottab + ((((uint32_t)((chunkid * UINT64_C(0x9E3779B97F4A7C15)) >> 32)) % (HOT_HASHSIZE/HOT_WAYS)) * HOT_WAYS);
+	coldest = NULL;
+	coldheat = heat;
+	zassert(pthread_mutex_lock(&hotlock));
+	for (i=0 ; i<HOT_WAYS ; i++,he++) {
+		if (he->chunkid==chunkid) {
+			he->heat = heat;
+			he->epoch = epoch;
+			zassert(pthread_mutex_unlock(&hotlock));
+			return;
+		}
+		h = (he->chunkid==0)?0:hdd_heat_decay(he->heat,he->epoch,epoch);
+		if (h<coldheat) {
+			coldheat = h;
+			coldest = he;
+		}
+	}
+	if (coldest!=NULL) {
+		coldest->chunkid = chunkid;
+		coldest->heat = heat;
+		coldest->epoch = epoch;
+	}
+	zassert(pthread_mutex_unlock(&hotlock));
+}
+
+static int hdd_hot_cmp(const void *a,const void *b) {
+	const hotentry *aa = (const hotentry*)a;
+	const hotentry *bb = (const hotentry*)b;
+	return (int)(bb->heat) - (int)(aa->heat);
+}
+
+uint32_t hdd_get_hot_chunk_count(uint32_t limit) {
+	uint32_t i,n;
+	uint8_t epoch,h;
+
+	epoch = hdd_rcache_epoch();
+	zassert(pthread_mutex_lock(&hotlock));
+	n = 0;
+	for (i=0 ; i<HOT_HASHSIZE ; i++) {
+		if (hottab[i].chunkid!=0) {
+			h = hdd_heat_decay(hottab[i].heat,hottab[i].epoch,epoch);
+			if (h>=HOT_MINHEAT) {
+				hotsorted[n].chunkid = hottab[i].chunkid;
+				hotsorted[n].heat = h;
+				n++;
+			} else {
+				hottab[i].chunkid = 0;
+			}
+		}
+	}
+	qsort(hotsorted,n,sizeof(hotentry),hdd_hot_cmp);
+	return (n<limit)?n:limit;
+}
+
+void hdd_get_hot_chunk_data(uint8_t *buff,uint32_t limit) {
+	uint32_t i;
+	if (buff) {
+		for (i=0 ; i<limit ; i++) {
+			put64bit(&buff,hotsorted[i].chunkid);
+			put8bit(&buff,hotsorted[i].heat);
+		}
+	}
+	zassert(pthread_mutex_unlock(&hotlock));
+}
+
+// counts client read request (chunk locked) - returns 1 when data will be read from read cache
+static uint8_t hdd_rcache_access(chunk *c) {
+	uint32_t minreads;
+	uint8_t epoch,enqueue,hit;
+
+	epoch = hdd_rcache_epoch();
+	c->heat = hdd_heat_decay(c->heat,c->heatepoch,epoch);
+	c->heatepoch = epoch;
+	if (c->heat<255) {
+		c->heat++;
+	}
+	if (c->heat>=HOT_MINHEAT) {
+		hdd_hot_update(c->chunkid,c->heat,epoch);
+	}
+	minreads = hdd_rcache_minreads();
+	if (minreads==0 || hdd_rcache_active()==0) {
+		return 0;
+	}
+	enqueue = (c->cachestate!=RCS_QUEUED && c->heat>=minreads && c->blocks>0)?1:0;
+	hit = hdd_rcache_lookup(c->chunkid,c->version,(c->cachestate==RCS_CACHED)?1:0,&enqueue);
+	if (hit==0) {
+		if (c->cachestate==RCS_CACHED && c->op!=NULL && c->op->cfd>=0) {
+			close(c->op->cfd);
+			c->op->cfd = -1;
+		}
+		if (enqueue) {
+			c->cachestate = RCS_QUEUED;
+		} else if (c->cachestate==RCS_CACHED) {
+			c->cachestate = RCS_NONE;
+		}
+	}
+	return hit;
+}
+
+// returns descriptor to read data blocks from (chunk locked and opened) - copy in read cache when available, otherwise chunk file
+static inline int hdd_rcache_datafd(chunk *c,uint64_t *dataoff) {
+	if (c->cachestate==RCS_CACHED) {
+		if (c->op->cfd<0) {
+			c->op->cfd = hdd_rcache_open(c->chunkid,c->version);
+			if (c->op->cfd<0) {
+				c->cachestate = RCS_NONE;
+			}
+		}
+		if (c->op->cfd>=0) {
+			*dataoff = 0;
+			return c->op->cfd;
+		}
+	}
+	*dataoff = c->hdrsize+CHUNKCRCSIZE;
+	return c->op->fd;
+}
+
+// forgets copy of chunk (chunk locked) - used when chunk is modified or when copy can not be read
+static void hdd_rcache_drop(chunk *c) {
+	if (c->op!=NULL && c->op->cfd>=0) {
+		close(c->op->cfd);
+		c->op->cfd = -1;
+	}
+	if (c->cachestate!=RCS_NONE) {
+		hdd_rcache_invalidate(c->chunkid);
+		c->cachestate = RCS_NONE;
+	}
+}
+
+uint32_t hdd_errorcounter(void) {
+	uint32_t result;
+	zassert(pthread_mutex_lock(&dclock));
+	result = errorcounter;
+	errorcounter = 0;
+	zassert(pthread_mutex_unlock(&dclock));
+	return result;
+}
+
+uint8_t hdd_spacechanged(void) {
+#ifdef HAVE___SYNC_FETCH_AND_OP
+	return __sync_fetch_and_and(&hddspacechanged,0);
+#else
+	uint8_t res;
+	zassert(pthread_mutex_lock(&dclock));
+	res = hddspacechanged;
+	hddspacechanged = 0;
+	zassert(pthread_mutex_unlock(&dclock));
+	return res;
+#endif
+}
+
+void hdd_stats(uint64_t *br,uint64_t *bw,uint32_t *opr,uint32_t *opw,uint32_t *dbr,uint32_t *dbw,uint32_t *dopr,uint32_t *dopw,uint32_t *movl,uint32_t *movh,uint64_t *rtime,uint64_t *wtime) {
+	uint64_t sums[HSC_GLOBALCNT];
+	uint32_t i;
+	tc_sums(iostats,0,HSC_GLOBALCNT,sums);
+	zassert(pthread_mutex_lock(&statslock));
+	for (i=0 ; i<HSC_GLOBALCNT ; i++) {
+		sums[i] -= iostatsbase[i];
+		iostatsbase[i] += sums[i];
+	}
+	*br = sums[HSC_BYTESR];
+	*bw = sums[HSC_BYTESW];
+	*opr = sums[HSC_OPR];
+	*opw = sums[HSC_OPW];
+	*dbr = sums[HSC_DATABYTESR];
+	*dbw = sums[HSC_DATABYTESW];
+	*dopr = sums[HSC_DATAOPR];
+	*dopw = sums[HSC_DATAOPW];
+	*movl = stats_movels;
+	*movh = stats_movehs;
+	*rtime = sums[HSC_RTIME];
+	*wtime = sums[HSC_WTIME] + stats_wtime;
+	stats_movels = 0;
+	stats_movehs = 0;
+	stats_wtime = 0;
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+void hdd_op_stats(uint32_t *op_create,uint32_t *op_delete,uint32_t *op_version,uint32_t *op_duplicate,uint32_t *op_truncate,uint32_t *op_duptrunc,uint32_t *op_test) {
+	zassert(pthread_mutex_lock(&statslock));
+	*op_create = stats_create;
+	*op_delete = stats_delete;
+	*op_version = stats_version;
+	*op_duplicate = stats_duplicate;
+	*op_truncate = stats_truncate;
+	*op_duptrunc = stats_duptrunc;
+	*op_test = stats_test;
+	stats_create = 0;
+	stats_delete = 0;
+	stats_version = 0;
+	stats_duplicate = 0;
+	stats_truncate = 0;
+	stats_duptrunc = 0;
+	stats_test = 0;
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+static inline void hdd_stats_move(uint8_t hsflag) {
+	zassert(pthread_mutex_lock(&statslock));
+	if (hsflag) {
+		stats_movehs++;
+	} else {
+		stats_movels++;
+	}
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+static inline void hdd_stats_read(uint32_t size) {
+	uint64_t *cnt = tc_get(iostats,0);
+	cnt[HSC_OPR]++;
+	cnt[HSC_BYTESR] += size;
+}
+
+static inline void hdd_stats_write(uint32_t size) {
+	uint64_t *cnt = tc_get(iostats,0);
+	cnt[HSC_OPW]++;
+	cnt[HSC_BYTESW] += size;
+}
+
+void hdd_hole_stats(uint64_t *punched,uint64_t *skipped) {
+	uint64_t sums[HSC_HOLECNT];
+	tc_sums(iostats,HSC_HOLEPUNCH,HSC_HOLECNT,sums);
+	zassert(pthread_mutex_lock(&statslock));
+	*punched = sums[0] - holestatsbase[0];
+	*skipped = sums[1] - holestatsbase[1];
+	holestatsbase[0] = sums[0];
+	holestatsbase[1] = sums[1];
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+static inline void hdd_stats_hole(uint32_t id,uint32_t size) {
+	uint64_t *cnt = tc_get(iostats,0);
+	cnt[id] += size;
+}
+
+static inline uint8_t hdd_punch_enabled(void) {
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	return __sync_or_and_fetch(&PunchHoles,0);
+#else
+	uint8_t r;
+	pthread_mutex_lock(&cfglock);
+	r = PunchHoles;
+	pthread_mutex_unlock(&cfglock);
+	return r;
+#endif
+}
+
+static inline int hdd_zero_block(const uint8_t *buff) {
+	return (buff[0]==0 && memcmp(buff,buff+1,MFSBLOCKSIZE-1)==0)?1:0;
+}
+
+/* returns number of bytes (up to 'leng') starting at 'offset' without any data extent (hole always reads as zeros) */
+/* file systems without SEEK_DATA support report whole file as data, so they only cost one lseek */
+static inline uint32_t hdd_hole_length(int fd,uint64_t offset,uint32_t leng) {
+#ifdef HDD_HOLES
+	off_t doff;
+	doff = lseek(fd,offset,SEEK_DATA);
+	if (doff<0) {
+		return (errno==ENXIO)?leng:0; // nothing but holes up to end of file
+	}
+	if ((uint64_t)doff>=offset+leng) {
+		return leng;
+	}
+	return doff-offset;
+#else
+	(void)fd;
+	(void)offset;
+	(void)leng;
+	return 0;
+#endif
+}
+
+static inline int hdd_range_is_hole(int fd,uint64_t offset,uint32_t leng) {
+	return (hdd_hole_length(fd,offset,leng)==leng)?1:0;
+}
+
+/* replaces block starting at 'offset' with a hole - returns 0 when block has to be written normally */
+static inline int hdd_block_punch(folder *f,int fd,uint64_t offset) {
+#ifdef HDD_HOLES
+	if (f->nopunch==0) {
+		if (syscall(__NR_fallocate,fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)offset,(off_t)MFSBLOCKSIZE)>=0) {
+			hdd_stats_hole(HSC_HOLEPUNCH,MFSBLOCKSIZE);
+			return 1;
+		}
+		if (errno==EOPNOTSUPP || errno==ENOSYS) {
+			f->nopunch = 1;
+		}
+	}
+#else
+	(void)f;
+	(void)fd;
+	(void)offset;
+#endif
+	return 0;
+}
+
+// assigns per thread counters slot to folder (if it has none) and starts its statistics from current sums (slot could be used earlier by removed folder)
+static void hdd_stats_slot_alloc(folder *f) {
+	uint32_t i;
+	zassert(pthread_mutex_lock(&statslock));
+	for (i=0 ; i<HSC_FOLDERSLOTS && f->statsslot==HSC_NOSLOT ; i++) {
+		if (iostatsslots[i]==0) {
+			iostatsslots[i] = 1;
+			f->statsslot = i;
+		}
+	}
+	if (f->statsslot!=HSC_NOSLOT) {
+		tc_sums(iostats,HSC_FOLDERID(f->statsslot),HSF_SUMCNT,f->tcbase);
+		memcpy(f->plbase,f->tcbase,sizeof(f->plbase));
+		tc_maxreset(iostats,HSC_FOLDERID(f->statsslot)+HSF_NSECREADMAX);
+		tc_maxreset(iostats,HSC_FOLDERID(f->statsslot)+HSF_NSECWRITEMAX);
+	}
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+static void hdd_stats_slot_free(folder *f) {
+	zassert(pthread_mutex_lock(&statslock));
+	if (f->statsslot!=HSC_NOSLOT) {
+		iostatsslots[f->statsslot] = 0;
+		f->statsslot = HSC_NOSLOT;
+	}
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+// adds current minute statistics counted per thread to 's' (statslock:locked) - when 'moveout' is set then they are marked as already moved to history
+static void hdd_stats_collect(folder *f,hddstats *s,uint8_t moveout) {
+	uint64_t sums[HSF_SUMCNT];
+	uint64_t rmax,wmax;
+	if (f->statsslot==HSC_NOSLOT) {
+		return;
+	}
+	tc_sums(iostats,HSC_FOLDERID(f->statsslot),HSF_SUMCNT,sums);
+	s->rbytes += sums[HSF_RBYTES] - f->tcbase[HSF_RBYTES];
+	s->wbytes += sums[HSF_WBYTES] - f->tcbase[HSF_WBYTES];
+	s->nsecreadsum += sums[HSF_NSECREADSUM] - f->tcbase[HSF_NSECREADSUM];
+	s->nsecwritesum += sums[HSF_NSECWRITESUM] - f->tcbase[HSF_NSECWRITESUM];
+	s->rops += sums[HSF_ROPS] - f->tcbase[HSF_ROPS];
+	s->wops += sums[HSF_WOPS] - f->tcbase[HSF_WOPS];
+	if (moveout) {
+		memcpy(f->tcbase,sums,sizeof(f->tcbase));
+		rmax = tc_maxreset(iostats,HSC_FOLDERID(f->statsslot)+HSF_NSECREADMAX);
+		wmax = tc_maxreset(iostats,HSC_FOLDERID(f->statsslot)+HSF_NSECWRITEMAX);
+		if (rmax>s->nsecreadmax) {
+			s->nsecreadmax = rmax;
+		}
+		if (wmax>s->nsecwritemax) {
+			s->nsecwritemax = wmax;
+		}
+	}
+}
+
+static inline void hdd_stats_dataread(folder *f,uint32_t size,int64_t rtime) {
+	uint64_t *cnt;
+	if (rtime<=0) {
+		return;
+	}
+	cnt = tc_get(iostats,0);
+	cnt[HSC_DATAOPR]++;
+	cnt[HSC_DATABYTESR] += size;
+	cnt[HSC_RTIME] += rtime;
+	if (f->statsslot!=HSC_NOSLOT) {
+		cnt = tc_get(iostats,HSC_FOLDERID(f->statsslot));
+		cnt[HSF_ROPS]++;
+		cnt[HSF_RBYTES] += size;
+		cnt[HSF_NSECREADSUM] += rtime;
+		if ((uint64_t)rtime>cnt[HSF_NSECREADMAX]) {
+			cnt[HSF_NSECREADMAX] = rtime;
+		}
+		return;
+	}
+	zassert(pthread_mutex_lock(&statslock));
+	f->cstat.rops++;
+	f->cstat.rbytes += size;
+	f->cstat.nsecreadsum += rtime;
+	f->plbusy += rtime;
+	if (rtime>(int64_t)(f->cstat.nsecreadmax)) {
+		f->cstat.nsecreadmax = rtime;
+	}
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+static inline void hdd_stats_datawrite(folder *f,uint32_t size,int64_t wtime) {
+	uint64_t *cnt;
+	if (wtime<=0) {
+		return;
+	}
+	cnt = tc_get(iostats,0);
+	cnt[HSC_DATAOPW]++;
+	cnt[HSC_DATABYTESW] += size;
+	cnt[HSC_WTIME] += wtime;
+	if (f->statsslot!=HSC_NOSLOT) {
+		cnt = tc_get(iostats,HSC_FOLDERID(f->statsslot));
+		cnt[HSF_WOPS]++;
+		cnt[HSF_WBYTES] += size;
+		cnt[HSF_NSECWRITESUM] += wtime;
+		if ((uint64_t)wtime>cnt[HSF_NSECWRITEMAX]) {
+			cnt[HSF_NSECWRITEMAX] = wtime;
+		}
+		return;
+	}
+	zassert(pthread_mutex_lock(&statslock));
+	f->cstat.wops++;
+	f->cstat.wbytes += size;
+	f->cstat.nsecwritesum += wtime;
+	f->plbusy += wtime;
+	f->plwnsec += wtime;
+	f->plwops++;
+	if (wtime>(int64_t)(f->cstat.nsecwritemax)) {
+		f->cstat.nsecwritemax = wtime;
+	}
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+static inline void hdd_stats_datafsync(folder *f,int64_t fsynctime) {
+	if (fsynctime<=0) {
+		return;
+	}
+	uint64_t t;
+	uint32_t b;
+
+	t = fsynctime / 256000; // 256us units
+	for (b=0 ; t>0 && b<FSYNCHISTSIZE-1 ; b++) {
+		t >>= 1;
+	}
+	zassert(pthread_mutex_lock(&statslock));
+	stats_wtime += fsynctime;
+	f->cstat.fsyncops++;
+	f->cstat.nsecfsyncsum += fsynctime;
+	f->plbusy += fsynctime;
+	f->plwnsec += fsynctime;
+	f->plwops++;
+	if (fsynctime>(int64_t)(f->cstat.nsecfsyncmax)) {
+		f->cstat.nsecfsyncmax = fsynctime;
+	}
+	f->fsynchist[b]++;
+	zassert(pthread_mutex_unlock(&statslock));
+}
+
+/* extended==0 - original entry layout (used by old tools), extended==1 - move, test and placement info appended to each entry */
+uint32_t hdd_diskinfo_size(uint8_t extended) {
+	cfgline *cl;
+	uint32_t s,sl;
+
+	s = 0;
+	zassert(pthread_mutex_lock(&folderlock));
+	for (cl=cfglinehead ; cl!=NULL ; cl=cl->next ) {
+		sl = strlen(cl->path);
+		if (sl>255) {
+			sl = 255;
+		}
+		s += 2+34+3*64+(extended?(28+12+8):0)+sl;
+	}
+	return s;
+}
+
+void hdd_diskinfo_data(uint8_t *buff,uint8_t extended) {
+	cfgline *cl;
+	folder *f;
+	hddstats s;
+	uint32_t sl;
+	uint32_t esize;
+	uint32_t ei;
+	uint32_t pos;
+	uint64_t usectime,rate;
+	if (buff) {
+		usectime = monotonic_useconds();
+		esize = 34+3*64+(extended?(28+12+8):0);
+		zassert(pthread_mutex_lock(&statslock));
+		for (cl=cfglinehead ; cl!=NULL ; cl=cl->next ) {
+			f = cl->f;
+			sl = strlen(cl->path);
+			if (sl>255) {
+				put16bit(&buff,esize+255);	// size of this entry
+				put8bit(&buff,255);
+				memcpy(buff,"(...)",5);
+				memcpy(buff+5,cl->path+(sl-250),250);
+				buff += 255;
+			} else {
+				put16bit(&buff,esize+sl);	// size of this entry
+				put8bit(&buff,sl);
+				if (sl>0) {
+					memcpy(buff,cl->path,sl);
+					buff += sl;
+				}
+			}
+			if (f!=NULL) {
+				put8bit(&buff,((f->markforremoval)?1:0)+((f->damaged)?2:0)+((f->scanstate==SCST_SCANINPROGRESS)?4:0));
+				ei = (f->lasterrindx+(LASTERRSIZE-1))%LASTERRSIZE;
+				put64bit(&buff,f->lasterrtab[ei].chunkid);
+				put32bit(&buff,f->lasterrtab[ei].timestamp);
+				if (f->scanstate==SCST_SCANINPROGRESS) {
+					put64bit(&buff,f->scanprogress);
+					put64bit(&buff,0);
+				} else {
+					put64bit(&buff,f->total-f->avail);
+					put64bit(&buff,f->total);
+				}
+				put32bit(&buff,f->chunkcount);
+				s = f->stats[f->statspos];
+				hdd_stats_binary_pack(&buff,&s);	// 64B
+				for (pos=1 ; pos<60 ; pos++) {
+					hdd_stats_add(&s,&(f->stats[(f->statspos+pos)%STATSHISTORY]));
+				}
+				hdd_stats_binary_pack(&buff,&s);	// 64B
+				for (pos=60 ; pos<24*60 ; pos++) {
+					hdd_stats_add(&s,&(f->stats[(f->statspos+pos)%STATSHISTORY]));
+				}
+				hdd_stats_binary_pack(&buff,&s);	// 64B
+				if (extended==0) {
+					continue;
+				}
+				// moving data out (rebalance): bytes moved, estimated bytes left, speed (B/s), ETA (seconds, 0xFFFFFFFF - unknown)
+				rate = 0;
+				if (f->move_start_usec>0 && usectime>f->move_start_usec) {
+					rate = (f->move_bytes * UINT64_C(1000000)) / (usectime - f->move_start_usec);
+				}
+				put64bit(&buff,f->move_bytes);
+				put64bit(&buff,f->move_remaining);
+				put64bit(&buff,rate);
+				if (f->move_remaining==0) {
+					put32bit(&buff,(f->move_start_usec>0)?0xFFFFFFFF:0);
+				} else if (rate==0 || f->move_remaining/rate>=0xFFFFFFFF) {
+					put32bit(&buff,0xFFFFFFFF);
+				} else {
+					put32bit(&buff,f->move_remaining/rate);
+				}
+				// chunk tests: chunks tested in current pass, ETA of current pass (seconds, 0xFFFFFFFF - unknown), duration of last full pass (seconds, 0 - none yet)
+				put32bit(&buff,f->testpasscnt);
+				if (f->testpasscnt>0 && f->testpassstart>0 && usectime>f->testpassstart && f->chunkcount>f->testpasscnt) {
+					rate = ((usectime - f->testpassstart) / f->testpasscnt) * (f->chunkcount - f->testpasscnt) / 1000000;
+					put32bit(&buff,(rate>=0xFFFFFFFF)?0xFFFFFFFF:rate);
+				} else {
+					put32bit(&buff,0xFFFFFFFF);
+				}
+				put32bit(&buff,f->testlastpass);
+				// new chunks placement: smoothed write latency (usec), average queue depth (x100), placement factor (permille)
+				put32bit(&buff,(f->wlatavg>=4294967295.0)?0xFFFFFFFF:(uint32_t)(f->wlatavg));
+				put16bit(&buff,(f->qdepthavg>=655.35)?0xFFFF:(uint16_t)(f->qdepthavg*100.0));
+				put16bit(&buff,(uint16_t)(f->placefactor*1000.0+0.5));
+			} else {
+				put8bit(&buff,2+8);
+				memset(buff,0,esize-2);
+				buff+=esize-2;
+			}
+		}
+		zassert(pthread_mutex_unlock(&statslock));
+	}
+	zassert(pthread_mutex_unlock(&folderlock));
+}
+
+uint32_t hdd_diskinfo_monotonic_size(void) {
+	folder *f;
+	uint32_t s,sl;
+
+	s = 2;
+	zassert(pthread_mutex_lock(&folderlock));
+	for (f=folderhead ; f ; f=f->next ) {
+		sl = strlen(f->path);
+		if (sl>255) {
+			sl = 255;
+		}
+		s += 2+34+64+4*FSYNCHISTSIZE+sl;
+	}
+	return s;
+}
+
+void hdd_diskinfo_monotonic_data(uint8_t *buff) {
 	folder *f;
 	uint32_t sl;
 	uint32_t ei;
+	uint32_t b;
 	uint16_t cnt;
 	if (buff) {
 		cnt = 0;
@@ -893,13 +2185,13 @@ void hdd_diskinfo_monotonic_data(uint8_t *buff) {
 		for (f=folderhead ; f ; f=f->next ) {
 			sl = strlen(f->path);
 			if (sl>255) {
-				put16bit(&buff,34+64+255);	// size of this entry
+				put16bit(&buff,34+64+4*FSYNCHISTSIZE+255);	// size of this entry
 				put8bit(&buff,255);
 				memcpy(buff,"(...)",5);
 				memcpy(buff+5,f->path+(sl-250),250);
 				buff += 255;
 			} else {
-				put16bit(&buff,34+64+sl);	// size of this entry
+				put16bit(&buff,34+64+4*FSYNCHISTSIZE+sl);	// size of this entry
 				put8bit(&buff,sl);
 				if (sl>0) {
 					memcpy(buff,f->path,sl);
@@ -919,51 +2211,140 @@ void hdd_diskinfo_monotonic_data(uint8_t *buff) {
 			}
 			put32bit(&buff,f->chunkcount);
 			hdd_stats_binary_pack(&buff,&(f->monotonic));	// 64B
+			for (b=0 ; b<FSYNCHISTSIZE ; b++) {
+				put32bit(&buff,f->fsynchist[b]);
+			}
 		}
 		zassert(pthread_mutex_unlock(&statslock));
 	}
 	zassert(pthread_mutex_unlock(&folderlock));
 }
 
-#define OF_BEFORE_OPEN 0
-#define OF_AFTER_CLOSE 1
-#define OF_INIT 2
-#define OF_INFO 3
+/* descriptor cache - chunks that are opened, but not used by any i/o operation (idle) are kept on two lists in order of their last use:
+ * fdlru - chunks with open descriptor - descriptor is closed OpenFilesIdleTime seconds after last use or earlier (least recently used first) when open files limit is reached
+ * crclru - chunks with crc block in memory - block is freed CRC_DELAY seconds after last use
+ * chunkopen structure is never freed while chunk is on any list, but chunks from lists can be changed only when they are locked,
+ * so chunk ids are taken from lists and chunks are locked (by hdd_chunk_tryfind) after fdcachelock is released (lock order: hashlock -> fdcachelock) */
+static pthread_mutex_t fdcachelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fdcachecond = PTHREAD_COND_INITIALIZER;
+static chunk *fdlruhead = NULL,**fdlrutail = &fdlruhead;
+static chunk *crclruhead = NULL,**crclrutail = &crclruhead;
+static dopchunk *fsyncqueue = NULL;	// idle chunks that have to be synced before close
+static uint32_t fdcount = 0;	// all open chunk descriptors (idle and used)
+static uint32_t fdidle = 0;	// descriptors on fdlru
+static uint32_t fdlimit = 500;
+static uint32_t fdwaiting = 0;
+static double OpenFilesIdleTime = OPEN_DELAY;
+static uint32_t stats_fdhit = 0;
+static uint32_t stats_fdmiss = 0;
+static uint32_t stats_fdevict = 0;
+
+void hdd_fdcache_stats(uint32_t *hits,uint32_t *misses,uint32_t *evictions,uint32_t *opened) {
+	zassert(pthread_mutex_lock(&fdcachelock));
+	*hits = stats_fdhit;
+	*misses = stats_fdmiss;
+	*evictions = stats_fdevict;
+	*opened = fdcount;
+	stats_fdhit = 0;
+	stats_fdmiss = 0;
+	stats_fdevict = 0;
+	zassert(pthread_mutex_unlock(&fdcachelock));
+}
 
-static inline void hdd_open_files_handle(uint8_t mode) {
-	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-	static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-	static uint32_t count = 0;
-	static uint32_t limit = 500;
-	static uint32_t waiting = 0;
-	if (mode==OF_BEFORE_OPEN) { // before open
-		zassert(pthread_mutex_lock(&lock));
-		while (count >= limit) {
-			waiting++;
-			zassert(pthread_cond_wait(&cond,&lock));
-		}
-		count++;
-		zassert(pthread_mutex_unlock(&lock));
-	} else if (mode==OF_AFTER_CLOSE) { // after close
-		zassert(pthread_mutex_lock(&lock));
-		count--;
-		if (waiting>0) {
-			zassert(pthread_cond_signal(&cond));
-			waiting--;
-		}
-		zassert(pthread_mutex_unlock(&lock));
-	} else if (mode==OF_INIT) {
-		struct rlimit rl;
-		getrlimit(RLIMIT_NOFILE,&rl);
-		limit = (rl.rlim_cur * 2) / 3;
-		syslog(LOG_NOTICE,"hdd space manager: setting open chunks limit to: %"PRIu32,limit);
-	} else if (mode==OF_INFO) {
-		uint32_t c;
-		zassert(pthread_mutex_lock(&lock));
-		c = count;
-		zassert(pthread_mutex_unlock(&lock));
-		syslog(LOG_NOTICE,"hdd space manager: open files: %"PRIu32"/%"PRIu32,c,limit);
+// fdcachelock:locked
+static inline void hdd_fdlru_remove(chunk *c) {
+	if (c->op->fdprev!=NULL) {
+		*(c->op->fdprev) = c->op->fdnext;
+		if (c->op->fdnext) {
+			c->op->fdnext->op->fdprev = c->op->fdprev;
+		} else {
+			fdlrutail = c->op->fdprev;
+		}
+		c->op->fdnext = NULL;
+		c->op->fdprev = NULL;
+		fdidle--;
+	}
+}
+
+// fdcachelock:locked
+static inline void hdd_crclru_remove(chunk *c) {
+	if (c->op->crcprev!=NULL) {
+		*(c->op->crcprev) = c->op->crcnext;
+		if (c->op->crcnext) {
+			c->op->crcnext->op->crcprev = c->op->crcprev;
+		} else {
+			crclrutail = c->op->crcprev;
+		}
+		c->op->crcnext = NULL;
+		c->op->crcprev = NULL;
+	}
+}
+
+// fdcachelock:locked
+static inline void hdd_fdcache_closed(void) {
+	fdcount--;
+	if (fdwaiting>0) {
+		zassert(pthread_cond_signal(&fdcachecond));
+		fdwaiting--;
+	}
+}
+
+// chunk:locked - chunk is not used by any i/o operation any more
+static void hdd_fdcache_idle(chunk *c) {
+	dopchunk *fq;
+	double now;
+
+	fq = NULL;
+	if (c->op->fd>=0 && c->op->fsyncneeded && DoFsyncBeforeClose) {
+		fq = malloc(sizeof(dopchunk));
+		passert(fq);
+		fq->chunkid = c->chunkid;
+	}
+	now = monotonic_seconds();
+	c->op->crcto = now + CRC_DELAY;
+	zassert(pthread_mutex_lock(&fdcachelock));
+	c->op->opento = now + OpenFilesIdleTime;
+	hdd_fdlru_remove(c);
+	hdd_crclru_remove(c);
+	if (c->op->fd>=0) {
+		c->op->fdprev = fdlrutail;
+		*fdlrutail = c;
+		fdlrutail = &(c->op->fdnext);
+		fdidle++;
+	}
+	if (c->op->crc!=NULL) {
+		c->op->crcprev = crclrutail;
+		*crclrutail = c;
+		crclrutail = &(c->op->crcnext);
+	}
+	if (fq!=NULL) {
+		fq->next = fsyncqueue;
+		fsyncqueue = fq;
+	}
+	zassert(pthread_mutex_unlock(&fdcachelock));
+}
+
+// chunk:locked - chunk is going to be used by i/o operation (hit - its descriptor was still open)
+static void hdd_fdcache_busy(chunk *c,uint8_t hit) {
+	zassert(pthread_mutex_lock(&fdcachelock));
+	hdd_fdlru_remove(c);
+	hdd_crclru_remove(c);
+	if (hit) {
+		stats_fdhit++;
+	} else {
+		stats_fdmiss++;
 	}
+	zassert(pthread_mutex_unlock(&fdcachelock));
+}
+
+static void hdd_fdcache_info(void) {
+	uint32_t c,i,l;
+	zassert(pthread_mutex_lock(&fdcachelock));
+	c = fdcount;
+	i = fdidle;
+	l = fdlimit;
+	zassert(pthread_mutex_unlock(&fdcachelock));
+	syslog(LOG_NOTICE,"hdd space manager: open files: %"PRIu32"/%"PRIu32" (idle: %"PRIu32")",c,l,i);
 }
 
 void hdd_diskinfo_movestats(void) {
@@ -977,7 +2358,8 @@ void hdd_diskinfo_movestats(void) {
 			f->statspos--;
 		}
 		f->stats[f->statspos] = f->cstat;
-		hdd_stats_add(&(f->monotonic),&(f->cstat));
+		hdd_stats_collect(f,f->stats+f->statspos,1);
+		hdd_stats_add(&(f->monotonic),f->stats+f->statspos);
 		hdd_stats_clear(&(f->cstat));
 	}
 	zassert(pthread_mutex_unlock(&statslock));
@@ -985,15 +2367,7 @@ void hdd_diskinfo_movestats(void) {
 }
 
 // testlock:locked
-static inline void hdd_remove_chunk_from_test_chain(chunk *c,folder *f) {
-	*(c->testprev) = c->testnext;
-	if (c->testnext) {
-		c->testnext->testprev = c->testprev;
-	} else {
-		f->testtail = c->testprev;
-	}
-	c->testnext = NULL;
-	c->testprev = NULL;
+static inline void hdd_remove_chunk_from_subfolder(chunk *c,folder *f) {
 	if (f->subf_count[c->pathid]>0) {
 		f->subf_count[c->pathid]--;
 		if (f->subf_count[c->pathid]<f->min_count) {
@@ -1004,14 +2378,10 @@ static inline void hdd_remove_chunk_from_test_chain(chunk *c,folder *f) {
 }
 
 // testlock:locked
-static inline void hdd_add_chunk_to_test_chain(chunk *c,folder *f) {
+static inline void hdd_add_chunk_to_subfolder(chunk *c,folder *f) {
 	uint8_t recalcmin;
 	uint16_t i;
 
-	c->testnext = NULL;
-	c->testprev = f->testtail;
-	*(c->testprev) = c;
-	f->testtail = &(c->testnext);
 	if (f->subf_count[c->pathid]<=f->min_count) {
 		recalcmin=1;
 	} else {
@@ -1035,9 +2405,17 @@ static inline void hdd_add_chunk_to_test_chain(chunk *c,folder *f) {
 
 // folderlock:locked
 static inline void hdd_remove_chunk_from_folder(chunk *c,folder *f) {
+	uint32_t indx;
+	indx = c->ownerindx;
 	f->chunkcount--;
-	f->chunktab[c->ownerindx] = f->chunktab[f->chunkcount];
-	f->chunktab[c->ownerindx]->ownerindx = c->ownerindx;
+	if (indx<f->testpos) { // keep already tested chunks before test position
+		f->testpos--;
+		f->chunktab[indx] = f->chunktab[f->testpos];
+		f->chunktab[indx]->ownerindx = indx;
+		indx = f->testpos;
+	}
+	f->chunktab[indx] = f->chunktab[f->chunkcount];
+	f->chunktab[indx]->ownerindx = indx;
 	c->owner = NULL;
 	c->ownerindx = 0;
 }
@@ -1063,6 +2441,74 @@ static inline void hdd_add_chunk_to_folder(chunk *c,folder *f) {
 
 static inline int chunk_writecrc(chunk *c);
 
+static inline chunk* hdd_chunkrec_new(void) {
+	chunk *c;
+	zassert(pthread_mutex_lock(&chunkreclock));
+	c = chunkrec_malloc();
+	zassert(pthread_mutex_unlock(&chunkreclock));
+	return c;
+}
+
+static inline void hdd_chunkrec_free(chunk *c) {
+	zassert(pthread_mutex_lock(&chunkreclock));
+	chunkrec_free(c);
+	zassert(pthread_mutex_unlock(&chunkreclock));
+}
+
+static inline chunkopen* hdd_chunkopen_new(void) {
+	chunkopen *op;
+	op = malloc(sizeof(chunkopen));
+	passert(op);
+	op->opento = 0.0;
+	op->crcto = 0.0;
+	op->crc = NULL;
+	op->fd = -1;
+	op->cfd = -1;
+	op->wbpending = 0;
+	op->crcrefcount = 0;
+	op->crcchanged = 0;
+	op->fsyncneeded = 0;
+	op->sfreaders = 0;
+	op->fdnext = NULL;
+	op->fdprev = NULL;
+	op->crcnext = NULL;
+	op->crcprev = NULL;
+	return op;
+}
+
+/* closes descriptor and frees crc block of chunk that is not used any more - 'where' is used only in log message */
+static inline void hdd_chunkopen_free(chunk *c,const char *where) {
+	if (c->op==NULL) {
+		return;
+	}
+	if (c->op->fd>=0) {
+		if (c->op->crcchanged && c->owner!=NULL) { // mainly pro forma
+			syslog(LOG_WARNING,"%s: CRC not flushed - writing now",where);
+			chunk_writecrc(c);
+		}
+		close(c->op->fd);
+	}
+	zassert(pthread_mutex_lock(&fdcachelock));
+	hdd_fdlru_remove(c);
+	hdd_crclru_remove(c);
+	if (c->op->fd>=0) {
+		hdd_fdcache_closed();
+	}
+	zassert(pthread_mutex_unlock(&fdcachelock));
+	if (c->op->cfd>=0) {
+		close(c->op->cfd);
+	}
+	if (c->op->crc!=NULL) {
+#ifdef MMAP_ALLOC
+		munmap((void*)(c->op->crc),CHUNKCRCSIZE);
+#else
+		free(c->op->crc);
+#endif
+	}
+	free(c->op);
+	c->op = NULL;
+}
+
 static inline void hdd_chunk_remove(chunk *c) {
 	chunk **cptr,*cp;
 	uint32_t hashpos = HASHPOS(c->chunkid);
@@ -1070,55 +2516,42 @@ static inline void hdd_chunk_remove(chunk *c) {
 	while ((cp=*cptr)) {
 		if (c==cp) {
 			*cptr = cp->next;
-			if (cp->fd>=0) {
-				if (cp->crcchanged && cp->owner!=NULL) { // mainly pro forma
-					syslog(LOG_WARNING,"hdd_chunk_remove: CRC not flushed - writing now");
-					chunk_writecrc(cp);
-				}
-				close(cp->fd);
-				hdd_open_files_handle(OF_AFTER_CLOSE);
-			}
-			if (cp->crc!=NULL) {
-#ifdef MMAP_ALLOC
-				munmap((void*)(cp->crc),CHUNKCRCSIZE);
-#else
-				free(cp->crc);
-#endif
-			}
-#ifdef PRESERVE_BLOCK
-			if (cp->block!=NULL) {
-# ifdef MMAP_ALLOC
-				munmap((void*)(cp->block),MFSBLOCKSIZE);
-# else
-				free(cp->block);
-# endif
-			}
-#endif /* PRESERVE_BLOCK */
-			free(cp);
+			hdd_chunkopen_free(cp,"hdd_chunk_remove");
+			hdd_chunkrec_free(cp);
 			return;
 		}
 		cptr = &(cp->next);
 	}
 }
 
+/* condition of threads waiting for given chunk (NULL - nobody waits) - hashlock[lockpos]:locked */
+static inline cntcond* hdd_chunk_waiters(chunk *c,uint32_t lockpos) {
+	cntcond *cc;
+	for (cc=cclist[lockpos] ; cc && (cc->wcnt==0 || cc->owner!=c) ; cc=cc->next) {}
+	return cc;
+}
+
 static void hdd_chunk_release(chunk *c) {
-	zassert(pthread_mutex_lock(&hashlock));
+	uint32_t lockpos = HASHLOCKPOS(c->chunkid);
+	cntcond *cc;
+	hdd_hashlock_lock(lockpos);
 //	syslog(LOG_WARNING,"hdd_chunk_release got chunk: %016"PRIX64" (c->state:%u)",c->chunkid,c->state);
 	if (c->state==CH_LOCKED) {
 		c->state = CH_AVAIL;
-		if (c->ccond) {
-//			printf("wake up one thread waiting for AVAIL chunk: %"PRIu64" on ccond:%p\n",c->chunkid,c->ccond);
+		cc = hdd_chunk_waiters(c,lockpos);
+		if (cc) {
+//			printf("wake up one thread waiting for AVAIL chunk: %"PRIu64" on ccond:%p\n",c->chunkid,cc);
 //			printbacktrace();
-			zassert(pthread_cond_signal(&(c->ccond->cond)));
+			zassert(pthread_cond_signal(&(cc->cond)));
 		}
 	}
-	zassert(pthread_mutex_unlock(&hashlock));
+	hdd_hashlock_unlock(lockpos);
 }
 
 static int hdd_chunk_getattr(chunk *c) {
 	struct stat sb;
-	if (c->fd>=0) {
-		if (fstat(c->fd,&sb)<0) {
+	if (c->op!=NULL && c->op->fd>=0) {
+		if (fstat(c->op->fd,&sb)<0) {
 			return -1;
 		}
 	} else {
@@ -1146,8 +2579,9 @@ static int hdd_chunk_getattr(chunk *c) {
 
 static chunk* hdd_chunk_tryfind(uint64_t chunkid) {
 	uint32_t hashpos = HASHPOS(chunkid);
+	uint32_t lockpos = HASHLOCKPOS(chunkid);
 	chunk *c;
-	zassert(pthread_mutex_lock(&hashlock));
+	hdd_hashlock_lock(lockpos);
 	for (c=hashtab[hashpos] ; c && c->chunkid!=chunkid ; c=c->next) {}
 	if (c!=NULL) {
 		if (c->state==CH_LOCKED) {
@@ -1161,58 +2595,169 @@ static chunk* hdd_chunk_tryfind(uint64_t chunkid) {
 //	if (c!=NULL && c!=CHUNKLOCKED) {
 //		syslog(LOG_WARNING,"hdd_chunk_tryfind returns chunk: %016"PRIX64" (c->state:%u)",c->chunkid,c->state);
 //	}
-	zassert(pthread_mutex_unlock(&hashlock));
+	hdd_hashlock_unlock(lockpos);
 	return c;
 }
 
+/* chunk index: '.chunkdb' (checkpoint) plus '.chunkjournal' (append-only log of changes made after checkpoint)
+ * journal is replayed over checkpoint during folder scan, so subfolders have to be read only when index is missing or broken */
+#define INDEX_JOURNAL_HDRSIZE 20
+#define INDEX_JOURNAL_RECSIZE 20
+#define INDEX_JOURNAL_MAXSIZE (16*1024*1024)
+
+#define INDEX_REC_SET 1
+#define INDEX_REC_DEL 2
+#define INDEX_REC_WFR 3
+
+static inline void hdd_index_filename(char fname[PATH_MAX],folder *f,const char *name) {
+	snprintf(fname,PATH_MAX,"%s%s",f->path,name);
+}
+
+// jlock:locked
+static void hdd_index_drop(folder *f) {
+	char fname[PATH_MAX];
+	if (f->jfd>=0) {
+		close(f->jfd);
+		f->jfd = -1;
+	}
+	hdd_index_filename(fname,f,".chunkjournal");
+	unlink(fname);
+	hdd_index_filename(fname,f,".chunkdb");
+	unlink(fname);
+}
+
+static void hdd_index_log(folder *f,uint8_t rtype,uint64_t chunkid,uint32_t version,uint16_t pathid) {
+	uint8_t buff[INDEX_JOURNAL_RECSIZE];
+	uint8_t *wptr;
+
+	if (f==NULL) {
+		return;
+	}
+	wptr = buff;
+	put8bit(&wptr,rtype);
+	put64bit(&wptr,chunkid);
+	put32bit(&wptr,version);
+	put16bit(&wptr,pathid);
+	put8bit(&wptr,0);
+	put32bit(&wptr,mycrc32(0,buff,INDEX_JOURNAL_RECSIZE-4));
+	zassert(pthread_mutex_lock(&(f->jlock)));
+	if (f->jfd>=0) {
+		if (write(f->jfd,buff,INDEX_JOURNAL_RECSIZE)!=INDEX_JOURNAL_RECSIZE) {
+			mfs_arg_errlog_silent(LOG_WARNING,"%s: chunk journal write error - index dropped",f->path);
+			hdd_index_drop(f);
+		} else {
+			f->jsize += INDEX_JOURNAL_RECSIZE;
+			f->jdirty = 1;
+		}
+	}
+	zassert(pthread_mutex_unlock(&(f->jlock)));
+}
+
+/* chunk has to be locked */
+static inline void hdd_index_chunk_set(chunk *c) {
+	hdd_index_log(c->owner,INDEX_REC_SET,c->chunkid,c->version,c->pathid);
+}
+
+/* starts new journal based on checkpoint 'id' - when 'id' is zero then new index lineage is started (old checkpoint is removed and new one will be written by index thread) */
+static void hdd_index_start(folder *f,uint64_t id) {
+	char fname[PATH_MAX];
+	uint8_t hdr[INDEX_JOURNAL_HDRSIZE];
+	uint8_t *wptr;
+	int fd;
+
+	if (f->markforremoval==MFR_READONLY) { // chunks on such disks are not indexed
+		hdd_index_filename(fname,f,".chunkjournal");
+		unlink(fname);
+		hdd_index_filename(fname,f,".chunkdb");
+		unlink(fname);
+		return;
+	}
+	if (id==0) {
+		do {
+			id = rndu64();
+		} while (id==0);
+		hdd_index_filename(fname,f,".chunkdb");
+		unlink(fname);
+	}
+	hdd_index_filename(fname,f,".chunkjournal");
+	fd = open(fname,O_RDWR | O_TRUNC | O_CREAT | O_APPEND,0666);
+	if (fd<0) {
+		mfs_arg_errlog(LOG_NOTICE,"%s: open error",fname);
+		return;
+	}
+	memcpy(hdr,"MFS CHUNKJNL",12);
+	wptr = hdr+12;
+	put64bit(&wptr,id);
+	if (write(fd,hdr,INDEX_JOURNAL_HDRSIZE)!=INDEX_JOURNAL_HDRSIZE) {
+		mfs_arg_errlog(LOG_NOTICE,"%s: write error",fname);
+		close(fd);
+		unlink(fname);
+		return;
+	}
+	zassert(pthread_mutex_lock(&(f->jlock)));
+	if (f->jfd>=0) {
+		close(f->jfd);
+	}
+	f->jfd = fd;
+	f->jsize = INDEX_JOURNAL_HDRSIZE;
+	f->ckptid = id;
+	f->jdirty = 1;
+	f->needcheckpoint = 1;
+	zassert(pthread_mutex_unlock(&(f->jlock)));
+}
+
+/* folder currently holding given chunk - doesn't wait for locked chunks, result is only a hint (used by job scheduler as a queue key, never dereferenced there) */
+void* hdd_chunk_folder_key(uint64_t chunkid) {
+	uint32_t hashpos = HASHPOS(chunkid);
+	uint32_t lockpos = HASHLOCKPOS(chunkid);
+	chunk *c;
+	void *fkey;
+	hdd_hashlock_lock(lockpos);
+	for (c=hashtab[hashpos] ; c && c->chunkid!=chunkid ; c=c->next) {}
+	fkey = (c!=NULL && c->state!=CH_DELETED)?(void*)(c->owner):NULL;
+	hdd_hashlock_unlock(lockpos);
+	return fkey;
+}
+
 static void hdd_chunk_delete(chunk *c);
 
 static chunk* hdd_chunk_get(uint64_t chunkid,uint8_t cflag) {
 	uint32_t hashpos = HASHPOS(chunkid);
+	uint32_t lockpos = HASHLOCKPOS(chunkid);
 	chunk *c;
 	cntcond *cc;
-	zassert(pthread_mutex_lock(&hashlock));
+	hdd_hashlock_lock(lockpos);
 	for (c=hashtab[hashpos] ; c && c->chunkid!=chunkid ; c=c->next) {}
 	if (c==NULL) {
 		if (cflag!=CH_NEW_NONE) { // create if not exists
-			c = malloc(sizeof(chunk));
-			passert(c);
+			c = hdd_chunkrec_new();
 			c->chunkid = chunkid;
 			c->version = 0;
 			c->owner = NULL;
+			c->ownerindx = 0;
 			c->pathid = 0xFFFF;
 			c->blocks = 0;
 			c->hdrsize = 0;
-			c->crcrefcount = 0;
-			c->opento = 0.0;
-			c->crcto = 0.0;
-			c->crcchanged = 0;
-			c->fsyncneeded = 0;
+			c->testtime = 0;
 			c->damaged = 0;
-			c->fd = -1;
-			c->crc = NULL;
+			c->op = NULL;
 			c->state = CH_LOCKED;
-			c->ccond = NULL;
-#ifdef PRESERVE_BLOCK
-			c->blockto = 0.0;
-			c->block = NULL;
-			c->blockno = 0xFFFF;
-#endif
 			c->validattr = 0;
-			c->testnext = NULL;
-			c->testprev = NULL;
+			c->heat = 0;
+			c->heatepoch = 0;
+			c->cachestate = RCS_NONE;
 			c->next = hashtab[hashpos];
 			hashtab[hashpos] = c;
 		} else {
 			hdd_report_lost_chunk(chunkid);
 		}
 //		syslog(LOG_WARNING,"hdd_chunk_get returns chunk: %016"PRIX64" (c->state:%u)",c->chunkid,c->state);
-		zassert(pthread_mutex_unlock(&hashlock));
+		hdd_hashlock_unlock(lockpos);
 		return c;
 	}
 	if (cflag==CH_NEW_EXCLUSIVE) {
 		if (c->state==CH_AVAIL || c->state==CH_LOCKED) {
-			zassert(pthread_mutex_unlock(&hashlock));
+			hdd_hashlock_unlock(lockpos);
 			return NULL;
 		}
 	}
@@ -1221,7 +2766,7 @@ static chunk* hdd_chunk_get(uint64_t chunkid,uint8_t cflag) {
 		case CH_AVAIL:
 			c->state = CH_LOCKED;
 //			syslog(LOG_WARNING,"hdd_chunk_get returns chunk: %016"PRIX64" (c->state:%u)",c->chunkid,c->state);
-			zassert(pthread_mutex_unlock(&hashlock));
+			hdd_hashlock_unlock(lockpos);
 			if (c->validattr==0 && cflag!=CH_NEW_AUTO) {
 				if (hdd_chunk_getattr(c)) {
 					char fname[PATH_MAX];
@@ -1235,108 +2780,80 @@ static chunk* hdd_chunk_get(uint64_t chunkid,uint8_t cflag) {
 			return c;
 		case CH_DELETED:
 			if (cflag!=CH_NEW_NONE) { // create if not exists
-				if (c->fd>=0) {
-					if (c->crcchanged) { // mainly pro forma
-						syslog(LOG_WARNING,"hdd_chunk_get: CRC not flushed - writing now");
-						chunk_writecrc(c);
-					}
-					close(c->fd);
-					hdd_open_files_handle(OF_AFTER_CLOSE);
-				}
-				if (c->crc!=NULL) {
-#ifdef MMAP_ALLOC
-					munmap((void*)(c->crc),CHUNKCRCSIZE);
-#else
-					free(c->crc);
-#endif
-				}
-#ifdef PRESERVE_BLOCK
-				if (c->block!=NULL) {
-# ifdef MMAP_ALLOC
-					munmap((void*)(c->crc),MFSBLOCKSIZE);
-# else
-					free(c->block);
-# endif
-				}
-#endif /* PRESERVE_BLOCK */
+				hdd_chunkopen_free(c,"hdd_chunk_get");
 				c->version = 0;
 				c->owner = NULL;
 				c->pathid = 0xFFFF;
 				c->blocks = 0;
 				c->hdrsize = 0;
-				c->crcrefcount = 0;
-				c->opento = 0.0;
-				c->crcto = 0.0;
-				c->crcchanged = 0;
-				c->fsyncneeded = 0;
 				c->damaged = 0;
-				c->fd = -1;
-				c->crc = NULL;
-#ifdef PRESERVE_BLOCK
-				c->blockto = 0.0;
-				c->block = NULL;
-				c->blockno = 0xFFFF;
-#endif /* PRESERVE_BLOCK */
 				c->validattr = 0;
 				c->state = CH_LOCKED;
 //				syslog(LOG_WARNING,"hdd_chunk_get returns chunk: %016"PRIX64" (c->state:%u)",c->chunkid,c->state);
-				zassert(pthread_mutex_unlock(&hashlock));
+				hdd_hashlock_unlock(lockpos);
 				return c;
 			}
-			if (c->ccond==NULL) {	// no more waiting threads - remove
+			cc = hdd_chunk_waiters(c,lockpos);
+			if (cc==NULL) {	// no more waiting threads - remove
 				hdd_chunk_remove(c);
 			} else {	// there are waiting threads - wake them up
-//				printf("wake up one thread waiting for DELETED chunk: %"PRIu64" on ccond:%p\n",c->chunkid,c->ccond);
+//				printf("wake up one thread waiting for DELETED chunk: %"PRIu64" on ccond:%p\n",c->chunkid,cc);
 //				printbacktrace();
-				zassert(pthread_cond_signal(&(c->ccond->cond)));
+				zassert(pthread_cond_signal(&(cc->cond)));
 			}
-			zassert(pthread_mutex_unlock(&hashlock));
+			hdd_hashlock_unlock(lockpos);
 			return NULL;
 		case CH_LOCKED:
-			if (c->ccond==NULL) {
-				for (cc=cclist ; cc && cc->wcnt ; cc=cc->next) {}
+			cc = hdd_chunk_waiters(c,lockpos);
+			if (cc==NULL) {
+				for (cc=cclist[lockpos] ; cc && cc->wcnt ; cc=cc->next) {}
 				if (cc==NULL) {
 					cc = malloc(sizeof(cntcond));
 					passert(cc);
 					zassert(pthread_cond_init(&(cc->cond),NULL));
 					cc->wcnt = 0;
-					cc->next = cclist;
-					cclist = cc;
+					cc->next = cclist[lockpos];
+					cclist[lockpos] = cc;
 				}
-				c->ccond = cc;
+				cc->owner = c;
 			}
-			c->ccond->wcnt++;
-//			printf("wait for %s chunk: %"PRIu64" on ccond:%p\n",(c->state==CH_LOCKED)?"LOCKED":"TOBEDELETED",c->chunkid,c->ccond);
+			cc->wcnt++;	// condition is released (can be used for other chunk) when wcnt drops to zero
+//			printf("wait for %s chunk: %"PRIu64" on ccond:%p\n",(c->state==CH_LOCKED)?"LOCKED":"TOBEDELETED",c->chunkid,cc);
 //			printbacktrace();
-			zassert(pthread_cond_wait(&(c->ccond->cond),&hashlock));
-//			printf("%s chunk: %"PRIu64" woke up on ccond:%p\n",(c->state==CH_LOCKED)?"LOCKED":(c->state==CH_DELETED)?"DELETED":(c->state==CH_AVAIL)?"AVAIL":"TOBEDELETED",c->chunkid,c->ccond);
-			c->ccond->wcnt--;
-			if (c->ccond->wcnt==0) {
-				c->ccond = NULL;
-			}
+			zassert(pthread_cond_wait(&(cc->cond),hashlock+lockpos));
+//			printf("%s chunk: %"PRIu64" woke up on ccond:%p\n",(c->state==CH_LOCKED)?"LOCKED":(c->state==CH_DELETED)?"DELETED":(c->state==CH_AVAIL)?"AVAIL":"TOBEDELETED",c->chunkid,cc);
+			cc->wcnt--;
 		}
 	}
 }
 
 static void hdd_chunk_delete(chunk *c) {
 	folder *f;
+	uint32_t lockpos;
+	cntcond *cc;
+	if (c->cachestate!=RCS_NONE) {
+		hdd_rcache_drop(c);
+	}
 	zassert(pthread_mutex_lock(&folderlock));
 	f = c->owner;
 	hdd_remove_chunk_from_folder(c,f);
 	zassert(pthread_mutex_unlock(&folderlock));
 	zassert(pthread_mutex_lock(&testlock));
-	hdd_remove_chunk_from_test_chain(c,f);
+	hdd_remove_chunk_from_subfolder(c,f);
 	zassert(pthread_mutex_unlock(&testlock));
-	zassert(pthread_mutex_lock(&hashlock));
-	if (c->ccond) {
+	hdd_index_log(f,INDEX_REC_DEL,c->chunkid,0,0);
+	lockpos = HASHLOCKPOS(c->chunkid);
+	hdd_hashlock_lock(lockpos);
+	cc = hdd_chunk_waiters(c,lockpos);
+	if (cc) {
 		c->state = CH_DELETED;
-//		printf("wake up one thread waiting for DELETED chunk: %"PRIu64" ccond:%p\n",c->chunkid,c->ccond);
+//		printf("wake up one thread waiting for DELETED chunk: %"PRIu64" ccond:%p\n",c->chunkid,cc);
 //		printbacktrace();
-		zassert(pthread_cond_signal(&(c->ccond->cond)));
+		zassert(pthread_cond_signal(&(cc->cond)));
 	} else {
 		hdd_chunk_remove(c);
 	}
-	zassert(pthread_mutex_unlock(&hashlock));
+	hdd_hashlock_unlock(lockpos);
 }
 
 static chunk* hdd_chunk_create(folder *f,uint64_t chunkid,uint32_t version) {
@@ -1354,31 +2871,19 @@ static chunk* hdd_chunk_create(folder *f,uint64_t chunkid,uint32_t version) {
 	hdd_add_chunk_to_folder(c,f);
 	zassert(pthread_mutex_lock(&testlock));
 	c->pathid = f->current_pathid;
-	hdd_add_chunk_to_test_chain(c,f);
+	hdd_add_chunk_to_subfolder(c,f);
 	zassert(pthread_mutex_unlock(&testlock));
+	hdd_index_log(f,INDEX_REC_SET,chunkid,version,c->pathid);
 	return c;
 }
 
 #define hdd_chunk_find(chunkid) hdd_chunk_get(chunkid,CH_NEW_NONE)
 
-static inline void hdd_int_chunk_testmove(chunk *c) {
-	if (c->testnext) {
-		*(c->testprev) = c->testnext;
-		c->testnext->testprev = c->testprev;
-		c->testnext = NULL;
-		c->testprev = c->owner->testtail;
-		*(c->testprev) = c;
-		c->owner->testtail = &(c->testnext);
-	}
+/* chunks used (or tested) during current test pass are skipped by tester until the next pass */
+static inline void hdd_chunk_testmove(chunk *c) {
 	c->testtime = main_time();
 }
 
-static void hdd_chunk_testmove(chunk *c) {
-	zassert(pthread_mutex_lock(&testlock));
-	hdd_int_chunk_testmove(c);
-	zassert(pthread_mutex_unlock(&testlock));
-}
-
 // no locks - locked by caller
 static inline void hdd_refresh_usage(folder *f) {
 	struct statvfs fsinfo;
@@ -1413,19 +2918,19 @@ static inline void hdd_refresh_usage(folder *f) {
 		uint32_t knownblocks;
 		uint32_t knowncount;
 		uint64_t calcsize;
+		uint32_t i;
 		chunk *c;
 		knownblocks = 0;
 		knowncount = 0;
-		zassert(pthread_mutex_lock(&hashlock));
-		zassert(pthread_mutex_lock(&testlock));
-		for (c=f->testhead ; c ; c=c->testnext) {
+		hdd_hashlock_all();
+		for (i=0 ; i<f->chunkcount ; i++) {
+			c = f->chunktab[i];
 			if (c->state==CH_AVAIL && c->validattr==1) {
 				knowncount++;
 				knownblocks+=c->blocks;
 			}
 		}
-		zassert(pthread_mutex_unlock(&testlock));
-		zassert(pthread_mutex_unlock(&hashlock));
+		hdd_hashunlock_all();
 		if (knowncount>0) {
 			calcsize = knownblocks;
 			calcsize *= f->chunkcount;
@@ -1450,11 +2955,87 @@ static inline void hdd_refresh_usage(folder *f) {
 	}
 }
 
+// recalculates placement factors of folders from their recent write latency and queue depth (called every second)
+// folder with write latency above median of all working folders or with more than one data operation in progress on average gets proportionally less new chunks
+static void hdd_placement_update(void) {
+	folder *f,*g;
+	uint64_t usectime;
+	uint64_t sums[HSF_SUMCNT];
+	uint32_t below,cnt;
+	double dt,lat,medlat,pen,fac;
+
+	usectime = monotonic_useconds();
+	zassert(pthread_mutex_lock(&folderlock));
+	zassert(pthread_mutex_lock(&statslock));
+	for (f=folderhead ; f ; f=f->next) {
+		if (f->statsslot!=HSC_NOSLOT) {
+			tc_sums(iostats,HSC_FOLDERID(f->statsslot),HSF_SUMCNT,sums);
+			f->plbusy += (sums[HSF_NSECREADSUM] - f->plbase[HSF_NSECREADSUM]) + (sums[HSF_NSECWRITESUM] - f->plbase[HSF_NSECWRITESUM]);
+			f->plwnsec += sums[HSF_NSECWRITESUM] - f->plbase[HSF_NSECWRITESUM];
+			f->plwops += sums[HSF_WOPS] - f->plbase[HSF_WOPS];
+			memcpy(f->plbase,sums,sizeof(f->plbase));
+		}
+		if (f->plusec>0 && usectime>f->plusec) {
+			dt = usectime - f->plusec;
+			f->qdepthavg = f->qdepthavg * 0.75 + (f->plbusy / (dt * 1000.0)) * 0.25;
+			if (f->plwops>0) {
+				lat = (f->plwnsec / 1000.0) / f->plwops;
+				if (f->wlatavg==0.0) {
+					f->wlatavg = lat;
+				} else {
+					f->wlatavg = f->wlatavg * 0.75 + lat * 0.25;
+				}
+			}
+		}
+		f->plbusy = 0;
+		f->plwnsec = 0;
+		f->plwops = 0;
+		f->plusec = usectime;
+	}
+	zassert(pthread_mutex_unlock(&statslock));
+	// lower median of write latency of working folders
+	medlat = 0.0;
+	cnt = 0;
+	for (f=folderhead ; f ; f=f->next) {
+		if (f->damaged==0 && f->toremove==REMOVING_NO && f->scanstate==SCST_WORKING && f->wlatavg>0.0) {
+			cnt++;
+		}
+	}
+	for (f=folderhead ; f && medlat==0.0 ; f=f->next) {
+		if (f->damaged==0 && f->toremove==REMOVING_NO && f->scanstate==SCST_WORKING && f->wlatavg>0.0) {
+			below = 0;
+			for (g=folderhead ; g ; g=g->next) {
+				if (g->damaged==0 && g->toremove==REMOVING_NO && g->scanstate==SCST_WORKING && g->wlatavg>0.0 && (g->wlatavg<f->wlatavg || (g->wlatavg==f->wlatavg && g<f))) {
+					below++;
+				}
+			}
+			if (below==(cnt-1)/2) {
+				medlat = f->wlatavg;
+			}
+		}
+	}
+	for (f=folderhead ; f ; f=f->next) {
+		pen = 0.0;
+		if (medlat>0.0 && f->wlatavg>medlat*1.25) { // small differences are ignored
+			pen += f->wlatavg / medlat - 1.25;
+		}
+		if (f->qdepthavg>1.0) {
+			pen += f->qdepthavg - 1.0;
+		}
+		fac = 1.0 / (1.0 + pen * HDDPlacementLatencyWeight / 100.0);
+		if (fac<0.05) { // never stop sending new chunks entirely - errors will mark really broken disk as damaged
+			fac = 0.05;
+		}
+		f->placefactor = fac;
+	}
+	zassert(pthread_mutex_unlock(&folderlock));
+}
+
 static inline folder* hdd_getfolder() {
 	folder *f,*bf;
 	double minerr,err,expdist;
 //	double usage;
-	uint64_t totalsum,good_totalsum;
+	double totalsum,good_totalsum;
 	uint32_t folder_cnt,good_cnt,notfull_cnt;
 	uint8_t onlygood;
 	uint64_t usectime;
@@ -1481,14 +3062,14 @@ static inline folder* hdd_getfolder() {
 			if (notfull_cnt==0 || f->avail * UINT64_C(1000) >= f->total) { // space used <= 99.9%
 				if (f->rebalance_last_usec + REBALANCE_GRACE_PERIOD < usectime) {
 					good_cnt++;
-					good_totalsum += f->total;
+					good_totalsum += f->total * f->placefactor;
 				}
-				totalsum += f->total;
+				totalsum += f->total * f->placefactor;
 				folder_cnt++;
 			}
 		}
 	}
-//	syslog(LOG_NOTICE,"good_cnt: %"PRIu32" ; folder_cnt: %"PRIu32" ; good_totalsum:%"PRIu64" ; totalsum:%"PRIu64,good_cnt,folder_cnt,good_totalsum,totalsum);
+//	syslog(LOG_NOTICE,"good_cnt: %"PRIu32" ; folder_cnt: %"PRIu32" ; good_totalsum:%.0lf ; totalsum:%.0lf",good_cnt,folder_cnt,good_totalsum,totalsum);
 	if (good_cnt * 3 >= folder_cnt * 2) {
 		onlygood = 1;
 		totalsum = good_totalsum;
@@ -1504,7 +3085,7 @@ static inline folder* hdd_getfolder() {
 						err = 1.0;
 					} else {
 						expdist = totalsum;
-						expdist /= f->total;
+						expdist /= f->total * f->placefactor;
 						err = (expdist + f->write_corr) / f->write_dist;
 					}
 					if (bf==NULL || err<minerr) {
@@ -1521,7 +3102,7 @@ static inline folder* hdd_getfolder() {
 			bf->write_first = 0;
 		} else {
 			expdist = totalsum;
-			expdist /= bf->total;
+			expdist /= bf->total * bf->placefactor;
 			bf->write_corr += expdist - bf->write_dist;
 		}
 		bf->write_dist = 0;
@@ -1600,6 +3181,7 @@ static inline folder* hdd_getfolder() {
 static inline void hdd_wfr_add(folder *f,uint64_t chunkid,uint32_t version,uint16_t pathid) {
 	waitforremoval *wfr;
 
+	zassert(pthread_mutex_lock(&folderlock));
 	if (f->wfrchunks==NULL || f->wfrchunks->entries>=WFR_ENTRIES_IN_BLOCK) {
 #ifdef MMAP_ALLOC
 		massert(sizeof(waitforremoval)<=4096,"bad waitforremoval size");
@@ -1619,6 +3201,8 @@ static inline void hdd_wfr_add(folder *f,uint64_t chunkid,uint32_t version,uint1
 	wfr->pathid[wfr->entries] = pathid;
 	wfr->entries++;
 	f->wfrcount++;
+	hdd_index_log(f,INDEX_REC_WFR,chunkid,version,pathid);
+	zassert(pthread_mutex_unlock(&folderlock));
 }
 
 static inline void hdd_wfr_check(folder *f) {
@@ -1683,8 +3267,19 @@ static inline void hdd_folder_dump_chunkdb_begin(folder *f) {
 	char *fname;
 	uint8_t hdr[14];
 	uint8_t *wptr;
-
-	if (f->damaged || f->markforremoval==MFR_READONLY || f->wfrcount>0) { // do not store '.chunkdb'
+	uint64_t id;
+
+	// stop journaling - from now chunk index will be stored as a whole
+	zassert(pthread_mutex_lock(&(f->jlock)));
+	if (f->damaged) {
+		hdd_index_drop(f);
+	} else if (f->jfd>=0) {
+		fdatasync(f->jfd);
+		close(f->jfd);
+		f->jfd = -1;
+	}
+	zassert(pthread_mutex_unlock(&(f->jlock)));
+	if (f->damaged || f->markforremoval==MFR_READONLY) { // do not store '.chunkdb'
 		f->dumpfd = -1;
 		return;
 	}
@@ -1700,7 +3295,7 @@ static inline void hdd_folder_dump_chunkdb_begin(folder *f) {
 	}
 	free(fname);
 	if (f->dumpfd>=0) {
-		memcpy(hdr,"MFS CHUNKDB2",12);
+		memcpy(hdr,"MFS CHUNKDB4",12);
 		wptr = hdr+12;
 		put16bit(&wptr,pleng);
 		if (write(f->dumpfd,hdr,14)!=14) {
@@ -1711,6 +3306,23 @@ static inline void hdd_folder_dump_chunkdb_begin(folder *f) {
 		if (write(f->dumpfd,f->path,pleng)!=(int32_t)pleng) {
 			close(f->dumpfd);
 			f->dumpfd = -1;
+			return;
+		}
+		do {
+			id = rndu64();
+		} while (id==0);
+		wptr = hdr;
+		put64bit(&wptr,id);
+		if (write(f->dumpfd,hdr,8)!=8) {
+			close(f->dumpfd);
+			f->dumpfd = -1;
+			return;
+		}
+		wptr = hdr;
+		put64bit(&wptr,f->ckptid); // journal written against previous checkpoint is still valid for this one
+		if (write(f->dumpfd,hdr,8)!=8) {
+			close(f->dumpfd);
+			f->dumpfd = -1;
 		}
 	}
 }
@@ -1718,12 +3330,33 @@ static inline void hdd_folder_dump_chunkdb_begin(folder *f) {
 static inline void hdd_folder_dump_chunkdb_end(folder *f) {
 	if (f->dumpfd>=0) {
 		uint32_t pleng;
+		uint32_t i;
 		char *fname_src,*fname_dst;
-		uint8_t buff[18];
+		uint8_t buff[22];
+		uint8_t *wptr;
+		waitforremoval *wfr;
+
+		// files waiting for removal are stored as entries with 0xFFFF as blocks and hdrsize
+		for (wfr=f->wfrchunks ; wfr ; wfr=wfr->next) {
+			for (i=0 ; i<wfr->entries ; i++) {
+				wptr = buff;
+				put64bit(&wptr,wfr->chunkid[i]);
+				put32bit(&wptr,wfr->version[i]);
+				put16bit(&wptr,0xFFFF);
+				put16bit(&wptr,0xFFFF);
+				put16bit(&wptr,wfr->pathid[i]);
+				put32bit(&wptr,0);
+				if (write(f->dumpfd,buff,22)!=22) {
+					close(f->dumpfd);
+					f->dumpfd = -1;
+					return;
+				}
+			}
+		}
 
-		memset(buff,0,18);
+		memset(buff,0,22);
 
-		if (write(f->dumpfd,buff,18)!=18) {
+		if (write(f->dumpfd,buff,22)!=22) {
 			close(f->dumpfd);
 			f->dumpfd = -1;
 			return;
@@ -1736,7 +3369,7 @@ static inline void hdd_folder_dump_chunkdb_end(folder *f) {
 
 		pleng = strlen(f->path);
 		fname_src = malloc(pleng+13);
-		fname_dst = malloc(pleng+9);
+		fname_dst = malloc(pleng+15);
 		passert(fname_src);
 		passert(fname_dst);
 		memcpy(fname_src,f->path,pleng);
@@ -1745,7 +3378,11 @@ static inline void hdd_folder_dump_chunkdb_end(folder *f) {
 		memcpy(fname_dst,f->path,pleng);
 		memcpy(fname_dst+pleng,".chunkdb",8);
 		fname_dst[pleng+8] = 0;
-		rename(fname_src,fname_dst);
+		if (rename(fname_src,fname_dst)>=0) {
+			memcpy(fname_dst+pleng,".chunkjournal",13);
+			fname_dst[pleng+13] = 0;
+			unlink(fname_dst);
+		}
 		free(fname_src);
 		free(fname_dst);
 	}
@@ -1753,7 +3390,7 @@ static inline void hdd_folder_dump_chunkdb_end(folder *f) {
 
 static inline void hdd_folder_dump_chunkdb_chunk(folder *f,chunk *c) {
 	if (f->dumpfd>=0) {
-		uint8_t buff[18];
+		uint8_t buff[22];
 		uint8_t *wptr;
 		wptr = buff;
 		put64bit(&wptr,c->chunkid);
@@ -1766,7 +3403,8 @@ static inline void hdd_folder_dump_chunkdb_chunk(folder *f,chunk *c) {
 			put16bit(&wptr,0);
 		}
 		put16bit(&wptr,c->pathid);
-		if (write(f->dumpfd,buff,18)!=18) {
+		put32bit(&wptr,c->testtime);
+		if (write(f->dumpfd,buff,22)!=22) {
 			close(f->dumpfd);
 			f->dumpfd = -1;
 			return;
@@ -1775,66 +3413,294 @@ static inline void hdd_folder_dump_chunkdb_chunk(folder *f,chunk *c) {
 }
 
 uint8_t hdd_senddata(folder *f,int rmflag) {
-	uint32_t i;
+	uint32_t i,lockpos;
 	uint8_t markforremoval;
 	uint8_t canberemoved;
 	chunk **cptr,*c;
 
 	markforremoval = f->markforremoval!=MFR_NO;
 	canberemoved = 1;
-	zassert(pthread_mutex_lock(&hashlock));
 	zassert(pthread_mutex_lock(&testlock));
-	for (i=0 ; i<HASHSIZE ; i++) {
-		cptr = &(hashtab[i]);
-		while ((c=*cptr)) {
-			if (c->owner==f) {
-				if (rmflag) {
-					if (c->state==CH_AVAIL) {
-						hdd_report_lost_chunk(c->chunkid);
-						hdd_folder_dump_chunkdb_chunk(f,c);
-						*cptr = c->next;
-						if (c->fd>=0) {
-							if (c->crcchanged) {
-								syslog(LOG_WARNING,"hdd_senddata: CRC not flushed - writing now");
-								chunk_writecrc(c);
-							}
-							close(c->fd);
-							hdd_open_files_handle(OF_AFTER_CLOSE);
-						}
-						if (c->crc!=NULL) {
-#ifdef MMAP_ALLOC
-							munmap((void*)(c->crc),CHUNKCRCSIZE);
-#else
-							free(c->crc);
-#endif
-						}
-#ifdef PRESERVE_BLOCK
-						if (c->block!=NULL) {
-# ifdef MMAP_ALLOC
-							munmap((void*)(c->block),MFSBLOCKSIZE);
-# else
-							free(c->block);
-# endif
+	for (lockpos=0 ; lockpos<HASHLOCKS ; lockpos++) {
+		hdd_hashlock_lock(lockpos);
+		for (i=lockpos ; i<HASHSIZE ; i+=HASHLOCKS) {
+			cptr = &(hashtab[i]);
+			while ((c=*cptr)) {
+				if (c->owner==f) {
+					if (rmflag) {
+						if (c->state==CH_AVAIL) {
+							hdd_report_lost_chunk(c->chunkid);
+							hdd_folder_dump_chunkdb_chunk(f,c);
+							*cptr = c->next;
+							hdd_chunkopen_free(c,"hdd_senddata");
+							hdd_remove_chunk_from_subfolder(c,c->owner);
+							hdd_chunkrec_free(c);
+						} else {
+							canberemoved = 0;
+							cptr = &(c->next);
 						}
-#endif /* PRESERVE_BLOCK */
-						hdd_remove_chunk_from_test_chain(c,c->owner);
-						free(c);
 					} else {
-						canberemoved = 0;
+						hdd_report_new_chunk(c->chunkid,c->version|(markforremoval?0x80000000:0));
 						cptr = &(c->next);
 					}
 				} else {
-					hdd_report_new_chunk(c->chunkid,c->version|(markforremoval?0x80000000:0));
 					cptr = &(c->next);
 				}
-			} else {
-				cptr = &(c->next);
+			}
+		}
+		hdd_hashlock_unlock(lockpos);
+	}
+	zassert(pthread_mutex_unlock(&testlock));
+	return canberemoved;
+}
+
+/* index thread only - stores current chunk list as new checkpoint and cuts from journal records covered by it */
+static void hdd_index_checkpoint(folder *f) {
+	char fname[PATH_MAX];
+	char tmpfname[PATH_MAX];
+	uint8_t *buff,*wptr;
+	uint32_t buffsize,leng;
+	uint32_t i,lockpos;
+	uint32_t pleng;
+	uint64_t l0,previd,newid;
+	waitforremoval *wfr;
+	chunk *c;
+	int fd,jfd;
+	uint8_t status;
+
+	zassert(pthread_mutex_lock(&(f->jlock)));
+	l0 = f->jsize;
+	previd = f->ckptid;
+	f->needcheckpoint = 0;
+	f->ckpttime = main_time();
+	zassert(pthread_mutex_unlock(&(f->jlock)));
+
+	do {
+		newid = rndu64();
+	} while (newid==0 || newid==previd);
+
+	hdd_index_filename(tmpfname,f,".tmp_chunkdb");
+	fd = open(tmpfname,O_WRONLY | O_TRUNC | O_CREAT,0666);
+	if (fd<0) {
+		mfs_arg_errlog(LOG_NOTICE,"%s: open error",tmpfname);
+		return;
+	}
+	pleng = strlen(f->path);
+	buffsize = 65536;
+	if (buffsize<pleng+30) {
+		buffsize = pleng+30;
+	}
+	buff = malloc(buffsize);
+	passert(buff);
+	status = 1;
+	memcpy(buff,"MFS CHUNKDB4",12);
+	wptr = buff+12;
+	put16bit(&wptr,pleng);
+	memcpy(wptr,f->path,pleng);
+	wptr += pleng;
+	put64bit(&wptr,newid);
+	put64bit(&wptr,previd);
+	leng = wptr-buff;
+	if (write(fd,buff,leng)!=(ssize_t)leng) {
+		status = 0;
+	}
+	// chunk list is copied stripe by stripe, so hash locks are not kept during i/o
+	for (lockpos=0 ; lockpos<HASHLOCKS && status ; lockpos++) {
+		leng = 0;
+		zassert(pthread_mutex_lock(&folderlock));
+		hdd_hashlock_lock(lockpos);
+		for (i=lockpos ; i<HASHSIZE ; i+=HASHLOCKS) {
+			for (c=hashtab[i] ; c ; c=c->next) {
+				if (c->owner==f && c->state!=CH_DELETED && c->pathid<256) {
+					if (leng+22>buffsize) {
+						buffsize *= 2;
+						buff = realloc(buff,buffsize);
+						passert(buff);
+					}
+					wptr = buff+leng;
+					put64bit(&wptr,c->chunkid);
+					put32bit(&wptr,c->version);
+					if (c->validattr) {
+						put16bit(&wptr,c->blocks);
+						put16bit(&wptr,c->hdrsize);
+					} else {
+						put16bit(&wptr,0xFFFF);
+						put16bit(&wptr,0);
+					}
+					put16bit(&wptr,c->pathid);
+					put32bit(&wptr,c->testtime);
+					leng += 22;
+				}
+			}
+		}
+		hdd_hashlock_unlock(lockpos);
+		zassert(pthread_mutex_unlock(&folderlock));
+		if (leng>0 && write(fd,buff,leng)!=(ssize_t)leng) {
+			status = 0;
+		}
+	}
+	if (status) {
+		leng = 0;
+		zassert(pthread_mutex_lock(&folderlock));
+		for (wfr=f->wfrchunks ; wfr ; wfr=wfr->next) {
+			for (i=0 ; i<wfr->entries ; i++) {
+				if (leng+22>buffsize) {
+					buffsize *= 2;
+					buff = realloc(buff,buffsize);
+					passert(buff);
+				}
+				wptr = buff+leng;
+				put64bit(&wptr,wfr->chunkid[i]);
+				put32bit(&wptr,wfr->version[i]);
+				put16bit(&wptr,0xFFFF);
+				put16bit(&wptr,0xFFFF);
+				put16bit(&wptr,wfr->pathid[i]);
+				put32bit(&wptr,0);
+				leng += 22;
+			}
+		}
+		zassert(pthread_mutex_unlock(&folderlock));
+		if (leng+22>buffsize) {
+			buffsize = leng+22;
+			buff = realloc(buff,buffsize);
+			passert(buff);
+		}
+		memset(buff+leng,0,22);
+		leng += 22;
+		if (write(fd,buff,leng)!=(ssize_t)leng) {
+			status = 0;
+		}
+	}
+	if (status && fsync(fd)<0) {
+		status = 0;
+	}
+	if (close(fd)<0) {
+		status = 0;
+	}
+	if (status==0) {
+		mfs_arg_errlog(LOG_NOTICE,"%s: write error",tmpfname);
+		unlink(tmpfname);
+		free(buff);
+		return;
+	}
+
+	zassert(pthread_mutex_lock(&(f->jlock)));
+	if (f->jfd<0 || f->ckptid!=previd) { // index has been dropped or restarted in the meantime
+		zassert(pthread_mutex_unlock(&(f->jlock)));
+		unlink(tmpfname);
+		free(buff);
+		return;
+	}
+	hdd_index_filename(fname,f,".chunkdb");
+	if (rename(tmpfname,fname)<0) {
+		mfs_arg_errlog(LOG_NOTICE,"%s: rename error",tmpfname);
+		zassert(pthread_mutex_unlock(&(f->jlock)));
+		unlink(tmpfname);
+		free(buff);
+		return;
+	}
+	fd = open(f->path,O_RDONLY);
+	if (fd>=0) {
+		fsync(fd);
+		close(fd);
+	}
+	// new journal contains only records appended during checkpoint write (journal of previous lineage stays valid until rename)
+	leng = f->jsize - l0;
+	if (leng+INDEX_JOURNAL_HDRSIZE>buffsize) {
+		buffsize = leng+INDEX_JOURNAL_HDRSIZE;
+		buff = realloc(buff,buffsize);
+		passert(buff);
+	}
+	memcpy(buff,"MFS CHUNKJNL",12);
+	wptr = buff+12;
+	put64bit(&wptr,newid);
+	status = 0;
+	if (leng==0 || pread(f->jfd,buff+INDEX_JOURNAL_HDRSIZE,leng,l0)==(ssize_t)leng) {
+		hdd_index_filename(tmpfname,f,".tmp_chunkjournal");
+		jfd = open(tmpfname,O_RDWR | O_TRUNC | O_CREAT | O_APPEND,0666);
+		if (jfd>=0) {
+			if (write(jfd,buff,leng+INDEX_JOURNAL_HDRSIZE)==(ssize_t)(leng+INDEX_JOURNAL_HDRSIZE) && fdatasync(jfd)>=0) {
+				hdd_index_filename(fname,f,".chunkjournal");
+				if (rename(tmpfname,fname)>=0) {
+					close(f->jfd);
+					f->jfd = jfd;
+					f->jsize = leng+INDEX_JOURNAL_HDRSIZE;
+					f->ckptid = newid;
+					status = 1;
+				}
+			}
+			if (status==0) {
+				close(jfd);
+				unlink(tmpfname);
 			}
 		}
 	}
-	zassert(pthread_mutex_unlock(&testlock));
-	zassert(pthread_mutex_unlock(&hashlock));
-	return canberemoved;
+	if (status==0) {
+		syslog(LOG_NOTICE,"%s: can't compact chunk journal - old one is kept",f->path);
+	}
+	zassert(pthread_mutex_unlock(&(f->jlock)));
+	free(buff);
+}
+
+void* hdd_index_thread(void *arg) {
+	folder *f;
+	folder **ftab;
+	uint32_t fcnt,fsize,i;
+	uint8_t docheckpoint;
+	int jfd;
+
+	ftab = NULL;
+	fsize = 0;
+	for (;;) {
+		fcnt = 0;
+		zassert(pthread_mutex_lock(&folderlock));
+		for (f=folderhead ; f ; f=f->next) {
+			if (f->scanstate==SCST_WORKING && f->toremove==REMOVING_NO && f->damaged==0) {
+				if (fcnt>=fsize) {
+					fsize = (fsize==0)?16:fsize*2;
+					ftab = realloc(ftab,sizeof(folder*)*fsize);
+					passert(ftab);
+				}
+				f->indexbusy = 1;
+				ftab[fcnt++] = f;
+			}
+		}
+		zassert(pthread_mutex_unlock(&folderlock));
+		for (i=0 ; i<fcnt ; i++) {
+			f = ftab[i];
+			jfd = -1;
+			zassert(pthread_mutex_lock(&(f->jlock)));
+			if (f->jdirty && f->jfd>=0) {
+				jfd = dup(f->jfd);
+				f->jdirty = 0;
+			}
+			docheckpoint = (f->jfd>=0 && (f->needcheckpoint || f->jsize>=INDEX_JOURNAL_MAXSIZE || f->ckpttime+INDEX_CHECKPOINT_INTERVAL<=main_time()))?1:0;
+			zassert(pthread_mutex_unlock(&(f->jlock)));
+			if (jfd>=0) {
+				fdatasync(jfd);
+				close(jfd);
+			}
+			if (docheckpoint) {
+				hdd_index_checkpoint(f);
+			}
+		}
+		zassert(pthread_mutex_lock(&folderlock));
+		for (i=0 ; i<fcnt ; i++) {
+			ftab[i]->indexbusy = 0;
+		}
+		zassert(pthread_mutex_unlock(&folderlock));
+		zassert(pthread_mutex_lock(&termlock));
+		if (term) {
+			zassert(pthread_mutex_unlock(&termlock));
+			break;
+		}
+		zassert(pthread_mutex_unlock(&termlock));
+		sleep(1);
+	}
+	if (ftab) {
+		free(ftab);
+	}
+	return arg;
 }
 
 void* hdd_folder_scan(void *arg);
@@ -1865,7 +3731,7 @@ void hdd_check_folders(void) {
 //	}
 	fptr = &folderhead;
 	while ((f=*fptr)) {
-		if (f->toremove!=REMOVING_NO && f->rebalance_in_progress==0) {
+		if (f->toremove!=REMOVING_NO && f->rebalance_in_progress==0 && f->indexbusy==0) {
 			switch (f->scanstate) {
 			case SCST_SCANINPROGRESS:
 				f->scanstate = SCST_SCANTERMINATE;
@@ -1895,6 +3761,7 @@ void hdd_check_folders(void) {
 				if (f->damaged) {
 					f->toremove = REMOVING_NO;
 					f->chunkcount = 0;
+					f->testpos = 0;
 					f->chunktabsize = 0;
 					if (f->chunktab) {
 						free(f->chunktab);
@@ -1922,7 +3789,12 @@ void hdd_check_folders(void) {
 							cl->f = NULL;
 						}
 					}
+					hdd_stats_slot_free(f);
 					syslog(LOG_NOTICE,"folder %s successfully removed",f->path);
+					if (f->jfd>=0) {
+						close(f->jfd);
+					}
+					zassert(pthread_mutex_destroy(&(f->jlock)));
 					free(f->path);
 					free(f);
 				}
@@ -2040,30 +3912,35 @@ static uint32_t hdd_get_chunks_pos = 0;
 static pthread_cond_t hdd_get_chunks_cond = PTHREAD_COND_INITIALIZER;
 static uint8_t hdd_get_chunks_waiting = 0;
 static uint8_t hdd_get_chunks_partialmode = 0;
+static pthread_mutex_t hdd_get_chunks_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void hdd_get_chunks_begin(uint8_t partialmode) {
-	zassert(pthread_mutex_lock(&hashlock));
+	zassert(pthread_mutex_lock(&hdd_get_chunks_lock));
 	hdd_get_chunks_pos = 0;
 	while (hdd_get_chunks_partialmode) {
 		hdd_get_chunks_waiting++;
-		zassert(pthread_cond_wait(&hdd_get_chunks_cond,&hashlock));
+		zassert(pthread_cond_wait(&hdd_get_chunks_cond,&hdd_get_chunks_lock));
 	}
 	hdd_get_chunks_partialmode = partialmode;
 	if (partialmode) {
-		zassert(pthread_mutex_unlock(&hashlock));
+		zassert(pthread_mutex_unlock(&hdd_get_chunks_lock));
+	} else {
+		hdd_hashlock_all();
 	}
 }
 
 void hdd_get_chunks_end() {
 	if (hdd_get_chunks_partialmode) {
-		zassert(pthread_mutex_lock(&hashlock));
+		zassert(pthread_mutex_lock(&hdd_get_chunks_lock));
 		hdd_get_chunks_partialmode = 0;
 		if (hdd_get_chunks_waiting) {
 			zassert(pthread_cond_signal(&hdd_get_chunks_cond));
 			hdd_get_chunks_waiting--;
 		}
+	} else {
+		hdd_hashunlock_all();
 	}
-	zassert(pthread_mutex_unlock(&hashlock));
+	zassert(pthread_mutex_unlock(&hdd_get_chunks_lock));
 }
 
 uint32_t hdd_get_chunks_next_list_count() {
@@ -2072,7 +3949,7 @@ uint32_t hdd_get_chunks_next_list_count() {
 	chunk *c;
 	zassert(pthread_mutex_lock(&folderlock)); // c->owner !!!
 	if (hdd_get_chunks_partialmode) {
-		zassert(pthread_mutex_lock(&hashlock));
+		hdd_hashlock_all();
 	}
 	while (res<CHUNKS_CUT_COUNT && hdd_get_chunks_pos+i<HASHSIZE) {
 		for (c=hashtab[hdd_get_chunks_pos+i] ; c ; c=c->next) {
@@ -2084,7 +3961,7 @@ uint32_t hdd_get_chunks_next_list_count() {
 	}
 	if (res==0) {
 		if (hdd_get_chunks_partialmode) {
-			zassert(pthread_mutex_unlock(&hashlock));
+			hdd_hashunlock_all();
 		}
 		zassert(pthread_mutex_unlock(&folderlock));
 	}
@@ -2110,7 +3987,7 @@ void hdd_get_chunks_next_list_data(uint8_t *buff) {
 		hdd_get_chunks_pos++;
 	}
 	if (hdd_get_chunks_partialmode) {
-		zassert(pthread_mutex_unlock(&hashlock));
+		hdd_hashunlock_all();
 	}
 	zassert(pthread_mutex_unlock(&folderlock));
 }
@@ -2121,7 +3998,7 @@ uint32_t hdd_get_chunks_count() {
 	uint32_t res = 0;
 	uint32_t i;
 	chunk *c;
-	zassert(pthread_mutex_lock(&hashlock));
+	hdd_hashlock_all();
 	for (i=0 ; i<HASHSIZE ; i++) {
 		for (c=hashtab[i] ; c ; c=c->next) {
 			res++;
@@ -2217,31 +4094,289 @@ void hdd_get_space(uint64_t *usedspace,uint64_t *totalspace,uint32_t *chunkcount
 	*tdchunkcount = tdchunks;
 }
 
+#ifdef HAVE_IO_URING
+/* io_uring engine - every thread doing disk i/o gets its own small ring (created on first use), so submissions never need locks
+ * only independent operations issued together are put on the ring (header+crc read, fsync batches) - data block i/o of
+ * one request is already a single preadv/pwrite done by a worker that waits for its result, so the ring wouldn't save anything */
+
+#define URING_ENTRIES 64
+
+typedef struct hdd_uring {
+	int fd;
+	uint32_t pending;
+	uint32_t sqtail;
+	uint32_t *sqhead,*sqtailptr,*sqmask,*sqarray;
+	uint32_t *cqhead,*cqtail,*cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqptr,*cqptr;
+	size_t sqsize,cqsize,sqessize;
+} hdd_uring;
+
+static pthread_key_t uringkey;
+
+static void hdd_uring_free(void *arg) {
+	hdd_uring *r = (hdd_uring*)arg;
+	if (r==NULL) {
+		return;
+	}
+	munmap(r->sqes,r->sqessize);
+	munmap(r->cqptr,r->cqsize);
+	munmap(r->sqptr,r->sqsize);
+	close(r->fd);
+	free(r);
+}
+
+static hdd_uring* hdd_uring_new(void) {
+	struct io_uring_params p;
+	hdd_uring *r;
+	uint8_t *sqp,*cqp;
+	int fd;
+
+	memset(&p,0,sizeof(p));
+	fd = syscall(__NR_io_uring_setup,URING_ENTRIES,&p);
+	if (fd<0) {
+		return NULL;
+	}
+	r = malloc(sizeof(hdd_uring));
+	passert(r);
+	r->fd = fd;
+	r->pending = 0;
+	r->sqsize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqptr = mmap(NULL,r->sqsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	if (r->sqptr==MAP_FAILED) {
+		close(fd);
+		free(r);
+		return NULL;
+	}
+	r->cqptr = mmap(NULL,r->cqsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+	if (r->cqptr==MAP_FAILED) {
+		munmap(r->sqptr,r->sqsize);
+		close(fd);
+		free(r);
+		return NULL;
+	}
+	r->sqes = mmap(NULL,r->sqessize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQES);
+	if (r->sqes==MAP_FAILED) {
+		munmap(r->cqptr,r->cqsize);
+		munmap(r->sqptr,r->sqsize);
+		close(fd);
+		free(r);
+		return NULL;
+	}
+	sqp = r->sqptr;
+	cqp = r->cqptr;
+	r->sqhead = (uint32_t*)(sqp + p.sq_off.head);
+	r->sqtailptr = (uint32_t*)(sqp + p.sq_off.tail);
+	r->sqmask = (uint32_t*)(sqp + p.sq_off.ring_mask);
+	r->sqarray = (uint32_t*)(sqp + p.sq_off.array);
+	r->cqhead = (uint32_t*)(cqp + p.cq_off.head);
+	r->cqtail = (uint32_t*)(cqp + p.cq_off.tail);
+	r->cqmask = (uint32_t*)(cqp + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cqp + p.cq_off.cqes);
+	r->sqtail = *(r->sqtailptr);
+	return r;
+}
+
+// returns ring of current thread or NULL when io_uring is switched off or not available
+static inline hdd_uring* hdd_uring_get(void) {
+	hdd_uring *r;
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	if (__sync_or_and_fetch(&UseIoUring,0)==0) {
+		return NULL;
+	}
+#else
+	uint8_t u;
+	pthread_mutex_lock(&cfglock);
+	u = UseIoUring;
+	pthread_mutex_unlock(&cfglock);
+	if (u==0) {
+		return NULL;
+	}
+#endif
+	r = pthread_getspecific(uringkey);
+	if (r==NULL) {
+		r = hdd_uring_new();
+		if (r!=NULL) {
+			zassert(pthread_setspecific(uringkey,r));
+		}
+	}
+	return r;
+}
+
+static inline struct io_uring_sqe* hdd_uring_sqe(hdd_uring *r,uint8_t opcode,int fd,uint64_t userdata) {
+	struct io_uring_sqe *sqe;
+	uint32_t indx;
+
+	indx = r->sqtail & *(r->sqmask);
+	sqe = r->sqes + indx;
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = userdata;
+	r->sqarray[indx] = indx;
+	r->sqtail++;
+	r->pending++;
+	return sqe;
+}
+
+static inline void hdd_uring_prep_rw(hdd_uring *r,uint8_t opcode,int fd,struct iovec *iov,uint64_t offset,uint64_t userdata) {
+	struct io_uring_sqe *sqe;
+	sqe = hdd_uring_sqe(r,opcode,fd,userdata);
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = 1;
+	sqe->off = offset;
+}
+
+static inline void hdd_uring_prep_fsync(hdd_uring *r,int fd,uint64_t userdata) {
+	(void)hdd_uring_sqe(r,IORING_OP_FSYNC,fd,userdata);
+}
+
+static inline uint32_t hdd_uring_space(hdd_uring *r) {
+	return URING_ENTRIES - r->pending;
+}
+
+// submits all prepared operations and waits for all submitted ones; res[userdata] = operation result (-errno on error)
+// returns -1 (errno set) when not all operations could be submitted - results are then incomplete and caller has to
+// repeat everything with standard i/o (only idempotent operations - reads and fsyncs - are put on the ring)
+static int hdd_uring_run(hdd_uring *r,int32_t *res) {
+	struct io_uring_cqe *cqe;
+	uint32_t head,tail,submitted,done,tosubmit;
+	uint8_t waiterr,subfailed;
+	int errmem;
+	int ret;
+
+	if (r->pending==0) {
+		return 0;
+	}
+	__sync_synchronize();
+	*(r->sqtailptr) = r->sqtail;
+	__sync_synchronize();
+	submitted = 0;
+	done = 0;
+	waiterr = 0;
+	subfailed = 0;
+	errmem = 0;
+	while (submitted<r->pending || done<submitted) {
+		tosubmit = r->pending-submitted;
+		if (waiterr) {
+			// can't wait in kernel - completions are still posted, so just poll the ring
+			portable_usleep(1000);
+		} else {
+			ret = syscall(__NR_io_uring_enter,r->fd,tosubmit,submitted+tosubmit-done,IORING_ENTER_GETEVENTS,NULL,0);
+			if (ret<0) {
+				if (errno==EINTR) {
+					continue;
+				}
+				if (tosubmit>0) { // withdraw entries not taken by kernel, but still collect completions of submitted ones
+					errmem = errno;
+					r->sqtail -= tosubmit;
+					*(r->sqtailptr) = r->sqtail;
+					r->pending = submitted;
+					subfailed = 1;
+				} else {
+					mfs_errlog_silent(LOG_WARNING,"io_uring: error waiting for completions");
+					waiterr = 1;
+				}
+				continue;
+			}
+			submitted += ((uint32_t)ret>tosubmit)?tosubmit:(uint32_t)ret;
+		}
+		__sync_synchronize();
+		head = *(r->cqhead);
+		tail = *(r->cqtail);
+		while (head!=tail) {
+			cqe = r->cqes + (head & *(r->cqmask));
+			res[cqe->user_data] = cqe->res;
+			head++;
+			done++;
+		}
+		*(r->cqhead) = head;
+		__sync_synchronize();
+	}
+	r->pending = 0;
+	if (subfailed) {
+		errno = errmem;
+		return -1;
+	}
+	return 0;
+}
+#endif /* HAVE_IO_URING */
+
 static inline void chunk_emptycrc(chunk *c) {
 #ifdef MMAP_ALLOC
-	c->crc = (uint8_t*)mmap(NULL,CHUNKCRCSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
+	c->op->crc = (uint8_t*)mmap(NULL,CHUNKCRCSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
 #else
-	c->crc = (uint8_t*)malloc(CHUNKCRCSIZE);
+	c->op->crc = (uint8_t*)malloc(CHUNKCRCSIZE);
+#endif
+	passert(c->op->crc);
+	memcpy(c->op->crc,emptychunkcrc,CHUNKCRCSIZE);
+}
+
+static inline void chunk_crcbuff_free(uint8_t *crc) {
+#ifdef MMAP_ALLOC
+	munmap((void*)crc,CHUNKCRCSIZE);
+#else
+	free(crc);
 #endif
-	passert(c->crc);
-	memcpy(c->crc,emptychunkcrc,CHUNKCRCSIZE);
 }
 
 static inline int chunk_readcrc(chunk *c,int mode) {
-	int ret;
+	int hret,cret;
 	uint8_t hdr[20];
+	uint8_t *crc;
 	const uint8_t *ptr;
 	uint64_t chunkid;
 	uint32_t version;
 	char fname[PATH_MAX];
-	if (mypread(c->fd,hdr,20,0)!=20) {
+#ifdef HAVE_IO_URING
+	hdd_uring *r;
+	struct iovec iov[2];
+	int32_t res[2];
+#endif
+
+#ifdef MMAP_ALLOC
+	crc = (uint8_t*)mmap(NULL,CHUNKCRCSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
+#else
+	crc = (uint8_t*)malloc(CHUNKCRCSIZE);
+#endif
+	passert(crc);
+	cret = -2; // not read yet
+#ifdef HAVE_IO_URING
+	r = hdd_uring_get();
+	if (r!=NULL) { // header and crc block in one submission
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = 20;
+		iov[1].iov_base = crc;
+		iov[1].iov_len = CHUNKCRCSIZE;
+		hdd_uring_prep_rw(r,IORING_OP_READV,c->op->fd,iov,0,0);
+		hdd_uring_prep_rw(r,IORING_OP_READV,c->op->fd,iov+1,c->hdrsize,1);
+		if (hdd_uring_run(r,res)>=0) {
+			hret = res[0];
+			cret = res[1];
+			if (hret<0) {
+				errno = -hret;
+			}
+		}
+	}
+	if (cret==-2) {
+		hret = mypread(c->op->fd,hdr,20,0);
+	}
+#else
+	hret = mypread(c->op->fd,hdr,20,0);
+#endif
+	if (hret!=20) {
 		int errmem = errno;
+		chunk_crcbuff_free(crc);
 		hdd_generate_filename(fname,c); // preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"chunk_readcrc: file:%s - read error",fname);
 		errno = errmem;
 		return MFS_ERROR_IO;
 	}
 	if (memcmp(hdr,MFSSIGNATURE "C 1.",7)!=0 || (hdr[7]!='0' && hdr[7]!='1')) { // accept chunks 1.1 (correct CRC for non existing blocks)
+		chunk_crcbuff_free(crc);
 		hdd_generate_filename(fname,c);
 		syslog(LOG_WARNING,"chunk_readcrc: file:%s - wrong header",fname);
 		errno = 0;
@@ -2254,31 +4389,26 @@ static inline int chunk_readcrc(chunk *c,int mode) {
 		version = c->version;
 	}
 	if (c->chunkid!=chunkid || c->version!=version) {
+		chunk_crcbuff_free(crc);
 		hdd_generate_filename(fname,c);
 		syslog(LOG_WARNING,"chunk_readcrc: file:%s - wrong id/version in header (%016"PRIX64"_%08"PRIX32")",fname,chunkid,version);
 		errno = 0;
 		return MFS_ERROR_IO;
 	}
-#ifdef MMAP_ALLOC
-	c->crc = (uint8_t*)mmap(NULL,CHUNKCRCSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-#else
-	c->crc = (uint8_t*)malloc(CHUNKCRCSIZE);
-#endif
-	passert(c->crc);
-	ret = mypread(c->fd,c->crc,CHUNKCRCSIZE,c->hdrsize);
-	if (ret!=CHUNKCRCSIZE) {
+	if (cret==-2) {
+		cret = mypread(c->op->fd,crc,CHUNKCRCSIZE,c->hdrsize);
+	} else if (cret<0) {
+		errno = -cret;
+	}
+	if (cret!=CHUNKCRCSIZE) {
 		int errmem = errno;
 		hdd_generate_filename(fname,c); // preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"chunk_readcrc: file:%s - read error",fname);
-#ifdef MMAP_ALLOC
-		munmap((void*)(c->crc),CHUNKCRCSIZE);
-#else
-		free(c->crc);
-#endif
-		c->crc = NULL;
+		chunk_crcbuff_free(crc);
 		errno = errmem;
 		return MFS_ERROR_IO;
 	}
+	c->op->crc = crc;
 	hdd_stats_read(CHUNKCRCSIZE);
 	errno = 0;
 	return MFS_STATUS_OK;
@@ -2286,11 +4416,11 @@ static inline int chunk_readcrc(chunk *c,int mode) {
 
 static inline void chunk_freecrc(chunk *c) {
 #ifdef MMAP_ALLOC
-	munmap((void*)(c->crc),CHUNKCRCSIZE);
+	munmap((void*)(c->op->crc),CHUNKCRCSIZE);
 #else
-	free(c->crc);
+	free(c->op->crc);
 #endif
-	c->crc = NULL;
+	c->op->crc = NULL;
 }
 
 static inline int chunk_writecrc(chunk *c) {
@@ -2301,7 +4431,7 @@ static inline int chunk_writecrc(chunk *c) {
 		c->owner->needrefresh = 1;
 		zassert(pthread_mutex_unlock(&folderlock));
 	}
-	ret = mypwrite(c->fd,c->crc,CHUNKCRCSIZE,c->hdrsize);
+	ret = mypwrite(c->op->fd,c->op->crc,CHUNKCRCSIZE,c->hdrsize);
 	if (ret!=CHUNKCRCSIZE) {
 		int errmem = errno;
 		hdd_generate_filename(fname,c); // preserves errno !!!
@@ -2316,315 +4446,514 @@ static inline int chunk_writecrc(chunk *c) {
 void hdd_test_show_chunks(void) {
 	uint32_t hashpos;
 	chunk *c;
-	zassert(pthread_mutex_lock(&hashlock));
+	hdd_hashlock_all();
 	for (hashpos=0 ; hashpos<HASHSIZE ; hashpos++) {
 		for (c=hashtab[hashpos] ; c ; c=c->next) {
 			printf("chunk id:%"PRIu64" version:%"PRIu32" state:%u\n",c->chunkid,c->version,c->state);
 		}
 	}
-	zassert(pthread_mutex_unlock(&hashlock));
+	hdd_hashunlock_all();
+}
+
+#if 0
+void hdd_test_show_openedchunks(void) {
+	chunk *c;
+	double now;
+
+	now = monotonic_seconds();
+	zassert(pthread_mutex_lock(&fdcachelock));
+	printf("open files: %"PRIu32"/%"PRIu32" (idle: %"PRIu32")\n",fdcount,fdlimit,fdidle);
+	for (c=fdlruhead ; c ; c=c->op->fdnext) {
+		printf("id: %"PRIu64" - fd:%d (delay:%.3lfs)\n",c->chunkid,c->op->fd,c->op->opento-now);
+	}
+	for (c=crclruhead ; c ; c=c->op->crcnext) {
+		printf("id: %"PRIu64" - crc:%p (delay:%.3lfs)\n",c->chunkid,(void*)(c->op->crc),c->op->crcto-now);
+	}
+	zassert(pthread_mutex_unlock(&fdcachelock));
+}
+#endif
+
+static void hdd_chunk_fsync(chunk *c) {
+	uint64_t ts,te;
+	char fname[PATH_MAX];
+
+	ts = monotonic_nseconds();
+#ifdef F_FULLFSYNC
+	if (fcntl(c->op->fd,F_FULLFSYNC)<0) {
+		hdd_error_occured(c); // uses and preserves errno !!!
+		hdd_generate_filename(fname,c); // preserves errno !!!
+		mfs_arg_errlog_silent(LOG_WARNING,"hdd_delayed_ops: file:%s - fsync (via fcntl) error",fname);
+		hdd_report_damaged_chunk(c);
+	}
+#else
+	if (fsync(c->op->fd)<0) {
+		hdd_error_occured(c); // uses and preserves errno !!!
+		hdd_generate_filename(fname,c); // preserves errno !!!
+		mfs_arg_errlog_silent(LOG_WARNING,"hdd_delayed_ops: file:%s - fsync (direct call) error",fname);
+		hdd_report_damaged_chunk(c);
+	}
+#endif
+	te = monotonic_nseconds();
+	hdd_stats_datafsync(c->owner,te-ts);
+	c->op->fsyncneeded = 0;
+}
+
+#ifdef HAVE_IO_URING
+// all fsyncs from batch are executed in parallel, so each of them is accounted with time of whole batch
+static void hdd_delayed_fsync_batch(hdd_uring *r,chunk **fsynctab,uint32_t fsynccnt,int32_t *res) {
+	uint32_t i;
+	chunk *c;
+	uint64_t ts,te;
+	char fname[PATH_MAX];
+
+	ts = monotonic_nseconds();
+	for (i=0 ; i<fsynccnt ; i++) {
+		res[i] = 1; // not done
+	}
+	if (hdd_uring_run(r,res)<0) { // not all submitted - do the rest the old way (errors reported by ring are kept)
+		for (i=0 ; i<fsynccnt ; i++) {
+			if (res[i]>0) {
+				res[i] = (fsync(fsynctab[i]->op->fd)<0)?-errno:0;
+			}
+		}
+	}
+	te = monotonic_nseconds();
+	for (i=0 ; i<fsynccnt ; i++) {
+		c = fsynctab[i];
+		if (res[i]<0) {
+			errno = -res[i];
+			hdd_error_occured(c); // uses and preserves errno !!!
+			hdd_generate_filename(fname,c); // preserves errno !!!
+			mfs_arg_errlog_silent(LOG_WARNING,"hdd_delayed_ops: file:%s - fsync (via io_uring) error",fname);
+			hdd_report_damaged_chunk(c);
+		}
+		hdd_stats_datafsync(c->owner,te-ts);
+		c->op->fsyncneeded = 0;
+		hdd_chunk_release(c);
+	}
+}
+#endif
+
+#ifdef HDD_FSYNC_GROUP
+/* syncfs returns writeback errors of files from given file system only since Linux 5.8 - on older kernels it always succeeds */
+static int hdd_syncfs_reports_errors(void) {
+	struct utsname un;
+	unsigned int major,minor;
+	if (uname(&un)<0) {
+		return 0;
+	}
+	if (sscanf(un.release,"%u.%u",&major,&minor)!=2) {
+		return 0;
+	}
+	return (major>5 || (major==5 && minor>=8))?1:0;
+}
+
+/* group commit - when at least FsyncGroupMin chunks from one folder wait for fsync, all of them are synced by one syncfs
+ * call, the rest is synced one by one ; all chunks are locked since they were added to the group, so nothing could be
+ * written to them between the time they were added and the sync */
+static void hdd_delayed_fsync_group(chunk **grouptab,uint32_t groupcnt) {
+	uint32_t i;
+	chunk *c;
+	folder *f;
+	uint64_t ts,te;
+#ifdef HAVE_IO_URING
+	hdd_uring *r;
+	chunk *fsynctab[URING_ENTRIES];
+	int32_t res[URING_ENTRIES];
+	uint32_t fsynccnt;
+#endif
+
+	for (i=0 ; i<groupcnt ; i++) {
+		f = grouptab[i]->owner;
+		f->fsyncgroupcnt = 0;
+		f->fsyncgroupdone = 0;
+	}
+	for (i=0 ; i<groupcnt ; i++) {
+		grouptab[i]->owner->fsyncgroupcnt++;
+	}
+#ifdef HAVE_IO_URING
+	r = hdd_uring_get();
+	fsynccnt = 0;
+#endif
+	for (i=0 ; i<groupcnt ; i++) {
+		c = grouptab[i];
+		f = c->owner;
+		if (f->fsyncgroupcnt>=FsyncGroupMin) {
+			if (f->fsyncgroupdone==0) {
+				ts = monotonic_nseconds();
+				f->fsyncgrouperr = (syncfs(c->op->fd)<0)?errno:0;
+				te = monotonic_nseconds();
+				hdd_stats_datafsync(f,te-ts);
+				f->fsyncgroupdone = 1;
+				if (f->fsyncgrouperr!=0) {
+					errno = f->fsyncgrouperr;
+					mfs_arg_errlog_silent(LOG_WARNING,"hdd_delayed_ops: folder:%s - syncfs error",f->path);
+				}
+			}
+			if (f->fsyncgrouperr!=0) {
+				errno = f->fsyncgrouperr;
+				hdd_error_occured(c); // uses and preserves errno !!!
+				hdd_report_damaged_chunk(c);
+			}
+			c->op->fsyncneeded = 0;
+			hdd_chunk_release(c);
+			continue;
+		}
+#ifdef HAVE_IO_URING
+		if (r!=NULL) {
+			hdd_uring_prep_fsync(r,c->op->fd,fsynccnt);
+			fsynctab[fsynccnt++] = c;
+			if (hdd_uring_space(r)==0) {
+				hdd_delayed_fsync_batch(r,fsynctab,fsynccnt,res);
+				fsynccnt = 0;
+			}
+			continue;
+		}
+#endif
+		hdd_chunk_fsync(c);
+		hdd_chunk_release(c);
+	}
+#ifdef HAVE_IO_URING
+	if (fsynccnt>0) {
+		hdd_delayed_fsync_batch(r,fsynctab,fsynccnt,res);
+	}
+#endif
+}
+#endif
+
+/* closes descriptor of idle chunk (chunk:locked) - chunkopen is freed when crc block is not in memory */
+static void hdd_fdcache_close(chunk *c) {
+	char fname[PATH_MAX];
+
+	if (c->op->crcchanged && c->owner!=NULL) { // should never happened !!!
+		syslog(LOG_WARNING,"hdd_fdcache_close: CRC not flushed - writing now");
+		if (chunk_writecrc(c)!=MFS_STATUS_OK) {
+			hdd_error_occured(c);	// uses and preserves errno !!!
+			hdd_report_damaged_chunk(c);
+		} else {
+			c->op->crcchanged = 0;
+		}
+	}
+	if (close(c->op->fd)<0) {
+		hdd_error_occured(c);	// uses and preserves errno !!!
+		hdd_generate_filename(fname,c); // preserves errno !!!
+		mfs_arg_errlog_silent(LOG_WARNING,"hdd_fdcache_close: file:%s - close error",fname);
+		hdd_report_damaged_chunk(c);
+	}
+	c->op->fd = -1;
+	c->op->opento = 0.0;
+	if (c->op->cfd>=0) {
+		close(c->op->cfd);
+		c->op->cfd = -1;
+	}
+	zassert(pthread_mutex_lock(&fdcachelock));
+	hdd_fdlru_remove(c);
+	hdd_fdcache_closed();
+	zassert(pthread_mutex_unlock(&fdcachelock));
+	if (c->op->crc==NULL) {
+		free(c->op);
+		c->op = NULL;
+	}
+}
+
+/* frees crc block of idle chunk (chunk:locked) - chunkopen is freed when descriptor is closed */
+static void hdd_fdcache_freecrc(chunk *c) {
+	if (c->op->crcchanged) {
+		syslog(LOG_ERR,"serious error: crc changes lost (chunk:%016"PRIX64"_%08"PRIX32")",c->chunkid,c->version);
+	}
+	chunk_freecrc(c);
+	c->op->crcchanged = 0;
+	c->op->crcto = 0.0;
+	zassert(pthread_mutex_lock(&fdcachelock));
+	hdd_crclru_remove(c);
+	zassert(pthread_mutex_unlock(&fdcachelock));
+	if (c->op->fd<0) {
+		free(c->op);
+		c->op = NULL;
+	}
+}
+
+/* called before new chunk descriptor is opened (by thread that holds lock of its chunk) - when open files limit is reached
+ * then least recently used idle descriptors are closed (chunks waiting for fsync are left for delayed ops), when all of them
+ * are used then waits until some descriptor is closed */
+static void hdd_fdcache_reserve(void) {
+	uint64_t cids[FDCACHE_EVICT_TRIES];
+	uint32_t i,n;
+	uint8_t evicted;
+	chunk *c;
+
+	zassert(pthread_mutex_lock(&fdcachelock));
+	while (fdcount>=fdlimit) {
+		n = 0;
+		for (c=fdlruhead ; c!=NULL && n<FDCACHE_EVICT_TRIES ; c=c->op->fdnext) {
+			cids[n++] = c->chunkid;
+		}
+		zassert(pthread_mutex_unlock(&fdcachelock));
+		evicted = 0;
+		for (i=0 ; i<n && evicted==0 ; i++) {
+			c = hdd_chunk_tryfind(cids[i]);
+			if (c!=NULL && c!=CHUNKLOCKED) {
+				if (c->op!=NULL && c->op->crcrefcount==0 && c->op->fd>=0 && (c->op->fsyncneeded==0 || DoFsyncBeforeClose==0)) {
+					hdd_fdcache_close(c);
+					evicted = 1;
+				}
+				hdd_chunk_release(c);
+			}
+		}
+		zassert(pthread_mutex_lock(&fdcachelock));
+		if (evicted) {
+			stats_fdevict++;
+		} else if (fdcount>=fdlimit) {
+			fdwaiting++;
+			zassert(pthread_cond_wait(&fdcachecond,&fdcachelock));
+		}
+	}
+	fdcount++;
+	zassert(pthread_mutex_unlock(&fdcachelock));
+}
+
+// after failed open
+static void hdd_fdcache_unreserve(void) {
+	zassert(pthread_mutex_lock(&fdcachelock));
+	hdd_fdcache_closed();
+	zassert(pthread_mutex_unlock(&fdcachelock));
+}
+
+/* syncs idle chunks from fsync queue - chunks locked by other threads stay in queue for the next round */
+static void hdd_delayed_fsyncs(void) {
+	dopchunk *fq,*fqn,*fqkeep,**fqkeeptail;
+	chunk *c;
+#ifdef HAVE_IO_URING
+	hdd_uring *r;
+	chunk *fsynctab[URING_ENTRIES];
+	int32_t res[URING_ENTRIES];
+	uint32_t fsynccnt;
+#endif
+#ifdef HDD_FSYNC_GROUP
+	static chunk **grouptab = NULL;
+	uint32_t groupcnt;
+#endif
+
+	zassert(pthread_mutex_lock(&fdcachelock));
+	fq = fsyncqueue;
+	fsyncqueue = NULL;
+	zassert(pthread_mutex_unlock(&fdcachelock));
+	if (fq==NULL) {
+		return;
+	}
+#ifdef HAVE_IO_URING
+	r = DoFsyncBeforeClose?hdd_uring_get():NULL;
+	fsynccnt = 0;
+#endif
+#ifdef HDD_FSYNC_GROUP
+	if (grouptab==NULL) {
+		grouptab = malloc(sizeof(chunk*)*FSYNC_GROUP_MAX);
+		passert(grouptab);
+	}
+	groupcnt = 0;
+#endif
+	fqkeep = NULL;
+	fqkeeptail = &fqkeep;
+	for (; fq ; fq=fqn) {
+		fqn = fq->next;
+		c = hdd_chunk_tryfind(fq->chunkid);
+		if (c==CHUNKLOCKED) {	// locked chunk - try again in the next round
+			fq->next = NULL;
+			*fqkeeptail = fq;
+			fqkeeptail = &(fq->next);
+			continue;
+		}
+		free(fq);
+		if (c==NULL) {
+			continue;
+		}
+		// chunk used again, closed or already synced - when it becomes idle with unsynced data it will be queued again
+		if (c->op==NULL || c->op->crcrefcount>0 || c->op->fd<0 || c->op->fsyncneeded==0 || DoFsyncBeforeClose==0) {
+			hdd_chunk_release(c);
+			continue;
+		}
+#ifdef HDD_FSYNC_GROUP
+		if (FsyncGroupMin>0) {
+			// chunk stays locked until its group is synced
+			grouptab[groupcnt++] = c;
+			if (groupcnt==FSYNC_GROUP_MAX) {
+				hdd_delayed_fsync_group(grouptab,groupcnt);
+				groupcnt = 0;
+			}
+			continue;
+		}
+#endif
+#ifdef HAVE_IO_URING
+		if (r!=NULL) {
+			// chunk stays locked until the whole batch is done
+			hdd_uring_prep_fsync(r,c->op->fd,fsynccnt);
+			fsynctab[fsynccnt++] = c;
+			if (hdd_uring_space(r)==0) {
+				hdd_delayed_fsync_batch(r,fsynctab,fsynccnt,res);
+				fsynccnt = 0;
+			}
+			continue;
+		}
+#endif
+		hdd_chunk_fsync(c);
+		hdd_chunk_release(c);
+	}
+#ifdef HAVE_IO_URING
+	if (fsynccnt>0) {
+		hdd_delayed_fsync_batch(r,fsynctab,fsynccnt,res);
+	}
+#endif
+#ifdef HDD_FSYNC_GROUP
+	if (groupcnt>0) {
+		hdd_delayed_fsync_group(grouptab,groupcnt);
+	}
+#endif
+	if (fqkeep!=NULL) {
+		zassert(pthread_mutex_lock(&fdcachelock));
+		*fqkeeptail = fsyncqueue;
+		fsyncqueue = fqkeep;
+		zassert(pthread_mutex_unlock(&fdcachelock));
+	}
 }
 
-#if 0
-void hdd_test_show_openedchunks(void) {
-	dopchunk *cc,*tcc;
-	uint32_t dhashpos;
-	chunk *c;
+/* closes descriptors idle for too long (and least recently used ones when open files limit has been lowered) - only beginning of the list is checked */
+static void hdd_delayed_close(void) {
+	uint64_t cids[FDCACHE_BATCH];
+	uint32_t i,n,over,done;
 	double now;
+	chunk *c;
 
-	printf("lock doplock\n");
-	if (pthread_mutex_lock(&doplock)<0) {
-		printf("lock error: %u\n",errno);
-	}
-	printf("lock ndoplock\n");
-	if (pthread_mutex_lock(&ndoplock)<0) {
-		printf("lock error: %u\n",errno);
-	}
-/* append new chunks */
-	cc = newdopchunks;
-	while (cc) {
-		dhashpos = DHASHPOS(cc->chunkid);
-		for (tcc=dophashtab[dhashpos] ; tcc && tcc->chunkid!=cc->chunkid ; tcc=tcc->next) {}
-		if (tcc) {	// found - ignore
-			tcc = cc;
-			cc = cc->next;
-			free(tcc);
-		} else {	// not found - add
-			tcc = cc;
-			cc = cc->next;
-			tcc->next = dophashtab[dhashpos];
-			dophashtab[dhashpos] = tcc;
-		}
-	}
-	newdopchunks = NULL;
-	printf("unlock ndoplock\n");
-	if (pthread_mutex_unlock(&ndoplock)<0) {
-		printf("unlock error: %u\n",errno);
-	}
-/* show all */
-	now = monotonic_seconds();
-	for (dhashpos=0 ; dhashpos<DHASHSIZE ; dhashpos++) {
-		for (cc=dophashtab[dhashpos]; cc ; cc=cc->next) {
-			c = hdd_chunk_find(cc->chunkid);
-			if (c==NULL) {	// no chunk - delete entry
-				printf("id: %"PRIu64" - chunk doesn't exist\n",cc->chunkid);
-			} else if (c->crcrefcount>0) {	// io in progress - skip entry
-				printf("id: %"PRIu64" - chunk in use (refcount:%u)\n",cc->chunkid,c->crcrefcount);
-				hdd_chunk_release(c);
-			} else {
-#ifdef PRESERVE_BLOCK
-				double fdsec,crcsec,blocksec;
-				fdsec = c->opento;
-				crcsec = c->crcto;
-				blocksec = c->blockto;
-				if (fdsec>0.0) {
-					fdsec -= now;
-				}
-				if (crcsec>0.0) {
-					crcsec -= now;
-				}
-				if (blocksec>0.0) {
-					blocksec -= now;
-				}
-				printf("id: %"PRIu64" - fd:%d (delay:%.3lfs) crc:%p (delay:%.3lfs) block:%p,blockno:%u (delay:%.3lfs)\n",cc->chunkid,c->fd,fdsec,(void*)(c->crc),crcsec,c->block,c->blockno,blocksec);
-#else /* PRESERVE_BLOCK */
-				double fdsec,crcsec;
-				fdsec = c->opento;
-				crcsec = c->crcto;
-				if (fdsec>0.0) {
-					fdsec -= now;
-				}
-				if (crcsec>0.0) {
-					crcsec -= now;
+	do {
+		now = monotonic_seconds();
+		n = 0;
+		zassert(pthread_mutex_lock(&fdcachelock));
+		over = (fdcount>fdlimit)?fdcount-fdlimit:0;
+		for (c=fdlruhead ; c!=NULL && n<FDCACHE_BATCH && (c->op->opento<now || n<over) ; c=c->op->fdnext) {
+			cids[n++] = c->chunkid;
+		}
+		zassert(pthread_mutex_unlock(&fdcachelock));
+		done = 0;
+		for (i=0 ; i<n ; i++) {
+			c = hdd_chunk_tryfind(cids[i]);
+			if (c!=NULL && c!=CHUNKLOCKED) {
+				if (c->op!=NULL && c->op->crcrefcount==0 && c->op->fd>=0 && (c->op->opento<now || i<over)) {
+					if (c->op->fsyncneeded && DoFsyncBeforeClose) {
+						hdd_chunk_fsync(c);
+					}
+					hdd_fdcache_close(c);
+					done++;
 				}
-				printf("id: %"PRIu64" - fd:%d (delay:%.3lfs) crc:%p (delay:%.3lfs)\n",cc->chunkid,c->fd,fdsec,(void*)(c->crc),crcsec);
-#endif /* PRESERVE_BLOCK */
 				hdd_chunk_release(c);
 			}
 		}
-	}
-	printf("unlock doplock\n");
-	if (pthread_mutex_unlock(&doplock)<0) {
-		printf("unlock error: %u\n",errno);
-	}
+	} while (n==FDCACHE_BATCH && done>0);
 }
-#endif
 
-void hdd_delayed_ops() {
-	dopchunk **ccp,*cc,*tcc;
-	uint32_t dhashpos;
+/* frees crc blocks idle for too long */
+static void hdd_delayed_freecrc(void) {
+	uint64_t cids[FDCACHE_BATCH];
+	uint32_t i,n,done;
+	double now;
 	chunk *c;
-	uint64_t ts,te;
-	char fname[PATH_MAX];
-//	int status;
 
-//	printf("delayed ops: before lock\n");
-	zassert(pthread_mutex_lock(&doplock));
-	zassert(pthread_mutex_lock(&ndoplock));
-//	printf("delayed ops: after lock\n");
-/* append new chunks */
-	cc = newdopchunks;
-	while (cc) {
-		dhashpos = DHASHPOS(cc->chunkid);
-		for (tcc=dophashtab[dhashpos] ; tcc && tcc->chunkid!=cc->chunkid ; tcc=tcc->next) {}
-		if (tcc) {	// found - ignore
-			tcc = cc;
-			cc = cc->next;
-			free(tcc);
-		} else {	// not found - add
-			tcc = cc;
-			cc = cc->next;
-			tcc->next = dophashtab[dhashpos];
-			dophashtab[dhashpos] = tcc;
-		}
-	}
-	newdopchunks = NULL;
-	zassert(pthread_mutex_unlock(&ndoplock));
-/* check all */
-//	printf("delayed ops: before loop\n");
-	for (dhashpos=0 ; dhashpos<DHASHSIZE ; dhashpos++) {
-		ccp = dophashtab+dhashpos;
-		while ((cc=*ccp)) {
-//			printf("find chunk: %llu\n",cc->chunkid);
-			c = hdd_chunk_tryfind(cc->chunkid);
-//			if (c!=NULL && c!=CHUNKLOCKED) {
-//				printf("found chunk: %llu (c->state:%u c->crcrefcount:%u)\n",cc->chunkid,c->state,c->crcrefcount);
-//			}
-//			c = hdd_chunk_find(cc->chunkid);
-			if (c==NULL) {	// no chunk - delete entry
-				*ccp = cc->next;
-				free(cc);
-			} else if (c==CHUNKLOCKED) {	// locked chunk - just ignore
-				ccp = &(cc->next);
-			} else if (c->crcrefcount>0) {	// io in progress - skip entry
-				hdd_chunk_release(c);
-				ccp = &(cc->next);
-			} else {
-				double now;
-				if (c->fd>=0 && c->fsyncneeded && DoFsyncBeforeClose) {
-					ts = monotonic_nseconds();
-#ifdef F_FULLFSYNC
-					if (fcntl(c->fd,F_FULLFSYNC)<0) {
-						hdd_error_occured(c); // uses and preserves errno !!!
-						hdd_generate_filename(fname,c); // preserves errno !!!
-						mfs_arg_errlog_silent(LOG_WARNING,"hdd_delayed_ops: file:%s - fsync (via fcntl) error",fname);
-						hdd_report_damaged_chunk(c);
-					}
-#else
-					if (fsync(c->fd)<0) {
-						hdd_error_occured(c); // uses and preserves errno !!!
-						hdd_generate_filename(fname,c); // preserves errno !!!
-						mfs_arg_errlog_silent(LOG_WARNING,"hdd_delayed_ops: file:%s - fsync (direct call) error",fname);
-						hdd_report_damaged_chunk(c);
-					}
-#endif
-					te = monotonic_nseconds();
-					hdd_stats_datafsync(c->owner,te-ts);
-					c->fsyncneeded = 0;
-				}
-				now = monotonic_seconds();
-#ifdef PRESERVE_BLOCK
-//				printf("block\n");
-				if (c->block!=NULL && c->blockto<now) {
-# ifdef MMAP_ALLOC
-					munmap((void*)(c->block),MFSBLOCKSIZE);
-# else
-					free(c->block);
-# endif
-					c->block = NULL;
-					c->blockno = 0xFFFF;
-					c->blockto = 0.0;
-				}
-#endif /* PRESERVE_BLOCK */
-//				printf("descriptor\n");
-				if (c->fd>=0 && c->opento<now) {
-					if (c->crcchanged && c->owner!=NULL) { // should never happened !!!
-						syslog(LOG_WARNING,"hdd_delayed_ops: CRC not flushed - writing now");
-						if (chunk_writecrc(c)!=MFS_STATUS_OK) {
-							hdd_error_occured(c);	// uses and preserves errno !!!
-							hdd_report_damaged_chunk(c);
-						} else {
-							c->crcchanged = 0;
-						}
-					}
-					if (close(c->fd)<0) {
-						hdd_error_occured(c);	// uses and preserves errno !!!
-						hdd_generate_filename(fname,c); // preserves errno !!!
-						mfs_arg_errlog_silent(LOG_WARNING,"hdd_delayed_ops: file:%s - close error",fname);
-						hdd_report_damaged_chunk(c);
-					}
-					c->fd = -1;
-					c->opento = 0.0;
-					hdd_open_files_handle(OF_AFTER_CLOSE);
-				}
-//				printf("crc\n");
-				if (c->crc!=NULL && c->crcto<now) {
-					if (c->crcchanged) {
-						syslog(LOG_ERR,"serious error: crc changes lost (chunk:%016"PRIX64"_%08"PRIX32")",c->chunkid,c->version);
-					}
-//					printf("chunk %llu - free crc record\n",c->chunkid);
-					chunk_freecrc(c);
-					c->crcchanged = 0;
-					c->crcto = 0.0;
-				}
-#ifdef PRESERVE_BLOCK
-				if (c->fd<0 && c->crc==NULL && c->block==NULL) {
-#else /* PRESERVE_BLOCK */
-				if (c->fd<0 && c->crc==NULL) {
-#endif /* PRESERVE_BLOCK */
-					*ccp = cc->next;
-					free(cc);
-				} else {
-					ccp = &(cc->next);
+	do {
+		now = monotonic_seconds();
+		n = 0;
+		zassert(pthread_mutex_lock(&fdcachelock));
+		for (c=crclruhead ; c!=NULL && n<FDCACHE_BATCH && c->op->crcto<now ; c=c->op->crcnext) {
+			cids[n++] = c->chunkid;
+		}
+		zassert(pthread_mutex_unlock(&fdcachelock));
+		done = 0;
+		for (i=0 ; i<n ; i++) {
+			c = hdd_chunk_tryfind(cids[i]);
+			if (c!=NULL && c!=CHUNKLOCKED) {
+				if (c->op!=NULL && c->op->crcrefcount==0 && c->op->crc!=NULL && c->op->crcto<now) {
+					hdd_fdcache_freecrc(c);
+					done++;
 				}
 				hdd_chunk_release(c);
 			}
 		}
-	}
-//	printf("delayed ops: after loop , before unlock\n");
+	} while (n==FDCACHE_BATCH && done>0);
+}
+
+void hdd_delayed_ops() {
+	zassert(pthread_mutex_lock(&doplock));
+	hdd_delayed_fsyncs();
+	hdd_delayed_close();
+	hdd_delayed_freecrc();
 	zassert(pthread_mutex_unlock(&doplock));
-//	printf("delayed ops: after unlock\n");
 }
 
 static int hdd_io_begin(chunk *c,int mode) {
-	dopchunk *cc;
 	char fname[PATH_MAX];
 	int status;
 	int add;
+	uint8_t opened;
 
 //	sassert(c->state==CH_LOCKED);
 
 //	syslog(LOG_NOTICE,"chunk: %"PRIu64" - before io",c->chunkid);
 	hdd_chunk_testmove(c);
-	if (c->crcrefcount==0) {
+	if (c->op==NULL) {
+		c->op = hdd_chunkopen_new();
+	}
+	if (c->op->crcrefcount==0) {
 		hdd_generate_filename(fname,c);
-#ifdef PRESERVE_BLOCK
-		add = (c->fd<0 && c->crc==NULL && c->block==NULL);
-#else /* PRESERVE_BLOCK */
-		add = (c->fd<0 && c->crc==NULL);
-#endif /* PRESERVE_BLOCK */
-		if (c->fd<0) {
-			hdd_open_files_handle(OF_BEFORE_OPEN);
+		add = (c->op->fd<0 && c->op->crc==NULL);
+		opened = 0;
+		if (c->op->fd<0) {
+			hdd_fdcache_reserve();
 			if (mode==MODE_NEW) {
-				c->fd = open(fname,O_RDWR | O_CREAT | O_EXCL,0666);
+				c->op->fd = open(fname,O_RDWR | O_CREAT | O_EXCL,0666);
 			} else {
 				if (c->owner->markforremoval!=MFR_READONLY) {
-					c->fd = open(fname,O_RDWR);
+					c->op->fd = open(fname,O_RDWR);
 				} else {
-					c->fd = open(fname,O_RDONLY);
+					c->op->fd = open(fname,O_RDONLY);
 				}
 			}
-			if (c->fd<0) {
+			if (c->op->fd<0) {
 				int errmem = errno;
 				mfs_arg_errlog_silent(LOG_WARNING,"hdd_io_begin: file:%s - open error",fname);
-				hdd_open_files_handle(OF_AFTER_CLOSE);
+				hdd_fdcache_unreserve();
+				if (add) {
+					free(c->op);
+					c->op = NULL;
+				}
 				errno = errmem;
 				return MFS_ERROR_IO;
 			}
-			c->fsyncneeded = 0;
+			c->op->fsyncneeded = 0;
+			opened = 1;
 		}
-		if (c->crc==NULL) {
+		if (c->op->crc==NULL) {
 			if (mode==MODE_NEW) {
 				chunk_emptycrc(c);
 			} else {
 				status = chunk_readcrc(c,mode);
 				if (status!=MFS_STATUS_OK) {
 					int errmem = errno;
+					if (opened) {
+						close(c->op->fd);
+						c->op->fd = -1;
+						hdd_fdcache_unreserve();
+					}
 					if (add) {
-						close(c->fd);
-						c->fd=-1;
-						hdd_open_files_handle(OF_AFTER_CLOSE);
+						free(c->op);
+						c->op = NULL;
 					}
 					mfs_arg_errlog_silent(LOG_WARNING,"hdd_io_begin: file:%s - read error",fname);
 					errno = errmem;
 					return status;
 				}
 			}
-			c->crcchanged = 0;
+			c->op->crcchanged = 0;
 		}
-#ifdef PRESERVE_BLOCK
-		if (c->block==NULL) {
-# ifdef MMAP_ALLOC
-			c->block = (uint8_t*)mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
-			c->block = (uint8_t*)malloc(MFSBLOCKSIZE);
-# endif
-//			syslog(LOG_WARNING,"chunk: %016"PRIX64", block:%p",c->chunkid,c->block);
-			passert(c->block);
-			c->blockno = 0xFFFF;
-		}
-#endif /* PRESERVE_BLOCK */
-		if (add) {
-			cc = malloc(sizeof(dopchunk));
-			passert(cc);
-			cc->chunkid = c->chunkid;
-			zassert(pthread_mutex_lock(&ndoplock));
-			cc->next = newdopchunks;
-			newdopchunks = cc;
-			zassert(pthread_mutex_unlock(&ndoplock));
-		}
-	}
-	c->crcrefcount++;
+		hdd_fdcache_busy(c,opened^1);
+	}
+	c->op->crcrefcount++;
 	errno = 0;
 	return MFS_STATUS_OK;
 }
@@ -2632,22 +4961,17 @@ static int hdd_io_begin(chunk *c,int mode) {
 static int hdd_io_end(chunk *c) {
 	int status;
 
-	if (c->crcchanged) {
+	if (c->op->crcchanged) {
 		status = chunk_writecrc(c);
-		c->crcchanged = 0;
+		c->op->crcchanged = 0;
 		if (status!=MFS_STATUS_OK) {
 			return status;
 		}
-		c->fsyncneeded = 1;
+		c->op->fsyncneeded = 1;
 	}
-	c->crcrefcount--;
-	if (c->crcrefcount==0) {
-		double now = monotonic_seconds();
-		c->opento = now + OPEN_DELAY;
-		c->crcto = now + CRC_DELAY;
-#ifdef PRESERVE_BLOCK
-		c->blockto = now + BLOCK_DELAY;
-#endif
+	c->op->crcrefcount--;
+	if (c->op->crcrefcount==0) {
+		hdd_fdcache_idle(c);
 	}
 	errno = 0;
 	return MFS_STATUS_OK;
@@ -2761,7 +5085,7 @@ int hdd_close(uint64_t chunkid) {
 
 static void hdd_sequential_mode_int(chunk *c) {
 #if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
-	posix_fadvise(c->fd,c->hdrsize+CHUNKCRCSIZE,0,POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(c->op->fd,c->hdrsize+CHUNKCRCSIZE,0,POSIX_FADV_SEQUENTIAL);
 #else
 	(void)c;
 #endif
@@ -2769,54 +5093,60 @@ static void hdd_sequential_mode_int(chunk *c) {
 
 static void hdd_drop_caches_int(chunk *c) {
 #if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
-	posix_fadvise(c->fd,0,0,POSIX_FADV_DONTNEED);
+	posix_fadvise(c->op->fd,0,0,POSIX_FADV_DONTNEED);
 #else
 	(void)c;
 #endif
 }
 
 void hdd_precache_data(uint64_t chunkid,uint32_t offset,uint32_t size) {
-#if defined(HAVE_POSIX_FADVISE)	&& (defined(POSIX_FADV_WILLNEED) || defined(POSIX_FADV_SEQUENTIAL))
 	chunk *c;
 	c = hdd_chunk_find(chunkid);
 	if (c==NULL) {
 		return;
 	}
+	if (c->op==NULL || c->op->fd<0) {
+		hdd_chunk_release(c);
+		return;
+	}
+	if (hdd_rcache_access(c)==0) { // data will be read from hdd
+#if defined(HAVE_POSIX_FADVISE)	&& (defined(POSIX_FADV_WILLNEED) || defined(POSIX_FADV_SEQUENTIAL))
 #  ifdef POSIX_FADV_SEQUENTIAL
-	posix_fadvise(c->fd,c->hdrsize+CHUNKCRCSIZE+offset,size,POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(c->op->fd,c->hdrsize+CHUNKCRCSIZE+offset,size,POSIX_FADV_SEQUENTIAL);
 #  endif
 #  ifdef POSIX_FADV_WILLNEED
-	posix_fadvise(c->fd,c->hdrsize+CHUNKCRCSIZE+offset,size,POSIX_FADV_WILLNEED);
+		posix_fadvise(c->op->fd,c->hdrsize+CHUNKCRCSIZE+offset,size,POSIX_FADV_WILLNEED);
 #  endif
-	hdd_chunk_release(c);
 #else
-	(void)chunkid;
-	(void)offset;
-	(void)size;
+		(void)offset;
+		(void)size;
 #endif
+	}
+	hdd_chunk_release(c);
 }
 
 int hdd_read(uint64_t chunkid,uint32_t version,uint16_t blocknum,uint8_t *buffer,uint32_t offset,uint32_t size,uint8_t *crcbuff) {
 	chunk *c;
 	int ret;
 	int error;
+	int fd;
+	uint64_t dataoff;
 	const uint8_t *rcrcptr;
 	uint32_t crc,bcrc,precrc,postcrc,combinedcrc;
 	uint64_t ts,te;
 	char fname[PATH_MAX];
-#ifndef PRESERVE_BLOCK
+	bcentry *be;
 	uint8_t *blockbuffer;
 	blockbuffer = pthread_getspecific(blockbufferkey);
 	if (blockbuffer==NULL) {
-# ifdef MMAP_ALLOC
+#ifdef MMAP_ALLOC
 		blockbuffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
+#else
 		blockbuffer = malloc(MFSBLOCKSIZE);
-# endif
+#endif
 		passert(blockbuffer);
 		zassert(pthread_setspecific(blockbufferkey,blockbuffer));
 	}
-#endif /* PRESERVE_BLOCK */
 	c = hdd_chunk_find(chunkid);
 	if (c==NULL) {
 		return MFS_ERROR_NOCHUNK;
@@ -2848,27 +5178,55 @@ int hdd_read(uint64_t chunkid,uint32_t version,uint16_t blocknum,uint8_t *buffer
 		hdd_chunk_release(c);
 		return MFS_STATUS_OK;
 	}
-	if (offset==0 && size==MFSBLOCKSIZE) {
-#ifdef PRESERVE_BLOCK
-		if (c->blockno==blocknum) {
-			memcpy(buffer,c->block,MFSBLOCKSIZE);
-			ret = MFSBLOCKSIZE;
-			error = 0;
+	be = hdd_bcache_get(chunkid,c->version,blocknum);
+	if (be!=NULL) { // cached blocks have been already verified
+		if (offset==0 && size==MFSBLOCKSIZE) {
+			memcpy(buffer,be->data,MFSBLOCKSIZE);
+			rcrcptr = (c->op->crc)+(4*blocknum);
+			crc = get32bit(&rcrcptr);
 		} else {
-#endif /* PRESERVE_BLOCK */
-		ts = monotonic_nseconds();
-		ret = mypread(c->fd,buffer,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
-		error = errno;
-		te = monotonic_nseconds();
-		hdd_stats_dataread(c->owner,MFSBLOCKSIZE,te-ts);
-#ifdef PRESERVE_BLOCK
-			c->blockno = blocknum;
-			memcpy(c->block,buffer,MFSBLOCKSIZE);
-		}
-#endif /* PRESERVE_BLOCK */
-		crc = mycrc32(0,buffer,MFSBLOCKSIZE);
-		rcrcptr = (c->crc)+(4*blocknum);
-		bcrc = get32bit(&rcrcptr);
+			memcpy(buffer,be->data+offset,size);
+			crc = mycrc32(0,buffer,size);
+		}
+		hdd_bcache_release(be);
+		put32bit(&crcbuff,crc);
+		hdd_chunk_release(c);
+		return MFS_STATUS_OK;
+	}
+	rcrcptr = (c->op->crc)+(4*blocknum);
+	bcrc = get32bit(&rcrcptr);
+	if (offset==0 && size==MFSBLOCKSIZE) {
+		do {
+			fd = hdd_rcache_datafd(c,&dataoff);
+			ts = monotonic_nseconds();
+			if (bcrc==emptyblockcrc && hdd_range_is_hole(fd,dataoff+(((uint32_t)blocknum)<<MFSBLOCKBITS),MFSBLOCKSIZE)) {
+				memset(buffer,0,MFSBLOCKSIZE);
+				hdd_stats_hole(HSC_HOLESKIP,MFSBLOCKSIZE);
+				ret = MFSBLOCKSIZE;
+				error = 0;
+				crc = emptyblockcrc;
+				break;
+			}
+			ret = mypread(fd,buffer,MFSBLOCKSIZE,dataoff+(((uint32_t)blocknum)<<MFSBLOCKBITS));
+			error = errno;
+			te = monotonic_nseconds();
+			crc = mycrc32(0,buffer,MFSBLOCKSIZE);
+			if (fd==c->op->fd) {
+				hdd_stats_dataread(c->owner,MFSBLOCKSIZE,te-ts);
+			} else if (ret!=MFSBLOCKSIZE || bcrc!=crc) {
+				hdd_rcache_drop(c); // bad copy in read cache - read block from chunk file
+				fd = -1;
+			}
+		} while (fd<0);
+		if (ret!=MFSBLOCKSIZE) {
+			errno = error;
+			hdd_error_occured(c);	// uses and preserves errno !!!
+			hdd_generate_filename(fname,c); // preserves errno !!!
+			mfs_arg_errlog_silent(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - read error",fname,blocknum);
+			hdd_report_damaged_chunk(c);
+			hdd_chunk_release(c);
+			return MFS_ERROR_IO;
+		}
 		if (bcrc!=crc) {
 			errno = error;
 			hdd_error_occured(c);	// uses and preserves errno !!!
@@ -2876,84 +5234,434 @@ int hdd_read(uint64_t chunkid,uint32_t version,uint16_t blocknum,uint8_t *buffer
 			syslog(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - crc error (data crc: %08"PRIX32" ; check crc: %08"PRIX32")",fname,blocknum,crc,bcrc);
 			hdd_report_damaged_chunk(c);
 			hdd_chunk_release(c);
-			return MFS_ERROR_CRC;
+			return MFS_ERROR_CRC;
+		}
+		hdd_bcache_put(chunkid,c->version,blocknum,buffer);
+	} else {
+		do {
+			fd = hdd_rcache_datafd(c,&dataoff);
+			ts = monotonic_nseconds();
+			if (bcrc==emptyblockcrc && hdd_range_is_hole(fd,dataoff+(((uint32_t)blocknum)<<MFSBLOCKBITS),MFSBLOCKSIZE)) {
+				memset(blockbuffer,0,MFSBLOCKSIZE);
+				hdd_stats_hole(HSC_HOLESKIP,MFSBLOCKSIZE);
+				ret = MFSBLOCKSIZE;
+				error = 0;
+				precrc = postcrc = 0; // used only in crc error message
+				crc = mycrc32_zeroblock(0,size);
+				combinedcrc = emptyblockcrc;
+				break;
+			}
+			ret = mypread(fd,blockbuffer,MFSBLOCKSIZE,dataoff+(((uint32_t)blocknum)<<MFSBLOCKBITS));
+			error = errno;
+			te = monotonic_nseconds();
+//			crc = mycrc32(0,blockbuffer+offset,size);	// first calc crc for piece
+			precrc = mycrc32(0,blockbuffer,offset);
+			crc = mycrc32(0,blockbuffer+offset,size);
+			postcrc = mycrc32(0,blockbuffer+offset+size,MFSBLOCKSIZE-(offset+size));
+			if (offset==0) {
+				combinedcrc = mycrc32_combine(crc,postcrc,MFSBLOCKSIZE-(offset+size));
+			} else {
+				combinedcrc = mycrc32_combine(precrc,crc,size);
+				if ((offset+size)<MFSBLOCKSIZE) {
+					combinedcrc = mycrc32_combine(combinedcrc,postcrc,MFSBLOCKSIZE-(offset+size));
+				}
+			}
+			if (fd==c->op->fd) {
+				hdd_stats_dataread(c->owner,MFSBLOCKSIZE,te-ts);
+			} else if (ret!=MFSBLOCKSIZE || bcrc!=combinedcrc) {
+				hdd_rcache_drop(c); // bad copy in read cache - read block from chunk file
+				fd = -1;
+			}
+		} while (fd<0);
+//		if (bcrc!=mycrc32(0,blockbuffer,MFSBLOCKSIZE)) {
+		if (ret!=MFSBLOCKSIZE) {
+			errno = error;
+			hdd_error_occured(c);	// uses and preserves errno !!!
+			hdd_generate_filename(fname,c); // preserves errno !!!
+			mfs_arg_errlog_silent(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - read error",fname,blocknum);
+			hdd_report_damaged_chunk(c);
+			hdd_chunk_release(c);
+			return MFS_ERROR_IO;
+		}
+		if (bcrc!=combinedcrc) {
+			errno = error;
+			hdd_error_occured(c);	// uses and preserves errno !!!
+			hdd_generate_filename(fname,c);
+			syslog(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - crc error (data crc: %08"PRIX32" (0:%"PRIu32" - %08"PRIX32" ; %"PRIu32":%"PRIu32" - %08"PRIX32" ; %"PRIu32":%u - %08"PRIX32") ; check crc: %08"PRIX32")",fname,blocknum,combinedcrc,offset,precrc,offset,size,crc,offset+size,MFSBLOCKSIZE-(offset+size),postcrc,bcrc);
+			hdd_report_damaged_chunk(c);
+			hdd_chunk_release(c);
+			return MFS_ERROR_CRC;
+		}
+		hdd_bcache_put(chunkid,c->version,blocknum,blockbuffer);
+		memcpy(buffer,blockbuffer+offset,size);
+	}
+	put32bit(&crcbuff,crc);
+	hdd_chunk_release(c);
+	return MFS_STATUS_OK;
+}
+
+static inline uint8_t* hdd_get_threadbuffer(pthread_key_t key) {
+	uint8_t *buffer;
+	buffer = pthread_getspecific(key);
+	if (buffer==NULL) {
+#ifdef MMAP_ALLOC
+		buffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
+#else
+		buffer = malloc(MFSBLOCKSIZE);
+#endif
+		passert(buffer);
+		zassert(pthread_setspecific(key,buffer));
+	}
+	return buffer;
+}
+
+/* multi-block read - chunk is found and locked once, all blocks are read by one preadv and checked in one pass
+ * range can't cross chunk boundary and can't contain more than HDD_READ_RANGE_MAXBLOCKS blocks
+ * for each block in range buffers[i] receives requested part of the block and crcbuffs[i] crc of this part
+ * ranges within one block are read by hdd_read (block cache), longer ranges bypass the cache (big sequential reads would only flush it)
+ * in both cases blocks stored as holes are returned as zeros without reading them from disk */
+int hdd_read_range(uint64_t chunkid,uint32_t version,uint32_t offset,uint32_t size,uint8_t * const *buffers,uint8_t * const *crcbuffs) {
+	chunk *c;
+	int ret;
+	int error;
+	struct iovec iov[HDD_READ_RANGE_MAXBLOCKS];
+	const uint8_t *rcrcptr;
+	uint8_t *wcrcptr;
+	uint8_t *bb;
+	uint32_t crc,bcrc,precrc,postcrc,combinedcrc;
+	uint32_t i,blocks,rblocks,boffset,bsize;
+	uint16_t firstblock;
+	uint64_t ts,te;
+	uint64_t dataoff;
+	int fd;
+	char fname[PATH_MAX];
+	uint8_t *firstbuffer,*lastbuffer;
+
+	if (size==0 || size>MFSCHUNKSIZE) {
+		return MFS_ERROR_WRONGSIZE;
+	}
+	if (offset>=MFSCHUNKSIZE || offset+size>MFSCHUNKSIZE) {
+		return MFS_ERROR_WRONGOFFSET;
+	}
+	firstblock = offset>>MFSBLOCKBITS;
+	blocks = ((offset+size-1)>>MFSBLOCKBITS) - firstblock + 1;
+	if (blocks>HDD_READ_RANGE_MAXBLOCKS) {
+		return MFS_ERROR_WRONGSIZE;
+	}
+	if (blocks==1) { // small reads - use block cache
+		return hdd_read(chunkid,version,firstblock,buffers[0],offset&MFSBLOCKMASK,size,crcbuffs[0]);
+	}
+	firstbuffer = hdd_get_threadbuffer(blockbufferkey);
+	lastbuffer = hdd_get_threadbuffer(rangebufferkey);
+	c = hdd_chunk_find(chunkid);
+	if (c==NULL) {
+		return MFS_ERROR_NOCHUNK;
+	}
+	if (c->version!=version && version>0) {
+		hdd_chunk_release(c);
+		return MFS_ERROR_WRONGVERSION;
+	}
+	if (firstblock+blocks<=c->blocks) {
+		rblocks = blocks;
+	} else if (firstblock<c->blocks) {
+		rblocks = c->blocks - firstblock;
+	} else {
+		rblocks = 0;
+	}
+	for (i=0 ; i<blocks ; i++) {
+		boffset = (i==0)?(offset&MFSBLOCKMASK):0;
+		bsize = (i+1==blocks)?(((offset+size-1)&MFSBLOCKMASK)+1-boffset):(MFSBLOCKSIZE-boffset);
+		if (i<rblocks) {
+			if (boffset==0 && bsize==MFSBLOCKSIZE) {
+				iov[i].iov_base = buffers[i];
+			} else {
+				iov[i].iov_base = (i==0)?firstbuffer:lastbuffer;
+			}
+			iov[i].iov_len = MFSBLOCKSIZE;
+		} else { // blocks after the end of chunk
+			memset(buffers[i],0,bsize);
+			if (bsize==MFSBLOCKSIZE) {
+				crc = emptyblockcrc;
+			} else {
+				crc = mycrc32_zeroblock(0,bsize);
+			}
+			wcrcptr = crcbuffs[i];
+			put32bit(&wcrcptr,crc);
+		}
+	}
+	if (rblocks>0) { // whole range stored as hole - nothing to read
+		rcrcptr = (c->op->crc)+(4*firstblock);
+		for (i=0 ; i<rblocks ; i++) {
+			bcrc = get32bit(&rcrcptr);
+			if (bcrc!=emptyblockcrc) {
+				break;
+			}
+		}
+		if (i==rblocks) {
+			fd = hdd_rcache_datafd(c,&dataoff);
+			if (hdd_range_is_hole(fd,dataoff+(((uint32_t)firstblock)<<MFSBLOCKBITS),rblocks<<MFSBLOCKBITS)) {
+				for (i=0 ; i<rblocks ; i++) {
+					boffset = (i==0)?(offset&MFSBLOCKMASK):0;
+					bsize = (i+1==blocks)?(((offset+size-1)&MFSBLOCKMASK)+1-boffset):(MFSBLOCKSIZE-boffset);
+					memset(buffers[i],0,bsize);
+					if (bsize==MFSBLOCKSIZE) {
+						crc = emptyblockcrc;
+					} else {
+						crc = mycrc32_zeroblock(0,bsize);
+					}
+					wcrcptr = crcbuffs[i];
+					put32bit(&wcrcptr,crc);
+				}
+				hdd_stats_hole(HSC_HOLESKIP,rblocks<<MFSBLOCKBITS);
+				rblocks = 0;
+			}
+		}
+	}
+	if (rblocks>0) {
+		do {
+			fd = hdd_rcache_datafd(c,&dataoff);
+			ts = monotonic_nseconds();
+			ret = mypreadv(fd,iov,rblocks,dataoff+(((uint32_t)firstblock)<<MFSBLOCKBITS));
+			error = errno;
+			te = monotonic_nseconds();
+			if (fd==c->op->fd) {
+				hdd_stats_dataread(c->owner,rblocks*MFSBLOCKSIZE,te-ts);
+				if (ret!=(int)(rblocks*MFSBLOCKSIZE)) { // short read - don't check crc of data that hasn't been read
+					errno = error;
+					hdd_error_occured(c);	// uses and preserves errno !!!
+					hdd_generate_filename(fname,c); // preserves errno !!!
+					mfs_arg_errlog_silent(LOG_WARNING,"read_block_from_chunk: file: %s ; blocks: %"PRIu16"-%"PRIu32" - read error",fname,firstblock,firstblock+rblocks-1);
+					hdd_report_damaged_chunk(c);
+					hdd_chunk_release(c);
+					return MFS_ERROR_IO;
+				}
+			} else if (ret!=(int)(rblocks*MFSBLOCKSIZE)) {
+				hdd_rcache_drop(c); // bad copy in read cache - read blocks from chunk file
+				fd = -1;
+			}
+			for (i=0 ; i<rblocks && fd>=0 ; i++) {
+				boffset = (i==0)?(offset&MFSBLOCKMASK):0;
+				bsize = (i+1==blocks)?(((offset+size-1)&MFSBLOCKMASK)+1-boffset):(MFSBLOCKSIZE-boffset);
+				rcrcptr = (c->op->crc)+(4*(firstblock+i));
+				bcrc = get32bit(&rcrcptr);
+				bb = iov[i].iov_base;
+				if (boffset==0 && bsize==MFSBLOCKSIZE) {
+					crc = mycrc32(0,bb,MFSBLOCKSIZE);
+					combinedcrc = crc;
+					precrc = 0;
+					postcrc = 0;
+				} else {
+					precrc = mycrc32(0,bb,boffset);
+					crc = mycrc32(0,bb+boffset,bsize);
+					postcrc = mycrc32(0,bb+boffset+bsize,MFSBLOCKSIZE-(boffset+bsize));
+					if (boffset==0) {
+						combinedcrc = mycrc32_combine(crc,postcrc,MFSBLOCKSIZE-(boffset+bsize));
+					} else {
+						combinedcrc = mycrc32_combine(precrc,crc,bsize);
+						if ((boffset+bsize)<MFSBLOCKSIZE) {
+							combinedcrc = mycrc32_combine(combinedcrc,postcrc,MFSBLOCKSIZE-(boffset+bsize));
+						}
+					}
+				}
+				if (bcrc!=combinedcrc) {
+					if (fd!=c->op->fd) {
+						hdd_rcache_drop(c); // bad copy in read cache - read blocks from chunk file
+						fd = -1;
+						break;
+					}
+					errno = error;
+					hdd_error_occured(c);	// uses and preserves errno !!!
+					hdd_generate_filename(fname,c);
+					syslog(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu32" - crc error (data crc: %08"PRIX32" (0:%"PRIu32" - %08"PRIX32" ; %"PRIu32":%"PRIu32" - %08"PRIX32" ; %"PRIu32":%"PRIu32" - %08"PRIX32") ; check crc: %08"PRIX32")",fname,firstblock+i,combinedcrc,boffset,precrc,boffset,bsize,crc,boffset+bsize,MFSBLOCKSIZE-(boffset+bsize),postcrc,bcrc);
+					hdd_report_damaged_chunk(c);
+					hdd_chunk_release(c);
+					return MFS_ERROR_CRC;
+				}
+				if (bb!=buffers[i]) {
+					memcpy(buffers[i],bb+boffset,bsize);
+				}
+				wcrcptr = crcbuffs[i];
+				put32bit(&wcrcptr,crc);
+			}
+		} while (fd<0);
+	}
+	hdd_chunk_release(c);
+	return MFS_STATUS_OK;
+}
+
+uint8_t hdd_sendfile_enabled(void) {
+	uint8_t mode;
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	mode = __sync_or_and_fetch(&SendfileMode,0);
+#else
+	pthread_mutex_lock(&cfglock);
+	mode = SendfileMode;
+	pthread_mutex_unlock(&cfglock);
+#endif
+	return (mode>0)?1:0;
+}
+
+/* full block read without copying data through user space - returns descriptor and position of block data to be used by sendfile
+ * descriptor is a private copy (dup) of chunk descriptor, so chunk can be closed, moved or deleted before block is sent - it has to be given back by hdd_read_sendfile_end
+ * chunk has to be opened (hdd_open), MFS_ERROR_ENOTSUP means that standard hdd_read should be used
+ * in mode 1 block is checked on page cache mapping, in mode 2 checking is left for client (and chunk tester) */
+int hdd_read_sendfile_prepare(uint64_t chunkid,uint32_t version,uint16_t blocknum,int *fd,uint64_t *fileoffset,uint8_t *crcbuff) {
+	chunk *c;
+	const uint8_t *rcrcptr;
+	uint32_t crc,bcrc;
+	uint64_t foffset;
+	uint8_t mode;
+	struct stat sb;
+	uint8_t *map;
+	uint32_t pgoff;
+	uint64_t ts,te;
+	char fname[PATH_MAX];
+
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	mode = __sync_or_and_fetch(&SendfileMode,0);
+#else
+	pthread_mutex_lock(&cfglock);
+	mode = SendfileMode;
+	pthread_mutex_unlock(&cfglock);
+#endif
+	if (mode==0) {
+		return MFS_ERROR_ENOTSUP;
+	}
+	c = hdd_chunk_find(chunkid);
+	if (c==NULL) {
+		return MFS_ERROR_NOCHUNK;
+	}
+	if (c->version!=version && version>0) {
+		hdd_chunk_release(c);
+		return MFS_ERROR_WRONGVERSION;
+	}
+	if (blocknum>=MFSBLOCKSINCHUNK) {
+		hdd_chunk_release(c);
+		return MFS_ERROR_BNUMTOOBIG;
+	}
+	if (blocknum>=c->blocks || c->op==NULL || c->op->fd<0) { // empty blocks are generated by hdd_read
+		hdd_chunk_release(c);
+		return MFS_ERROR_ENOTSUP;
+	}
+	if (c->cachestate==RCS_CACHED) { // copy in read cache can be dropped at any time, so such chunks are read by hdd_read
+		hdd_chunk_release(c);
+		return MFS_ERROR_ENOTSUP;
+	}
+	foffset = c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS);
+	rcrcptr = (c->op->crc)+(4*blocknum);
+	bcrc = get32bit(&rcrcptr);
+	if (mode==1) {
+		// file shorter than expected would cause SIGBUS on mapping - leave such cases to hdd_read
+		if (fstat(c->op->fd,&sb)<0 || (uint64_t)(sb.st_size)<foffset+MFSBLOCKSIZE) {
+			hdd_chunk_release(c);
+			return MFS_ERROR_ENOTSUP;
 		}
-		if (ret!=MFSBLOCKSIZE) {
-			errno = error;
-			hdd_error_occured(c);	// uses and preserves errno !!!
-			hdd_generate_filename(fname,c); // preserves errno !!!
-			mfs_arg_errlog_silent(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - read error",fname,blocknum);
-			hdd_report_damaged_chunk(c);
+		ts = monotonic_nseconds();
+		pgoff = foffset % PageSize;
+		map = mmap(NULL,MFSBLOCKSIZE+pgoff,PROT_READ,MAP_SHARED,c->op->fd,foffset-pgoff);
+		if (map==MAP_FAILED) {
 			hdd_chunk_release(c);
-			return MFS_ERROR_IO;
-		}
-	} else {
-#ifdef PRESERVE_BLOCK
-		if (c->blockno != blocknum) {
-			ts = monotonic_nseconds();
-			ret = mypread(c->fd,c->block,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
-			error = errno;
-			te = monotonic_nseconds();
-			hdd_stats_dataread(c->owner,MFSBLOCKSIZE,te-ts);
-			c->blockno = blocknum;
-		} else {
-			ret = MFSBLOCKSIZE;
-			error = 0;
+			return MFS_ERROR_ENOTSUP;
 		}
-		precrc = mycrc32(0,c->block,offset);
-		crc = mycrc32(0,c->block+offset,size);
-		postcrc = mycrc32(0,c->block+offset+size,MFSBLOCKSIZE-(offset+size));
-#else /* PRESERVE_BLOCK */
-		ts = monotonic_nseconds();
-		ret = mypread(c->fd,blockbuffer,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
-		error = errno;
+		crc = mycrc32(0,map+pgoff,MFSBLOCKSIZE);
+		munmap(map,MFSBLOCKSIZE+pgoff);
 		te = monotonic_nseconds();
 		hdd_stats_dataread(c->owner,MFSBLOCKSIZE,te-ts);
-//		crc = mycrc32(0,blockbuffer+offset,size);	// first calc crc for piece
-		precrc = mycrc32(0,blockbuffer,offset);
-		crc = mycrc32(0,blockbuffer+offset,size);
-		postcrc = mycrc32(0,blockbuffer+offset+size,MFSBLOCKSIZE-(offset+size));
-#endif /* PRESERVE_BLOCK */
-		if (offset==0) {
-			combinedcrc = mycrc32_combine(crc,postcrc,MFSBLOCKSIZE-(offset+size));
-		} else {
-			combinedcrc = mycrc32_combine(precrc,crc,size);
-			if ((offset+size)<MFSBLOCKSIZE) {
-				combinedcrc = mycrc32_combine(combinedcrc,postcrc,MFSBLOCKSIZE-(offset+size));
-			}
-		}
-		rcrcptr = (c->crc)+(4*blocknum);
-		bcrc = get32bit(&rcrcptr);
-//		if (bcrc!=mycrc32(0,blockbuffer,MFSBLOCKSIZE)) {
-		if (bcrc!=combinedcrc) {
-			errno = error;
+		if (bcrc!=crc) {
 			hdd_error_occured(c);	// uses and preserves errno !!!
 			hdd_generate_filename(fname,c);
-			syslog(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - crc error (data crc: %08"PRIX32" (0:%"PRIu32" - %08"PRIX32" ; %"PRIu32":%"PRIu32" - %08"PRIX32" ; %"PRIu32":%u - %08"PRIX32") ; check crc: %08"PRIX32")",fname,blocknum,combinedcrc,offset,precrc,offset,size,crc,offset+size,MFSBLOCKSIZE-(offset+size),postcrc,bcrc);
+			syslog(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - crc error (data crc: %08"PRIX32" ; check crc: %08"PRIX32")",fname,blocknum,crc,bcrc);
 			hdd_report_damaged_chunk(c);
 			hdd_chunk_release(c);
 			return MFS_ERROR_CRC;
 		}
-		if (ret!=MFSBLOCKSIZE) {
-			errno = error;
-			hdd_error_occured(c);	// uses and preserves errno !!!
-			hdd_generate_filename(fname,c); // preserves errno !!!
-			mfs_arg_errlog_silent(LOG_WARNING,"read_block_from_chunk: file: %s ; block: %"PRIu16" - read error",fname,blocknum);
-			hdd_report_damaged_chunk(c);
-			hdd_chunk_release(c);
-			return MFS_ERROR_IO;
-		}
-#ifdef PRESERVE_BLOCK
-		memcpy(buffer,c->block+offset,size);
-#else /* PRESERVE_BLOCK */
-		memcpy(buffer,blockbuffer+offset,size);
-#endif /* PRESERVE_BLOCK */
 	}
-	put32bit(&crcbuff,crc);
+	*fd = dup(c->op->fd);
+	if (*fd<0) {
+		hdd_chunk_release(c);
+		return MFS_ERROR_ENOTSUP;
+	}
+	*fileoffset = foffset;
+	put32bit(&crcbuff,bcrc);
+	hdd_hashlock_lock(HASHLOCKPOS(chunkid));
+	c->op->sfreaders++;
+	hdd_hashlock_unlock(HASHLOCKPOS(chunkid));
 	hdd_chunk_release(c);
 	return MFS_STATUS_OK;
 }
 
+/* called (without chunk lock - also from main thread) when block prepared by hdd_read_sendfile_prepare has been sent or dropped
+ * chunk could have been closed or deleted in the meantime - then its descriptors (and reader counter) are already gone and there is nothing to wake up */
+void hdd_read_sendfile_end(uint64_t chunkid,int fd) {
+	uint32_t hashpos = HASHPOS(chunkid);
+	uint32_t lockpos = HASHLOCKPOS(chunkid);
+	chunk *c;
+	close(fd);
+	hdd_hashlock_lock(lockpos);
+	for (c=hashtab[hashpos] ; c && c->chunkid!=chunkid ; c=c->next) {}
+	if (c!=NULL && c->op!=NULL && c->op->sfreaders>0) {
+		c->op->sfreaders--;
+		if (c->op->sfreaders==0) {
+			zassert(pthread_cond_broadcast(sendfilecond+lockpos));
+		}
+	}
+	hdd_hashlock_unlock(lockpos);
+}
+
+/* waits until blocks of this chunk queued for sendfile are sent (chunk:locked) - they are sent straight from chunk file,
+ * so data shouldn't be changed before that ; wait is limited (SENDFILE_WAIT_USEC), so slow or stalled client can't hold chunk and disk worker */
+static inline void hdd_sendfile_wait(chunk *c) {
+	uint32_t lockpos;
+	struct timeval tv;
+	struct timespec ts;
+	if (c->op==NULL) {
+		return;
+	}
+	lockpos = HASHLOCKPOS(c->chunkid);
+	hdd_hashlock_lock(lockpos);
+	if (c->op->sfreaders>0) {
+		gettimeofday(&tv,NULL);
+		ts.tv_sec = tv.tv_sec + SENDFILE_WAIT_USEC / 1000000;
+		ts.tv_nsec = (tv.tv_usec + SENDFILE_WAIT_USEC % 1000000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while (c->op->sfreaders>0) {
+			if (pthread_cond_timedwait(sendfilecond+lockpos,hashlock+lockpos,&ts)==ETIMEDOUT) {
+				break;
+			}
+		}
+	}
+	hdd_hashlock_unlock(lockpos);
+}
+
+/* starts writeback of chunk data in background every WritebackPush bytes, so fsync before close has little left to do
+ * and dirty pages don't pile up while data is still streaming in */
+static inline void hdd_writeback_push(chunk *c,uint32_t size) {
+#ifdef HDD_WRITEBACK_PUSH
+	uint32_t wbpush;
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	wbpush = __sync_or_and_fetch(&WritebackPush,0);
+#else
+	pthread_mutex_lock(&cfglock);
+	wbpush = WritebackPush;
+	pthread_mutex_unlock(&cfglock);
+#endif
+	if (wbpush==0) {
+		return;
+	}
+	c->op->wbpending += size;
+	if (c->op->wbpending>=wbpush) {
+		c->op->wbpending = 0;
+		(void)sync_file_range(c->op->fd,0,0,SYNC_FILE_RANGE_WRITE); // only a hint - errors will be reported by fsync
+	}
+#else
+	(void)c;
+	(void)size;
+#endif
+}
+
 int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t *buffer,uint32_t offset,uint32_t size,const uint8_t *crcbuff) {
 	chunk *c;
 	int ret;
@@ -2963,21 +5671,20 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 	uint32_t crc,bcrc,precrc,postcrc,combinedcrc,chcrc;
 	uint32_t i;
 	uint64_t ts,te;
-	uint8_t truncneeded;
+	uint8_t truncneeded,cacheable,punch;
 	char fname[PATH_MAX];
-#ifndef PRESERVE_BLOCK
+	bcentry *be;
 	uint8_t *blockbuffer;
 	blockbuffer = pthread_getspecific(blockbufferkey);
 	if (blockbuffer==NULL) {
-# ifdef MMAP_ALLOC
+#ifdef MMAP_ALLOC
 		blockbuffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
+#else
 		blockbuffer = malloc(MFSBLOCKSIZE);
-# endif
+#endif
 		passert(blockbuffer);
 		zassert(pthread_setspecific(blockbufferkey,blockbuffer));
 	}
-#endif /* PRESERVE_BLOCK */
 	c = hdd_chunk_find(chunkid);
 	if (c==NULL) {
 		return MFS_ERROR_NOCHUNK;
@@ -2998,6 +5705,11 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 		hdd_chunk_release(c);
 		return MFS_ERROR_WRONGOFFSET;
 	}
+	c->heat = 0; // chunks being written are not promoted to read cache
+	if (c->cachestate!=RCS_NONE) {
+		hdd_rcache_drop(c);
+	}
+	hdd_sendfile_wait(c);
 	crc = get32bit(&crcbuff);
 #ifdef HAVE___SYNC_OP_AND_FETCH
 	if (blocknum>=c->blocks && __sync_or_and_fetch(&Sparsification,0)) { // new block - may be sparsified
@@ -3075,18 +5787,27 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 		}
 	}
 	if (offset==0 && size==MFSBLOCKSIZE) {
+		// zero block inside chunk file - punch a hole instead of writing (file size stays the same)
+		punch = (blocknum<c->blocks && crc==emptyblockcrc && hdd_punch_enabled() && hdd_zero_block(buffer))?1:0;
 		if (blocknum>=c->blocks) {
-			wcrcptr = (c->crc)+(4*(c->blocks));
+			wcrcptr = (c->op->crc)+(4*(c->blocks));
 			for (i=c->blocks ; i<blocknum ; i++) {
 				put32bit(&wcrcptr,emptyblockcrc);
 			}
 			c->blocks = blocknum+1;
 		}
+		hdd_bcache_invalidate_block(chunkid,blocknum);
 		ts = monotonic_nseconds();
-		ret = mypwrite(c->fd,buffer,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
-		error = errno;
+		if (punch && hdd_block_punch(c->owner,c->op->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS))) {
+			ret = MFSBLOCKSIZE;
+			error = 0;
+		} else {
+			punch = 0;
+			ret = mypwrite(c->op->fd,buffer,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
+			error = errno;
+		}
 		te = monotonic_nseconds();
-		hdd_stats_datawrite(c->owner,MFSBLOCKSIZE,te-ts);
+		hdd_stats_datawrite(c->owner,punch?0:MFSBLOCKSIZE,te-ts);
 		if (crc!=mycrc32(0,buffer,MFSBLOCKSIZE)) {
 			errno = error;
 			hdd_error_occured(c);
@@ -3096,9 +5817,9 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 			hdd_chunk_release(c);
 			return MFS_ERROR_CRC;
 		}
-		wcrcptr = (c->crc)+(4*blocknum);
+		wcrcptr = (c->op->crc)+(4*blocknum);
 		put32bit(&wcrcptr,crc);
-		c->crcchanged = 1;
+		c->op->crcchanged = 1;
 		if (ret!=MFSBLOCKSIZE) {
 			if (error==0 || error==EAGAIN) {
 				error=ENOSPC;
@@ -3111,32 +5832,26 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 			hdd_chunk_release(c);
 			return MFS_ERROR_IO;
 		}
-#ifdef PRESERVE_BLOCK
-		memcpy(c->block,buffer,MFSBLOCKSIZE);
-		c->blockno = blocknum;
-#endif /* PRESERVE_BLOCK */
+		if (punch==0) {
+			hdd_writeback_push(c,MFSBLOCKSIZE);
+		}
+		hdd_bcache_put(chunkid,c->version,blocknum,buffer);
 	} else {
 		truncneeded = 0;
-		if (blocknum<c->blocks) {
-#ifdef PRESERVE_BLOCK
-			if (c->blockno != blocknum) {
-				ts = monotonic_nseconds();
-				ret = mypread(c->fd,c->block,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
-				error = errno;
-				te = monotonic_nseconds();
-				hdd_stats_dataread(c->owner,MFSBLOCKSIZE,te-ts);
-				c->blockno = blocknum;
-			} else {
-				ret = MFSBLOCKSIZE;
-				error = 0;
-			}
-#else /* PRESERVE_BLOCK */
+		cacheable = 0;
+		if (blocknum<c->blocks && (be=hdd_bcache_get(chunkid,c->version,blocknum))!=NULL) {
+			// cached copy has been already verified - no need to read and check it again
+			memcpy(blockbuffer,be->data,MFSBLOCKSIZE);
+			hdd_bcache_release(be);
+			precrc = mycrc32(0,blockbuffer,offset);
+			postcrc = mycrc32(0,blockbuffer+offset+size,MFSBLOCKSIZE-(offset+size));
+			cacheable = 1;
+		} else if (blocknum<c->blocks) {
 			ts = monotonic_nseconds();
-			ret = mypread(c->fd,blockbuffer,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
+			ret = mypread(c->op->fd,blockbuffer,MFSBLOCKSIZE,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS));
 			error = errno;
 			te = monotonic_nseconds();
 			hdd_stats_dataread(c->owner,MFSBLOCKSIZE,te-ts);
-#endif /* PRESERVE_BLOCK */
 			if (ret!=MFSBLOCKSIZE) {
 				errno = error;
 				hdd_error_occured(c);	// uses and preserves errno !!!
@@ -3146,15 +5861,9 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 				hdd_chunk_release(c);
 				return MFS_ERROR_IO;
 			}
-#ifdef PRESERVE_BLOCK
-			precrc = mycrc32(0,c->block,offset);
-			chcrc = mycrc32(0,c->block+offset,size);
-			postcrc = mycrc32(0,c->block+offset+size,MFSBLOCKSIZE-(offset+size));
-#else /* PRESERVE_BLOCK */
 			precrc = mycrc32(0,blockbuffer,offset);
 			chcrc = mycrc32(0,blockbuffer+offset,size);
 			postcrc = mycrc32(0,blockbuffer+offset+size,MFSBLOCKSIZE-(offset+size));
-#endif /* PRESERVE_BLOCK */
 			if (offset==0) {
 				combinedcrc = mycrc32_combine(chcrc,postcrc,MFSBLOCKSIZE-(offset+size));
 			} else {
@@ -3163,7 +5872,7 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 					combinedcrc = mycrc32_combine(combinedcrc,postcrc,MFSBLOCKSIZE-(offset+size));
 				}
 			}
-			rcrcptr = (c->crc)+(4*blocknum);
+			rcrcptr = (c->op->crc)+(4*blocknum);
 			bcrc = get32bit(&rcrcptr);
 //			if (bcrc!=mycrc32(0,blockbuffer,MFSBLOCKSIZE)) {
 			if (bcrc!=combinedcrc) {
@@ -3175,42 +5884,29 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 				hdd_chunk_release(c);
 				return MFS_ERROR_CRC;
 			}
+			cacheable = 1;
 		} else {
 			if (offset+size < MFSBLOCKSIZE) {
 				truncneeded = 1;
 			}
-			wcrcptr = (c->crc)+(4*(c->blocks));
+			wcrcptr = (c->op->crc)+(4*(c->blocks));
 			for (i=c->blocks ; i<blocknum ; i++) {
 				put32bit(&wcrcptr,emptyblockcrc);
 			}
 			c->blocks = blocknum+1;
-#ifdef PRESERVE_BLOCK
-			memset(c->block,0,MFSBLOCKSIZE);
-			c->blockno = blocknum;
-#else /* PRESERVE_BLOCK */
 //			memset(blockbuffer,0,MFSBLOCKSIZE); // not needed (we do not preserve this buffer) !!!
-#endif /* PRESERVE_BLOCK */
 			precrc = mycrc32_zeroblock(0,offset);
 			postcrc = mycrc32_zeroblock(0,MFSBLOCKSIZE-(offset+size));
 		}
 		if (size>0) {
-#ifdef PRESERVE_BLOCK
-			memcpy(c->block+offset,buffer,size);
-			ts = monotonic_nseconds();
-			ret = mypwrite(c->fd,c->block+offset,size,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS)+offset);
-			error = errno;
-			te = monotonic_nseconds();
-			hdd_stats_datawrite(c->owner,size,te-ts);
-			chcrc = mycrc32(0,c->block+offset,size);
-#else /* PRESERVE_BLOCK */
 			memcpy(blockbuffer+offset,buffer,size);
+			hdd_bcache_invalidate_block(chunkid,blocknum);
 			ts = monotonic_nseconds();
-			ret = mypwrite(c->fd,blockbuffer+offset,size,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS)+offset);
+			ret = mypwrite(c->op->fd,blockbuffer+offset,size,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocknum)<<MFSBLOCKBITS)+offset);
 			error = errno;
 			te = monotonic_nseconds();
 			hdd_stats_datawrite(c->owner,size,te-ts);
 			chcrc = mycrc32(0,blockbuffer+offset,size);
-#endif /* PRESERVE_BLOCK */
 			if (offset==0) {
 				combinedcrc = mycrc32_combine(chcrc,postcrc,MFSBLOCKSIZE-(offset+size));
 			} else {
@@ -3232,11 +5928,11 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 				}
 			}
 		}
-		wcrcptr = (c->crc)+(4*blocknum);
+		wcrcptr = (c->op->crc)+(4*blocknum);
 //		bcrc = mycrc32(0,blockbuffer,MFSBLOCKSIZE);
 //		put32bit(&wcrcptr,bcrc);
 		put32bit(&wcrcptr,combinedcrc);
-		c->crcchanged = 1;
+		c->op->crcchanged = 1;
 //		if (crc!=mycrc32(0,blockbuffer+offset,size)) {
 		if (size>0 && crc!=chcrc) {
 			hdd_error_occured(c);	// uses and preserves errno !!!
@@ -3259,7 +5955,7 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 			return MFS_ERROR_IO;
 		}
 		if (truncneeded) {
-			if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)(blocknum+1))<<MFSBLOCKBITS))<0) {
+			if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)(blocknum+1))<<MFSBLOCKBITS))<0) {
 				hdd_error_occured(c);	// uses and preserves errno !!!
 				hdd_generate_filename(fname,c); // preserves errno !!!
 				mfs_arg_errlog_silent(LOG_WARNING,"write_block_to_chunk: file: %s ; block: %"PRIu16" - ftruncate error",fname,blocknum);
@@ -3268,6 +5964,10 @@ int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t
 				return MFS_ERROR_IO;
 			}
 		}
+		hdd_writeback_push(c,size);
+		if (cacheable) {
+			hdd_bcache_put(chunkid,c->version,blocknum,blockbuffer);
+		}
 	}
 	hdd_chunk_release(c);
 	return MFS_STATUS_OK;
@@ -3329,7 +6029,7 @@ int hdd_get_checksum(uint64_t chunkid,uint32_t version,uint8_t *checksum_buff) {
 	chksum = 1;
 	for (i=0 ; i<MFSBLOCKSINCHUNK ; i++) {
 		chksum *= 426265243;
-		chksum ^= c->crc[i];
+		chksum ^= c->op->crc[i];
 	}
 	put32bit(&checksum_buff,chksum);
 	status = hdd_io_end(c);
@@ -3363,7 +6063,7 @@ int hdd_get_checksum_tab(uint64_t chunkid,uint32_t version,uint8_t *checksum_tab
 		return status;
 	}
 	for (i=0 ; i<MFSBLOCKSINCHUNK ; i++) {
-		put32bit(&checksum_tab,c->crc[i]);
+		put32bit(&checksum_tab,c->op->crc[i]);
 	}
 	status = hdd_io_end(c);
 	if (status!=MFS_STATUS_OK) {
@@ -3388,11 +6088,7 @@ static int hdd_int_create(uint64_t chunkid,uint32_t version) {
 	int status;
 	uint8_t *ptr;
 	char fname[PATH_MAX];
-#ifdef PRESERVE_BLOCK
-	uint8_t hdrbuffer[CHUNKMAXHDRSIZE];
-#else /* PRESERVE_BLOCK */
 	uint8_t *hdrbuffer;
-#endif /* PRESERVE_BLOCK */
 
 	zassert(pthread_mutex_lock(&folderlock));
 	f = hdd_getfolder();
@@ -3406,14 +6102,12 @@ static int hdd_int_create(uint64_t chunkid,uint32_t version) {
 		return MFS_ERROR_CHUNKEXIST;
 	}
 
-#ifndef PRESERVE_BLOCK
 	hdrbuffer = pthread_getspecific(hdrbufferkey);
 	if (hdrbuffer==NULL) {
 		hdrbuffer = malloc(CHUNKMAXHDRSIZE);
 		passert(hdrbuffer);
 		zassert(pthread_setspecific(hdrbufferkey,hdrbuffer));
 	}
-#endif /* PRESERVE_BLOCK */
 
 	status = hdd_io_begin(c,MODE_NEW);
 	if (status!=MFS_STATUS_OK) {
@@ -3426,7 +6120,7 @@ static int hdd_int_create(uint64_t chunkid,uint32_t version) {
 	ptr = hdrbuffer+8;
 	put64bit(&ptr,chunkid);
 	put32bit(&ptr,version);
-	if (write(c->fd,hdrbuffer,c->hdrsize+CHUNKCRCSIZE)!=(ssize_t)(c->hdrsize+CHUNKCRCSIZE)) {
+	if (write(c->op->fd,hdrbuffer,c->hdrsize+CHUNKCRCSIZE)!=(ssize_t)(c->hdrsize+CHUNKCRCSIZE)) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		hdd_generate_filename(fname,c); // preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"create_newchunk: file:%s - write error",fname);
@@ -3450,26 +6144,21 @@ static int hdd_int_create(uint64_t chunkid,uint32_t version) {
 
 static int hdd_int_test(uint64_t chunkid,uint32_t version,uint16_t *blocks) {
 	const uint8_t *ptr;
-	uint16_t block;
-	uint32_t bcrc;
+	uint16_t block,batch,i;
+	uint32_t bcrc,bsize;
 	int32_t retsize;
 	uint32_t lasttesttime,now;
+	uint64_t dataoff;
 	int status;
 	chunk *c;
 	char fname[PATH_MAX];
-#ifndef PRESERVE_BLOCK
-	uint8_t *blockbuffer;
-	blockbuffer = pthread_getspecific(blockbufferkey);
-	if (blockbuffer==NULL) {
-# ifdef MMAP_ALLOC
-		blockbuffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
-		blockbuffer = malloc(MFSBLOCKSIZE);
-# endif
-		passert(blockbuffer);
-		zassert(pthread_setspecific(blockbufferkey,blockbuffer));
+	uint8_t *batchbuffer;
+	batchbuffer = pthread_getspecific(batchbufferkey);
+	if (batchbuffer==NULL) {
+		batchbuffer = malloc(MOVE_BATCH_BLOCKS*MFSBLOCKSIZE);
+		passert(batchbuffer);
+		zassert(pthread_setspecific(batchbufferkey,batchbuffer));
 	}
-#endif /* PRESERVE_BLOCK */
 	if (blocks!=NULL) {
 		*blocks = 0;
 	}
@@ -3491,15 +6180,22 @@ static int hdd_int_test(uint64_t chunkid,uint32_t version,uint16_t *blocks) {
 	hdd_sequential_mode_int(c);
 	now = main_time();
 	if (lasttesttime+MinTimeBetweenTests<=now) {
-		lseek(c->fd,c->hdrsize+CHUNKCRCSIZE,SEEK_SET);
-		ptr = c->crc;
-		for (block=0 ; block<c->blocks ; block++) {
-#ifdef PRESERVE_BLOCK
-			retsize = read(c->fd,c->block,MFSBLOCKSIZE);
-#else /* PRESERVE_BLOCK */
-			retsize = read(c->fd,blockbuffer,MFSBLOCKSIZE);
-#endif /* PRESERVE_BLOCK */
-			if (retsize!=MFSBLOCKSIZE) {
+		// data is read in big sequential batches (next one is requested while current one is checked)
+		dataoff = c->hdrsize+CHUNKCRCSIZE;
+		ptr = c->op->crc;
+		for (block=0 ; block<c->blocks ; block+=batch) {
+			batch = c->blocks - block;
+			if (batch>MOVE_BATCH_BLOCKS) {
+				batch = MOVE_BATCH_BLOCKS;
+			}
+			bsize = ((uint32_t)batch)<<MFSBLOCKBITS;
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+			if (block+batch<c->blocks) {
+				posix_fadvise(c->op->fd,dataoff+((((uint32_t)block)+batch)<<MFSBLOCKBITS),MOVE_BATCH_BLOCKS*MFSBLOCKSIZE,POSIX_FADV_WILLNEED);
+			}
+#endif
+			retsize = mypread(c->op->fd,batchbuffer,bsize,dataoff+(((uint32_t)block)<<MFSBLOCKBITS));
+			if (retsize!=(int32_t)bsize) {
 				hdd_error_occured(c);	// uses and preserves errno !!!
 				hdd_generate_filename(fname,c); // preserves errno !!!
 				mfs_arg_errlog_silent(LOG_WARNING,"test_chunk: file:%s - data read error",fname);
@@ -3508,24 +6204,19 @@ static int hdd_int_test(uint64_t chunkid,uint32_t version,uint16_t *blocks) {
 				hdd_chunk_release(c);
 				return MFS_ERROR_IO;
 			}
-			hdd_stats_read(MFSBLOCKSIZE);
-#ifdef PRESERVE_BLOCK
-			c->blockno = block;
-#endif
-			bcrc = get32bit(&ptr);
-#ifdef PRESERVE_BLOCK
-			if (bcrc!=mycrc32(0,c->block,MFSBLOCKSIZE)) {
-#else /* PRESERVE_BLOCK */
-			if (bcrc!=mycrc32(0,blockbuffer,MFSBLOCKSIZE)) {
-#endif /* PRESERVE_BLOCK */
-				errno = 0;	// set anything to errno
-				hdd_error_occured(c);	// uses and preserves errno !!!
-				hdd_generate_filename(fname,c); // preserves errno !!!
-				syslog(LOG_WARNING,"test_chunk: file:%s - crc error (data block %u)",fname,block);
-				hdd_io_end(c);
-				hdd_report_damaged_chunk(c);
-				hdd_chunk_release(c);
-				return MFS_ERROR_CRC;
+			hdd_stats_read(bsize);
+			for (i=0 ; i<batch ; i++) {
+				bcrc = get32bit(&ptr);
+				if (bcrc!=mycrc32(0,batchbuffer+(((uint32_t)i)<<MFSBLOCKBITS),MFSBLOCKSIZE)) {
+					errno = 0;	// set anything to errno
+					hdd_error_occured(c);	// uses and preserves errno !!!
+					hdd_generate_filename(fname,c); // preserves errno !!!
+					syslog(LOG_WARNING,"test_chunk: file:%s - crc error (data block %u)",fname,block+i);
+					hdd_io_end(c);
+					hdd_report_damaged_chunk(c);
+					hdd_chunk_release(c);
+					return MFS_ERROR_CRC;
+				}
 			}
 		}
 /*
@@ -3554,11 +6245,294 @@ static int hdd_int_test(uint64_t chunkid,uint32_t version,uint16_t *blocks) {
 		hdd_chunk_release(c);
 		return status;
 	}
-	if (blocks) {
-		*blocks = c->blocks;
+	if (blocks) {
+		*blocks = c->blocks;
+	}
+	hdd_chunk_release(c);
+	return MFS_STATUS_OK;
+}
+
+// reset promotion hint after failed (or abandoned) promotion
+static inline void hdd_rcache_unqueue(uint64_t chunkid) {
+	chunk *c;
+	c = hdd_chunk_find(chunkid);
+	if (c!=NULL) {
+		if (c->cachestate==RCS_QUEUED) {
+			c->cachestate = RCS_NONE;
+		}
+		hdd_chunk_release(c);
+	}
+}
+
+/* copies chunk data to read cache folder - chunk is locked only while one batch is read and checked,
+ * any modification of chunk in the meantime resets cachestate (and removes entry), so copying is abandoned */
+static void hdd_rcache_promote(uint64_t chunkid,uint32_t speed) {
+	chunk *c;
+	cacheentry *e;
+	const uint8_t *ptr;
+	char fname[PATH_MAX];
+	uint8_t *batchbuffer;
+	uint64_t st,delay;
+	uint32_t version,bsize;
+	uint16_t blocks,block,batch,i;
+	uint8_t ok;
+	int fd;
+
+	batchbuffer = pthread_getspecific(batchbufferkey);
+	if (batchbuffer==NULL) {
+		batchbuffer = malloc(MOVE_BATCH_BLOCKS*MFSBLOCKSIZE);
+		passert(batchbuffer);
+		zassert(pthread_setspecific(batchbufferkey,batchbuffer));
+	}
+	c = hdd_chunk_find(chunkid);
+	if (c==NULL) {
+		return;
+	}
+	if (c->cachestate!=RCS_QUEUED || c->blocks==0) {
+		if (c->cachestate==RCS_QUEUED) {
+			c->cachestate = RCS_NONE;
+		}
+		hdd_chunk_release(c);
+		return;
+	}
+	version = c->version;
+	blocks = c->blocks;
+	hdd_chunk_release(c);
+
+	e = hdd_rcache_entry_create(chunkid,version,((uint32_t)blocks)<<MFSBLOCKBITS);
+	if (e==NULL) { // no space
+		hdd_rcache_unqueue(chunkid);
+		return;
+	}
+	// only this thread removes folders, so e->cf can be used without lock
+	snprintf(fname,PATH_MAX,"%s%02"PRIX8,e->cf->path,(uint8_t)(chunkid));
+	(void)mkdir(fname,0755);
+	hdd_rcache_filename(fname,e->cf->path,chunkid,version);
+	fd = open(fname,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if (fd<0) {
+		mfs_arg_errlog_silent(LOG_NOTICE,"read cache: can't create file: %s",fname);
+	}
+	ok = (fd>=0)?1:0;
+	for (block=0 ; block<blocks && ok ; block+=batch) {
+		batch = blocks - block;
+		if (batch>MOVE_BATCH_BLOCKS) {
+			batch = MOVE_BATCH_BLOCKS;
+		}
+		bsize = ((uint32_t)batch)<<MFSBLOCKBITS;
+		st = monotonic_useconds();
+		ok = 0;
+		c = hdd_chunk_find(chunkid);
+		if (c!=NULL) {
+			if (c->version==version && c->blocks==blocks && c->cachestate==RCS_QUEUED && hdd_io_begin(c,MODE_EXISTING)==MFS_STATUS_OK) {
+				if (mypread(c->op->fd,batchbuffer,bsize,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS))==(int32_t)bsize) {
+					hdd_stats_read(bsize);
+					ptr = c->op->crc+(4*block);
+					ok = 1;
+					for (i=0 ; i<batch && ok ; i++) {
+						if (get32bit(&ptr)!=mycrc32(0,batchbuffer+(((uint32_t)i)<<MFSBLOCKBITS),MFSBLOCKSIZE)) {
+							ok = 0; // leave it to chunk tester
+						}
+					}
+				}
+				if (hdd_io_end(c)!=MFS_STATUS_OK) {
+					ok = 0;
+				}
+			}
+			hdd_chunk_release(c);
+		}
+		if (ok && mypwrite(fd,batchbuffer,bsize,((uint32_t)block)<<MFSBLOCKBITS)!=(int32_t)bsize) {
+			mfs_arg_errlog_silent(LOG_NOTICE,"read cache: write error: %s",fname);
+			ok = 0;
+		}
+		if (ok && speed>0) {
+			delay = bsize;
+			delay *= 1000000;
+			delay /= UINT64_C(1048576)*speed;
+			st = monotonic_useconds() - st;
+			if (delay>st) {
+				portable_usleep(delay-st);
+			}
+		}
+	}
+	if (fd>=0) {
+		close(fd);
+	}
+
+	zassert(pthread_mutex_lock(&cachelock));
+	if (hdd_rcache_entry_exists(e)) {
+		if (ok) {
+			e->valid = 1;
+			e->lrunext = NULL;
+			e->lruprev = cachelrutail;
+			*(e->lruprev) = e;
+			cachelrutail = &(e->lrunext);
+			stats_rcachepromote++;
+		} else {
+			hdd_rcache_entry_remove(e);
+		}
+	} else { // chunk was changed during copying (file has been already removed)
+		ok = 0;
+	}
+	zassert(pthread_mutex_unlock(&cachelock));
+
+	c = hdd_chunk_find(chunkid);
+	if (c!=NULL) {
+		if (c->cachestate==RCS_QUEUED) {
+			c->cachestate = (ok && c->version==version)?RCS_CACHED:RCS_NONE;
+		}
+		hdd_chunk_release(c);
+	}
+}
+
+void* hdd_rcache_thread(void *arg) {
+	uint64_t now,lastcheck,lastepoch;
+	uint64_t chunkid;
+	uint32_t period,speed;
+
+	lastcheck = 0;
+	lastepoch = monotonic_useconds();
+	for (;;) {
+		zassert(pthread_mutex_lock(&termlock));
+		if (term) {
+			zassert(pthread_mutex_unlock(&termlock));
+			return arg;
+		}
+		zassert(pthread_mutex_unlock(&termlock));
+
+		now = monotonic_useconds();
+		if (now>=lastcheck+1000000) {
+			hdd_rcache_folders_check();
+			lastcheck = now;
+		}
+		chunkid = 0;
+		zassert(pthread_mutex_lock(&cachelock));
+		period = RCachePeriod;
+		speed = RCacheSpeed;
+		if (now>=lastepoch+UINT64_C(1000000)*period) { // heat of all chunks is halved (lazily)
+#ifdef HAVE___SYNC_OP_AND_FETCH
+			__sync_add_and_fetch(&cacheepoch,1);
+#else
+			cacheepoch++;
+#endif
+			lastepoch = now;
+		}
+		if (cachequeuecnt>0) {
+			chunkid = cachequeue[cachequeuepos];
+			cachequeuepos = (cachequeuepos+1)%RCACHE_QUEUESIZE;
+			cachequeuecnt--;
+		}
+		zassert(pthread_mutex_unlock(&cachelock));
+
+		if (chunkid>0) {
+			hdd_rcache_promote(chunkid,speed);
+		} else {
+			portable_usleep(100000);
+		}
+	}
+	return arg;
+}
+
+static inline uint8_t hdd_clone_mode(void) {
+	uint8_t mode;
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	mode = __sync_or_and_fetch(&CloneMode,0);
+#else
+	pthread_mutex_lock(&cfglock);
+	mode = CloneMode;
+	pthread_mutex_unlock(&cfglock);
+#endif
+	return mode;
+}
+
+/* folder for copy of chunk 'oc' - when reflinks are enabled prefer folder of the original chunk (extents can be shared only within one file system) */
+static inline folder* hdd_getfolder_for_copy(chunk *oc) {
+	folder *f;
+
+	f = oc->owner;
+	if (hdd_clone_mode()>=2 && f->noreflink==0) {
+		if (f->damaged==0 && f->toremove==REMOVING_NO && f->markforremoval==MFR_NO && f->scanstate==SCST_WORKING && f->total>0 && f->avail>0 && f->balancemode!=REBALANCE_FORCE_SRC) {
+			if (f->avail * UINT64_C(1000) >= f->total) { // space used <= 99.9%
+				return f;
+			}
+		}
+	}
+	return hdd_getfolder();
+}
+
+/* copies 'leng' bytes between chunk files without passing them through user space
+ * mode: 1 - copy_file_range only, 2 - FICLONERANGE (shared extents) first
+ * returns 1 on success, 0 when standard copy should be used (part of data could have been copied already) */
+static int hdd_int_copy_range(int sfd,folder *fs,uint64_t srcoff,int dfd,folder *fd,uint64_t dstoff,uint64_t leng,uint8_t mode) {
+#if defined(HDD_REFLINK) || defined(HDD_COPY_RANGE)
+	if (mode==0 || leng==0) {
+		return 0;
+	}
+#ifdef HDD_REFLINK
+	// FICLONERANGE needs file system block aligned offsets - new chunk headers (4096 bytes) meet it, old ones (1024 bytes) don't
+	if (mode>=2 && fd->noreflink==0 && fs->devid==fd->devid && ((srcoff|dstoff)&4095)==0) {
+		struct file_clone_range fcr;
+		if (ftruncate(dfd,dstoff)>=0) {
+			fcr.src_fd = sfd;
+			fcr.src_offset = srcoff;
+			fcr.src_length = leng;
+			fcr.dest_offset = dstoff;
+			if (ioctl(dfd,FICLONERANGE,&fcr)>=0) {
+				return 1;
+			}
+			if (errno==EOPNOTSUPP || errno==ENOTTY || errno==ENOSYS) {
+				fd->noreflink = 1;
+			}
+		}
+	}
+#endif
+#ifdef HDD_COPY_RANGE
+	if (fd->nocopyrange==0) {
+		int64_t soff,doff;
+		ssize_t ret;
+		soff = srcoff;
+		doff = dstoff;
+		while (leng>0) {
+			ret = syscall(__NR_copy_file_range,sfd,&soff,dfd,&doff,(size_t)leng,0);
+			if (ret<=0) {
+				if (ret<0 && (errno==EOPNOTSUPP || errno==ENOSYS)) {
+					fd->nocopyrange = 1;
+				}
+				return 0;
+			}
+			hdd_stats_read(ret);
+			hdd_stats_write(ret);
+			leng -= ret;
+		}
+		return 1;
+	}
+#endif
+#else
+	(void)sfd;
+	(void)fs;
+	(void)srcoff;
+	(void)dfd;
+	(void)fd;
+	(void)dstoff;
+	(void)leng;
+	(void)mode;
+#endif
+	return 0;
+}
+
+/* copies data of first 'blocks' blocks from 'oc' to 'c' without passing them through user space
+ * returns 1 on success - oc->op->fd is then positioned just after copied data
+ * returns 0 when standard copy should be used - oc->op->fd is then positioned at the beginning of data */
+static int hdd_int_clone_blocks(chunk *oc,chunk *c,uint16_t blocks) {
+	uint64_t srcoff,leng;
+
+	srcoff = oc->hdrsize+CHUNKCRCSIZE;
+	leng = ((uint64_t)blocks)<<MFSBLOCKBITS;
+	if (hdd_int_copy_range(oc->op->fd,oc->owner,srcoff,c->op->fd,c->owner,c->hdrsize+CHUNKCRCSIZE,leng,hdd_clone_mode())) {
+		lseek(oc->op->fd,srcoff+leng,SEEK_SET);
+		return 1;
 	}
-	hdd_chunk_release(c);
-	return MFS_STATUS_OK;
+	lseek(oc->op->fd,srcoff,SEEK_SET);
+	return 0;
 }
 
 static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversion,uint64_t copychunkid,uint32_t copyversion) {
@@ -3575,17 +6549,14 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 	uint8_t truncneeded;
 	char ofname[PATH_MAX];
 	char fname[PATH_MAX];
-#ifdef PRESERVE_BLOCK
-	uint8_t hdrbuffer[CHUNKMAXHDRSIZE];
-#else /* PRESERVE_BLOCK */
 	uint8_t *blockbuffer,*hdrbuffer;
 	blockbuffer = pthread_getspecific(blockbufferkey);
 	if (blockbuffer==NULL) {
-# ifdef MMAP_ALLOC
+#ifdef MMAP_ALLOC
 		blockbuffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
+#else
 		blockbuffer = malloc(MFSBLOCKSIZE);
-# endif
+#endif
 		passert(blockbuffer);
 		zassert(pthread_setspecific(blockbufferkey,blockbuffer));
 	}
@@ -3595,7 +6566,6 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 		passert(hdrbuffer);
 		zassert(pthread_setspecific(hdrbufferkey,hdrbuffer));
 	}
-#endif /* PRESERVE_BLOCK */
 #ifdef HAVE___SYNC_OP_AND_FETCH
 	sp = __sync_or_and_fetch(&Sparsification,0);
 #else
@@ -3616,7 +6586,7 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 		copyversion = newversion;
 	}
 	zassert(pthread_mutex_lock(&folderlock));
-	f = hdd_getfolder();
+	f = hdd_getfolder_for_copy(oc);
 	if (f==NULL) {
 		zassert(pthread_mutex_unlock(&folderlock));
 		hdd_chunk_release(oc);
@@ -3641,11 +6611,13 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 			hdd_chunk_release(oc);
 			return MFS_ERROR_IO;
 		}
+		hdd_index_chunk_set(oc);
 		status = hdd_io_begin(oc,MODE_IGNVERS);
 		if (status!=MFS_STATUS_OK) {
 			hdd_error_occured(oc);	// uses and preserves errno !!!
 			if (rename(fname,ofname)>=0) {
 				oc->version = version;
+				hdd_index_chunk_set(oc);
 			}
 			hdd_chunk_delete(c);
 			hdd_chunk_release(oc);
@@ -3653,13 +6625,14 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 		}
 		ptr = vbuff;
 		put32bit(&ptr,newversion);
-		if (mypwrite(oc->fd,vbuff,4,16)!=4) {
+		if (mypwrite(oc->op->fd,vbuff,4,16)!=4) {
 			hdd_error_occured(oc);	// uses and preserves errno !!!
 			mfs_arg_errlog_silent(LOG_WARNING,"duplicate_chunk: file:%s - write error",fname);
 			hdd_chunk_delete(c);
 			hdd_io_end(oc);
 			if (rename(fname,ofname)>=0) {
 				oc->version = version;
+				hdd_index_chunk_set(oc);
 			}
 			hdd_chunk_release(oc);
 			return MFS_ERROR_IO;
@@ -3689,12 +6662,12 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 	ptr = hdrbuffer+8;
 	put64bit(&ptr,copychunkid);
 	put32bit(&ptr,copyversion);
-	memcpy(c->crc,oc->crc,CHUNKCRCSIZE);
-	memcpy(hdrbuffer+c->hdrsize,oc->crc,CHUNKCRCSIZE);
+	memcpy(c->op->crc,oc->op->crc,CHUNKCRCSIZE);
+	memcpy(hdrbuffer+c->hdrsize,oc->op->crc,CHUNKCRCSIZE);
 	if (oc->blocks<MFSBLOCKSINCHUNK) {
 		memcpy(hdrbuffer+c->hdrsize+4*oc->blocks,emptychunkcrc,4*(MFSBLOCKSINCHUNK-oc->blocks));
 	}
-	if (write(c->fd,hdrbuffer,c->hdrsize+CHUNKCRCSIZE)!=(ssize_t)(c->hdrsize+CHUNKCRCSIZE)) {
+	if (write(c->op->fd,hdrbuffer,c->hdrsize+CHUNKCRCSIZE)!=(ssize_t)(c->hdrsize+CHUNKCRCSIZE)) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		hdd_generate_filename(fname,c); // preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"duplicate_chunk: file:%s - hdr write error",fname);
@@ -3706,21 +6679,14 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 		return MFS_ERROR_IO;
 	}
 	hdd_stats_write(c->hdrsize+CHUNKCRCSIZE);
-#ifndef PRESERVE_BLOCK
-	lseek(oc->fd,oc->hdrsize+CHUNKCRCSIZE,SEEK_SET);
-#endif /* PRESERVE_BLOCK */
+	lseek(oc->op->fd,oc->hdrsize+CHUNKCRCSIZE,SEEK_SET);
 	truncneeded = 0;
-	for (block=0 ; block<oc->blocks ; block++) {
-#ifdef PRESERVE_BLOCK
-		if (oc->blockno==block) {
-			memcpy(c->block,oc->block,MFSBLOCKSIZE);
-			retsize = MFSBLOCKSIZE;
-		} else {
-			retsize = mypread(oc->fd,c->block,MFSBLOCKSIZE,oc->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS));
-		}
-#else /* PRESERVE_BLOCK */
-		retsize = read(oc->fd,blockbuffer,MFSBLOCKSIZE);
-#endif /* PRESERVE_BLOCK */
+	block = 0;
+	if (hdd_int_clone_blocks(oc,c,oc->blocks)) {
+		block = oc->blocks;
+	}
+	for ( ; block<oc->blocks ; block++) {
+		retsize = read(oc->op->fd,blockbuffer,MFSBLOCKSIZE);
 		if (retsize!=MFSBLOCKSIZE) {
 			hdd_error_occured(oc);	// uses and preserves errno !!!
 			hdd_generate_filename(ofname,oc); // preserves errno !!!
@@ -3734,15 +6700,8 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 			hdd_chunk_release(oc);
 			return MFS_ERROR_IO;
 		}
-#ifdef PRESERVE_BLOCK
-		if (oc->blockno!=block) {
-			hdd_stats_read(MFSBLOCKSIZE);
-		}
-		writeptr = c->block;
-#else /* PRESERVE_BLOCK */
 		hdd_stats_read(MFSBLOCKSIZE);
 		writeptr = blockbuffer;
-#endif /* PRESERVE_BLOCK */
 		if (sp) {
 			// sparsify
 			p = writeptr;
@@ -3771,7 +6730,7 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 			retsize = 0;
 			nzstart = nzend = 0;
 		} else {
-			retsize = mypwrite(c->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
+			retsize = mypwrite(c->op->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
 		}
 		if (retsize!=(int32_t)(nzend-nzstart)) {
 			hdd_error_occured(c);	// uses and preserves errno !!!
@@ -3790,12 +6749,9 @@ static int hdd_int_duplicate(uint64_t chunkid,uint32_t version,uint32_t newversi
 		} else {
 			truncneeded = 0;
 		}
-#ifdef PRESERVE_BLOCK
-		c->blockno = block;
-#endif /* PRESERVE_BLOCK */
 	}
 	if (truncneeded) {
-		if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)oc->blocks)<<MFSBLOCKBITS))<0) { // yes it is ok - oc->blocks not c->blocks !!!
+		if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)oc->blocks)<<MFSBLOCKBITS))<0) { // yes it is ok - oc->blocks not c->blocks !!!
 			hdd_error_occured(c);	// uses and preserves errno !!!
 			hdd_generate_filename(fname,c); // preserves errno !!!
 			mfs_arg_errlog_silent(LOG_WARNING,"duplicate_chunk: file:%s - ftruncate error",fname);
@@ -3863,23 +6819,26 @@ static int hdd_int_version(uint64_t chunkid,uint32_t version,uint32_t newversion
 		hdd_chunk_release(c);
 		return MFS_ERROR_IO;
 	}
+	hdd_index_chunk_set(c);
 	status = hdd_io_begin(c,MODE_IGNVERS);
 	if (status!=MFS_STATUS_OK) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		if (rename(fname,ofname)>=0) {
 			c->version = version;
+			hdd_index_chunk_set(c);
 		}
 		hdd_chunk_release(c);
 		return status;
 	}
 	ptr = vbuff;
 	put32bit(&ptr,newversion);
-	if (mypwrite(c->fd,vbuff,4,16)!=4) {
+	if (mypwrite(c->op->fd,vbuff,4,16)!=4) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"set_chunk_version: file:%s - write error",fname);
 		hdd_io_end(c);
 		if (rename(fname,ofname)>=0) {
 			c->version = version;
+			hdd_index_chunk_set(c);
 		}
 		hdd_chunk_release(c);
 		return MFS_ERROR_IO;
@@ -3901,19 +6860,17 @@ static int hdd_int_truncate(uint64_t chunkid,uint32_t version,uint32_t newversio
 	uint32_t i;
 	char ofname[PATH_MAX];
 	char fname[PATH_MAX];
-#ifndef PRESERVE_BLOCK
 	uint8_t *blockbuffer;
 	blockbuffer = pthread_getspecific(blockbufferkey);
 	if (blockbuffer==NULL) {
-# ifdef MMAP_ALLOC
+#ifdef MMAP_ALLOC
 		blockbuffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
+#else
 		blockbuffer = malloc(MFSBLOCKSIZE);
-# endif
+#endif
 		passert(blockbuffer);
 		zassert(pthread_setspecific(blockbufferkey,blockbuffer));
 	}
-#endif /* !PRESERVE_BLOCK */
 
 	if (length>MFSCHUNKSIZE) {
 		return MFS_ERROR_WRONGSIZE;
@@ -3927,6 +6884,7 @@ static int hdd_int_truncate(uint64_t chunkid,uint32_t version,uint32_t newversio
 		hdd_chunk_release(c);
 		return MFS_ERROR_WRONGVERSION;
 	}
+	hdd_sendfile_wait(c);
 	hdd_generate_filename(ofname,c);
 	c->version = newversion;
 	hdd_generate_filename(fname,c);
@@ -3937,23 +6895,26 @@ static int hdd_int_truncate(uint64_t chunkid,uint32_t version,uint32_t newversio
 		hdd_chunk_release(c);
 		return MFS_ERROR_IO;
 	}
+	hdd_index_chunk_set(c);
 	status = hdd_io_begin(c,MODE_IGNVERS);
 	if (status!=MFS_STATUS_OK) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		if (rename(fname,ofname)>=0) {
 			c->version = version;
+			hdd_index_chunk_set(c);
 		}
 		hdd_chunk_release(c);
 		return status;	//can't change file version
 	}
 	ptr = vbuff;
 	put32bit(&ptr,newversion);
-	if (mypwrite(c->fd,vbuff,4,16)!=4) {
+	if (mypwrite(c->op->fd,vbuff,4,16)!=4) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"truncate_chunk: file:%s - write error",fname);
 		hdd_io_end(c);
 		if (rename(fname,ofname)>=0) {
 			c->version = version;
+			hdd_index_chunk_set(c);
 		}
 		hdd_chunk_release(c);
 		return MFS_ERROR_IO;
@@ -3962,49 +6923,38 @@ static int hdd_int_truncate(uint64_t chunkid,uint32_t version,uint32_t newversio
 	// step 2. truncate
 	blocks = ((length+MFSBLOCKMASK)>>MFSBLOCKBITS);
 	if (blocks>c->blocks) {
-		if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+(blocks<<MFSBLOCKBITS))<0) {
+		if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+(blocks<<MFSBLOCKBITS))<0) {
 			hdd_error_occured(c);	// uses and preserves errno !!!
 			mfs_arg_errlog_silent(LOG_WARNING,"truncate_chunk: file:%s - ftruncate error",fname);
 			hdd_io_end(c);
 			hdd_chunk_release(c);
 			return MFS_ERROR_IO;
 		}
-		ptr = (c->crc)+(4*(c->blocks));
+		ptr = (c->op->crc)+(4*(c->blocks));
 		for (i=c->blocks ; i<blocks ; i++) {
 			put32bit(&ptr,emptyblockcrc);
 		}
-		c->crcchanged = 1;
+		c->op->crcchanged = 1;
 	} else {
 		uint32_t blocknum = length>>MFSBLOCKBITS;
 		uint32_t blockpos = length&MFSCHUNKBLOCKMASK;
 		uint32_t blocksize = length&MFSBLOCKMASK;
-		if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+length)<0) {
+		if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+length)<0) {
 			hdd_error_occured(c);	// uses and preserves errno !!!
 			mfs_arg_errlog_silent(LOG_WARNING,"truncate_chunk: file:%s - ftruncate error",fname);
 			hdd_io_end(c);
 			hdd_chunk_release(c);
 			return MFS_ERROR_IO;
 		}
-#ifdef PRESERVE_BLOCK
-		if (c->blockno>=blocks) {
-			c->blockno = 0xFFFF;	// invalidate truncated block
-		}
-#endif
 		if (blocksize>0) {
-			if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+(blocks<<MFSBLOCKBITS))<0) {
+			if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+(blocks<<MFSBLOCKBITS))<0) {
 				hdd_error_occured(c);	// uses and preserves errno !!!
 				mfs_arg_errlog_silent(LOG_WARNING,"truncate_chunk: file:%s - ftruncate error",fname);
 				hdd_io_end(c);
 				hdd_chunk_release(c);
 				return MFS_ERROR_IO;
 			}
-#ifdef PRESERVE_BLOCK
-			if (c->blockno!=blocknum) {
-
-				if (mypread(c->fd,c->block,blocksize,c->hdrsize+CHUNKCRCSIZE+blockpos)!=(signed)blocksize) {
-#else /* PRESERVE_BLOCK */
-			if (mypread(c->fd,blockbuffer,blocksize,c->hdrsize+CHUNKCRCSIZE+blockpos)!=(signed)blocksize) {
-#endif /* PRESERVE_BLOCK */
+			if (mypread(c->op->fd,blockbuffer,blocksize,c->hdrsize+CHUNKCRCSIZE+blockpos)!=(signed)blocksize) {
 				hdd_error_occured(c);	// uses and preserves errno !!!
 				mfs_arg_errlog_silent(LOG_WARNING,"truncate_chunk: file:%s - read error",fname);
 				hdd_io_end(c);
@@ -4012,26 +6962,19 @@ static int hdd_int_truncate(uint64_t chunkid,uint32_t version,uint32_t newversio
 				return MFS_ERROR_IO;
 			}
 			hdd_stats_read(blocksize);
-#ifdef PRESERVE_BLOCK
-			}
-			memset(c->block+blocksize,0,MFSBLOCKSIZE-blocksize);
-			c->blockno = blocknum;
-			i = mycrc32_zeroexpanded(0,c->block,blocksize,MFSBLOCKSIZE-blocksize);
-#else /* PRESERVE_BLOCK */
 			i = mycrc32_zeroexpanded(0,blockbuffer,blocksize,MFSBLOCKSIZE-blocksize);
-#endif /* PRESERVE_BLOCK */
-			ptr = (c->crc)+(4*blocknum);
+			ptr = (c->op->crc)+(4*blocknum);
 			put32bit(&ptr,i);
 			blocknum++;
-			c->crcchanged = 1;
+			c->op->crcchanged = 1;
 		} else {
-			ptr = (c->crc)+(4*blocknum);
+			ptr = (c->op->crc)+(4*blocknum);
 		}
 		if (blocknum < c->blocks) {
 			for (i=blocknum ; i<c->blocks ; i++) {
 				put32bit(&ptr,emptyblockcrc);
 			}
-			c->crcchanged = 1;
+			c->op->crcchanged = 1;
 		}
 	}
 	if (c->blocks != blocks && c->owner!=NULL) {
@@ -4064,17 +7007,14 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 	uint8_t truncneeded;
 	char ofname[PATH_MAX];
 	char fname[PATH_MAX];
-#ifdef PRESERVE_BLOCK
-	uint8_t hdrbuffer[CHUNKMAXHDRSIZE];
-#else /* PRESERVE_BLOCK */
 	uint8_t *blockbuffer,*hdrbuffer;
 	blockbuffer = pthread_getspecific(blockbufferkey);
 	if (blockbuffer==NULL) {
-# ifdef MMAP_ALLOC
+#ifdef MMAP_ALLOC
 		blockbuffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
+#else
 		blockbuffer = malloc(MFSBLOCKSIZE);
-# endif
+#endif
 		passert(blockbuffer);
 		zassert(pthread_setspecific(blockbufferkey,blockbuffer));
 	}
@@ -4084,7 +7024,6 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 		passert(hdrbuffer);
 		zassert(pthread_setspecific(hdrbufferkey,hdrbuffer));
 	}
-#endif /* PRESERVE_BLOCK */
 #ifdef HAVE___SYNC_OP_AND_FETCH
 	sp = __sync_or_and_fetch(&Sparsification,0);
 #else
@@ -4108,7 +7047,7 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 		copyversion = newversion;
 	}
 	zassert(pthread_mutex_lock(&folderlock));
-	f = hdd_getfolder();
+	f = hdd_getfolder_for_copy(oc);
 	if (f==NULL) {
 		zassert(pthread_mutex_unlock(&folderlock));
 		hdd_chunk_release(oc);
@@ -4133,11 +7072,13 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 			hdd_chunk_release(oc);
 			return MFS_ERROR_IO;
 		}
+		hdd_index_chunk_set(oc);
 		status = hdd_io_begin(oc,MODE_IGNVERS);
 		if (status!=MFS_STATUS_OK) {
 			hdd_error_occured(oc);	// uses and preserves errno !!!
 			if (rename(fname,ofname)>=0) {
 				oc->version = version;
+				hdd_index_chunk_set(oc);
 			}
 			hdd_chunk_delete(c);
 			hdd_chunk_release(oc);
@@ -4145,13 +7086,14 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 		}
 		ptr = vbuff;
 		put32bit(&ptr,newversion);
-		if (mypwrite(oc->fd,vbuff,4,16)!=4) {
+		if (mypwrite(oc->op->fd,vbuff,4,16)!=4) {
 			hdd_error_occured(oc);	// uses and preserves errno !!!
 			mfs_arg_errlog_silent(LOG_WARNING,"duptrunc_chunk: file:%s - write error",fname);
 			hdd_chunk_delete(c);
 			hdd_io_end(oc);
 			if (rename(fname,ofname)>=0) {
 				oc->version = version;
+				hdd_index_chunk_set(oc);
 			}
 			hdd_chunk_release(oc);
 			return MFS_ERROR_IO;
@@ -4182,8 +7124,8 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 	ptr = hdrbuffer+8;
 	put64bit(&ptr,copychunkid);
 	put32bit(&ptr,copyversion);
-	memcpy(hdrbuffer+c->hdrsize,oc->crc,CHUNKCRCSIZE);
-	if (write(c->fd,hdrbuffer,c->hdrsize)!=(ssize_t)(c->hdrsize)) {
+	memcpy(hdrbuffer+c->hdrsize,oc->op->crc,CHUNKCRCSIZE);
+	if (write(c->op->fd,hdrbuffer,c->hdrsize)!=(ssize_t)(c->hdrsize)) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		hdd_generate_filename(fname,c); // preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"duptrunc_chunk: file:%s - hdr write error",fname);
@@ -4195,23 +7137,16 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 		return MFS_ERROR_IO;
 	}
 	hdd_stats_write(c->hdrsize);
-	lseek(c->fd,c->hdrsize+CHUNKCRCSIZE,SEEK_SET);
-#ifndef PRESERVE_BLOCK
-	lseek(oc->fd,oc->hdrsize+CHUNKCRCSIZE,SEEK_SET);
-#endif /* PRESERVE_BLOCK */
+	lseek(c->op->fd,c->hdrsize+CHUNKCRCSIZE,SEEK_SET);
+	lseek(oc->op->fd,oc->hdrsize+CHUNKCRCSIZE,SEEK_SET);
 	if (blocks>oc->blocks) { // expanding
 //		truncneeded = 0; - always expanding here
-		for (block=0 ; block<oc->blocks ; block++) {
-#ifdef PRESERVE_BLOCK
-			if (oc->blockno==block) {
-				memcpy(c->block,oc->block,MFSBLOCKSIZE);
-				retsize = MFSBLOCKSIZE;
-			} else {
-				retsize = mypread(oc->fd,c->block,MFSBLOCKSIZE,oc->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS));
-			}
-#else /* PRESERVE_BLOCK */
-			retsize = read(oc->fd,blockbuffer,MFSBLOCKSIZE);
-#endif /* PRESERVE_BLOCK */
+		block = 0;
+		if (hdd_int_clone_blocks(oc,c,oc->blocks)) {
+			block = oc->blocks;
+		}
+		for ( ; block<oc->blocks ; block++) {
+			retsize = read(oc->op->fd,blockbuffer,MFSBLOCKSIZE);
 			if (retsize!=MFSBLOCKSIZE) {
 				hdd_error_occured(oc);	// uses and preserves errno !!!
 				hdd_generate_filename(ofname,oc); // preserves errno !!!
@@ -4225,15 +7160,8 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 				hdd_chunk_release(oc);
 				return MFS_ERROR_IO;
 			}
-#ifdef PRESERVE_BLOCK
-			if (oc->blockno!=block) {
-				hdd_stats_read(MFSBLOCKSIZE);
-			}
-			writeptr = c->block;
-#else /* PRESERVE_BLOCK */
 			hdd_stats_read(MFSBLOCKSIZE);
 			writeptr = blockbuffer;
-#endif /* PRESERVE_BLOCK */
 			if (sp) {
 				// sparsify
 				p = writeptr;
@@ -4262,7 +7190,7 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 				retsize = 0;
 				nzstart = nzend = 0;
 			} else {
-				retsize = mypwrite(c->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
+				retsize = mypwrite(c->op->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
 			}
 			if (retsize!=(int32_t)(nzend-nzstart)) {
 				hdd_error_occured(c);	// uses and preserves errno !!!
@@ -4281,12 +7209,9 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 //			} else {
 //				truncneeded = 0;
 //			}
-#ifdef PRESERVE_BLOCK
-			c->blockno = block;
-#endif /* PRESERVE_BLOCK */
 		}
 		// always truncate because we are expanding chunk here
-		if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocks)<<MFSBLOCKBITS))<0) {
+		if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocks)<<MFSBLOCKBITS))<0) {
 			hdd_error_occured(c);	// uses and preserves errno !!!
 			hdd_generate_filename(fname,c); // preserves errno !!!
 			mfs_arg_errlog_silent(LOG_WARNING,"duptrunc_chunk: file:%s - ftruncate error",fname);
@@ -4304,17 +7229,12 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 		uint32_t blocksize = (length&MFSBLOCKMASK);
 		if (blocksize==0) { // aligned shring
 			truncneeded = 0;
-			for (block=0 ; block<blocks ; block++) {
-#ifdef PRESERVE_BLOCK
-				if (oc->blockno==block) {
-					memcpy(c->block,oc->block,MFSBLOCKSIZE);
-					retsize = MFSBLOCKSIZE;
-				} else {
-					retsize = mypread(oc->fd,c->block,MFSBLOCKSIZE,oc->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS));
-				}
-#else /* PRESERVE_BLOCK */
-				retsize = read(oc->fd,blockbuffer,MFSBLOCKSIZE);
-#endif /* PRESERVE_BLOCK */
+			block = 0;
+			if (hdd_int_clone_blocks(oc,c,blocks)) {
+				block = blocks;
+			}
+			for ( ; block<blocks ; block++) {
+				retsize = read(oc->op->fd,blockbuffer,MFSBLOCKSIZE);
 				if (retsize!=MFSBLOCKSIZE) {
 					hdd_error_occured(oc);	// uses and preserves errno !!!
 					hdd_generate_filename(ofname,oc); // preserves errno !!!
@@ -4328,15 +7248,8 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 					hdd_chunk_release(oc);
 					return MFS_ERROR_IO;
 				}
-#ifdef PRESERVE_BLOCK
-				if (oc->blockno!=block) {
-					hdd_stats_read(MFSBLOCKSIZE);
-				}
-				writeptr = c->block;
-#else /* PRESERVE_BLOCK */
 				hdd_stats_read(MFSBLOCKSIZE);
 				writeptr = blockbuffer;
-#endif /* PRESERVE_BLOCK */
 				if (sp) {
 					// sparsify
 					p = writeptr;
@@ -4365,7 +7278,7 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 					retsize = 0;
 					nzstart = nzend = 0;
 				} else {
-					retsize = mypwrite(c->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
+					retsize = mypwrite(c->op->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
 				}
 				if (retsize!=(int32_t)(nzend-nzstart)) {
 					hdd_error_occured(c);	// uses and preserves errno !!!
@@ -4384,12 +7297,9 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 				} else {
 					truncneeded = 0;
 				}
-#ifdef PRESERVE_BLOCK
-				c->blockno = block;
-#endif /* PRESERVE_BLOCK */
 			}
 			if (truncneeded) {
-				if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocks)<<MFSBLOCKBITS))<0) {
+				if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocks)<<MFSBLOCKBITS))<0) {
 					hdd_error_occured(c);	// uses and preserves errno !!!
 					hdd_generate_filename(fname,c); // preserves errno !!!
 					mfs_arg_errlog_silent(LOG_WARNING,"duptrunc_chunk: file:%s - ftruncate error",fname);
@@ -4406,17 +7316,12 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 			}
 		} else { // misaligned shrink
 //			truncneeded = 0; - we need to check it only in last block
-			for (block=0 ; block<blocks-1 ; block++) {
-#ifdef PRESERVE_BLOCK
-				if (oc->blockno==block) {
-					memcpy(c->block,oc->block,MFSBLOCKSIZE);
-					retsize = MFSBLOCKSIZE;
-				} else {
-					retsize = mypread(oc->fd,c->block,MFSBLOCKSIZE,oc->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS));
-				}
-#else /* PRESERVE_BLOCK */
-				retsize = read(oc->fd,blockbuffer,MFSBLOCKSIZE);
-#endif /* PRESERVE_BLOCK */
+			block = 0;
+			if (hdd_int_clone_blocks(oc,c,blocks-1)) {
+				block = blocks-1;
+			}
+			for ( ; block<blocks-1 ; block++) {
+				retsize = read(oc->op->fd,blockbuffer,MFSBLOCKSIZE);
 				if (retsize!=MFSBLOCKSIZE) {
 					hdd_error_occured(oc);	// uses and preserves errno !!!
 					hdd_generate_filename(ofname,oc); // preserves errno !!!
@@ -4430,15 +7335,8 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 					hdd_chunk_release(oc);
 					return MFS_ERROR_IO;
 				}
-#ifdef PRESERVE_BLOCK
-				if (oc->blockno!=block) {
-					hdd_stats_read(MFSBLOCKSIZE);
-				}
-				writeptr = c->block;
-#else /* PRESERVE_BLOCK */
 				hdd_stats_read(MFSBLOCKSIZE);
 				writeptr = blockbuffer;
-#endif /* PRESERVE_BLOCK */
 				if (sp) {
 					// sparsify
 					p = writeptr;
@@ -4467,7 +7365,7 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 					retsize = 0;
 					nzstart = nzend = 0;
 				} else {
-					retsize = mypwrite(c->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
+					retsize = mypwrite(c->op->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
 				}
 				if (retsize!=(int32_t)(nzend-nzstart)) {
 					hdd_error_occured(c);	// uses and preserves errno !!!
@@ -4488,16 +7386,7 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 //				}
 			}
 			block = blocks-1;
-#ifdef PRESERVE_BLOCK
-			if (oc->blockno==block) {
-				memcpy(c->block,oc->block,blocksize);
-				retsize = blocksize;
-			} else {
-				retsize = mypread(oc->fd,c->block,blocksize,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS));
-			}
-#else /* PRESERVE_BLOCK */
-			retsize = read(oc->fd,blockbuffer,blocksize);
-#endif /* PRESERVE_BLOCK */
+			retsize = read(oc->op->fd,blockbuffer,blocksize);
 			if (retsize!=(signed)blocksize) {
 				hdd_error_occured(oc);	// uses and preserves errno !!!
 				hdd_generate_filename(ofname,oc); // preserves errno !!!
@@ -4511,17 +7400,9 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 				hdd_chunk_release(oc);
 				return MFS_ERROR_IO;
 			}
-#ifdef PRESERVE_BLOCK
-			if (oc->blockno!=block) {
-				hdd_stats_read(blocksize);
-			}
-			memset(c->block+blocksize,0,MFSBLOCKSIZE-blocksize);
-			writeptr = c->block;
-#else /* PRESERVE_BLOCK */
 			hdd_stats_read(blocksize);
 			memset(blockbuffer+blocksize,0,MFSBLOCKSIZE-blocksize);
 			writeptr = blockbuffer;
-#endif /* PRESERVE_BLOCK */
 			if (sp) {
 				// sparsify
 				p = writeptr;
@@ -4553,7 +7434,7 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 				retsize = 0;
 				nzstart = nzend = 0;
 			} else {
-				retsize = mypwrite(c->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
+				retsize = mypwrite(c->op->fd,writeptr+nzstart,nzend-nzstart,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
 			}
 			if (retsize!=(int32_t)(nzend-nzstart)) {
 				hdd_error_occured(c);	// uses and preserves errno !!!
@@ -4573,17 +7454,10 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 				truncneeded = 0;
 			}
 			ptr = hdrbuffer+c->hdrsize+4*(blocks-1);
-#ifdef PRESERVE_BLOCK
-			crc = mycrc32_zeroexpanded(0,c->block,blocksize,MFSBLOCKSIZE-blocksize);
-#else /* PRESERVE_BLOCK */
 			crc = mycrc32_zeroexpanded(0,blockbuffer,blocksize,MFSBLOCKSIZE-blocksize);
-#endif /* PRESERVE_BLOCK */
 			put32bit(&ptr,crc);
-#ifdef PRESERVE_BLOCK
-			c->blockno = block;
-#endif /* PRESERVE_BLOCK */
 			if (truncneeded) {
-				if (ftruncate(c->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocks)<<MFSBLOCKBITS))<0) {
+				if (ftruncate(c->op->fd,c->hdrsize+CHUNKCRCSIZE+(((uint32_t)blocks)<<MFSBLOCKBITS))<0) {
 					hdd_error_occured(c);	// uses and preserves errno !!!
 					hdd_generate_filename(fname,c); // preserves errno !!!
 					mfs_arg_errlog_silent(LOG_WARNING,"duptrunc_chunk: file:%s - ftruncate error",fname);
@@ -4601,9 +7475,9 @@ static int hdd_int_duptrunc(uint64_t chunkid,uint32_t version,uint32_t newversio
 		}
 	}
 // and now write header
-	memcpy(c->crc,hdrbuffer+c->hdrsize,CHUNKCRCSIZE);
-	lseek(c->fd,c->hdrsize,SEEK_SET);
-	if (write(c->fd,hdrbuffer+c->hdrsize,CHUNKCRCSIZE)!=(ssize_t)(CHUNKCRCSIZE)) {
+	memcpy(c->op->crc,hdrbuffer+c->hdrsize,CHUNKCRCSIZE);
+	lseek(c->op->fd,c->hdrsize,SEEK_SET);
+	if (write(c->op->fd,hdrbuffer+c->hdrsize,CHUNKCRCSIZE)!=(ssize_t)(CHUNKCRCSIZE)) {
 		hdd_error_occured(c);	// uses and preserves errno !!!
 		hdd_generate_filename(fname,c); // preserves errno !!!
 		mfs_arg_errlog_silent(LOG_WARNING,"duptrunc_chunk: file:%s - hdr write error",fname);
@@ -4679,6 +7553,21 @@ static int hdd_int_delete(uint64_t chunkid,uint32_t version) {
 	return MFS_STATUS_OK;
 }
 
+// removes copy of chunk from read cache before chunk is changed (also closes copy used by readers of opened chunk)
+static void hdd_rcache_forget(uint64_t chunkid) {
+	chunk *c;
+	if (hdd_rcache_active()==0) {
+		return;
+	}
+	c = hdd_chunk_find(chunkid);
+	if (c==NULL) {
+		hdd_rcache_invalidate(chunkid);
+		return;
+	}
+	hdd_rcache_drop(c);
+	hdd_chunk_release(c);
+}
+
 /* all chunk operations in one call */
 // newversion>0 && length==0xFFFFFFFF && copychunkid==0      -> change version
 // newversion>0 && length==0xFFFFFFFF && copychunkid>0       -> duplicate
@@ -4713,6 +7602,10 @@ int hdd_chunkop(uint64_t chunkid,uint32_t version,uint32_t newversion,uint64_t c
 		}
 	}
 	zassert(pthread_mutex_unlock(&statslock));
+	if (newversion>0 || length==0) { // version change, truncate or delete - cached blocks of this chunk are useless
+		hdd_bcache_invalidate_chunk(chunkid);
+		hdd_rcache_forget(chunkid);
+	}
 	if (newversion>0) {
 		if (length==0xFFFFFFFF) {
 			if (copychunkid==0) {
@@ -4745,18 +7638,20 @@ int hdd_chunkop(uint64_t chunkid,uint32_t version,uint32_t newversion,uint64_t c
 chunk* hdd_random_chunk(folder *f) {
 	uint32_t try;
 	uint32_t pos;
+	uint32_t lockpos;
 	chunk *c;
 	char fname[PATH_MAX];
 
 	zassert(pthread_mutex_lock(&folderlock));
-	zassert(pthread_mutex_lock(&hashlock));
 	if (f->chunkcount>0) {
 		for (try=0 ; try<RANDOM_CHUNK_RETRIES ; try++) {
 			pos = rndu32_ranged(f->chunkcount);
 			c = f->chunktab[pos];
+			lockpos = HASHLOCKPOS(c->chunkid);
+			hdd_hashlock_lock(lockpos);
 			if (c->state==CH_AVAIL && c->damaged==0) {
 				c->state = CH_LOCKED;
-				zassert(pthread_mutex_unlock(&hashlock));
+				hdd_hashlock_unlock(lockpos);
 				zassert(pthread_mutex_unlock(&folderlock));
 				if (c->validattr==0) {
 					if (hdd_chunk_getattr(c)) {
@@ -4771,15 +7666,45 @@ chunk* hdd_random_chunk(folder *f) {
 					return c;
 				}
 				zassert(pthread_mutex_lock(&folderlock));
-				zassert(pthread_mutex_lock(&hashlock));
+			} else {
+				hdd_hashlock_unlock(lockpos);
 			}
 		}
 	}
-	zassert(pthread_mutex_unlock(&hashlock));
 	zassert(pthread_mutex_unlock(&folderlock));
 	return NULL;
 }
 
+/* paces data read by chunk moves (all rebalance threads and jobs together) to MoveBandwidth MiB/s */
+static void hdd_move_throttle(uint32_t size) {
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static uint64_t nextusec = 0;
+	uint64_t usectime,startusec;
+	uint32_t bw;
+
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	bw = __sync_or_and_fetch(&MoveBandwidth,0);
+#else
+	pthread_mutex_lock(&cfglock);
+	bw = MoveBandwidth;
+	pthread_mutex_unlock(&cfglock);
+#endif
+	if (bw==0) {
+		return;
+	}
+	usectime = monotonic_useconds();
+	zassert(pthread_mutex_lock(&lock));
+	if (nextusec<usectime) {
+		nextusec = usectime;
+	}
+	startusec = nextusec;
+	nextusec += (((uint64_t)size) * UINT64_C(1000000)) / (((uint64_t)bw) << 20);
+	zassert(pthread_mutex_unlock(&lock));
+	if (startusec>usectime) {
+		portable_usleep(startusec-usectime);
+	}
+}
+
 static int hdd_int_move(folder *fsrc,folder *fdst) {
 	uint8_t *wptr;
 	const uint8_t *rptr;
@@ -4799,20 +7724,16 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 	uint8_t sp;
 	uint32_t nzstart,nzend;
 	uint8_t truncneeded;
+	uint16_t i,batch;
+	uint32_t bsize;
+	uint64_t srcoff,dstoff;
 	char fname[PATH_MAX];
-#ifdef PRESERVE_BLOCK
-	uint8_t hdrbuffer[CHUNKMAXHDRSIZE];
-#else /* PRESERVE_BLOCK */
-	uint8_t *blockbuffer,*hdrbuffer;
-	blockbuffer = pthread_getspecific(blockbufferkey);
-	if (blockbuffer==NULL) {
-# ifdef MMAP_ALLOC
-		blockbuffer = mmap(NULL,MFSBLOCKSIZE,PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,-1,0);
-# else
-		blockbuffer = malloc(MFSBLOCKSIZE);
-# endif
-		passert(blockbuffer);
-		zassert(pthread_setspecific(blockbufferkey,blockbuffer));
+	uint8_t *movebuffer,*hdrbuffer;
+	movebuffer = pthread_getspecific(batchbufferkey);
+	if (movebuffer==NULL) {
+		movebuffer = malloc(MOVE_BATCH_BLOCKS*MFSBLOCKSIZE);
+		passert(movebuffer);
+		zassert(pthread_setspecific(batchbufferkey,movebuffer));
 	}
 	hdrbuffer = pthread_getspecific(hdrbufferkey);
 	if (hdrbuffer==NULL) {
@@ -4820,7 +7741,6 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 		passert(hdrbuffer);
 		zassert(pthread_setspecific(hdrbufferkey,hdrbuffer));
 	}
-#endif /* PRESERVE_BLOCK */
 #ifdef HAVE___SYNC_OP_AND_FETCH
 	sp = __sync_or_and_fetch(&Sparsification,0);
 #else
@@ -4883,7 +7803,7 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 	wptr = hdrbuffer+8;
 	put64bit(&wptr,c->chunkid);
 	put32bit(&wptr,c->version);
-	memcpy(hdrbuffer+new_hdrsize,c->crc,CHUNKCRCSIZE);
+	memcpy(hdrbuffer+new_hdrsize,c->op->crc,CHUNKCRCSIZE);
 	if (c->blocks<MFSBLOCKSINCHUNK) {
 		memcpy(hdrbuffer+new_hdrsize+4*c->blocks,emptychunkcrc,4*(MFSBLOCKSINCHUNK-c->blocks));
 	}
@@ -4897,19 +7817,55 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 		return MFS_ERROR_IO;
 	}
 	hdd_stats_write(new_hdrsize+CHUNKCRCSIZE);
-	lseek(c->fd,c->hdrsize+CHUNKCRCSIZE,SEEK_SET);
-	rptr = c->crc;
+	srcoff = c->hdrsize+CHUNKCRCSIZE;
+	dstoff = new_hdrsize+CHUNKCRCSIZE;
 	truncneeded = 0;
-	for (block=0 ; block<c->blocks ; block++) {
+	block = 0;
+	// both folders on the same file system - copy (or share) data inside the kernel, crc table is copied anyway, so data is still verified by readers and chunk tester
+	if (fsrc->devid==fdst->devid && c->blocks>0) {
+		hdd_move_throttle(((uint32_t)c->blocks)<<MFSBLOCKBITS);
+		if (hdd_int_copy_range(c->op->fd,fsrc,srcoff,new_fd,fdst,dstoff,((uint64_t)c->blocks)<<MFSBLOCKBITS,hdd_clone_mode())) {
+			block = c->blocks;
+		}
+	}
+	rptr = c->op->crc;
+	while (block<c->blocks) {
+		batch = c->blocks - block;
+		if (batch>MOVE_BATCH_BLOCKS) {
+			batch = MOVE_BATCH_BLOCKS;
+		}
+		if (sp) { // leading zero blocks stored as hole - skip them (sparse target doesn't need them either)
+			p = rptr;
+			for (i=0 ; i<batch ; i++) {
+				bcrc = get32bit(&p);
+				if (bcrc!=emptyblockcrc) {
+					break;
+				}
+			}
+			if (i>0) {
+				i = hdd_hole_length(c->op->fd,srcoff+(((uint32_t)block)<<MFSBLOCKBITS),((uint32_t)i)<<MFSBLOCKBITS)>>MFSBLOCKBITS;
+			}
+			if (i>0) {
+				hdd_stats_hole(HSC_HOLESKIP,((uint32_t)i)<<MFSBLOCKBITS);
+				rptr += 4*i;
+				block += i;
+				truncneeded = 1;
+				continue;
+			}
+		}
+		bsize = ((uint32_t)batch)<<MFSBLOCKBITS;
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+		// start reading next batch while this one is checked and written
+		if (block+batch<c->blocks) {
+			posix_fadvise(c->op->fd,srcoff+((((uint32_t)block)+batch)<<MFSBLOCKBITS),MOVE_BATCH_BLOCKS*MFSBLOCKSIZE,POSIX_FADV_WILLNEED);
+		}
+#endif
+		hdd_move_throttle(bsize);
 		ts = monotonic_nseconds();
-#ifdef PRESERVE_BLOCK
-		retsize = read(c->fd,c->block,MFSBLOCKSIZE);
-#else /* PRESERVE_BLOCK */
-		retsize = read(c->fd,blockbuffer,MFSBLOCKSIZE);
-#endif /* PRESERVE_BLOCK */
+		retsize = mypread(c->op->fd,movebuffer,bsize,srcoff+(((uint32_t)block)<<MFSBLOCKBITS));
 		error = errno;
 		te = monotonic_nseconds();
-		if (retsize!=MFSBLOCKSIZE) {
+		if (retsize!=(int32_t)bsize) {
 			errno = error;
 			hdd_error_occured(c);	// uses and preserves errno !!!
 			hdd_generate_filename(fname,c); // preserves errno !!!
@@ -4922,34 +7878,44 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 			free(tmp_filename);
 			return MFS_ERROR_IO;
 		}
-		hdd_stats_dataread(fsrc,MFSBLOCKSIZE,te-ts);
-		hdd_stats_read(MFSBLOCKSIZE);
-#ifdef PRESERVE_BLOCK
-		c->blockno = block;
-#endif
-		bcrc = get32bit(&rptr);
-#ifdef PRESERVE_BLOCK
-		if (bcrc!=mycrc32(0,c->block,MFSBLOCKSIZE)) {
-#else /* PRESERVE_BLOCK */
-		if (bcrc!=mycrc32(0,blockbuffer,MFSBLOCKSIZE)) {
-#endif /* PRESERVE_BLOCK */
-			errno = 0;	// set anything to errno
-			hdd_error_occured(c);	// uses and preserves errno !!!
-			hdd_generate_filename(fname,c); // preserves errno !!!
-			syslog(LOG_WARNING,"move_chunk: file:%s - crc error",fname);
-			close(new_fd);
-			unlink(tmp_filename);
-			hdd_io_end(c);
-			hdd_chunk_release(c);
-			free(tmp_filename);
-			return MFS_ERROR_CRC;
+		hdd_stats_dataread(fsrc,bsize,te-ts);
+		hdd_stats_read(bsize);
+		for (i=0 ; i<batch ; i++) {
+			bcrc = get32bit(&rptr);
+			if (bcrc!=mycrc32(0,movebuffer+(((uint32_t)i)<<MFSBLOCKBITS),MFSBLOCKSIZE)) {
+				errno = 0;	// set anything to errno
+				hdd_error_occured(c);	// uses and preserves errno !!!
+				hdd_generate_filename(fname,c); // preserves errno !!!
+				syslog(LOG_WARNING,"move_chunk: file:%s - crc error",fname);
+				close(new_fd);
+				unlink(tmp_filename);
+				hdd_io_end(c);
+				hdd_chunk_release(c);
+				free(tmp_filename);
+				return MFS_ERROR_CRC;
+			}
 		}
-#ifdef PRESERVE_BLOCK
-		writeptr = c->block;
-#else /* PRESERVE_BLOCK */
-		writeptr = blockbuffer;
-#endif /* PRESERVE_BLOCK */
-		if (sp) {
+		if (sp==0) { // whole batch with one write
+			ts = monotonic_nseconds();
+			retsize = mypwrite(new_fd,movebuffer,bsize,dstoff+(((uint32_t)block)<<MFSBLOCKBITS));
+			te = monotonic_nseconds();
+			if (retsize!=(int32_t)bsize) {
+				mfs_arg_errlog_silent(LOG_WARNING,"move_chunk: file:%s - data write error",tmp_filename);
+				close(new_fd);
+				unlink(tmp_filename);
+				hdd_io_end(c);
+				hdd_chunk_release(c);
+				free(tmp_filename);
+				return MFS_ERROR_IO;	//write error
+			}
+			hdd_stats_datawrite(fdst,bsize,te-ts);
+			hdd_stats_write(bsize);
+			truncneeded = 0;
+			block += batch;
+			continue;
+		}
+		for (i=0 ; i<batch ; i++,block++) {
+			writeptr = movebuffer+(((uint32_t)i)<<MFSBLOCKBITS);
 			// sparsify
 			p = writeptr;
 			e = p+MFSBLOCKSIZE;
@@ -4969,33 +7935,30 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 				nzstart &= UINT32_C(0xFFFFFE00); // floor(nzstart/512)*512
 				nzend = (nzend+511) & UINT32_C(0xFFFFFE00); // ceil(nzend/512)*512
 			}
-		} else {
-			nzstart = 0;
-			nzend = MFSBLOCKSIZE;
-		}
-		ts = monotonic_nseconds();
-		if (nzend==nzstart) {
-			retsize = 0;
-			nzstart = nzend = 0;
-		} else {
-			retsize = mypwrite(new_fd,writeptr+nzstart,nzend-nzstart,new_hdrsize+CHUNKCRCSIZE+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
-		}
-		te = monotonic_nseconds();
-		if (retsize!=(int32_t)(nzend-nzstart)) {
-			mfs_arg_errlog_silent(LOG_WARNING,"move_chunk: file:%s - data write error",tmp_filename);
-			close(new_fd);
-			unlink(tmp_filename);
-			hdd_io_end(c);
-			hdd_chunk_release(c);
-			free(tmp_filename);
-			return MFS_ERROR_IO;	//write error
-		}
-		hdd_stats_datawrite(fdst,nzend-nzstart,te-ts);
-		hdd_stats_write(nzend-nzstart);
-		if (nzend!=MFSBLOCKSIZE) {
-			truncneeded = 1;
-		} else {
-			truncneeded = 0;
+			ts = monotonic_nseconds();
+			if (nzend==nzstart) {
+				retsize = 0;
+				nzstart = nzend = 0;
+			} else {
+				retsize = mypwrite(new_fd,writeptr+nzstart,nzend-nzstart,dstoff+(((uint32_t)block)<<MFSBLOCKBITS)+nzstart);
+			}
+			te = monotonic_nseconds();
+			if (retsize!=(int32_t)(nzend-nzstart)) {
+				mfs_arg_errlog_silent(LOG_WARNING,"move_chunk: file:%s - data write error",tmp_filename);
+				close(new_fd);
+				unlink(tmp_filename);
+				hdd_io_end(c);
+				hdd_chunk_release(c);
+				free(tmp_filename);
+				return MFS_ERROR_IO;	//write error
+			}
+			hdd_stats_datawrite(fdst,nzend-nzstart,te-ts);
+			hdd_stats_write(nzend-nzstart);
+			if (nzend!=MFSBLOCKSIZE) {
+				truncneeded = 1;
+			} else {
+				truncneeded = 0;
+			}
 		}
 	}
 	if (truncneeded) {
@@ -5037,9 +8000,9 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 		return MFS_ERROR_IO;
 	}
 
-	if (c->fd>=0) {
-		close(c->fd);
-		c->fd = new_fd;
+	if (c->op->fd>=0) {
+		close(c->op->fd);
+		c->op->fd = new_fd;
 	} else {
 		close(new_fd);
 	}
@@ -5052,12 +8015,17 @@ static int hdd_int_move(folder *fsrc,folder *fdst) {
 	zassert(pthread_mutex_lock(&folderlock));
 	fsrc->needrefresh = 1;
 	fdst->needrefresh = 1;
+	if (fsrc->move_start_usec>0) {
+		fsrc->move_bytes += ((uint64_t)(c->blocks))<<MFSBLOCKBITS;
+	}
 	hdd_remove_chunk_from_folder(c,fsrc);
 	hdd_add_chunk_to_folder(c,fdst);
+	hdd_index_log(fsrc,INDEX_REC_DEL,c->chunkid,0,0);
+	hdd_index_log(fdst,INDEX_REC_SET,c->chunkid,c->version,c->pathid);
 	zassert(pthread_mutex_unlock(&folderlock));
 	zassert(pthread_mutex_lock(&testlock));
-	hdd_remove_chunk_from_test_chain(c,fsrc);
-	hdd_add_chunk_to_test_chain(c,fdst);
+	hdd_remove_chunk_from_subfolder(c,fsrc);
+	hdd_add_chunk_to_subfolder(c,fdst);
 	zassert(pthread_mutex_unlock(&testlock));
 	hdd_chunk_release(c);
 	return MFS_STATUS_OK;
@@ -5095,6 +8063,7 @@ static inline int hdd_rebalance_find_servers(folder **fsrc,folder **fdst,uint8_t
 	uint8_t rebalance_servers;
 	uint8_t waitcond;
 	double monotonic_time;
+	uint64_t usectime;
 
 	monotonic_time = 0.0;
 	// check REBALANCE_FORCE_SRC and REBALANCE_FORCE_DST
@@ -5135,11 +8104,13 @@ static inline int hdd_rebalance_find_servers(folder **fsrc,folder **fdst,uint8_t
 						rebalance_servers |= 1;
 					} else if (f->chunkcount>0) {
 						f->tmpbalancemode = REBALANCE_SRC;
+						f->move_remaining = 0;
 						rebalance_servers |= 2;
 					}
 				} else if (belowcnt==0) {
 					if (f->balancemode==REBALANCE_FORCE_SRC && f->chunkcount>0) {
 						f->tmpbalancemode = REBALANCE_SRC;
+						f->move_remaining = f->total-f->avail;
 						rebalance_servers |= 2;
 					} else if (usage<REBALANCE_DST_MAX_USAGE) {
 						f->tmpbalancemode = REBALANCE_DST;
@@ -5151,6 +8122,7 @@ static inline int hdd_rebalance_find_servers(folder **fsrc,folder **fdst,uint8_t
 						rebalance_servers |= 1;
 					} else if (f->balancemode==REBALANCE_FORCE_SRC && f->chunkcount>0) {
 						f->tmpbalancemode = REBALANCE_SRC;
+						f->move_remaining = f->total-f->avail;
 						rebalance_servers |= 2;
 					}
 				}
@@ -5200,6 +8172,7 @@ static inline int hdd_rebalance_find_servers(folder **fsrc,folder **fdst,uint8_t
 							rebalance_servers |= 1;
 						} else if ((((usage > avgusage + rebalancediff) && abovecnt>0) || ((usage >= avgusage - rebalancediff) && abovecnt==0)) && f->chunkcount>0) {
 							f->tmpbalancemode = REBALANCE_SRC;
+							f->move_remaining = (usage>avgusage)?(uint64_t)((usage-avgusage)*f->total):0;
 							rebalance_servers |= 2;
 						}
 					}
@@ -5207,6 +8180,23 @@ static inline int hdd_rebalance_find_servers(folder **fsrc,folder **fdst,uint8_t
 			}
 		}
 	}
+	// progress of moving data out of source folders
+	usectime = 0;
+	for (f=folderhead ; f ; f=f->next) {
+		if (f->tmpbalancemode==REBALANCE_SRC && rebalance_servers==3) {
+			if (f->move_start_usec==0) {
+				if (usectime==0) {
+					usectime = monotonic_useconds();
+				}
+				f->move_start_usec = usectime;
+				f->move_bytes = 0;
+			}
+		} else {
+			f->move_start_usec = 0;
+			f->move_bytes = 0;
+			f->move_remaining = 0;
+		}
+	}
 	*fdst = NULL;
 	*fsrc = NULL;
 	if (rebalance_servers==3) {
@@ -5537,15 +8527,44 @@ void* hdd_rebalance_thread(void *arg) {
 	return arg;
 }
 
+/* client latency is measured over last full minute and current one - every check too high latency halves test budget of the folder (down to 1/2^TEST_MAX_BACKOFF), every check with acceptable latency doubles it back */
+static void hdd_test_backoff_update(folder *f,uint32_t maxlatency) {
+	hddstats s;
+	uint64_t ops,nsec;
+
+	if (maxlatency==0) {
+		f->testbackoff = 0;
+		return;
+	}
+	zassert(pthread_mutex_lock(&statslock));
+	s = f->stats[f->statspos];
+	hdd_stats_add(&s,&(f->cstat));
+	hdd_stats_collect(f,&s,0);
+	zassert(pthread_mutex_unlock(&statslock));
+	ops = s.rops + s.wops;
+	nsec = s.nsecreadsum + s.nsecwritesum;
+	if (ops>=TEST_LATENCY_MIN_OPS && nsec>ops*maxlatency*UINT64_C(1000000)) {
+		if (f->testbackoff<TEST_MAX_BACKOFF) {
+			f->testbackoff++;
+		}
+	} else if (f->testbackoff>0) {
+		f->testbackoff--;
+	}
+}
+
 void* hdd_tester_thread(void* arg) {
 	folder *f,*tf;
 	chunk *c;
 	uint64_t chunkid;
+	uint32_t lockpos;
+	uint32_t i;
 	uint32_t version;
 	uint64_t testbps;
+	uint32_t testiops;
+	uint32_t maxlatency;
 	uint16_t blocks;
 	uint8_t idlemode;
-	uint64_t st,en,nextdelay,nextevent;
+	uint64_t st,en,nextdelay,iodelay,nextevent;
 #ifdef HDD_TESTER_DEBUG
 	FILE *fd;
 	uint64_t global_st,global_bytes;
@@ -5565,9 +8584,10 @@ void* hdd_tester_thread(void* arg) {
 		version = 0;
 		idlemode = 1;
 		zassert(pthread_mutex_lock(&folderlock));
-		zassert(pthread_mutex_lock(&hashlock));
 		zassert(pthread_mutex_lock(&testlock));
 		testbps = HDDTestMBPS*1024*1024;
+		testiops = HDDTestIOPS;
+		maxlatency = HDDTestMaxLatency;
 
 #ifdef HDD_TESTER_DEBUG
 		if (fd) {
@@ -5597,14 +8617,27 @@ void* hdd_tester_thread(void* arg) {
 					fprintf(fd,"chosen path: %s\n",tf->path);
 				}
 #endif
-				c = tf->testhead;
-				if (c && c->state==CH_AVAIL) {
-					if (c->damaged) {
-						hdd_int_chunk_testmove(c);
-					} else {
+				for (i=0 ; i<TEST_SKIP_MAX && tf->chunkcount>0 && chunkid==0 ; i++) {
+					if (tf->testpos>=tf->chunkcount) { // pass complete
+						tf->testlastpass = (st>tf->testpassstart+1000000)?(st-tf->testpassstart)/1000000:1;
+						tf->testpassstart = st;
+						tf->testpasscnt = 0;
+						tf->testpos = 0;
+						tf->testpasstime = main_time();
+					}
+					c = tf->chunktab[tf->testpos];
+					lockpos = HASHLOCKPOS(c->chunkid);
+					hdd_hashlock_lock(lockpos);
+					if (c->state!=CH_AVAIL) { // locked chunk - try again in the next round
+						hdd_hashlock_unlock(lockpos);
+						break;
+					}
+					tf->testpos++;
+					if (c->damaged==0 && c->testtime<=tf->testpasstime) {
 						chunkid = c->chunkid;
 						version = c->version;
 					}
+					hdd_hashlock_unlock(lockpos);
 				}
 #ifdef HDD_TESTER_DEBUG
 			} else if (fd) {
@@ -5614,7 +8647,6 @@ void* hdd_tester_thread(void* arg) {
 		}
 
 		zassert(pthread_mutex_unlock(&testlock));
-		zassert(pthread_mutex_unlock(&hashlock));
 		zassert(pthread_mutex_unlock(&folderlock));
 
 		blocks = 0;
@@ -5648,6 +8680,14 @@ void* hdd_tester_thread(void* arg) {
 			} else {
 				nextdelay = 10000;
 			}
+			if (testiops>0) { // crc block read by hdd_io_begin and one read per batch
+				iodelay = 1 + (blocks+MOVE_BATCH_BLOCKS-1)/MOVE_BATCH_BLOCKS;
+				iodelay *= 1000000;
+				iodelay /= testiops;
+				if (iodelay>nextdelay) {
+					nextdelay = iodelay;
+				}
+			}
 #ifdef HDD_TESTER_DEBUG
 			if (fd) {
 				fprintf(fd,"blocks: %u ; nextdelay: %"PRIu64".%06u\n",blocks,nextdelay/1000000,(unsigned int)(nextdelay%1000000));
@@ -5655,8 +8695,15 @@ void* hdd_tester_thread(void* arg) {
 #endif
 			nextevent = 0;
 			for (f=folderhead ; f!=NULL ; f=f->next) {
+				if (f->testlatcheck<=st) {
+					hdd_test_backoff_update(f,maxlatency);
+					f->testlatcheck = st+TEST_LATENCY_CHECK_USEC;
+				}
 				if (f==tf) {
-					f->nexttest = st+nextdelay;
+					f->nexttest = st+(nextdelay<<f->testbackoff);
+					if (chunkid>0) {
+						f->testpasscnt++;
+					}
 #ifdef HDD_TESTER_DEBUG
 					if (fd) {
 						fprintf(fd,"%s: set next event to: %"PRIu64".%06u\n",f->path,f->nexttest/1000000,(unsigned int)(f->nexttest%1000000));
@@ -5719,91 +8766,41 @@ void* hdd_tester_thread(void* arg) {
 	return arg;
 }
 
-void hdd_testshuffle(folder *f) {
-	uint32_t i,j,chunksno;
-	chunk **csorttab,*c;
-	zassert(pthread_mutex_lock(&testlock));
-	chunksno = 0;
-	for (c=f->testhead ; c ; c=c->testnext) {
-		chunksno++;
-	}
-	if (chunksno>0) {
-		csorttab = malloc(sizeof(chunk*)*chunksno);
-		passert(csorttab);
-		chunksno = 0;
-		for (c=f->testhead ; c ; c=c->testnext) {
-			csorttab[chunksno++] = c;
-		}
-		if (chunksno>1) {
-			for (i=0 ; i<chunksno-1 ; i++) {
-				j = i+rndu32_ranged(chunksno-i);
-				if (j!=i) {
-					c = csorttab[i];
-					csorttab[i] = csorttab[j];
-					csorttab[j] = c;
-				}
-			}
-		}
-	} else {
-		csorttab = NULL;
-	}
-	f->testhead = NULL;
-	f->testtail = &(f->testhead);
-	f->nexttest = 0;
-	for (i=0 ; i<chunksno ; i++) {
-		c = csorttab[i];
-		c->testnext = NULL;
-		c->testprev = f->testtail;
-		*(c->testprev) = c;
-		f->testtail = &(c->testnext);
-	}
-	if (csorttab) {
-		free(csorttab);
-	}
-	zassert(pthread_mutex_unlock(&testlock));
-}
-
-/*
-int hdd_testcompare(const void *a,const void *b) {
+static int hdd_testcompare(const void *a,const void *b) {
 	chunk const* *aa = (chunk const* *)a;
 	chunk const* *bb = (chunk const* *)b;
-	return (**aa).testtime - (**bb).testtime;
+	return ((**aa).testtime<(**bb).testtime)?-1:((**aa).testtime>(**bb).testtime)?1:0;
 }
 
-void hdd_testsort(folder *f) {
-	uint32_t i,chunksno;
+/* chunks not tested (nor used) for the longest time go first - chunks with equal test time are tested in random order
+ * tester walks folder's chunktab, so it is sorted in place (folderlock:locked) */
+void hdd_testshuffle(folder *f) {
+	uint32_t i,j,chunksno;
 	chunk **csorttab,*c;
 	zassert(pthread_mutex_lock(&testlock));
-	chunksno = 0;
-	for (c=f->testhead ; c ; c=c->testnext) {
-		chunksno++;
-	}
-	if (chunksno>0) {
-		csorttab = malloc(sizeof(chunk*)*chunksno);
-		passert(csorttab);
-		chunksno = 0;
-		for (c=f->testhead ; c ; c=c->testnext) {
-			csorttab[chunksno++] = c;
+	chunksno = f->chunkcount;
+	csorttab = f->chunktab;
+	if (chunksno>1) {
+		for (i=0 ; i<chunksno-1 ; i++) {
+			j = i+rndu32_ranged(chunksno-i);
+			if (j!=i) {
+				c = csorttab[i];
+				csorttab[i] = csorttab[j];
+				csorttab[j] = c;
+			}
 		}
 		qsort(csorttab,chunksno,sizeof(chunk*),hdd_testcompare);
-	} else {
-		csorttab = NULL;
-	}
-	f->testhead = NULL;
-	f->testtail = &(f->testhead);
-	for (i=0 ; i<chunksno ; i++) {
-		c = csorttab[i];
-		c->testnext = NULL;
-		c->testprev = f->testtail;
-		*(c->testprev) = c;
-		f->testtail = &(c->testnext);
-	}
-	if (csorttab) {
-		free(csorttab);
+		for (i=0 ; i<chunksno ; i++) {
+			csorttab[i]->ownerindx = i;
+		}
 	}
+	f->testpos = 0;
+	f->testpasstime = main_time();
+	f->nexttest = 0;
+	f->testpassstart = monotonic_useconds();
+	f->testpasscnt = 0;
 	zassert(pthread_mutex_unlock(&testlock));
 }
-*/
 
 /* initialization */
 
@@ -5861,15 +8858,13 @@ void hdd_create_filename_for_path(char fname[PATH_MAX],const char *fpath,uint16_
 	}
 }
 
-static inline void hdd_add_chunk(folder *f,uint16_t pathid,uint64_t chunkid,uint32_t version,uint16_t blocks,uint16_t hdrsize) {
+static inline void hdd_add_chunk(folder *f,uint16_t pathid,uint64_t chunkid,uint32_t version,uint16_t blocks,uint16_t hdrsize,uint32_t testtime) {
 	struct stat sb;
 	folder *prevf,*currf;
 	chunk *c;
 	uint8_t validattr;
-	uint32_t testtime;
 	char fname[PATH_MAX];
 
-	testtime = 0;
 	if (blocks<MFSBLOCKSINCHUNK) {
 		validattr = 1;
 	} else if (f->sizelimit) {
@@ -5898,12 +8893,13 @@ static inline void hdd_add_chunk(folder *f,uint16_t pathid,uint64_t chunkid,uint
 			return;
 		}
 		blocks = (sb.st_size - hdrsize - CHUNKCRCSIZE) / MFSBLOCKSIZE;
-		testtime = (sb.st_atime>sb.st_mtime)?sb.st_atime:sb.st_mtime;
+		if (testtime==0) {
+			testtime = (sb.st_atime>sb.st_mtime)?sb.st_atime:sb.st_mtime;
+		}
 		validattr = 1;
 	} else {
 		hdrsize = 0;
 		blocks = 0;
-		testtime = 0;
 		validattr = 0;
 	}
 	prevf = NULL;
@@ -5918,7 +8914,7 @@ static inline void hdd_add_chunk(folder *f,uint16_t pathid,uint64_t chunkid,uint
 		}
 	}
 	if (c->pathid!=0xFFFF) { // already have this chunk
-		if (version <= c->version || c->crcrefcount) {	// new chunk is older than existing one or existing one is open
+		if (version <= c->version || (c->op!=NULL && c->op->crcrefcount)) {	// new chunk is older than existing one or existing one is open
 			if (f->markforremoval!=MFR_READONLY) { // this is R/W fs?
 				hdd_wfr_add(f,chunkid,version,pathid); // add file to 'wait for removal' queue
 			}
@@ -5934,9 +8930,9 @@ static inline void hdd_add_chunk(folder *f,uint16_t pathid,uint64_t chunkid,uint
 			c->validattr = validattr;
 			c->testtime = testtime;
 			zassert(pthread_mutex_lock(&testlock));
-			hdd_remove_chunk_from_test_chain(c,prevf);
+			hdd_remove_chunk_from_subfolder(c,prevf);
 			c->pathid = pathid;
-			hdd_add_chunk_to_test_chain(c,currf);
+			hdd_add_chunk_to_subfolder(c,currf);
 			zassert(pthread_mutex_unlock(&testlock));
 		}
 	} else {
@@ -5947,13 +8943,14 @@ static inline void hdd_add_chunk(folder *f,uint16_t pathid,uint64_t chunkid,uint
 		c->validattr = validattr;
 		c->testtime = testtime;
 		zassert(pthread_mutex_lock(&testlock));
-		hdd_add_chunk_to_test_chain(c,currf);
+		hdd_add_chunk_to_subfolder(c,currf);
 		zassert(pthread_mutex_unlock(&testlock));
 		hdd_report_new_chunk(c->chunkid,c->version|((f->markforremoval!=MFR_NO)?0x80000000:0));
 	}
 	zassert(pthread_mutex_lock(&folderlock));
 	if (prevf) {
 		hdd_remove_chunk_from_folder(c,prevf);
+		hdd_index_log(prevf,INDEX_REC_DEL,chunkid,0,0);
 	}
 	if (currf) {
 		hdd_add_chunk_to_folder(c,currf);
@@ -5962,27 +8959,40 @@ static inline void hdd_add_chunk(folder *f,uint16_t pathid,uint64_t chunkid,uint
 	hdd_chunk_release(c);
 }
 
+typedef struct _indexjentry {
+	uint64_t chunkid;
+	uint32_t version;
+	uint32_t testtime;	// taken from '.chunkdb' entry (test time is not journaled)
+	uint16_t pathid;
+	uint8_t rtype;
+} indexjentry;
+
 static inline int hdd_folder_fastscan(folder *f,char *fullname,uint16_t plen) {
 	struct stat sb;
 	int fd;
-	uint8_t *chunkbuff;
+	uint8_t *chunkbuff,*jbuff;
 	const uint8_t *rptr,*rptrmem,*endbuff;
 	uint16_t pleng;
 	uint64_t chunkid;
+	uint64_t ckptid,previd,jbaseid;
 	uint32_t version;
+	uint32_t testtime;
 	uint16_t blocks;
 	uint16_t pathid;
 	uint16_t hdrsize;
 	uint16_t subf;
-	uint8_t mode;
-	time_t foldersmaxtime;
+	uint8_t mode,rtype,recsize;
+	uint32_t jrecs,hsize,hpos,i;
+	indexjentry *jhash;
+	uint64_t foldersmaxtime,topfoldertime,indextime;
+	char fname[PATH_MAX];
 
 	foldersmaxtime = 0;
 	fullname[plen] = '\0';
 	if (lstat(fullname,&sb)<0) {
 		return -1;
 	}
-	foldersmaxtime = sb.st_mtime;
+	topfoldertime = STAT_MTIME_NS(sb); // also changed by writing index files
 	for (subf=0 ; subf<256 ; subf++) {
 		fullname[plen] = "0123456789ABCDEF"[(subf>>4)&0xF];
 		fullname[plen+1] = "0123456789ABCDEF"[subf&0xF];
@@ -5990,11 +9000,55 @@ static inline int hdd_folder_fastscan(folder *f,char *fullname,uint16_t plen) {
 		if (lstat(fullname,&sb)<0) {
 			return -1;
 		}
-		if (sb.st_atime > foldersmaxtime) {
-			foldersmaxtime = sb.st_atime;
+		if (STAT_ATIME_NS(sb) > foldersmaxtime) {
+			foldersmaxtime = STAT_ATIME_NS(sb);
+		}
+		if (STAT_MTIME_NS(sb) > foldersmaxtime) {
+			foldersmaxtime = STAT_MTIME_NS(sb);
+		}
+	}
+
+	// journal (optional) - changes made after '.chunkdb' has been written
+	jbuff = NULL;
+	jrecs = 0;
+	jbaseid = 0;
+	indextime = 0;
+	memcpy(fullname+plen,".chunkjournal",13);
+	fullname[plen+13] = '\0';
+	fd = open(fullname,O_RDONLY);
+	if (fd>=0) {
+		if (fstat(fd,&sb)<0 || sb.st_size<INDEX_JOURNAL_HDRSIZE) {
+			close(fd);
+			return -1;
+		}
+		indextime = STAT_MTIME_NS(sb);
+		jrecs = (sb.st_size - INDEX_JOURNAL_HDRSIZE) / INDEX_JOURNAL_RECSIZE; // partially written last record is ignored
+		jbuff = malloc(INDEX_JOURNAL_HDRSIZE+(uint64_t)jrecs*INDEX_JOURNAL_RECSIZE);
+		if (jbuff==NULL) {
+			close(fd);
+			return -1;
+		}
+		if (read(fd,jbuff,INDEX_JOURNAL_HDRSIZE+jrecs*INDEX_JOURNAL_RECSIZE)!=(ssize_t)(INDEX_JOURNAL_HDRSIZE+jrecs*INDEX_JOURNAL_RECSIZE)) {
+			free(jbuff);
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		if (memcmp(jbuff,"MFS CHUNKJNL",12)!=0) {
+			syslog(LOG_NOTICE,"scanning folder %s: wrong header in .chunkjournal - fallback to standard scan",f->path);
+			free(jbuff);
+			return -1;
 		}
-		if (sb.st_mtime > foldersmaxtime) {
-			foldersmaxtime = sb.st_mtime;
+		rptr = jbuff+12;
+		jbaseid = get64bit(&rptr);
+		for (i=0 ; i<jrecs ; i++) {
+			rptrmem = jbuff+INDEX_JOURNAL_HDRSIZE+i*INDEX_JOURNAL_RECSIZE;
+			rptr = rptrmem+INDEX_JOURNAL_RECSIZE-4;
+			if (mycrc32(0,rptrmem,INDEX_JOURNAL_RECSIZE-4)!=get32bit(&rptr) || rptrmem[0]<INDEX_REC_SET || rptrmem[0]>INDEX_REC_WFR) {
+				syslog(LOG_NOTICE,"scanning folder %s: damaged record in .chunkjournal - fallback to standard scan",f->path);
+				free(jbuff);
+				return -1;
+			}
 		}
 	}
 
@@ -6003,15 +9057,28 @@ static inline int hdd_folder_fastscan(folder *f,char *fullname,uint16_t plen) {
 
 	fd = open(fullname,O_RDONLY);
 	if (fd<0) {
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
 	if (fstat(fd,&sb)<0) {
 		close(fd);
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
-	if (sb.st_mtime < foldersmaxtime) { // somebody touched data subfolders, so '.chunkdb' might be not valid
-		syslog(LOG_NOTICE,"scanning folder %s: at least one of data subfolders has more recent atime/mtime than '.chunkdb' - fallback to standard scan",f->path);
+	if (STAT_MTIME_NS(sb) > indextime) {
+		indextime = STAT_MTIME_NS(sb);
+	}
+	// equal subfolder times are treated as stale - subfolder change and last index write might have happened within one tick of file system clock
+	if (indextime < topfoldertime || indextime <= foldersmaxtime) { // somebody touched data subfolders, so '.chunkdb' might be not valid
+		syslog(LOG_NOTICE,"scanning folder %s: at least one of data subfolders has not older atime/mtime than '.chunkdb' - fallback to standard scan",f->path);
 		close(fd);
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
 //	if (sb.st_size<12 || (sb.st_size-12)%6!=0) {
@@ -6021,56 +9088,85 @@ static inline int hdd_folder_fastscan(folder *f,char *fullname,uint16_t plen) {
 	chunkbuff = malloc(sb.st_size);
 	if (chunkbuff==NULL) {
 		close(fd);
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
 	if (read(fd,chunkbuff,sb.st_size)!=sb.st_size) {
 		free(chunkbuff);
-		close(fd);
-		return -1;
-	}
-	close(fd);
-	if (unlink(fullname)<0) {
-		free(chunkbuff);
+		close(fd);
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
+	close(fd);
 
 	rptr = chunkbuff;
 	endbuff = rptr+sb.st_size;
 
-	if (memcmp(rptr,"MFS CHUNKDB",11)!=0 && rptr[11]!='1' && rptr[11]!='2') {
+	if (sb.st_size<14 || memcmp(rptr,"MFS CHUNKDB",11)!=0 || (rptr[11]<'1' || rptr[11]>'4')) {
 		syslog(LOG_NOTICE,"scanning folder %s: wrong header in .chunkdb - fallback to standard scan",f->path);
 		free(chunkbuff);
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
-	if (rptr[11]=='1') {
-		mode = 1;
-	} else {
-		mode = 2;
-	}
+	mode = rptr[11]-'0';
 	rptr+=12;
 
 	pleng = get16bit(&rptr);
 	if (rptr+pleng>endbuff || pleng != plen || memcmp(rptr,fullname,pleng)!=0) {
 		syslog(LOG_NOTICE,"scanning folder %s: wrong path in .chunkdb - fallback to standard scan",f->path);
 		free(chunkbuff);
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
 	rptr += pleng;
+	ckptid = 0;
+	previd = 0;
+	if (mode>=3) {
+		if (rptr+16>endbuff) {
+			syslog(LOG_NOTICE,"scanning folder %s: data malformed in .chunkdb - fallback to standard scan",f->path);
+			free(chunkbuff);
+			if (jbuff) {
+				free(jbuff);
+			}
+			return -1;
+		}
+		ckptid = get64bit(&rptr);
+		previd = get64bit(&rptr);
+	}
+	if (jbuff!=NULL && (mode<3 || (jbaseid!=ckptid && jbaseid!=previd))) {
+		syslog(LOG_NOTICE,"scanning folder %s: .chunkjournal doesn't match .chunkdb - fallback to standard scan",f->path);
+		free(chunkbuff);
+		free(jbuff);
+		return -1;
+	}
 	rptrmem = rptr;
+	recsize = (mode>=4)?22:(mode>=2)?18:16;
 	chunkid = 0;
 	version = 0;
 	blocks = 0;
 	hdrsize = OLDHDRSIZE;
 	pathid = 0xFFFF;
+	testtime = 0;
 
-	while (rptr+16<=endbuff) {
+	while (rptr+recsize<=endbuff) {
 		chunkid = get64bit(&rptr);
 		version = get32bit(&rptr);
 		blocks = get16bit(&rptr);
-		if (mode==2) {
+		if (mode>=2) {
 			hdrsize = get16bit(&rptr);
 		}
 		pathid = get16bit(&rptr);
+		if (mode>=4) {
+			testtime = get32bit(&rptr);
+		}
 		if (chunkid==0) {
 			break;
 		}
@@ -6078,30 +9174,268 @@ static inline int hdd_folder_fastscan(folder *f,char *fullname,uint16_t plen) {
 	if (rptr!=endbuff || chunkid!=0 || version!=0 || blocks!=0 || pathid!=0) {
 		syslog(LOG_NOTICE,"scanning folder %s: data malformed in .chunkdb - fallback to standard scan",f->path);
 		free(chunkbuff);
+		if (jbuff) {
+			free(jbuff);
+		}
 		return -1;
 	}
 
+	// last SET/DEL record for given chunk overrides its entry from '.chunkdb'
+	jhash = NULL;
+	hsize = 0;
+	if (jbuff!=NULL && jrecs>0) {
+		hsize = 16;
+		while (hsize < jrecs*2) {
+			hsize *= 2;
+		}
+		jhash = calloc(hsize,sizeof(indexjentry));
+		if (jhash==NULL) {
+			free(chunkbuff);
+			free(jbuff);
+			return -1;
+		}
+		for (i=0 ; i<jrecs ; i++) {
+			rptr = jbuff+INDEX_JOURNAL_HDRSIZE+i*INDEX_JOURNAL_RECSIZE;
+			rtype = get8bit(&rptr);
+			chunkid = get64bit(&rptr);
+			version = get32bit(&rptr);
+			pathid = get16bit(&rptr);
+			if (rtype==INDEX_REC_WFR) {
+				continue;
+			}
+			hpos = chunkid & (hsize-1);
+			while (jhash[hpos].rtype!=0 && jhash[hpos].chunkid!=chunkid) {
+				hpos = (hpos+1) & (hsize-1);
+			}
+			jhash[hpos].chunkid = chunkid;
+			jhash[hpos].version = version;
+			jhash[hpos].pathid = pathid;
+			jhash[hpos].rtype = rtype;
+		}
+		// journal is synced only once per second, so its last records might have been lost in a crash - files of chunks changed after checkpoint have to exist
+		for (hpos=0 ; hpos<hsize ; hpos++) {
+			if (jhash[hpos].rtype==INDEX_REC_SET) {
+				hdd_create_filename(fname,f->path,jhash[hpos].pathid,jhash[hpos].chunkid,jhash[hpos].version);
+				if (stat(fname,&sb)<0 || (sb.st_mode & S_IFMT) != S_IFREG) {
+					syslog(LOG_NOTICE,"scanning folder %s: chunk %016"PRIX64"_%08"PRIX32" from .chunkjournal not found - fallback to standard scan",f->path,jhash[hpos].chunkid,jhash[hpos].version);
+					free(jhash);
+					free(chunkbuff);
+					free(jbuff);
+					return -1;
+				}
+			}
+		}
+	}
+
 	rptr = rptrmem;
 
 	while (1) {
 		chunkid = get64bit(&rptr);
 		version = get32bit(&rptr);
 		blocks = get16bit(&rptr);
-		if (mode==2) {
+		if (mode>=2) {
 			hdrsize = get16bit(&rptr);
 		}
 		pathid = get16bit(&rptr);
+		if (mode>=4) {
+			testtime = get32bit(&rptr);
+		}
 		if (chunkid==0 && version==0 && blocks==0 && pathid==0) {
 			break;
 		}
-		hdd_add_chunk(f,pathid,chunkid,version,blocks,hdrsize);
+		if (mode>=3 && blocks==0xFFFF && hdrsize==0xFFFF) {
+			if (f->markforremoval!=MFR_READONLY) {
+				hdd_wfr_add(f,chunkid,version,pathid);
+			}
+			continue;
+		}
+		if (jhash!=NULL) {
+			hpos = chunkid & (hsize-1);
+			while (jhash[hpos].rtype!=0 && jhash[hpos].chunkid!=chunkid) {
+				hpos = (hpos+1) & (hsize-1);
+			}
+			if (jhash[hpos].rtype!=0) {
+				jhash[hpos].testtime = testtime;
+				continue;
+			}
+		}
+		hdd_add_chunk(f,pathid,chunkid,version,blocks,hdrsize,testtime);
+	}
+	if (jhash!=NULL) {
+		for (hpos=0 ; hpos<hsize ; hpos++) {
+			if (jhash[hpos].rtype==INDEX_REC_SET) {
+				hdd_add_chunk(f,jhash[hpos].pathid,jhash[hpos].chunkid,jhash[hpos].version,0xFFFF,0,jhash[hpos].testtime);
+			}
+		}
+		free(jhash);
+	}
+	if (jbuff!=NULL) {
+		if (f->markforremoval!=MFR_READONLY) {
+			for (i=0 ; i<jrecs ; i++) {
+				rptr = jbuff+INDEX_JOURNAL_HDRSIZE+i*INDEX_JOURNAL_RECSIZE;
+				rtype = get8bit(&rptr);
+				chunkid = get64bit(&rptr);
+				version = get32bit(&rptr);
+				pathid = get16bit(&rptr);
+				if (rtype==INDEX_REC_WFR) {
+					hdd_wfr_add(f,chunkid,version,pathid);
+				}
+			}
+		}
+		free(jbuff);
 	}
 
-	syslog(LOG_NOTICE,"scanning folder %s: .chunkdb used - full scan not needed",f->path);
+	// continue current journal (records are idempotent), or start new one if there is no journal
+	fd = -1;
+	if (jrecs>0 || jbaseid!=0) {
+		if (f->markforremoval!=MFR_READONLY) {
+			memcpy(fullname+plen,".chunkjournal",13);
+			fullname[plen+13] = '\0';
+			fd = open(fullname,O_RDWR | O_APPEND);
+			if (fd>=0 && ftruncate(fd,INDEX_JOURNAL_HDRSIZE+(uint64_t)jrecs*INDEX_JOURNAL_RECSIZE)<0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		fullname[plen] = '\0';
+	}
+	if (fd>=0) {
+		zassert(pthread_mutex_lock(&(f->jlock)));
+		f->jfd = fd;
+		f->jsize = INDEX_JOURNAL_HDRSIZE+(uint64_t)jrecs*INDEX_JOURNAL_RECSIZE;
+		f->ckptid = jbaseid;
+		f->needcheckpoint = 1;
+		zassert(pthread_mutex_unlock(&(f->jlock)));
+	} else {
+		hdd_index_start(f,(mode>=3 && jbaseid==0)?ckptid:0);
+	}
+
+	syslog(LOG_NOTICE,"scanning folder %s: %s used - full scan not needed",f->path,(jrecs>0)?".chunkdb and .chunkjournal":".chunkdb");
 	free(chunkbuff);
 	return 0;
 }
 
+typedef struct _scanctx {
+	folder *f;
+	uint16_t plen;
+	uint16_t nextsubf;
+	uint16_t donesubf;
+	uint8_t scanterm;
+	uint8_t lastperc;
+	uint32_t lasttime;
+	uint32_t begintime;
+	pthread_mutex_t lock;
+} scanctx;
+
+/* scans data subfolders taken one by one from shared counter (many such threads can work on one folder) */
+static void* hdd_folder_scan_worker(void *arg) {
+	scanctx *sc = (scanctx*)arg;
+	folder *f = sc->f;
+	DIR *dd;
+	struct dirent *de;
+#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
+	struct dirent *destorage;
+#endif
+	char *fullname;
+	uint16_t subf,plen;
+	uint64_t namechunkid;
+	uint32_t nameversion;
+	uint32_t tcheckcnt;
+	uint8_t scanterm,currentperc,report;
+	uint32_t currenttime;
+
+	plen = sc->plen;
+	fullname = malloc(plen+37);
+	passert(fullname);
+	memcpy(fullname,f->path,plen-3);
+	fullname[plen-1] = '/';
+
+	/* size of name added to size of structure because on some os'es d_name has size of 1 byte */
+#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
+	destorage = (struct dirent*)malloc(sizeof(struct dirent)+pathconf(f->path,_PC_NAME_MAX)+1);
+	passert(destorage);
+#endif
+
+	tcheckcnt = 0;
+	scanterm = 0;
+	for (;;) {
+		zassert(pthread_mutex_lock(&(sc->lock)));
+		if (sc->scanterm || sc->nextsubf>=256) {
+			zassert(pthread_mutex_unlock(&(sc->lock)));
+			break;
+		}
+		subf = sc->nextsubf++;
+		zassert(pthread_mutex_unlock(&(sc->lock)));
+		fullname[plen-3]="0123456789ABCDEF"[(subf>>4)&0xF];
+		fullname[plen-2]="0123456789ABCDEF"[subf&0xF];
+		fullname[plen]='\0';
+//		mkdir(fullname,0755);
+		dd = opendir(fullname);
+		if (dd) {
+#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
+			while (readdir_r(dd,destorage,&de)==0 && de!=NULL && scanterm==0) {
+#else
+			while ((de = readdir(dd)) != NULL && scanterm==0) {
+#endif
+//#warning debug
+//				portable_usleep(100000);
+//
+				if (hdd_check_filename(de->d_name,&namechunkid,&nameversion)<0) {
+					continue;
+				}
+//				memcpy(fullname+plen,de->d_name,36);
+				hdd_add_chunk(f,subf,namechunkid,nameversion,0xFFFF,0,0);
+				tcheckcnt++;
+				if (tcheckcnt>=1000) {
+					zassert(pthread_mutex_lock(&folderlock));
+					if (f->scanstate==SCST_SCANTERMINATE) {
+						scanterm = 1;
+					}
+					zassert(pthread_mutex_unlock(&folderlock));
+					// portable_usleep(100000); - slow down scanning (also change 1000 in 'if' to something much smaller) - for tests
+					tcheckcnt = 0;
+				}
+			}
+			closedir(dd);
+		}
+		currenttime = time(NULL);
+		report = 0;
+		zassert(pthread_mutex_lock(&(sc->lock)));
+		if (scanterm) {
+			sc->scanterm = 1;
+		}
+		sc->donesubf++;
+		currentperc = ((sc->donesubf*100.0)/256.0);
+		if (currentperc>sc->lastperc && currenttime>sc->lasttime) {
+			sc->lastperc = currentperc;
+			sc->lasttime = currenttime;
+			report = 1;
+		}
+		zassert(pthread_mutex_unlock(&(sc->lock)));
+		if (report) {
+			zassert(pthread_mutex_lock(&folderlock));
+			f->scanprogress = currentperc;
+			zassert(pthread_mutex_unlock(&folderlock));
+#ifdef HAVE___SYNC_FETCH_AND_OP
+			__sync_fetch_and_or(&hddspacechanged,1);
+#else
+			zassert(pthread_mutex_lock(&dclock));
+			hddspacechanged = 1; // report chunk count to master
+			zassert(pthread_mutex_unlock(&dclock));
+#endif
+			syslog(LOG_NOTICE,"scanning folder %s: %"PRIu8"%% (%"PRIu32"s)",f->path,currentperc,currenttime-sc->begintime);
+		}
+		if (scanterm) {
+			break;
+		}
+	}
+#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
+	free(destorage);
+#endif
+	free(fullname);
+	return NULL;
+}
+
 void* hdd_folder_scan(void *arg) {
 	folder *f = (folder*)arg;
 	DIR *dd;
@@ -6114,18 +9448,17 @@ void* hdd_folder_scan(void *arg) {
 	uint16_t plen,oldplen;
 	uint64_t namechunkid;
 	uint32_t nameversion;
-	uint32_t tcheckcnt;
-	uint8_t scanterm,markforremoval;
-//	uint8_t progressreportmode;
-	uint8_t lastperc,currentperc;
-	uint32_t lasttime,currenttime,begintime;
+	uint8_t markforremoval;
+	uint32_t begintime;
+	uint32_t i,threads;
+	pthread_t *workers;
+	scanctx sc;
 
 	begintime = time(NULL);
 
 	zassert(pthread_mutex_lock(&folderlock));
 	markforremoval = f->markforremoval;
 	hdd_refresh_usage(f);
-//	progressreportmode = wait_for_scan;
 	zassert(pthread_mutex_unlock(&folderlock));
 
 	plen = strlen(f->path);
@@ -6142,19 +9475,14 @@ void* hdd_folder_scan(void *arg) {
 
 	if (hdd_folder_fastscan(f,fullname,plen)<0) {
 
+		// chunk files will be found by scan - start new index (journal records changes made during scan, checkpoint is written when scan is finished)
+		hdd_index_start(f,0);
+
 		fullname[plen++]='_';
 		fullname[plen++]='_';
 		fullname[plen++]='/';
 		fullname[plen]='\0';
 
-		/* size of name added to size of structure because on some os'es d_name has size of 1 byte */
-#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
-		destorage = (struct dirent*)malloc(sizeof(struct dirent)+pathconf(f->path,_PC_NAME_MAX)+1);
-		passert(destorage);
-#endif
-
-		scanterm = 0;
-
 #ifdef HAVE___SYNC_FETCH_AND_OP
 		__sync_fetch_and_or(&hddspacechanged,1);
 #else
@@ -6172,6 +9500,11 @@ void* hdd_folder_scan(void *arg) {
 
 	/* move chunks from "X/name" to "XX/name" */
 
+			/* size of name added to size of structure because on some os'es d_name has size of 1 byte */
+#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
+			destorage = (struct dirent*)malloc(sizeof(struct dirent)+pathconf(f->path,_PC_NAME_MAX)+1);
+			passert(destorage);
+#endif
 			oldfullname = malloc(oldplen+38);
 			passert(oldfullname);
 			memcpy(oldfullname,f->path,oldplen);
@@ -6205,67 +9538,51 @@ void* hdd_folder_scan(void *arg) {
 				closedir(dd);
 			}
 			free(oldfullname);
+#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
+			free(destorage);
+#endif
 
 		}
 	/* scan new file names */
 
-		tcheckcnt = 0;
-		lastperc = 0;
-		lasttime = time(NULL);
-		for (subf=0 ; subf<256 && scanterm==0 ; subf++) {
-			fullname[plen-3]="0123456789ABCDEF"[(subf>>4)&0xF];
-			fullname[plen-2]="0123456789ABCDEF"[subf&0xF];
-			fullname[plen]='\0';
-	//		mkdir(fullname,0755);
-			dd = opendir(fullname);
-			if (dd) {
-#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
-				while (readdir_r(dd,destorage,&de)==0 && de!=NULL && scanterm==0) {
+		sc.f = f;
+		sc.plen = plen;
+		sc.nextsubf = 0;
+		sc.donesubf = 0;
+		sc.scanterm = 0;
+		sc.lastperc = 0;
+		sc.lasttime = time(NULL);
+		sc.begintime = begintime;
+		zassert(pthread_mutex_init(&(sc.lock),NULL));
+#ifdef HAVE___SYNC_OP_AND_FETCH
+		threads = __sync_or_and_fetch(&ScanThreads,0);
 #else
-				while ((de = readdir(dd)) != NULL && scanterm==0) {
+		zassert(pthread_mutex_lock(&cfglock));
+		threads = ScanThreads;
+		zassert(pthread_mutex_unlock(&cfglock));
 #endif
-	//#warning debug
-	//				portable_usleep(100000);
-	//
-					if (hdd_check_filename(de->d_name,&namechunkid,&nameversion)<0) {
-						continue;
-					}
-//					memcpy(fullname+plen,de->d_name,36);
-					hdd_add_chunk(f,subf,namechunkid,nameversion,0xFFFF,0);
-					tcheckcnt++;
-					if (tcheckcnt>=1000) {
-						zassert(pthread_mutex_lock(&folderlock));
-						if (f->scanstate==SCST_SCANTERMINATE) {
-							scanterm = 1;
-						}
-						zassert(pthread_mutex_unlock(&folderlock));
-						// portable_usleep(100000); - slow down scanning (also change 1000 in 'if' to something much smaller) - for tests
-						tcheckcnt = 0;
-					}
+		workers = NULL;
+		if (threads>1) {
+			workers = malloc(sizeof(pthread_t)*(threads-1));
+			passert(workers);
+			for (i=0 ; i<threads-1 ; i++) {
+				if (lwt_minthread_create(workers+i,0,hdd_folder_scan_worker,&sc)!=0) {
+					break;
 				}
-				closedir(dd);
-			}
-			currenttime = time(NULL);
-			currentperc = ((subf*100.0)/256.0);
-			if (currentperc>lastperc && currenttime>lasttime) {
-				lastperc=currentperc;
-				lasttime=currenttime;
-				zassert(pthread_mutex_lock(&folderlock));
-				f->scanprogress = currentperc;
-				zassert(pthread_mutex_unlock(&folderlock));
-#ifdef HAVE___SYNC_FETCH_AND_OP
-				__sync_fetch_and_or(&hddspacechanged,1);
-#else
-				zassert(pthread_mutex_lock(&dclock));
-				hddspacechanged = 1; // report chunk count to master
-				zassert(pthread_mutex_unlock(&dclock));
-#endif
-				syslog(LOG_NOTICE,"scanning folder %s: %"PRIu8"%% (%"PRIu32"s)",f->path,lastperc,currenttime-begintime);
 			}
+			threads = i+1;
 		}
-#if !defined(__GLIBC__) || (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 23))
-		free(destorage);
-#endif
+		hdd_folder_scan_worker(&sc);
+		for (i=0 ; i<threads-1 ; i++) {
+			zassert(pthread_join(workers[i],NULL));
+		}
+		if (workers) {
+			free(workers);
+		}
+		zassert(pthread_mutex_destroy(&(sc.lock)));
+		zassert(pthread_mutex_lock(&(f->jlock)));
+		f->needcheckpoint = 1;
+		zassert(pthread_mutex_unlock(&(f->jlock)));
 	}
 	free(fullname);
 //	fprintf(stderr,"hdd space manager: %s: %"PRIu32" chunks found\n",f->path,f->chunkcount);
@@ -6317,6 +9634,7 @@ void hdd_setmetaid(uint64_t metaid) { // metaid has been verified with master -
 void* hdd_folders_thread(void *arg) {
 	for (;;) {
 		hdd_check_folders();
+		hdd_placement_update();
 		zassert(pthread_mutex_lock(&termlock));
 		if (term) {
 			zassert(pthread_mutex_unlock(&termlock));
@@ -6342,12 +9660,10 @@ void* hdd_delayed_thread(void *arg) {
 	return arg;
 }
 
-#ifndef PRESERVE_BLOCK
-# ifdef MMAP_ALLOC
+#ifdef MMAP_ALLOC
 void hdd_blockbuffer_free(void *addr) {
 	munmap(addr,MFSBLOCKSIZE);
 }
-# endif
 #endif
 
 void hdd_clear_cfglines(void) {
@@ -6382,6 +9698,8 @@ void hdd_term(void) {
 		zassert(pthread_join(hsrebalancethread,NULL));
 		zassert(pthread_join(rebalancethread,NULL));
 		zassert(pthread_join(delayedthread,NULL));
+		zassert(pthread_join(indexthread,NULL));
+		zassert(pthread_join(rcachethread,NULL));
 	}
 	zassert(pthread_mutex_lock(&folderlock));
 	i = 0;
@@ -6442,31 +9760,8 @@ void hdd_term(void) {
 				hdd_folder_dump_chunkdb_chunk(c->owner,c);
 			}
 			if (c->state==CH_AVAIL && c->owner!=NULL) {
-				if (c->fd>=0) {
-					if (c->crcchanged) {
-						syslog(LOG_WARNING,"hdd_term: CRC not flushed - writing now");
-						chunk_writecrc(c);
-					}
-					close(c->fd);
-					hdd_open_files_handle(OF_AFTER_CLOSE);
-				}
-				if (c->crc!=NULL) {
-#ifdef MMAP_ALLOC
-					munmap((void*)(c->crc),CHUNKCRCSIZE);
-#else
-					free(c->crc);
-#endif
-				}
-#ifdef PRESERVE_BLOCK
-				if (c->block!=NULL) {
-# ifdef MMAP_ALLOC
-					munmap((void*)(c->block),MFSBLOCKSIZE);
-# else
-					free(c->block);
-# endif
-				}
-#endif /* PRESERVE_BLOCK */
-				free(c);
+				hdd_chunkopen_free(c,"hdd_term");
+				hdd_chunkrec_free(c);
 			} else {
 				syslog(LOG_WARNING,"hdd_term: locked chunk !!!");
 			}
@@ -6482,6 +9777,10 @@ void hdd_term(void) {
 		if (f->lfd>=0) {
 			close(f->lfd);
 		}
+		if (f->jfd>=0) {
+			close(f->jfd);
+		}
+		zassert(pthread_mutex_destroy(&(f->jlock)));
 		if (f->chunktab) {
 			free(f->chunktab);
 		}
@@ -6497,24 +9796,23 @@ void hdd_term(void) {
 		}
 		free(f);
 	}
-	for (i=0 ; i<DHASHSIZE ; i++) {
-		for (dc=dophashtab[i] ; dc ; dc=dcn) {
-			dcn = dc->next;
-			free(dc);
-		}
-	}
-	for (dc=newdopchunks ; dc ; dc=dcn) {
+	hdd_rcache_free();
+	for (dc=fsyncqueue ; dc ; dc=dcn) {
 		dcn = dc->next;
 		free(dc);
 	}
-	for (cc=cclist ; cc ; cc=ccn) {
-		ccn = cc->next;
-		if (cc->wcnt) {
-			syslog(LOG_WARNING,"hddspacemgr (atexit): used cond !!!");
-		} else {
-			zassert(pthread_cond_destroy(&(cc->cond)));
+	fsyncqueue = NULL;
+	for (i=0 ; i<HASHLOCKS ; i++) {
+		for (cc=cclist[i] ; cc ; cc=ccn) {
+			ccn = cc->next;
+			if (cc->wcnt) {
+				syslog(LOG_WARNING,"hddspacemgr (atexit): used cond !!!");
+			} else {
+				zassert(pthread_cond_destroy(&(cc->cond)));
+			}
+			free(cc);
 		}
-		free(cc);
+		zassert(pthread_mutex_destroy(hashlock+i));
 	}
 	for (nc=newchunks ; nc ; nc=ncn) {
 		ncn = nc->next;
@@ -6528,6 +9826,7 @@ void hdd_term(void) {
 		dmcn = dmc->next;
 		free(dmc);
 	}
+	hdd_bcache_set_limit(0);
 	syslog(LOG_NOTICE,"hddspacemgr: terminating done");
 }
 
@@ -6610,6 +9909,9 @@ int hdd_parseline(char *hddcfgline) {
 	} else {
 		hddcfgline[l]='\0';
 	}
+	if (hddcfgline[0]=='$') { // read cache folder
+		return hdd_rcache_folder_add(hddcfgline+1,lmode,(lmode)?limit:0);
+	}
 	mfr = MFR_NO;
 	bm = REBALANCE_STD;
 	is = 0;
@@ -6831,10 +10133,13 @@ int hdd_parseline(char *hddcfgline) {
 						free(f->chunktab);
 					}
 					f->chunkcount = 0;
+					f->testpos = 0;
 					f->chunktabsize = 0;
 					f->chunktab = NULL;
 					hdd_stats_clear(&(f->cstat));
+					hdd_stats_slot_alloc(f);
 					hdd_stats_clear(&(f->monotonic));
+					memset(f->fsynchist,0,sizeof(f->fsynchist));
 					for (l=0 ; l<STATSHISTORY ; l++) {
 						hdd_stats_clear(&(f->stats[l]));
 					}
@@ -6895,7 +10200,10 @@ int hdd_parseline(char *hddcfgline) {
 	f->chunktabsize = 0;
 	f->chunktab = NULL;
 	hdd_stats_clear(&(f->cstat));
+	f->statsslot = HSC_NOSLOT;
+	hdd_stats_slot_alloc(f);
 	hdd_stats_clear(&(f->monotonic));
+	memset(f->fsynchist,0,sizeof(f->fsynchist));
 	for (l=0 ; l<STATSHISTORY ; l++) {
 		hdd_stats_clear(&(f->stats[l]));
 	}
@@ -6913,9 +10221,14 @@ int hdd_parseline(char *hddcfgline) {
 	f->lockinode = sb.st_ino;
 	f->lfd = lfd;
 	f->dumpfd = -1;
-	f->testhead = NULL;
-	f->testtail = &(f->testhead);
+	f->testpos = 0;
+	f->testpasstime = 0;
 	f->nexttest = 0;
+	f->testpassstart = 0;
+	f->testpasscnt = 0;
+	f->testlastpass = 0;
+	f->testlatcheck = 0;
+	f->testbackoff = 0;
 	f->min_count = 0;
 	f->min_pathid = 0;
 	f->current_pathid = 0;
@@ -6927,12 +10240,35 @@ int hdd_parseline(char *hddcfgline) {
 	f->write_first = 1;
 	f->read_corr = 0.0;
 	f->write_corr = 0.0;
+	f->plbusy = 0;
+	f->plwnsec = 0;
+	f->plwops = 0;
+	f->plusec = 0;
+	f->wlatavg = 0.0;
+	f->qdepthavg = 0.0;
+	f->placefactor = 1.0;
 	f->rebalance_in_progress = 0;
 	f->rebalance_last_usec = 0;
+	f->move_start_usec = 0;
+	f->move_bytes = 0;
+	f->move_remaining = 0;
 	f->wfrtime = monotonic_seconds();
 	f->wfrlast = 0.0;
 	f->wfrcount = 0;
 	f->wfrchunks = NULL;
+	f->noreflink = 0;
+	f->nocopyrange = 0;
+	f->jfd = -1;
+	f->jsize = 0;
+	f->ckptid = 0;
+	f->ckpttime = 0;
+	f->jdirty = 0;
+	f->needcheckpoint = 0;
+	f->indexbusy = 0;
+	zassert(pthread_mutex_init(&(f->jlock),NULL));
+	f->fsyncgroupcnt = 0;
+	f->fsyncgroupdone = 0;
+	f->fsyncgrouperr = 0;
 	f->next = folderhead;
 	folderhead = f;
 	cl->f = f;
@@ -6942,6 +10278,7 @@ int hdd_parseline(char *hddcfgline) {
 
 int hdd_folders_reinit(void) {
 	folder *f;
+	cachefolder *cf;
 	FILE *fd;
 	char buff[1000];
 	char *hddfname;
@@ -6981,6 +10318,12 @@ int hdd_folders_reinit(void) {
 	hdd_clear_cfglines();
 	zassert(pthread_mutex_unlock(&folderlock));
 
+	zassert(pthread_mutex_lock(&cachelock));
+	for (cf=cachefolderhead ; cf ; cf=cf->next) {
+		cf->toremove = 1;
+	}
+	zassert(pthread_mutex_unlock(&cachelock));
+
 	while (fgets(buff,999,fd)) {
 		buff[999] = 0;
 		if (hdd_parseline(buff)<0) {
@@ -7026,12 +10369,56 @@ void hdd_wantexit(void) {
 }
 
 void hdd_info(void) {
-	hdd_open_files_handle(OF_INFO);
+	hdd_fdcache_info();
+}
+
+static void hdd_fdcache_options(uint8_t initflag) {
+	struct rlimit rl;
+	uint32_t limit,syslimit;
+	double idletime;
+
+	limit = cfg_getuint32("HDD_OPEN_FILES_LIMIT",0);
+	idletime = cfg_getdouble("HDD_OPEN_FILES_IDLE_TIME",OPEN_DELAY);
+	syslimit = 500;
+	if (getrlimit(RLIMIT_NOFILE,&rl)==0) {
+		if (rl.rlim_cur==RLIM_INFINITY || rl.rlim_cur>UINT32_MAX) {
+			syslimit = UINT32_MAX;
+		} else {
+			syslimit = (rl.rlim_cur * 2) / 3;
+		}
+	}
+	if (limit==0) {
+		limit = syslimit;
+	} else if (limit>syslimit) {
+		mfs_arg_syslog(LOG_NOTICE,"hdd space manager: open files limit too big for current descriptor limit - changed to %"PRIu32,syslimit);
+		limit = syslimit;
+	}
+	if (limit<16) {
+		limit = 16;
+	}
+	if (idletime<0.0) {
+		idletime = 0.0;
+	} else if (idletime>CRC_DELAY) {
+		mfs_arg_syslog(LOG_NOTICE,"hdd space manager: open files idle time too big - changed to %u seconds",CRC_DELAY);
+		idletime = CRC_DELAY;
+	}
+	zassert(pthread_mutex_lock(&fdcachelock));
+	if (initflag || limit!=fdlimit) {
+		mfs_arg_syslog(LOG_NOTICE,"hdd space manager: setting open chunks limit to: %"PRIu32,limit);
+	}
+	fdlimit = limit;
+	OpenFilesIdleTime = idletime;
+	if (fdwaiting>0) { // limit could be raised
+		zassert(pthread_cond_broadcast(&fdcachecond));
+		fdwaiting = 0;
+	}
+	zassert(pthread_mutex_unlock(&fdcachelock));
 }
 
 static inline void hdd_options_common(uint8_t initflag) {
-	char *LeaveFreeStr;
-	uint8_t sp;
+	char *LeaveFreeStr,*BlockCacheStr,*WritebackPushStr;
+	uint8_t sp,uu,sfmode,fsyncmode,clmode,scthreads;
+	uint64_t wbpush;
 	uint32_t tmp;
 
 	zassert(pthread_mutex_lock(&folderlock));
@@ -7051,6 +10438,11 @@ static inline void hdd_options_common(uint8_t initflag) {
 		mfs_syslog(LOG_NOTICE,"hdd space manager: error tolerance period too big - changed to 86400 seconds (1 day)");
 		HDDErrorTime = 86400;
 	}
+	HDDPlacementLatencyWeight = cfg_getuint32("HDD_PLACEMENT_LATENCY_WEIGHT",100);
+	if (HDDPlacementLatencyWeight>1000) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: placement latency weight too big - changed to 1000");
+		HDDPlacementLatencyWeight = 1000;
+	}
 	HDDRoundRobinChunkCount = cfg_getint32("HDD_RR_CHUNK_COUNT",10000);
 	if (HDDRoundRobinChunkCount<1) {
 		mfs_syslog(LOG_NOTICE,"hdd space manager: round robin chunk count too small - changed to 1");
@@ -7102,13 +10494,62 @@ static inline void hdd_options_common(uint8_t initflag) {
 	if (HSRebalanceLimit>10) {
 		HSRebalanceLimit=10;
 	}
+	tmp = cfg_getuint32("HDD_REBALANCE_BANDWIDTH_LIMIT",0);
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	__sync_and_and_fetch(&MoveBandwidth,0);
+	__sync_or_and_fetch(&MoveBandwidth,tmp);
+#else
+	pthread_mutex_lock(&cfglock);
+	MoveBandwidth = tmp;
+	pthread_mutex_unlock(&cfglock);
+#endif
+	HDDTestIOPS = cfg_getuint32("HDD_TEST_IOPS",0);
+	HDDTestMaxLatency = cfg_getuint32("HDD_TEST_MAX_LATENCY",20);
 	MinTimeBetweenTests = cfg_getuint32("HDD_MIN_TEST_INTERVAL",86400);
 	MinFlushCacheTime = cfg_getint32("HDD_FADVISE_MIN_TIME",86400);
 	zassert(pthread_mutex_unlock(&testlock));
 	zassert(pthread_mutex_lock(&doplock));
 	DoFsyncBeforeClose = cfg_getuint8("HDD_FSYNC_BEFORE_CLOSE",0);
+	FsyncGroupMin = cfg_getuint32("HDD_FSYNC_GROUP_MIN",0);
+#ifdef HDD_FSYNC_GROUP
+	if (FsyncGroupMin>0 && hdd_syncfs_reports_errors()==0) {
+		mfs_syslog(LOG_WARNING,"hdd space manager: HDD_FSYNC_GROUP_MIN needs Linux 5.8 or newer (older kernels don't report write errors from syncfs) - chunks will be synced one by one");
+		FsyncGroupMin = 0;
+	}
+#endif
+	fsyncmode = DoFsyncBeforeClose;
 	zassert(pthread_mutex_unlock(&doplock));
 
+	hdd_fdcache_options(initflag);
+
+	WritebackPushStr = cfg_getstr("HDD_WRITEBACK_PUSH","4MiB");
+	if (hdd_size_parse(WritebackPushStr,&wbpush)<0) {
+		if (initflag) {
+			mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_WRITEBACK_PUSH parse error - using default (4MiB)");
+			wbpush = 0x400000;
+		} else {
+			mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_WRITEBACK_PUSH parse error - left unchanged");
+			wbpush = UINT64_C(0xFFFFFFFFFFFFFFFF);
+		}
+	}
+	free(WritebackPushStr);
+	if (wbpush!=UINT64_C(0xFFFFFFFFFFFFFFFF)) {
+		if (wbpush>MFSCHUNKSIZE) {
+			wbpush = MFSCHUNKSIZE;
+		}
+		if (fsyncmode==0) { // without fsync before close writeback is left entirely to the kernel
+			wbpush = 0;
+		}
+#ifdef HAVE___SYNC_OP_AND_FETCH
+		__sync_and_and_fetch(&WritebackPush,0);
+		__sync_or_and_fetch(&WritebackPush,(uint32_t)wbpush);
+#else
+		pthread_mutex_lock(&cfglock);
+		WritebackPush = wbpush;
+		pthread_mutex_unlock(&cfglock);
+#endif
+	}
+
 	LeaveFreeStr = cfg_getstr("HDD_LEAVE_SPACE_DEFAULT","256MiB");
 	if (hdd_size_parse(LeaveFreeStr,&LeaveFree)<0) {
 		if (initflag) {
@@ -7123,6 +10564,96 @@ static inline void hdd_options_common(uint8_t initflag) {
 		mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_LEAVE_SPACE_DEFAULT < chunk size - leaving so small space on hdd is not recommended");
 	}
 
+	BlockCacheStr = cfg_getstr("HDD_BLOCK_CACHE_SIZE","64MiB");
+	if (hdd_size_parse(BlockCacheStr,&BlockCacheSize)<0) {
+		if (initflag) {
+			mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_BLOCK_CACHE_SIZE parse error - using default (64MiB)");
+			BlockCacheSize = 0x4000000;
+		} else {
+			mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_BLOCK_CACHE_SIZE parse error - left unchanged");
+		}
+	}
+	free(BlockCacheStr);
+	if (BlockCacheSize>(UINT64_C(1)<<40)) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_BLOCK_CACHE_SIZE too big - changed to 1TiB");
+		BlockCacheSize = UINT64_C(1)<<40;
+	}
+	hdd_bcache_set_limit(BlockCacheSize>>MFSBLOCKBITS);
+
+	tmp = cfg_getuint32("HDD_READ_CACHE_MIN_READS",8);
+	if (tmp>255) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_READ_CACHE_MIN_READS too big - changed to 255");
+		tmp = 255;
+	}
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	__sync_and_and_fetch(&RCacheMinReads,0);
+	__sync_or_and_fetch(&RCacheMinReads,tmp);
+#endif
+	zassert(pthread_mutex_lock(&cachelock));
+#ifndef HAVE___SYNC_OP_AND_FETCH
+	RCacheMinReads = tmp;
+#endif
+	RCachePeriod = cfg_getuint32("HDD_READ_CACHE_PERIOD",300);
+	if (RCachePeriod<10) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: HDD_READ_CACHE_PERIOD too small - changed to 10 seconds");
+		RCachePeriod = 10;
+	}
+	RCacheSpeed = cfg_getuint32("HDD_READ_CACHE_SPEED",50);
+	zassert(pthread_mutex_unlock(&cachelock));
+
+	sfmode = cfg_getuint8("HDD_SENDFILE",0);
+	if (sfmode>2) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: wrong HDD_SENDFILE value - using 0");
+		sfmode = 0;
+	}
+#ifndef __linux__
+	if (sfmode) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: sendfile is not supported on this platform - using standard reads");
+		sfmode = 0;
+	}
+#endif
+	if (PageSize==0) {
+		long ps;
+		ps = sysconf(_SC_PAGESIZE);
+		PageSize = (ps>0)?ps:4096;
+	}
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	__sync_and_and_fetch(&SendfileMode,0);
+	__sync_or_and_fetch(&SendfileMode,sfmode);
+#else
+	pthread_mutex_lock(&cfglock);
+	SendfileMode = sfmode;
+	pthread_mutex_unlock(&cfglock);
+#endif
+
+	uu = cfg_getuint8("HDD_IO_URING",0);
+	if (uu) {
+#ifdef HAVE_IO_URING
+		hdd_uring *r;
+		r = hdd_uring_new();
+		if (r==NULL) {
+			mfs_errlog(LOG_NOTICE,"hdd space manager: can't initialize io_uring - using standard i/o");
+			uu = 0;
+		} else {
+			hdd_uring_free(r);
+		}
+#else
+		mfs_syslog(LOG_NOTICE,"hdd space manager: io_uring is not supported on this platform - using standard i/o");
+		uu = 0;
+#endif
+	}
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	if (uu) {
+		__sync_or_and_fetch(&UseIoUring,1);
+	} else {
+		__sync_and_and_fetch(&UseIoUring,0);
+	}
+#else
+	pthread_mutex_lock(&cfglock);
+	UseIoUring = uu;
+	pthread_mutex_unlock(&cfglock);
+#endif
+
 	sp = cfg_getuint8("HDD_SPARSIFY_ON_WRITE",1);
 #ifdef HAVE___SYNC_OP_AND_FETCH
 	if (sp) {
@@ -7135,6 +10666,70 @@ static inline void hdd_options_common(uint8_t initflag) {
 	Sparsification = sp?1:0;
 	pthread_mutex_unlock(&cfglock);
 #endif
+
+	sp = cfg_getuint8("HDD_PUNCH_HOLES",1);
+#ifndef HDD_HOLES
+	if (sp) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: punching holes is not supported on this platform - zero blocks will be written");
+		sp = 0;
+	}
+#endif
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	if (sp) {
+		__sync_or_and_fetch(&PunchHoles,1);
+	} else {
+		__sync_and_and_fetch(&PunchHoles,0);
+	}
+#else
+	pthread_mutex_lock(&cfglock);
+	PunchHoles = sp?1:0;
+	pthread_mutex_unlock(&cfglock);
+#endif
+
+	scthreads = cfg_getuint8("HDD_SCAN_THREADS",4);
+	if (scthreads<1) {
+		scthreads = 1;
+	}
+	if (scthreads>64) {
+		scthreads = 64;
+	}
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	__sync_and_and_fetch(&ScanThreads,0);
+	__sync_or_and_fetch(&ScanThreads,scthreads);
+#else
+	pthread_mutex_lock(&cfglock);
+	ScanThreads = scthreads;
+	pthread_mutex_unlock(&cfglock);
+#endif
+
+	clmode = cfg_getuint8("HDD_DUPLICATE_CLONE",2);
+	if (clmode>2) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: wrong HDD_DUPLICATE_CLONE value - using 2");
+		clmode = 2;
+	}
+#if !defined(HDD_REFLINK) && !defined(HDD_COPY_RANGE)
+	if (clmode) {
+		mfs_syslog(LOG_NOTICE,"hdd space manager: in-kernel chunk copying is not supported on this platform - using standard reads and writes");
+		clmode = 0;
+	}
+#endif
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	__sync_and_and_fetch(&CloneMode,0);
+	__sync_or_and_fetch(&CloneMode,clmode);
+#else
+	pthread_mutex_lock(&cfglock);
+	CloneMode = clmode;
+	pthread_mutex_unlock(&cfglock);
+#endif
+	if (initflag==0) { // give file systems another chance (they could have been remounted or upgraded in the meantime)
+		folder *f;
+		zassert(pthread_mutex_lock(&folderlock));
+		for (f=folderhead ; f ; f=f->next) {
+			f->noreflink = 0;
+			f->nocopyrange = 0;
+		}
+		zassert(pthread_mutex_unlock(&folderlock));
+	}
 }
 
 void hdd_reload(void) {
@@ -7158,6 +10753,8 @@ int hdd_late_init(void) {
 	zassert(lwt_minthread_create(&rebalancethread,0,hdd_rebalance_thread,NULL));
 	zassert(lwt_minthread_create(&hsrebalancethread,0,hdd_highspeed_rebalance_thread,NULL));
 	zassert(lwt_minthread_create(&delayedthread,0,hdd_delayed_thread,NULL));
+	zassert(lwt_minthread_create(&indexthread,0,hdd_index_thread,NULL));
+	zassert(lwt_minthread_create(&rcachethread,0,hdd_rcache_thread,NULL));
 	return 0;
 }
 
@@ -7171,15 +10768,25 @@ int hdd_init(void) {
 	for (hp=0 ; hp<HASHSIZE ; hp++) {
 		hashtab[hp] = NULL;
 	}
-	for (hp=0 ; hp<DHASHSIZE ; hp++) {
-		dophashtab[hp] = NULL;
+	for (hp=0 ; hp<HASHLOCKS ; hp++) {
+		zassert(pthread_mutex_init(hashlock+hp,NULL));
+		zassert(pthread_cond_init(sendfilecond+hp,NULL));
+		cclist[hp] = NULL;
+	}
+	for (hp=0 ; hp<BCACHE_STRIPES ; hp++) {
+		zassert(pthread_mutex_init(&(bcache[hp].lock),NULL));
+		for (i=0 ; i<BCACHE_HASHSIZE ; i++) {
+			bcache[hp].hash[i] = NULL;
+		}
+		bcache[hp].hand = NULL;
+		bcache[hp].entries = 0;
+		bcache[hp].limit = 0;
+		bcache[hp].hits = 0;
+		bcache[hp].misses = 0;
 	}
 
 #if 0
 	fprintf(stderr,"compiled with features: ");
-#ifdef PRESERVE_BLOCK
-	fprintf(stderr,"PRESERVE_BLOCK,");
-#endif
 #ifdef MMAP_ALLOC
 	fprintf(stderr,"MMAP_ALLOC,");
 #endif
@@ -7203,14 +10810,19 @@ int hdd_init(void) {
 	}
 #endif
 
-#ifndef PRESERVE_BLOCK
+	iostats = tc_new();
 	zassert(pthread_key_create(&hdrbufferkey,free));
-# ifdef MMAP_ALLOC
+	zassert(pthread_key_create(&batchbufferkey,free));
+#ifdef MMAP_ALLOC
 	zassert(pthread_key_create(&blockbufferkey,hdd_blockbuffer_free));
-# else
+	zassert(pthread_key_create(&rangebufferkey,hdd_blockbuffer_free));
+#else
 	zassert(pthread_key_create(&blockbufferkey,free));
-# endif
-#endif /* PRESERVE_BLOCK */
+	zassert(pthread_key_create(&rangebufferkey,free));
+#endif
+#ifdef HAVE_IO_URING
+	zassert(pthread_key_create(&uringkey,hdd_uring_free));
+#endif
 
 	emptyblockcrc = mycrc32_zeroblock(0,MFSBLOCKSIZE);
 #ifdef MMAP_ALLOC
@@ -7232,8 +10844,6 @@ int hdd_init(void) {
 		}
 	}
 
-	hdd_open_files_handle(OF_INIT);
-
 	zassert(pthread_mutex_lock(&folderlock));
 	for (f=folderhead ; f ; f=f->next) {
 		fprintf(stderr,"hdd space manager: path to scan: %s\n",f->path);
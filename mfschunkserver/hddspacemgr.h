@@ -27,6 +27,11 @@
 
 void hdd_stats(uint64_t *br,uint64_t *bw,uint32_t *opr,uint32_t *opw,uint32_t *dbr,uint32_t *dbw,uint32_t *dopr,uint32_t *dopw,uint32_t *movl,uint32_t *movh,uint64_t *rtime,uint64_t *wtime);
 void hdd_op_stats(uint32_t *op_create,uint32_t *op_delete,uint32_t *op_version,uint32_t *op_duplicate,uint32_t *op_truncate,uint32_t *op_duptrunc,uint32_t *op_test);
+void hdd_lock_stats(uint32_t *hlwait);
+void hdd_bcache_stats(uint32_t *hits,uint32_t *misses,uint32_t *blocks);
+void hdd_rcache_stats(uint32_t *hits,uint32_t *misses,uint32_t *promotions,uint32_t *evictions);
+void hdd_fdcache_stats(uint32_t *hits,uint32_t *misses,uint32_t *evictions,uint32_t *opened);
+void hdd_hole_stats(uint64_t *punched,uint64_t *skipped);
 uint32_t hdd_errorcounter(void);
 
 /* lock/unlock pair */
@@ -39,8 +44,11 @@ void hdd_get_lost_chunk_data(uint8_t *buff,uint32_t limit);
 uint32_t hdd_get_new_chunk_count(uint32_t limit);
 void hdd_get_new_chunk_data(uint8_t *buff,uint32_t limit);
 /* lock/unlock pair */
-uint32_t hdd_diskinfo_size(void);
-void hdd_diskinfo_data(uint8_t *buff);
+uint32_t hdd_get_hot_chunk_count(uint32_t limit);
+void hdd_get_hot_chunk_data(uint8_t *buff,uint32_t limit);
+/* lock/unlock pair */
+uint32_t hdd_diskinfo_size(uint8_t extended);
+void hdd_diskinfo_data(uint8_t *buff,uint8_t extended);
 uint32_t hdd_diskinfo_monotonic_size(void);
 void hdd_diskinfo_monotonic_data(uint8_t *buff);
 /* lock/unlock pair */
@@ -68,6 +76,11 @@ void hdd_precache_data(uint64_t chunkid,uint32_t offset,uint32_t size);
 int hdd_open(uint64_t chunkid,uint32_t version);
 int hdd_close(uint64_t chunkid);
 int hdd_read(uint64_t chunkid,uint32_t version,uint16_t blocknum,uint8_t *buffer,uint32_t offset,uint32_t size,uint8_t *crcbuff);
+/* range read - up to 64 consecutive blocks of one chunk */
+int hdd_read_range(uint64_t chunkid,uint32_t version,uint32_t offset,uint32_t size,uint8_t * const *buffers,uint8_t * const *crcbuffs);
+uint8_t hdd_sendfile_enabled(void);
+int hdd_read_sendfile_prepare(uint64_t chunkid,uint32_t version,uint16_t blocknum,int *fd,uint64_t *fileoffset,uint8_t *crcbuff);
+void hdd_read_sendfile_end(uint64_t chunkid,int fd);
 int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t *buffer,uint32_t offset,uint32_t size,const uint8_t *crcbuff);
 
 /* chunk info */
@@ -77,6 +90,7 @@ int hdd_get_checksum(uint64_t chunkid, uint32_t version, uint8_t *checksum_buff)
 int hdd_get_checksum_tab(uint64_t chunkid, uint32_t version, uint8_t *checksum_tab);
 
 int hdd_move(void *fsrcv,void *fdstv);
+void* hdd_chunk_folder_key(uint64_t chunkid);
 
 /* chunk operations */
 
@@ -31,6 +31,7 @@
 #include "csserv.h"
 #include "mainserv.h"
 #include "chartsdata.h"
+#include "replicator.h"
 
 #define STR_AUX(x) #x
 #define STR(x) STR_AUX(x)
@@ -51,6 +52,7 @@ struct {
 	{hdd_init,"hdd space manager"},
 	{mainserv_init,"main server threads"},
 	{job_init,"jobs manager"},
+	{replicator_init,"replicator"},
 	{csserv_init,"main server acceptor"},	/* it has to be before "masterconn" */
 	{masterconn_init,"master connection module"},
 	{chartsdata_init,"charts module"},
@@ -49,6 +49,7 @@
 #include "clocks.h"
 #include "portable.h"
 #include "mainserv.h"
+#include "tcounters.h"
 #ifdef USE_CONNCACHE
 #include "conncache.h"
 #endif
@@ -64,6 +65,9 @@
 
 #define SMALL_PACKET_SIZE 12
 
+// max number of blocks read by one hdd_read_range call (limits memory used by one read request)
+#define MAINSERV_READ_BLOCKS 16
+
 #define CONNECT_RETRIES 10	//connect retries
 #define CONNECT_TIMEOUT(cnt) (((cnt) % 2) ? (300 * (1 << ((cnt) >> 1))) : (200 * (1 << ((cnt) >> 1))))
 
@@ -74,26 +78,30 @@ static uint32_t MaxPacketSize = CSTOCS_MAXPACKETSIZE;
 static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
-static uint64_t stats_bytesin = 0;
-static uint64_t stats_bytesout = 0;
+// bytes are counted per thread (after every socket operation) and summed only by mainserv_stats
+#define MSC_BYTESIN 0
+#define MSC_BYTESOUT 1
+#define MSC_CNT 2
+
+static void *stats_bytes;
+static uint64_t stats_bytesbase[MSC_CNT];	// sums already returned by mainserv_stats
 static uint32_t stats_hlopr = 0;
 static uint32_t stats_hlopw = 0;
 
 void mainserv_stats(uint64_t *bin, uint64_t *bout, uint32_t *hlopr, uint32_t *hlopw)
 {
+	uint64_t sums[MSC_CNT];
+	tc_sums(stats_bytes, 0, MSC_CNT, sums);
+	*bin = sums[MSC_BYTESIN] - stats_bytesbase[MSC_BYTESIN];
+	*bout = sums[MSC_BYTESOUT] - stats_bytesbase[MSC_BYTESOUT];
+	memcpy(stats_bytesbase, sums, sizeof(stats_bytesbase));
 #ifdef HAVE___SYNC_FETCH_AND_OP
-	*bin = __sync_fetch_and_and(&stats_bytesin, 0);
-	*bout = __sync_fetch_and_and(&stats_bytesout, 0);
 	*hlopr = __sync_fetch_and_and(&stats_hlopr, 0);
 	*hlopw = __sync_fetch_and_and(&stats_hlopw, 0);
 #else
 	zassert(pthread_mutex_lock(&statslock));
-	*bin = stats_bytesin;
-	*bout = stats_bytesout;
 	*hlopr = stats_hlopr;
 	*hlopw = stats_hlopw;
-	stats_bytesin = 0;
-	stats_bytesout = 0;
 	stats_hlopr = 0;
 	stats_hlopw = 0;
 	zassert(pthread_mutex_unlock(&statslock));
@@ -102,24 +110,12 @@ void mainserv_stats(uint64_t *bin, uint64_t *bout, uint32_t *hlopr, uint32_t *hl
 
 static inline void mainserv_bytesin(uint64_t bytes)
 {
-#ifdef HAVE___SYNC_FETCH_AND_OP
-	__sync_fetch_and_add(&stats_bytesin, bytes);
-#else
-	zassert(pthread_mutex_lock(&statslock));
-	stats_bytesin += bytes;
-	zassert(pthread_mutex_unlock(&statslock));
-#endif
+	tc_get(stats_bytes, MSC_BYTESIN)[0] += bytes;
 }
 
 static inline void mainserv_bytesout(uint64_t bytes)
 {
-#ifdef HAVE___SYNC_FETCH_AND_OP
-	__sync_fetch_and_add(&stats_bytesout, bytes);
-#else
-	zassert(pthread_mutex_lock(&statslock));
-	stats_bytesout += bytes;
-	zassert(pthread_mutex_unlock(&statslock));
-#endif
+	tc_get(stats_bytes, MSC_BYTESOUT)[0] += bytes;
 }
 
 static inline int32_t mainserv_toread(int sock, uint8_t *ptr, uint32_t leng, uint32_t timeout)
@@ -164,6 +160,17 @@ static inline int32_t mainserv_toforward(int sock1, int sock2, uint8_t *ptr, uin
 	return r;
 }
 
+static inline int32_t mainserv_tosendfile(int sock, int fd, uint64_t offset, uint32_t leng, uint32_t timeout)
+{
+	int32_t r;
+	r = tcptosendfile(sock, fd, offset, leng, timeout);
+	if (r > 0)
+	{
+		mainserv_bytesout(r);
+	}
+	return r;
+}
+
 uint8_t *mainserv_create_packet(uint8_t **wptr, uint32_t cmd, uint32_t leng)
 {
 	uint8_t *ptr;
@@ -174,6 +181,15 @@ uint8_t *mainserv_create_packet(uint8_t **wptr, uint32_t cmd, uint32_t leng)
 	put32bit(wptr, leng);
 	return ptr;
 }
+static inline void mainserv_free_packets(uint8_t **packets, uint16_t from, uint16_t to)
+{
+	while (from < to)
+	{
+		free(packets[from]);
+		from++;
+	}
+}
+
 /**
  * 发送包，并且free packet
  * */
@@ -344,6 +360,15 @@ uint8_t mainserv_read(int sock, const uint8_t *data, uint32_t length)
 	uint8_t hdr[8];
 	uint32_t cmd, leng;
 	read_nops rn;
+	uint8_t sfhdr[8 + 8 + 2 + 2 + 4 + 4];
+	int sendfd;
+	uint64_t sendoffset;
+	uint8_t *packets[MAINSERV_READ_BLOCKS];
+	uint8_t *dataptrs[MAINSERV_READ_BLOCKS];
+	uint8_t *crcptrs[MAINSERV_READ_BLOCKS];
+	uint32_t psizes[MAINSERV_READ_BLOCKS];
+	uint32_t rsize;
+	uint16_t b, blocks;
 
 	if (length != 20 && length != 21)
 	{
@@ -432,29 +457,71 @@ uint8_t mainserv_read(int sock, const uint8_t *data, uint32_t length)
 	{
 		blocknum = (offset) >> MFSBLOCKBITS;
 		blockoffset = (offset)&MFSBLOCKMASK;
-		if (((offset + size - 1) >> MFSBLOCKBITS) == blocknum)
-		{ // last block
-			blocksize = size;
-		}
-		else
-		{
-			blocksize = MFSBLOCKSIZE - blockoffset;
-		}
-		packet = mainserv_create_packet(&wptr, CSTOCL_READ_DATA, 8 + 2 + 2 + 4 + 4 + blocksize);
-		put64bit(&wptr, chunkid);
-		put16bit(&wptr, blocknum);
-		put16bit(&wptr, blockoffset);
-		put32bit(&wptr, blocksize);
 		if (protover)
 		{
 			mainserv_read_nop_add(&rn);
 		}
-		status = hdd_read(chunkid, version, blocknum, wptr + 4, blockoffset, blocksize, wptr);
+		blocks = 0;
+		status = MFS_ERROR_ENOTSUP;
+		if (blockoffset == 0 && size >= MFSBLOCKSIZE)
+		{ // full block - send it directly from chunk file if possible
+			rsize = MFSBLOCKSIZE;
+			wptr = sfhdr;
+			put32bit(&wptr, CSTOCL_READ_DATA);
+			put32bit(&wptr, 8 + 2 + 2 + 4 + 4 + MFSBLOCKSIZE);
+			put64bit(&wptr, chunkid);
+			put16bit(&wptr, blocknum);
+			put16bit(&wptr, 0);
+			put32bit(&wptr, MFSBLOCKSIZE);
+			status = hdd_read_sendfile_prepare(chunkid, version, blocknum, &sendfd, &sendoffset, wptr);
+		}
+		if (status == MFS_ERROR_ENOTSUP)
+		{ // read up to MAINSERV_READ_BLOCKS blocks at once - each block is sent in its own packet
+			rsize = MAINSERV_READ_BLOCKS * MFSBLOCKSIZE - blockoffset;
+			if (rsize > size)
+			{
+				rsize = size;
+			}
+			blocks = ((offset + rsize - 1) >> MFSBLOCKBITS) - blocknum + 1;
+			for (b = 0; b < blocks; b++)
+			{
+				if (b == 0 && blocks == 1)
+				{
+					blocksize = rsize;
+				}
+				else if (b == 0)
+				{
+					blocksize = MFSBLOCKSIZE - blockoffset;
+				}
+				else if (b + 1 == blocks)
+				{
+					blocksize = ((offset + rsize - 1) & MFSBLOCKMASK) + 1;
+				}
+				else
+				{
+					blocksize = MFSBLOCKSIZE;
+				}
+				packets[b] = mainserv_create_packet(&wptr, CSTOCL_READ_DATA, 8 + 2 + 2 + 4 + 4 + blocksize);
+				put64bit(&wptr, chunkid);
+				put16bit(&wptr, blocknum + b);
+				put16bit(&wptr, (b == 0) ? blockoffset : 0);
+				put32bit(&wptr, blocksize);
+				crcptrs[b] = wptr;
+				dataptrs[b] = wptr + 4;
+				psizes[b] = 8 + 2 + 2 + 4 + 4 + blocksize;
+			}
+			status = hdd_read_range(chunkid, version, offset, rsize, dataptrs, crcptrs);
+		}
 		if (protover)
 		{
 			mainserv_read_nop_del(&rn);
 			if (rn.error)
 			{
+				mainserv_free_packets(packets, 0, blocks);
+				if (blocks == 0 && status == MFS_STATUS_OK)
+				{ // block prepared for sendfile won't be sent
+					hdd_read_sendfile_end(chunkid, sendfd);
+				}
 				hdd_close(chunkid);
 				return 0;
 			}
@@ -462,6 +529,11 @@ uint8_t mainserv_read(int sock, const uint8_t *data, uint32_t length)
 			{
 				if (mainserv_towrite(sock, read_nop_buff + (8 - rn.bytesleft), rn.bytesleft, SERV_TIMEOUT) != (int32_t)rn.bytesleft)
 				{
+					mainserv_free_packets(packets, 0, blocks);
+					if (blocks == 0 && status == MFS_STATUS_OK)
+					{
+						hdd_read_sendfile_end(chunkid, sendfd);
+					}
 					hdd_close(chunkid);
 					return 0;
 				}
@@ -470,7 +542,7 @@ uint8_t mainserv_read(int sock, const uint8_t *data, uint32_t length)
 		}
 		if (status != MFS_STATUS_OK)
 		{
-			free(packet);
+			mainserv_free_packets(packets, 0, blocks);
 			hdd_close(chunkid);
 			packet = mainserv_create_packet(&wptr, CSTOCL_READ_STATUS, 8 + 1);
 			put64bit(&wptr, chunkid);
@@ -485,13 +557,27 @@ uint8_t mainserv_read(int sock, const uint8_t *data, uint32_t length)
 #endif
 			return ret;
 		}
-		if (mainserv_send_and_free(sock, packet, 8 + 2 + 2 + 4 + 4 + blocksize) == 0)
+		if (blocks == 0)
 		{
-			hdd_close(chunkid);
-			return 0;
+			ret = (mainserv_towrite(sock, sfhdr, 8 + 8 + 2 + 2 + 4 + 4, SERV_TIMEOUT) == (int32_t)(8 + 8 + 2 + 2 + 4 + 4) && mainserv_tosendfile(sock, sendfd, sendoffset, MFSBLOCKSIZE, SERV_TIMEOUT) == (int32_t)MFSBLOCKSIZE) ? 1 : 0;
+			hdd_read_sendfile_end(chunkid, sendfd); // sent or dropped - writers of this chunk don't have to wait for it any more
+			if (ret == 0)
+			{
+				hdd_close(chunkid);
+				return 0;
+			}
+		}
+		for (b = 0; b < blocks; b++)
+		{
+			if (mainserv_send_and_free(sock, packets[b], psizes[b]) == 0)
+			{
+				mainserv_free_packets(packets, b + 1, blocks);
+				hdd_close(chunkid);
+				return 0;
+			}
 		}
-		offset += blocksize;
-		size -= blocksize;
+		offset += rsize;
+		size -= rsize;
 		i = read(sock, hdr + rcvd, (8 - rcvd));
 		if (i < 0)
 		{ // error or nothing to read
@@ -1466,6 +1552,7 @@ int mainserv_init(void)
 		return -1;
 	}
 	main_destruct_register(mainserv_term);
+	stats_bytes = tc_new();
 	read_nops_head = NULL;
 	read_nops_tail = &read_nops_head;
 	if (pthread_mutex_init(&read_nops_lock, NULL) < 0)
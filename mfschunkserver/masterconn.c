@@ -61,9 +61,12 @@
 #define LOSTCHUNKLIMIT 25000
 // has to be less than MaxPacketSize on master side divided by 12
 #define NEWCHUNKLIMIT 25000
+// number of hottest chunks sent to master every REPORT_HOT_FREQ seconds
+#define HOTCHUNKLIMIT 100
 
 #define REPORT_LOAD_FREQ 5
 #define REPORT_SPACE_FREQ 1
+#define REPORT_HOT_FREQ 60
 
 // force disconnection X seconds after term signal
 #define FORCE_DISCONNECTION_TO 5.0
@@ -114,6 +117,7 @@ typedef struct masterconn {
 	out_packetstruct *outputhead,**outputtail;
 
 	uint32_t masterversion;
+	uint32_t mastercaps;	// MASTERCAP_* flags received in MATOCS_MASTER_ACK
 	uint32_t conncnt;
 	uint32_t bindip;
 	uint32_t masterip;
@@ -139,6 +143,9 @@ static double wantexittime = 0.0;
 static uint64_t stats_bytesout=0;
 static uint64_t stats_bytesin=0;
 
+static uint8_t *chunklistbuff = NULL;
+static uint32_t chunklistbuffsize = 0;
+
 // from config
 // static uint32_t BackLogsNumber;
 static char *MasterHost;
@@ -336,6 +343,13 @@ void masterconn_sendlabels(masterconn *eptr) {
 	put32bit(&buff,labelmask);
 }
 
+void masterconn_sendcapabilities(masterconn *eptr) {
+	uint8_t *buff;
+
+	buff = masterconn_create_attached_packet(eptr,CSTOMA_CAPABILITIES,4);
+	put32bit(&buff,CSCAP_CHUNKOPS);
+}
+
 void masterconn_sendregister(masterconn *eptr) {
 	uint8_t *buff;
 	uint32_t myip;
@@ -437,6 +451,52 @@ void masterconn_sendchunksinfo(masterconn *eptr) {
 	}
 }
 
+static int masterconn_chunkid_cmp(const void *a,const void *b) {
+	const uint8_t *rptra = a;
+	const uint8_t *rptrb = b;
+	uint64_t chunkida,chunkidb;
+	chunkida = get64bit(&rptra);
+	chunkidb = get64bit(&rptrb);
+	return (chunkida<chunkidb)?-1:(chunkida>chunkidb)?1:0;
+}
+
+// compact chunk list (ver 6:CHUNKS_COMPACT) - chunks sorted by id, each one as varint id delta (from previous chunk) and varint (version<<1 | 'mark for removal' flag) - 2-4 bytes per chunk instead of 12
+static void masterconn_sendcompactchunks(masterconn *eptr,uint32_t chunks) {
+	uint8_t *buff,*wptr,*cbuff;
+	const uint8_t *rptr;
+	uint64_t chunkid,prevchunkid;
+	uint32_t i,v,need;
+
+	need = chunks*(8+4+10+5)+1;
+	if (need>chunklistbuffsize) {
+		if (chunklistbuff!=NULL) {
+			free(chunklistbuff);
+		}
+		chunklistbuffsize = need;
+		chunklistbuff = malloc(chunklistbuffsize);
+		passert(chunklistbuff);
+	}
+	hdd_get_chunks_next_list_data(chunklistbuff);
+	qsort(chunklistbuff,chunks,8+4,masterconn_chunkid_cmp);
+	rptr = chunklistbuff;
+	cbuff = wptr = chunklistbuff+chunks*(8+4);
+	prevchunkid = 0;
+	for (i=0 ; i<chunks ; i++) {
+		chunkid = get64bit(&rptr);
+		v = get32bit(&rptr);
+		putvarint(&wptr,chunkid-prevchunkid);
+		putvarint(&wptr,(((uint64_t)(v&0x7FFFFFFF))<<1)|(v>>31));
+		prevchunkid = chunkid;
+	}
+	if ((wptr-cbuff)&1) { // packets with even length are treated by master as old register packets
+		put8bit(&wptr,0);
+	}
+	buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4+(wptr-cbuff));
+	put8bit(&buff,64);
+	put32bit(&buff,chunks);
+	memcpy(buff,cbuff,wptr-cbuff);
+}
+
 void masterconn_sendnextchunks(masterconn *eptr) {
 	uint8_t *buff;
 	uint32_t chunks;
@@ -446,6 +506,8 @@ void masterconn_sendnextchunks(masterconn *eptr) {
 		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1);
 		put8bit(&buff,62);
 		eptr->registerstate = REGISTERED;
+	} else if (eptr->mastercaps&MASTERCAP_COMPACTLIST) {
+		masterconn_sendcompactchunks(eptr,chunks);
 	} else {
 		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+chunks*(8+4));
 		put8bit(&buff,61);
@@ -494,6 +556,9 @@ void masterconn_master_ack(masterconn *eptr,const uint8_t *data,uint32_t length)
 				return;
 			}
 		}
+		if (length>=33) {
+			eptr->mastercaps = get32bit(&data);
+		}
 		if (csid>0 || metaid>0) {
 			masterconn_setcsid(csid,metaid);
 		}
@@ -512,6 +577,9 @@ void masterconn_master_ack(masterconn *eptr,const uint8_t *data,uint32_t length)
 				if (eptr->masterversion>=VERSION2INT(2,1,0)) {
 					masterconn_sendlabels(eptr);
 				}
+				if (eptr->mastercaps&MASTERCAP_CSCAPS) {
+					masterconn_sendcapabilities(eptr);
+				}
 			}
 			if (eptr->registerstate == INPROGRESS) {
 				masterconn_sendnextchunks(eptr);
@@ -759,6 +827,21 @@ void masterconn_check_hdd_reports(void) {
 	}
 }
 
+void masterconn_report_hot_chunks(void) {
+	masterconn *eptr = masterconnsingleton;
+	uint32_t chunkcounter;
+	uint8_t *buff;
+	if (eptr->registerstate==REGISTERED && eptr->mode==DATA && (eptr->mastercaps&MASTERCAP_HOTCHUNKS)) {
+		chunkcounter = hdd_get_hot_chunk_count(HOTCHUNKLIMIT);	// lock
+		if (chunkcounter) {
+			buff = masterconn_create_attached_packet(eptr,CSTOMA_HOT_CHUNKS,9*chunkcounter);
+			hdd_get_hot_chunk_data(buff,chunkcounter);	// unlock
+		} else {
+			hdd_get_hot_chunk_data(NULL,0);
+		}
+	}
+}
+
 void masterconn_reportload(void) {
 	masterconn *eptr = masterconnsingleton;
 	uint32_t load;
@@ -826,6 +909,16 @@ void masterconn_replicationfinished(uint8_t status,void *packet) {
 	}
 }
 
+void masterconn_chunkopsfinished(uint8_t status,void *packet) {
+	masterconn *eptr = masterconnsingleton;
+	(void)status; // statuses of particular operations are already in packet
+	if (eptr && eptr->conncnt==((out_packetstruct*)packet)->conncnt && eptr->mode==DATA) {
+		masterconn_attach_packet(eptr,packet);
+	} else {
+		masterconn_delete_packet(packet);
+	}
+}
+
 void masterconn_create(masterconn *eptr,const uint8_t *data,uint32_t length) {
 	uint64_t chunkid;
 	uint32_t version;
@@ -864,6 +957,67 @@ void masterconn_delete(masterconn *eptr,const uint8_t *data,uint32_t length) {
 	job_delete(masterconn_jobfinished,packet,chunkid,version);
 }
 
+// splits batch into one job per folder, so each worker works on one disk and operations on different disks are done in parallel
+void masterconn_chunkops(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	const uint8_t *rptr;
+	uint8_t *ptr;
+	void *packet;
+	void **fkeys;
+	uint32_t *versions;
+	uint8_t *done;
+	uint32_t cnt,gcnt,i,j;
+	void *fkey;
+
+	if (length==0 || length%13!=0) {
+		syslog(LOG_NOTICE,"MATOCS_CHUNKOPS - wrong size (%"PRIu32"/N*13)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	cnt = length/13;
+	fkeys = malloc(sizeof(void*)*cnt);
+	passert(fkeys);
+	versions = malloc(sizeof(uint32_t)*cnt);
+	passert(versions);
+	done = malloc(cnt);
+	passert(done);
+	rptr = data;
+	for (i=0 ; i<cnt ; i++) {
+		rptr++;
+		fkeys[i] = hdd_chunk_folder_key(get64bit(&rptr));
+		rptr+=4;
+		done[i] = 0;
+	}
+	for (i=0 ; i<cnt ; i++) {
+		if (done[i]) {
+			continue;
+		}
+		fkey = fkeys[i];
+		gcnt = 0;
+		for (j=i ; j<cnt ; j++) {
+			if (done[j]==0 && fkeys[j]==fkey) {
+				gcnt++;
+			}
+		}
+		packet = masterconn_create_detached_packet(eptr,CSTOMA_CHUNKOPS,gcnt*10);
+		ptr = masterconn_get_packet_data(packet);
+		gcnt = 0;
+		for (j=i ; j<cnt ; j++) {
+			if (done[j]==0 && fkeys[j]==fkey) {
+				rptr = data+j*13;
+				put8bit(&ptr,get8bit(&rptr));
+				put64bit(&ptr,get64bit(&rptr));
+				put8bit(&ptr,MFS_ERROR_NOTDONE);
+				versions[gcnt++] = get32bit(&rptr);
+				done[j] = 1;
+			}
+		}
+		job_chunkops(masterconn_chunkopsfinished,packet,fkey,gcnt,versions,masterconn_get_packet_data(packet));
+	}
+	free(done);
+	free(versions);
+	free(fkeys);
+}
+
 void masterconn_setversion(masterconn *eptr,const uint8_t *data,uint32_t length) {
 	uint64_t chunkid;
 	uint32_t version;
@@ -1152,6 +1306,9 @@ void masterconn_gotpacket(masterconn *eptr,uint32_t type,const uint8_t *data,uin
 		case MATOCS_DELETE:
 			masterconn_delete(eptr,data,length);
 			break;
+		case MATOCS_CHUNKOPS:
+			masterconn_chunkops(eptr,data,length);
+			break;
 		case MATOCS_SET_VERSION:
 			masterconn_setversion(eptr,data,length);
 			break;
@@ -1210,6 +1367,7 @@ void masterconn_connected(masterconn *eptr) {
 	eptr->outputtail = &(eptr->outputhead);
 	eptr->conncnt++;
 	eptr->masterversion = 0;
+	eptr->mastercaps = 0;
 	eptr->hlstatus = 0;
 	eptr->gotrndblob = 0;
 	memset(eptr->rndblob,0,32);
@@ -1692,6 +1850,9 @@ void masterconn_term(void) {
 
 	masterconn_read(NULL,0.0); // free internal read buffer
 
+	if (chunklistbuff!=NULL) {
+		free(chunklistbuff);
+	}
 	free(eptr);
 
 	free(MasterHost);
@@ -1787,6 +1948,7 @@ int masterconn_init(void) {
 	eptr->masteraddrvalid = 0;//表示master的ip和port是正确的
 	eptr->new_register_mode = 3;
 	eptr->masterversion = 0;
+	eptr->mastercaps = 0;
 	eptr->hlstatus = 0;
 	eptr->mode = FREE;
 	eptr->pdescpos = -1;
@@ -1809,6 +1971,8 @@ int masterconn_init(void) {
 	main_time_register(REPORT_LOAD_FREQ,0,masterconn_reportload);
 	//用于定期向master发送CSTOMA_SPACE消息
 	main_time_register(REPORT_SPACE_FREQ,0,masterconn_check_hdd_space);
+	//send list of the hottest chunks (CSTOMA_HOT_CHUNKS) to master every minute
+	main_time_register(REPORT_HOT_FREQ,0,masterconn_report_hot_chunks);
 	//在产生错误时向master报告相关错误。
 	main_eachloop_register(masterconn_check_hdd_reports);	
 	//向timehead函数链表注册函数masterconn_reconnect用于每隔ReconnectionDelay秒（默认为5s）尝试连接master
@@ -38,11 +38,13 @@
 #include "hddspacemgr.h"
 #include "sockets.h"
 #include "crc.h"
+#include "xorblock.h"
 #include "slogger.h"
 #include "datapack.h"
 #include "massert.h"
 #include "mfsstrerr.h"
 #include "clocks.h"
+#include "tcounters.h"
 
 #include "replicator.h"
 
@@ -70,6 +72,7 @@ typedef struct _repsrc {
 	uint16_t port;
 
 	uint32_t crcsums[4];
+	uint8_t crcdone;
 } repsrc;
 
 typedef struct _replication {
@@ -77,6 +80,8 @@ typedef struct _replication {
 	uint32_t version;
 
 	uint8_t *xorbuff;
+	const uint8_t **xorsrcs;
+	uint32_t **xorcrcs;
 
 	uint8_t created,opened;
 	uint8_t srccnt;
@@ -84,82 +89,40 @@ typedef struct _replication {
 	repsrc *repsources;
 } replication;
 
+#define RSC_BYTESIN 0
+#define RSC_BYTESOUT 1
+#define RSC_CNT 2
+
 static uint32_t stats_repl = 0;
-static uint64_t stats_bytesin = 0;
-static uint64_t stats_bytesout = 0;
+static void *stats_bytes;	// counted per thread
+static uint64_t stats_bytesbase[RSC_CNT];	// sums already returned by replicator_stats
 static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
 
+int replicator_init(void) {
+	xorblock_init();
+	stats_bytes = tc_new();
+	mfs_arg_syslog(LOG_NOTICE,"replicator: using %s xor engine",xorblock_variant_name(xorblock_get_variant()));
+	return 0;
+}
+
 void replicator_stats(uint64_t *bin,uint64_t *bout,uint32_t *repl) {
+	uint64_t sums[RSC_CNT];
+	tc_sums(stats_bytes,0,RSC_CNT,sums);
 	pthread_mutex_lock(&statslock);
-	*bin = stats_bytesin;
-	*bout = stats_bytesout;
+	*bin = sums[RSC_BYTESIN] - stats_bytesbase[RSC_BYTESIN];
+	*bout = sums[RSC_BYTESOUT] - stats_bytesbase[RSC_BYTESOUT];
+	memcpy(stats_bytesbase,sums,sizeof(stats_bytesbase));
 	*repl = stats_repl;
 	stats_repl = 0;
-	stats_bytesin = 0;
-	stats_bytesout = 0;
 	pthread_mutex_unlock(&statslock);
 }
 
 static inline void replicator_bytesin(uint64_t bytes) {
-	zassert(pthread_mutex_lock(&statslock));
-	stats_bytesin += bytes;
-	zassert(pthread_mutex_unlock(&statslock));
+	tc_get(stats_bytes,RSC_BYTESIN)[0] += bytes;
 }
 
 static inline void replicator_bytesout(uint64_t bytes) {
-	zassert(pthread_mutex_lock(&statslock));
-	stats_bytesout += bytes;
-	zassert(pthread_mutex_unlock(&statslock));
-}
-
-static void xordata(uint8_t *dst,const uint8_t *src,uint32_t leng) {
-	uint32_t *dst4;
-	const uint32_t *src4;
-#define XOR_ONE_BYTE (*dst++)^=(*src++)
-#define XOR_FOUR_BYTES (*dst4++)^=(*src4++)
-	if (((unsigned long)dst&3)==((unsigned long)src&3)) {
-		while (leng && ((unsigned long)src & 3)) {
-			XOR_ONE_BYTE;
-			leng--;
-		}
-		dst4 = (uint32_t*)dst;
-		src4 = (const uint32_t*)src;
-		while (leng>=32) {
-			XOR_FOUR_BYTES;
-			XOR_FOUR_BYTES;
-			XOR_FOUR_BYTES;
-			XOR_FOUR_BYTES;
-			XOR_FOUR_BYTES;
-			XOR_FOUR_BYTES;
-			XOR_FOUR_BYTES;
-			XOR_FOUR_BYTES;
-			leng-=32;
-		}
-		while (leng>=4) {
-			XOR_FOUR_BYTES;
-			leng-=4;
-		}
-		src = (const uint8_t*)src4;
-		dst = (uint8_t*)dst4;
-		if (leng) do {
-			XOR_ONE_BYTE;
-		} while (--leng);
-	} else {
-		while (leng>=8) {
-			XOR_ONE_BYTE;
-			XOR_ONE_BYTE;
-			XOR_ONE_BYTE;
-			XOR_ONE_BYTE;
-			XOR_ONE_BYTE;
-			XOR_ONE_BYTE;
-			XOR_ONE_BYTE;
-			XOR_ONE_BYTE;
-			leng-=8;
-		}
-		if (leng>0) do {
-			XOR_ONE_BYTE;
-		} while (--leng);
-	}
+	tc_get(stats_bytes,RSC_BYTESOUT)[0] += bytes;
 }
 
 static int rep_read(repsrc *rs) {
@@ -424,12 +387,19 @@ static void rep_cleanup(replication *r) {
 	if (r->xorbuff) {
 		free(r->xorbuff);
 	}
+	if (r->xorsrcs) {
+		free(r->xorsrcs);
+	}
+	if (r->xorcrcs) {
+		free(r->xorcrcs);
+	}
 }
 
 /* srcs: srccnt * (chunkid:64 version:32 ip:32 port:16) */
 uint8_t replicate(uint64_t chunkid,uint32_t version,const uint32_t xormasks[4],uint8_t srccnt,const uint8_t *srcs) {
 	replication r;
-	uint8_t status,i,j,vbuffs,first;
+	uint8_t status,i,j,vbuffs;
+	uint32_t xsrccnt;
 	uint16_t b,blocks;
 	uint32_t xcrc[4],crc;
 	uint32_t codeindex,codeword;
@@ -460,8 +430,14 @@ uint8_t replicate(uint64_t chunkid,uint32_t version,const uint32_t xormasks[4],u
 	if (srccnt>1) {
 		r.xorbuff = malloc(MFSBLOCKSIZE+4);
 		passert(r.xorbuff);
+		r.xorsrcs = malloc(sizeof(const uint8_t*)*srccnt*4);
+		passert(r.xorsrcs);
+		r.xorcrcs = malloc(sizeof(uint32_t*)*srccnt*4);
+		passert(r.xorcrcs);
 	} else {
 		r.xorbuff = NULL;
+		r.xorsrcs = NULL;
+		r.xorcrcs = NULL;
 	}
 // create chunk
 	status = hdd_create(chunkid,0);
@@ -722,13 +698,52 @@ uint8_t replicate(uint64_t chunkid,uint32_t version,const uint32_t xormasks[4],u
 				}
 			}
 		} else {
+			// every quarter of result is made in one pass over all its sources - checksums of these sources are calculated in the same pass
+			for (i=0 ; i<srccnt ; i++) {
+				r.repsources[i].crcdone = 0;
+			}
+			crc = mycrc32_zeroblock(0,MFSBLOCKSIZE/4);
+			for (codeindex=0 ; codeindex<4 ; codeindex++) {
+				codeword = xormasks[codeindex];
+				xsrccnt = 0;
+				for (i=0 ; i<srccnt ; i++) {
+					for (j=0 ; j<4 ; j++) {
+						if (r.repsources[i].mode!=IDLE && (codeword&UINT32_C(0x80000000))) {
+							r.xorsrcs[xsrccnt] = r.repsources[i].packet+20+j*MFSBLOCKSIZE/4;
+							if (r.repsources[i].crcdone&(1<<j)) {
+								r.xorcrcs[xsrccnt] = NULL;
+							} else {
+								r.repsources[i].crcsums[j] = 0;
+								r.repsources[i].crcdone |= (1<<j);
+								r.xorcrcs[xsrccnt] = r.repsources[i].crcsums+j;
+							}
+							xsrccnt++;
+						}
+						codeword>>=1;
+					}
+				}
+				xorblock_multi_crc(r.xorbuff+4+codeindex*MFSBLOCKSIZE/4,r.xorsrcs,r.xorcrcs,xsrccnt,MFSBLOCKSIZE/4);
+				// crc(a^b) = crc(a)^crc(b)^crc(zeros)
+				xcrc[codeindex] = (xsrccnt&1)?0:crc;
+				codeword = xormasks[codeindex];
+				for (i=0 ; i<srccnt ; i++) {
+					for (j=0 ; j<4 ; j++) {
+						if (r.repsources[i].mode!=IDLE && (codeword&UINT32_C(0x80000000))) {
+							xcrc[codeindex] ^= r.repsources[i].crcsums[j];
+						}
+						codeword>>=1;
+					}
+				}
+			}
 			for (i=0 ; i<srccnt ; i++) {
 				if (r.repsources[i].mode!=IDLE) {
 					rptr = r.repsources[i].packet;
 					rptr += 16;
 					crc = get32bit(&rptr);
 					for (j=0 ; j<4 ; j++) {
-						r.repsources[i].crcsums[j] = mycrc32(0,rptr+j*MFSBLOCKSIZE/4,MFSBLOCKSIZE/4);
+						if ((r.repsources[i].crcdone&(1<<j))==0) { // quarter not used in any part of result - only checked
+							r.repsources[i].crcsums[j] = mycrc32(0,rptr+j*MFSBLOCKSIZE/4,MFSBLOCKSIZE/4);
+						}
 					}
 					if (crc != mycrc32_combine(mycrc32_combine(r.repsources[i].crcsums[0],r.repsources[i].crcsums[1],MFSBLOCKSIZE/4),mycrc32_combine(r.repsources[i].crcsums[2],r.repsources[i].crcsums[3],MFSBLOCKSIZE/4),MFSBLOCKSIZE/2)) {
 						uint32_t ip;
@@ -739,28 +754,6 @@ uint8_t replicate(uint64_t chunkid,uint32_t version,const uint32_t xormasks[4],u
 					}
 				}
 			}
-			crc = mycrc32_zeroblock(0,MFSBLOCKSIZE/4);
-			for (codeindex=0 ; codeindex<4 ; codeindex++) {
-				codeword = xormasks[codeindex];
-				first = 1;
-				for (i=0 ; i<srccnt ; i++) {
-					for (j=0 ; j<4 ; j++) {
-						if (r.repsources[i].mode!=IDLE && (codeword&UINT32_C(0x80000000))) {
-							rptr = r.repsources[i].packet;
-							rptr += 16;
-							if (first) {
-								memcpy(r.xorbuff+4+codeindex*MFSBLOCKSIZE/4,rptr+4+j*MFSBLOCKSIZE/4,MFSBLOCKSIZE/4);
-								first = 0;
-								xcrc[codeindex] = r.repsources[i].crcsums[j];
-							} else {
-								xordata(r.xorbuff+4+codeindex*MFSBLOCKSIZE/4,rptr+4+j*MFSBLOCKSIZE/4,MFSBLOCKSIZE/4);
-								xcrc[codeindex] ^= r.repsources[i].crcsums[j] ^ crc;
-							}
-						}
-						codeword>>=1;
-					}
-				}
-			}
 			crc = mycrc32_combine(mycrc32_combine(xcrc[0],xcrc[1],MFSBLOCKSIZE/4),mycrc32_combine(xcrc[2],xcrc[3],MFSBLOCKSIZE/4),MFSBLOCKSIZE/2);
 			wptr = r.xorbuff;
 			put32bit(&wptr,crc);
@@ -781,7 +774,7 @@ uint8_t replicate(uint64_t chunkid,uint32_t version,const uint32_t xormasks[4],u
 						memcpy(r.xorbuff+4,rptr+4,MFSBLOCKSIZE);
 						first=0;
 					} else {
-						xordata(r.xorbuff+4,rptr+4,MFSBLOCKSIZE);
+						xorblock(r.xorbuff+4,rptr+4,MFSBLOCKSIZE);
 					}
 					crc = get32bit(&rptr);
 					if (crc!=mycrc32(0,rptr,MFSBLOCKSIZE)) {
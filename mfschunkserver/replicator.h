@@ -23,6 +23,7 @@
 
 #include <inttypes.h>
 
+int replicator_init(void);
 void replicator_stats(uint64_t *bin,uint64_t *bout,uint32_t *repl);
 /* srcs: srccnt * (chunkid:64 version:32 ip:32 port:16) */
 uint8_t replicate(uint64_t chunkid,uint32_t version,const uint32_t xormasks[4],uint8_t srccnt,const uint8_t *srcs);
@@ -704,6 +704,8 @@
 //	rver==62:	// version 6 / END
 //		( rver:8 ) -
 //	rver==63:	// version 6 / DISCONNECT
+//	rver==64:	// version 6 / CHUNKS (compact, only to masters with MASTERCAP_COMPACTLIST) - chunks sorted by chunkid, chunkiddelta - difference from previous chunkid (first from 0), vermfr = version<<1 | 'mark for removal' flag ; zero byte added when packet length would be even
+//		( rver:8 ) N:32 N*[chunkiddelta:VARINT vermfr:VARINT] [ 0:8 ]
 
 // 0x0065
 #define CSTOMA_SPACE (PROTO_BASE+101)
@@ -731,6 +733,11 @@
 // atype:8 master_version:32
 // atype:8 master_version:32 tcptimeout:16 csid:16
 // atype:8 master_version:32 tcptimeout:16 csid:16 metadataid:64 (both versions >= 2.0.33)
+// atype:8 master_version:32 tcptimeout:16 csid:16 metadataid:64 mastercaps:32 0:96 (both versions >= 3.0.112 - older chunkservers accept this length and ignore trailing data)
+
+#define MASTERCAP_HOTCHUNKS 0x00000001	// master accepts CSTOMA_HOT_CHUNKS
+#define MASTERCAP_COMPACTLIST 0x00000002	// master accepts CSTOMA_REGISTER rver==64
+#define MASTERCAP_CSCAPS 0x00000004	// master accepts CSTOMA_CAPABILITIES
 
 // 0x0069
 #define CSTOMA_CHUNK_LOST (PROTO_BASE+105)
@@ -744,6 +751,9 @@
 #define CSTOMA_CHUNK_NEW (PROTO_BASE+107)
 // N*[ chunkid:64 version:32 ]
 
+// 0x006C
+#define CSTOMA_HOT_CHUNKS (PROTO_BASE+108)
+// N*[ chunkid:64 heat:8 ] (only to masters with MASTERCAP_HOTCHUNKS)
 
 // 0x006D
 #define CSTOMA_LABELS (PROTO_BASE+109)
@@ -757,6 +767,12 @@
 #define CSTOMA_CREATE (PROTO_BASE+111)
 // chunkid:64 status:8
 
+// 0x0070
+#define CSTOMA_CAPABILITIES (PROTO_BASE+112)
+// cscaps:32 (only to masters with MASTERCAP_CSCAPS)
+
+#define CSCAP_CHUNKOPS 0x00000001	// chunkserver accepts MATOCS_CHUNKOPS
+
 // 0x0078
 #define MATOCS_DELETE (PROTO_BASE+120)
 // chunkid:64 version:32
@@ -805,6 +821,19 @@
 #define CSTOMA_CHUNKOP (PROTO_BASE+153)
 // chunkid:64 version:32 newversion:32 copychunkid:64 copyversion:32 length:32 status:8
 
+// 0x009C
+#define MATOCS_CHUNKOPS (PROTO_BASE+156)
+// batch of create/delete operations (only to chunkservers with CSCAP_CHUNKOPS) - answer: CSTOMA_CHUNKOPS (possibly split into several packets)
+// N * [ op:8 chunkid:64 version:32 ]
+// op: CHUNKOPS_DELETE or CHUNKOPS_CREATE
+
+// 0x009D
+#define CSTOMA_CHUNKOPS (PROTO_BASE+157)
+// N * [ op:8 chunkid:64 status:8 ]
+
+#define CHUNKOPS_DELETE 0
+#define CHUNKOPS_CREATE 1
+
 
 // 0x00A0
 #define MATOCS_TRUNCATE (PROTO_BASE+160)
@@ -1801,8 +1830,12 @@
 // N*[ inode:32 pathssize:32 M*[ pathleng:32 path:pathlengB ] ]
 
 // 0x021A
+#define CLTOMA_HOT_CHUNKS (PROTO_BASE+538)
+// -
 
 // 0x021B
+#define MATOCL_HOT_CHUNKS (PROTO_BASE+539)
+// N*[ chunkid:64 heat:32 servers:16 copies:8 ]
 
 // 0x021C
 
@@ -1842,10 +1875,12 @@
 // 0x0258
 #define CLTOCS_HDD_LIST (PROTO_BASE+600)
 // -
+// infover:8 (infover>=1 - extended entries)
 
 // 0x0259
 #define CSTOCL_HDD_LIST (PROTO_BASE+601)
 // N * [ entrysize:16 path:NAME flags:8 errchunkid:64 errtime:32 used:64 total:64 chunkscount:32 3 * [ bytesread:64 byteswritten:64 usecread:64 usecwrite:64 usecfsync:64 readops:32 writeops:32 fsyncops:32 usecreadmax:32 usecwritemax:32 usecfsyncmax:32 ] ]
+// N * [ entrysize:16 path:NAME flags:8 errchunkid:64 errtime:32 used:64 total:64 chunkscount:32 3 * [ ... ] movedbytes:64 moveleft:64 moverate:64 moveeta:32 testedchunks:32 testeta:32 lasttestpass:32 wlatency:32 qdepth:16 placefactor:16 ] (infover>=1)
 
 
 
@@ -25,6 +25,34 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include "MFSCommunication.h"
+#include "crc.h"
+
+/* hardware accelerated variants (both chosen at run time): x86-64 - PCLMULQDQ folding ; aarch64 - ARMv8 CRC32 instructions */
+#if defined(__x86_64__) && !defined(WORDS_BIGENDIAN) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define CRC_PCLMUL 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && !defined(WORDS_BIGENDIAN) && (defined(__ARM_FEATURE_CRC32) || (defined(__linux__) && ((defined(__clang__) && __clang_major__ >= 11) || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 9))))
+#define CRC_ARMV8 1
+#include <arm_acle.h>
+#ifdef __ARM_FEATURE_CRC32
+#define CRC_ARMV8_TARGET
+#else
+/* generic armv8-a build - only crc32_armv8 is compiled with crc extension and it is used when kernel reports it */
+#define CRC_ARMV8_RUNTIME 1
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#ifdef __clang__
+#define CRC_ARMV8_TARGET __attribute__((target("crc")))
+#else
+#define CRC_ARMV8_TARGET __attribute__((target("+crc")))
+#endif
+#endif
+#endif
+
+static uint8_t crc_variant = CRC_VARIANT_TABLE;
 
 /* original crc32 code
 uint32_t* crc32_reference_generate(void) {
@@ -122,7 +150,7 @@ void crc_generate_main_tables(void) {
 #endif
 }
 
-uint32_t mycrc32(uint32_t crc,const uint8_t *block,uint32_t leng) {
+static uint32_t mycrc32_table(uint32_t crc,const uint8_t *block,uint32_t leng) {
 #ifdef FASTCRC
 	const uint32_t *block4;
 	uint32_t next;
@@ -198,9 +226,161 @@ uint32_t mycrc32(uint32_t crc,const uint8_t *block,uint32_t leng) {
 #endif
 }
 
+#ifdef CRC_PCLMUL
+/* folding by four 128-bit lanes ('Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction' - Intel) */
+/* crc is internal (inverted) value ; leng has to be a multiple of 16 and at least 64 */
+static __attribute__((target("pclmul,sse2"))) uint32_t crc32_pclmul_fold(uint32_t crc,const uint8_t *block,uint32_t leng) {
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = {UINT64_C(0x0154442bd4), UINT64_C(0x01c6e41596)};
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = {UINT64_C(0x01751997d0), UINT64_C(0x00ccaa009e)};
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = {UINT64_C(0x0163cd6124), UINT64_C(0x0000000000)};
+	static const uint64_t poly[2] __attribute__((aligned(16))) = {UINT64_C(0x01db710641), UINT64_C(0x01f7011641)};
+	__m128i x0,x1,x2,x3,x4,x5,x6,x7,x8,y5,y6,y7,y8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(block + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(block + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(block + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(block + 0x30));
+	x1 = _mm_xor_si128(x1,_mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i*)k1k2);
+	block += 64;
+	leng -= 64;
+
+	/* fold 64 bytes at a time */
+	while (leng>=64) {
+		x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+		x6 = _mm_clmulepi64_si128(x2,x0,0x00);
+		x7 = _mm_clmulepi64_si128(x3,x0,0x00);
+		x8 = _mm_clmulepi64_si128(x4,x0,0x00);
+		x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+		x2 = _mm_clmulepi64_si128(x2,x0,0x11);
+		x3 = _mm_clmulepi64_si128(x3,x0,0x11);
+		x4 = _mm_clmulepi64_si128(x4,x0,0x11);
+		y5 = _mm_loadu_si128((const __m128i*)(block + 0x00));
+		y6 = _mm_loadu_si128((const __m128i*)(block + 0x10));
+		y7 = _mm_loadu_si128((const __m128i*)(block + 0x20));
+		y8 = _mm_loadu_si128((const __m128i*)(block + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1,x5),y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2,x6),y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3,x7),y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4,x8),y8);
+		block += 64;
+		leng -= 64;
+	}
+
+	/* four lanes -> one lane */
+	x0 = _mm_load_si128((const __m128i*)k3k4);
+	x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1,x2),x5);
+	x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1,x3),x5);
+	x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1,x4),x5);
+
+	/* remaining 16-byte blocks */
+	while (leng>=16) {
+		x2 = _mm_loadu_si128((const __m128i*)block);
+		x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+		x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1,x2),x5);
+		block += 16;
+		leng -= 16;
+	}
+
+	/* 128 bits -> 64 bits */
+	x2 = _mm_clmulepi64_si128(x1,x0,0x10);
+	x3 = _mm_setr_epi32(~0,0,~0,0);
+	x1 = _mm_srli_si128(x1,8);
+	x1 = _mm_xor_si128(x1,x2);
+	x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+	x2 = _mm_srli_si128(x1,4);
+	x1 = _mm_and_si128(x1,x3);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_xor_si128(x1,x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_and_si128(x1,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x10);
+	x2 = _mm_and_si128(x2,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x00);
+	x1 = _mm_xor_si128(x1,x2);
+
+	return _mm_cvtsi128_si32(_mm_srli_si128(x1,4));
+}
+
+static uint8_t crc32_pclmul_supported(void) {
+	unsigned int eax,ebx,ecx,edx;
+	if (__get_cpuid(1,&eax,&ebx,&ecx,&edx)==0) {
+		return 0;
+	}
+	return ((ecx & bit_PCLMUL) && (edx & bit_SSE2))?1:0;
+}
+#endif /* CRC_PCLMUL */
+
+#ifdef CRC_ARMV8
+static CRC_ARMV8_TARGET uint32_t crc32_armv8(uint32_t crc,const uint8_t *block,uint32_t leng) {
+	const uint64_t *block8;
+	crc ^= 0xFFFFFFFF;
+	while (leng && ((uintptr_t)block & 7)) {
+		crc = __crc32b(crc,*block++);
+		leng--;
+	}
+	block8 = (const uint64_t*)block;
+	while (leng>=32) {
+		crc = __crc32d(crc,block8[0]);
+		crc = __crc32d(crc,block8[1]);
+		crc = __crc32d(crc,block8[2]);
+		crc = __crc32d(crc,block8[3]);
+		block8 += 4;
+		leng -= 32;
+	}
+	while (leng>=8) {
+		crc = __crc32d(crc,*block8++);
+		leng -= 8;
+	}
+	block = (const uint8_t*)block8;
+	while (leng) {
+		crc = __crc32b(crc,*block++);
+		leng--;
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+static uint8_t crc32_armv8_supported(void) {
+#ifdef CRC_ARMV8_RUNTIME
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32)?1:0;
+#else
+	return 1;
+#endif
+}
+#endif /* CRC_ARMV8 */
+
+uint32_t mycrc32(uint32_t crc,const uint8_t *block,uint32_t leng) {
+#ifdef CRC_PCLMUL
+	if (crc_variant==CRC_VARIANT_PCLMUL && leng>=64) {
+		uint32_t fleng = leng & ~UINT32_C(15);
+		crc = crc32_pclmul_fold(crc^0xFFFFFFFF,block,fleng)^0xFFFFFFFF;
+		block += fleng;
+		leng -= fleng;
+	}
+#endif
+#ifdef CRC_ARMV8
+	if (crc_variant==CRC_VARIANT_ARMV8) {
+		return crc32_armv8(crc,block,leng);
+	}
+#endif
+	return mycrc32_table(crc,block,leng);
+}
+
 /* crc_combine */
 
 static uint32_t crc_combine_table[32][4][256];
+#ifdef CRC_PCLMUL
+static uint32_t crc_xpow8[32]; // x^(8*2^i) mod P
+#endif
 
 static void crc_matrix_square(uint32_t sqr[32], uint32_t m[32]) {
 	uint32_t i,j,s,v;
@@ -252,9 +432,67 @@ static void crc_generate_combine_tables(void) {
 	}
 }
 
+#ifdef CRC_PCLMUL
+/* a*b mod P - product and Barrett reduction done entirely with PCLMULQDQ (no table lookups) */
+static __attribute__((target("pclmul,sse2"))) uint32_t crc32_pclmul_mulmod(uint32_t a,uint32_t b) {
+	static const uint64_t poly[2] __attribute__((aligned(16))) = {UINT64_C(0x01db710641), UINT64_C(0x01f7011641)};
+	__m128i x0,x1,x2,x3;
+
+	x3 = _mm_setr_epi32(~0,0,~0,0);
+	x1 = _mm_clmulepi64_si128(_mm_cvtsi32_si128(a),_mm_cvtsi32_si128(b),0x00);
+	x1 = _mm_slli_epi64(x1,1);
+	x0 = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_and_si128(x1,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x10);
+	x2 = _mm_and_si128(x2,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x00);
+	x1 = _mm_xor_si128(x1,x2);
+	return _mm_cvtsi128_si32(_mm_srli_si128(x1,4));
+}
+
+/* a*b mod P - bit by bit (CPU without PCLMULQDQ has to be able to generate tables) ; a can't be zero */
+static uint32_t crc_multmodp(uint32_t a,uint32_t b) {
+	uint32_t m,p;
+	m = UINT32_C(1)<<31;
+	p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m-1))==0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = (b&1) ? (b>>1)^CRC_POLY : (b>>1);
+	}
+	return p;
+}
+
+static void crc_generate_xpow8_table(void) {
+	uint32_t i;
+	crc_xpow8[0] = UINT32_C(0x00800000); // x^8
+	for (i=1 ; i<32 ; i++) {
+		crc_xpow8[i] = crc_multmodp(crc_xpow8[i-1],crc_xpow8[i-1]);
+	}
+}
+#endif
+
 uint32_t mycrc32_combine(uint32_t crc1, uint32_t crc2, uint32_t leng2) {
 	uint8_t i;
 
+#ifdef CRC_PCLMUL
+	if (crc_variant==CRC_VARIANT_PCLMUL) {
+		i=0;
+		while (leng2) {
+			if (leng2&1) {
+				crc1 = crc32_pclmul_mulmod(crc1,crc_xpow8[i]);
+			}
+			i++;
+			leng2>>=1;
+		}
+		return crc1^crc2;
+	}
+#endif
 	/* add leng2 zeros to crc1 */
 	i=0;
 	while (leng2) {
@@ -271,7 +509,53 @@ uint32_t mycrc32_combine(uint32_t crc1, uint32_t crc2, uint32_t leng2) {
 	return crc1^crc2;
 }
 
+uint8_t mycrc32_variant_supported(uint8_t variant) {
+	switch (variant) {
+		case CRC_VARIANT_TABLE:
+			return 1;
+#ifdef CRC_PCLMUL
+		case CRC_VARIANT_PCLMUL:
+			return crc32_pclmul_supported();
+#endif
+#ifdef CRC_ARMV8
+		case CRC_VARIANT_ARMV8:
+			return crc32_armv8_supported();
+#endif
+	}
+	return 0;
+}
+
+int mycrc32_set_variant(uint8_t variant) {
+	if (mycrc32_variant_supported(variant)==0) {
+		return -1;
+	}
+	crc_variant = variant;
+	return 0;
+}
+
+uint8_t mycrc32_get_variant(void) {
+	return crc_variant;
+}
+
+const char* mycrc32_variant_name(uint8_t variant) {
+	switch (variant) {
+		case CRC_VARIANT_TABLE:
+			return "table";
+		case CRC_VARIANT_PCLMUL:
+			return "pclmul";
+		case CRC_VARIANT_ARMV8:
+			return "armv8";
+	}
+	return "unknown";
+}
+
 void mycrc32_init(void) {
 	crc_generate_main_tables();
 	crc_generate_combine_tables();
+#ifdef CRC_PCLMUL
+	crc_generate_xpow8_table();
+#endif
+	if (mycrc32_set_variant(CRC_VARIANT_PCLMUL)<0 && mycrc32_set_variant(CRC_VARIANT_ARMV8)<0) {
+		crc_variant = CRC_VARIANT_TABLE;
+	}
 }
@@ -28,6 +28,16 @@ uint32_t mycrc32_combine(uint32_t crc1, uint32_t crc2, uint32_t leng2);
 #define mycrc32_zeroexpanded(crc,block,leng,zeros) mycrc32_zeroblock(mycrc32((crc),(block),(leng)),(zeros))
 #define mycrc32_xorblocks(crc,crcblock1,crcblock2,leng) ((crcblock1)^(crcblock2)^mycrc32_zeroblock(crc,leng))
 
+#define CRC_VARIANT_TABLE 0
+#define CRC_VARIANT_PCLMUL 1
+#define CRC_VARIANT_ARMV8 2
+
+/* mycrc32_init chooses the fastest supported variant - the others are used only by tests */
+uint8_t mycrc32_variant_supported(uint8_t variant);
+int mycrc32_set_variant(uint8_t variant);
+uint8_t mycrc32_get_variant(void);
+const char* mycrc32_variant_name(uint8_t variant);
+
 void mycrc32_init(void);
 
 #endif
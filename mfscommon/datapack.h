@@ -157,4 +157,34 @@ static inline uint8_t get8bit(const uint8_t **ptr) {
 	return t8;
 }
 
+/* variable length numbers - 7 bits per byte, lowest bits first, high bit set in all bytes except the last one (up to 10 bytes for 64-bit values) */
+static inline void putvarint(uint8_t **ptr,uint64_t val) {
+	while (val>=0x80) {
+		(*ptr)[0]=(val&0x7F)|0x80;
+		(*ptr)++;
+		val>>=7;
+	}
+	(*ptr)[0]=(uint8_t)val;
+	(*ptr)++;
+}
+
+/* returns -1 when number doesn't end before 'endptr' or is too long */
+static inline int getvarint(const uint8_t **ptr,const uint8_t *endptr,uint64_t *val) {
+	uint64_t v;
+	uint8_t b,shift;
+	v=0;
+	shift=0;
+	do {
+		if ((*ptr)>=endptr || shift>63) {
+			return -1;
+		}
+		b=(*ptr)[0];
+		(*ptr)++;
+		v|=((uint64_t)(b&0x7F))<<shift;
+		shift+=7;
+	} while (b&0x80);
+	*val=v;
+	return 0;
+}
+
 #endif
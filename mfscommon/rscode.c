@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include "crc.h"
+#include "rscode.h"
+
+/* vector variants (split nibble tables and byte shuffle): x86-64 - SSSE3 and AVX2 (chosen at run time) ; aarch64 - NEON (always available) */
+#if defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define RS_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define RS_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define GF_POLY 0x11D
+
+/* data is combined and checksummed in such pieces, so all sources of one piece stay in L1/L2 cache */
+#define RS_CRC_STRIP 4096
+
+/* kernels process data from pos to end and return position where they stopped ; tabs: srccnt * (16 products of low nibble, 16 products of high nibble) */
+typedef uint32_t (*rskernel)(uint8_t *dst,const uint8_t * const *srcs,const uint8_t (*tabs)[32],uint32_t srccnt,uint32_t pos,uint32_t end);
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_multab[256][256];
+static uint8_t rs_variant = RS_VARIANT_GENERIC;
+
+static void gf_generate_tables(void) {
+	uint32_t i,j,x;
+
+	x = 1;
+	for (i=0 ; i<255 ; i++) {
+		gf_exp[i] = x;
+		gf_exp[i+255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x&0x100) {
+			x ^= GF_POLY;
+		}
+	}
+	gf_exp[510] = gf_exp[0];
+	gf_exp[511] = gf_exp[1];
+	gf_log[0] = 0;
+	for (i=0 ; i<256 ; i++) {
+		for (j=0 ; j<256 ; j++) {
+			gf_multab[i][j] = (i==0 || j==0)?0:gf_exp[gf_log[i]+gf_log[j]];
+		}
+	}
+}
+
+uint8_t rs_gf_mul(uint8_t a,uint8_t b) {
+	return gf_multab[a][b];
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+	return gf_exp[255-gf_log[a]];
+}
+
+/* row of generator matrix for given part */
+static void rs_generator_row(uint8_t k,uint8_t part,uint8_t *row) {
+	uint8_t j;
+
+	if (part<k) {
+		memset(row,0,k);
+		row[part] = 1;
+	} else {
+		for (j=0 ; j<k ; j++) {
+			row[j] = gf_inv(part^j); // Cauchy: 1/(x_i+y_j) where x_i = part (k..k+m-1) and y_j = j (0..k-1)
+		}
+	}
+}
+
+int rs_coefs(uint8_t k,uint8_t m,const uint8_t *srcparts,uint8_t dstpart,uint8_t *coefs) {
+	uint8_t a[RS_MAXDATA][RS_MAXDATA];
+	uint8_t inv[RS_MAXDATA][RS_MAXDATA];
+	uint8_t row[RS_MAXDATA];
+	uint8_t i,j,c,p,f;
+	uint32_t used[(RS_MAXDATA+RS_MAXPARITY+31)/32];
+
+	if (k==0 || k>RS_MAXDATA || m>RS_MAXPARITY || dstpart>=k+m) {
+		return -1;
+	}
+	memset(used,0,sizeof(used));
+	for (i=0 ; i<k ; i++) {
+		if (srcparts[i]>=k+m || (used[srcparts[i]>>5]&(1U<<(srcparts[i]&31)))) {
+			return -1;
+		}
+		used[srcparts[i]>>5] |= 1U<<(srcparts[i]&31);
+		rs_generator_row(k,srcparts[i],a[i]);
+		memset(inv[i],0,k);
+		inv[i][i] = 1;
+	}
+	// Gauss-Jordan elimination - sources = A * data, so data = inv(A) * sources
+	for (c=0 ; c<k ; c++) {
+		for (p=c ; p<k && a[p][c]==0 ; p++) {}
+		if (p==k) {
+			return -1;
+		}
+		if (p!=c) {
+			memcpy(row,a[p],k);
+			memcpy(a[p],a[c],k);
+			memcpy(a[c],row,k);
+			memcpy(row,inv[p],k);
+			memcpy(inv[p],inv[c],k);
+			memcpy(inv[c],row,k);
+		}
+		f = gf_inv(a[c][c]);
+		for (j=0 ; j<k ; j++) {
+			a[c][j] = gf_multab[f][a[c][j]];
+			inv[c][j] = gf_multab[f][inv[c][j]];
+		}
+		for (i=0 ; i<k ; i++) {
+			if (i!=c && a[i][c]!=0) {
+				f = a[i][c];
+				for (j=0 ; j<k ; j++) {
+					a[i][j] ^= gf_multab[f][a[c][j]];
+					inv[i][j] ^= gf_multab[f][inv[c][j]];
+				}
+			}
+		}
+	}
+	// dstpart = row * data = (row * inv(A)) * sources
+	rs_generator_row(k,dstpart,row);
+	for (j=0 ; j<k ; j++) {
+		c = 0;
+		for (i=0 ; i<k ; i++) {
+			c ^= gf_multab[row[i]][inv[i][j]];
+		}
+		coefs[j] = c;
+	}
+	return 0;
+}
+
+static void rs_combine_generic(uint8_t *dst,const uint8_t * const *srcs,const uint8_t *coefs,uint32_t srccnt,uint32_t pos,uint32_t end) {
+	const uint8_t *mt;
+	uint32_t i,p;
+
+	mt = gf_multab[coefs[0]];
+	for (p=pos ; p<end ; p++) {
+		dst[p] = mt[srcs[0][p]];
+	}
+	for (i=1 ; i<srccnt ; i++) {
+		mt = gf_multab[coefs[i]];
+		for (p=pos ; p<end ; p++) {
+			dst[p] ^= mt[srcs[i][p]];
+		}
+	}
+}
+
+#ifdef RS_X86
+static __attribute__((target("ssse3"))) uint32_t rs_combine_ssse3(uint8_t *dst,const uint8_t * const *srcs,const uint8_t (*tabs)[32],uint32_t srccnt,uint32_t pos,uint32_t end) {
+	__m128i x0,x1,tl,th,v0,v1,mask;
+	const uint8_t *s;
+	uint32_t i;
+
+	mask = _mm_set1_epi8(0x0F);
+	for ( ; pos+32<=end ; pos+=32) {
+		x0 = _mm_setzero_si128();
+		x1 = _mm_setzero_si128();
+		for (i=0 ; i<srccnt ; i++) {
+			s = srcs[i]+pos;
+			tl = _mm_loadu_si128((const __m128i*)(tabs[i]));
+			th = _mm_loadu_si128((const __m128i*)(tabs[i]+16));
+			v0 = _mm_loadu_si128((const __m128i*)s);
+			v1 = _mm_loadu_si128((const __m128i*)(s+16));
+			x0 = _mm_xor_si128(x0,_mm_shuffle_epi8(tl,_mm_and_si128(v0,mask)));
+			x0 = _mm_xor_si128(x0,_mm_shuffle_epi8(th,_mm_and_si128(_mm_srli_epi64(v0,4),mask)));
+			x1 = _mm_xor_si128(x1,_mm_shuffle_epi8(tl,_mm_and_si128(v1,mask)));
+			x1 = _mm_xor_si128(x1,_mm_shuffle_epi8(th,_mm_and_si128(_mm_srli_epi64(v1,4),mask)));
+		}
+		_mm_storeu_si128((__m128i*)(dst+pos),x0);
+		_mm_storeu_si128((__m128i*)(dst+pos+16),x1);
+	}
+	return pos;
+}
+
+static __attribute__((target("avx2"))) uint32_t rs_combine_avx2(uint8_t *dst,const uint8_t * const *srcs,const uint8_t (*tabs)[32],uint32_t srccnt,uint32_t pos,uint32_t end) {
+	__m256i x0,x1,tl,th,v0,v1,mask;
+	const uint8_t *s;
+	uint32_t i;
+
+	mask = _mm256_set1_epi8(0x0F);
+	for ( ; pos+64<=end ; pos+=64) {
+		x0 = _mm256_setzero_si256();
+		x1 = _mm256_setzero_si256();
+		for (i=0 ; i<srccnt ; i++) {
+			s = srcs[i]+pos;
+			tl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(tabs[i])));
+			th = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(tabs[i]+16)));
+			v0 = _mm256_loadu_si256((const __m256i*)s);
+			v1 = _mm256_loadu_si256((const __m256i*)(s+32));
+			x0 = _mm256_xor_si256(x0,_mm256_shuffle_epi8(tl,_mm256_and_si256(v0,mask)));
+			x0 = _mm256_xor_si256(x0,_mm256_shuffle_epi8(th,_mm256_and_si256(_mm256_srli_epi64(v0,4),mask)));
+			x1 = _mm256_xor_si256(x1,_mm256_shuffle_epi8(tl,_mm256_and_si256(v1,mask)));
+			x1 = _mm256_xor_si256(x1,_mm256_shuffle_epi8(th,_mm256_and_si256(_mm256_srli_epi64(v1,4),mask)));
+		}
+		_mm256_storeu_si256((__m256i*)(dst+pos),x0);
+		_mm256_storeu_si256((__m256i*)(dst+pos+32),x1);
+	}
+	_mm256_zeroupper();
+	return pos;
+}
+
+static uint8_t rs_ssse3_supported(void) {
+	unsigned int eax,ebx,ecx,edx;
+	if (__get_cpuid(1,&eax,&ebx,&ecx,&edx)==0) {
+		return 0;
+	}
+	return (ecx & bit_SSSE3)?1:0;
+}
+
+static uint8_t rs_avx2_supported(void) {
+	unsigned int eax,ebx,ecx,edx;
+	uint32_t xcr0l,xcr0h;
+	if (__get_cpuid(1,&eax,&ebx,&ecx,&edx)==0 || (ecx & bit_OSXSAVE)==0 || __get_cpuid_max(0,NULL)<7) {
+		return 0;
+	}
+	__asm__ volatile ("xgetbv" : "=a"(xcr0l), "=d"(xcr0h) : "c"(0));
+	if ((xcr0l & 0x6)!=0x6) { // AVX state has to be enabled by OS
+		return 0;
+	}
+	__cpuid_count(7,0,eax,ebx,ecx,edx);
+	return (ebx & (1<<5))?1:0;
+}
+#endif /* RS_X86 */
+
+#ifdef RS_NEON
+static uint32_t rs_combine_neon(uint8_t *dst,const uint8_t * const *srcs,const uint8_t (*tabs)[32],uint32_t srccnt,uint32_t pos,uint32_t end) {
+	uint8x16_t x0,x1,tl,th,v0,v1,mask;
+	const uint8_t *s;
+	uint32_t i;
+
+	mask = vdupq_n_u8(0x0F);
+	for ( ; pos+32<=end ; pos+=32) {
+		x0 = vdupq_n_u8(0);
+		x1 = vdupq_n_u8(0);
+		for (i=0 ; i<srccnt ; i++) {
+			s = srcs[i]+pos;
+			tl = vld1q_u8(tabs[i]);
+			th = vld1q_u8(tabs[i]+16);
+			v0 = vld1q_u8(s);
+			v1 = vld1q_u8(s+16);
+			x0 = veorq_u8(x0,vqtbl1q_u8(tl,vandq_u8(v0,mask)));
+			x0 = veorq_u8(x0,vqtbl1q_u8(th,vshrq_n_u8(v0,4)));
+			x1 = veorq_u8(x1,vqtbl1q_u8(tl,vandq_u8(v1,mask)));
+			x1 = veorq_u8(x1,vqtbl1q_u8(th,vshrq_n_u8(v1,4)));
+		}
+		vst1q_u8(dst+pos,x0);
+		vst1q_u8(dst+pos+16,x1);
+	}
+	return pos;
+}
+#endif /* RS_NEON */
+
+static inline void rs_combine_range(uint8_t *dst,const uint8_t * const *srcs,const uint8_t *coefs,const uint8_t (*tabs)[32],uint32_t srccnt,uint32_t pos,uint32_t end) {
+	rskernel kernel;
+
+	switch (rs_variant) {
+#ifdef RS_X86
+		case RS_VARIANT_SSSE3:
+			kernel = rs_combine_ssse3;
+			break;
+		case RS_VARIANT_AVX2:
+			kernel = rs_combine_avx2;
+			break;
+#endif
+#ifdef RS_NEON
+		case RS_VARIANT_NEON:
+			kernel = rs_combine_neon;
+			break;
+#endif
+		default:
+			kernel = NULL;
+	}
+	if (kernel!=NULL) {
+		pos = kernel(dst,srcs,tabs,srccnt,pos,end);
+	}
+	if (pos<end) {
+		rs_combine_generic(dst,srcs,coefs,srccnt,pos,end);
+	}
+}
+
+static inline void rs_make_tabs(const uint8_t *coefs,uint32_t srccnt,uint8_t (*tabs)[32]) {
+	uint32_t i,x;
+
+	for (i=0 ; i<srccnt ; i++) {
+		for (x=0 ; x<16 ; x++) {
+			tabs[i][x] = gf_multab[coefs[i]][x];
+			tabs[i][x+16] = gf_multab[coefs[i]][x<<4];
+		}
+	}
+}
+
+void rs_combine(uint8_t *dst,const uint8_t * const *srcs,const uint8_t *coefs,uint32_t srccnt,uint32_t leng) {
+	uint8_t tabs[RS_MAXDATA][32];
+
+	if (srccnt==0) {
+		memset(dst,0,leng);
+		return;
+	}
+	rs_make_tabs(coefs,srccnt,tabs);
+	rs_combine_range(dst,srcs,coefs,(const uint8_t (*)[32])tabs,srccnt,0,leng);
+}
+
+void rs_combine_crc(uint8_t *dst,const uint8_t * const *srcs,const uint8_t *coefs,uint32_t * const *crcs,uint32_t srccnt,uint32_t leng) {
+	uint8_t tabs[RS_MAXDATA][32];
+	uint32_t i,pos,end;
+
+	if (srccnt==0) {
+		memset(dst,0,leng);
+		return;
+	}
+	rs_make_tabs(coefs,srccnt,tabs);
+	for (pos=0 ; pos<leng ; pos=end) {
+		end = (leng-pos>RS_CRC_STRIP)?pos+RS_CRC_STRIP:leng;
+		for (i=0 ; i<srccnt ; i++) {
+			if (crcs[i]!=NULL) {
+				*(crcs[i]) = mycrc32(*(crcs[i]),srcs[i]+pos,end-pos);
+			}
+		}
+		rs_combine_range(dst,srcs,coefs,(const uint8_t (*)[32])tabs,srccnt,pos,end);
+	}
+}
+
+uint8_t rs_variant_supported(uint8_t variant) {
+	switch (variant) {
+		case RS_VARIANT_GENERIC:
+			return 1;
+#ifdef RS_X86
+		case RS_VARIANT_SSSE3:
+			return rs_ssse3_supported();
+		case RS_VARIANT_AVX2:
+			return rs_avx2_supported();
+#endif
+#ifdef RS_NEON
+		case RS_VARIANT_NEON:
+			return 1;
+#endif
+	}
+	return 0;
+}
+
+int rs_set_variant(uint8_t variant) {
+	if (rs_variant_supported(variant)==0) {
+		return -1;
+	}
+	rs_variant = variant;
+	return 0;
+}
+
+uint8_t rs_get_variant(void) {
+	return rs_variant;
+}
+
+const char* rs_variant_name(uint8_t variant) {
+	switch (variant) {
+		case RS_VARIANT_GENERIC:
+			return "generic";
+		case RS_VARIANT_SSSE3:
+			return "ssse3";
+		case RS_VARIANT_AVX2:
+			return "avx2";
+		case RS_VARIANT_NEON:
+			return "neon";
+	}
+	return "unknown";
+}
+
+void rs_init(void) {
+	gf_generate_tables();
+	if (rs_set_variant(RS_VARIANT_AVX2)<0 && rs_set_variant(RS_VARIANT_SSSE3)<0 && rs_set_variant(RS_VARIANT_NEON)<0) {
+		rs_variant = RS_VARIANT_GENERIC;
+	}
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef _RSCODE_H_
+#define _RSCODE_H_
+#include <inttypes.h>
+
+/* Reed-Solomon k+m code over GF(2^8) ; parts 0..k-1 are data, parts k..k+m-1 are parity (systematic Cauchy matrix) */
+#define RS_MAXDATA 32
+#define RS_MAXPARITY 16
+
+/* dst = coefs[0]*srcs[0] + ... + coefs[srccnt-1]*srcs[srccnt-1] (in GF(2^8)) - done in one pass, srccnt<=RS_MAXDATA */
+void rs_combine(uint8_t *dst,const uint8_t * const *srcs,const uint8_t *coefs,uint32_t srccnt,uint32_t leng);
+/* as above, but also updates checksums of sources (*crcs[i] = mycrc32(*crcs[i],srcs[i],leng)) while data is still in cache ; crcs[i] can be NULL */
+void rs_combine_crc(uint8_t *dst,const uint8_t * const *srcs,const uint8_t *coefs,uint32_t * const *crcs,uint32_t srccnt,uint32_t leng);
+/* coefficients for rs_combine that make part 'dstpart' from k different parts 'srcparts' (encoding when srcparts are 0..k-1) ; returns -1 on wrong arguments */
+int rs_coefs(uint8_t k,uint8_t m,const uint8_t *srcparts,uint8_t dstpart,uint8_t *coefs);
+
+uint8_t rs_gf_mul(uint8_t a,uint8_t b);
+
+#define RS_VARIANT_GENERIC 0
+#define RS_VARIANT_SSSE3 1
+#define RS_VARIANT_AVX2 2
+#define RS_VARIANT_NEON 3
+
+/* rs_init chooses the fastest supported variant - the others are used only by tests */
+uint8_t rs_variant_supported(uint8_t variant);
+int rs_set_variant(uint8_t variant);
+uint8_t rs_get_variant(void);
+const char* rs_variant_name(uint8_t variant);
+
+void rs_init(void);
+
+#endif
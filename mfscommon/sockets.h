@@ -59,6 +59,8 @@ int tcpstrlisten(int sock,const char *hostname,const char *service,uint16_t queu
 int32_t tcptoread(int sock,void *buff,uint32_t leng,uint32_t msecto);
 int32_t tcptowrite(int sock,const void *buff,uint32_t leng,uint32_t msecto);
 int32_t tcptoforward(int srcsock,int dstsock,void *buff,uint32_t leng,uint32_t rcvd,uint32_t sent,uint32_t msecto);
+int32_t tcptosendfile(int sock,int fd,uint64_t offset,uint32_t leng,uint32_t msecto);
+int32_t tcpsendfile(int sock,int fd,uint64_t offset,uint32_t leng);
 int tcptoaccept(int sock,uint32_t msecto);
 int tcpaccept(int lsock);
 int tcpgetpeer(int sock,uint32_t *ip,uint16_t *port);
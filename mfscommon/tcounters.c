@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "massert.h"
+#include "tcounters.h"
+
+typedef struct _tcslab {
+	uint64_t *blocks[TC_MAXBLOCKS];	// written only by owner thread, blocks are never freed before tc_delete
+	uint8_t inuse;	// 0 - owner thread has finished (slab can be taken by new thread - its sums are kept)
+	struct _tcslab *next;
+} tcslab;
+
+typedef struct _tcounters {
+	pthread_key_t key;
+	pthread_mutex_t lock;	// slab list
+	tcslab *head;
+} tcounters;
+
+static void tc_slab_release(void *slabp) {
+	tcslab *slab = (tcslab*)slabp;
+#ifdef HAVE___SYNC_OP_AND_FETCH
+	__sync_and_and_fetch(&(slab->inuse),0);
+#else
+	slab->inuse = 0;
+#endif
+}
+
+void* tc_new(void) {
+	tcounters *tc;
+	tc = malloc(sizeof(tcounters));
+	passert(tc);
+	zassert(pthread_key_create(&(tc->key),tc_slab_release));
+	zassert(pthread_mutex_init(&(tc->lock),NULL));
+	tc->head = NULL;
+	return tc;
+}
+
+void tc_delete(void *tcp) {
+	tcounters *tc = (tcounters*)tcp;
+	tcslab *slab,*nslab;
+	uint32_t i;
+	for (slab=tc->head ; slab ; slab=nslab) {
+		nslab = slab->next;
+		for (i=0 ; i<TC_MAXBLOCKS ; i++) {
+			if (slab->blocks[i]) {
+				free(slab->blocks[i]);
+			}
+		}
+		free(slab);
+	}
+	zassert(pthread_mutex_destroy(&(tc->lock)));
+	zassert(pthread_key_delete(tc->key));
+	free(tc);
+}
+
+static inline tcslab* tc_slab_get(tcounters *tc) {
+	tcslab *slab;
+	slab = pthread_getspecific(tc->key);
+	if (slab==NULL) {
+		zassert(pthread_mutex_lock(&(tc->lock)));
+		for (slab=tc->head ; slab ; slab=slab->next) {
+			if (slab->inuse==0) {
+				break;
+			}
+		}
+		if (slab==NULL) {
+			slab = malloc(sizeof(tcslab));
+			passert(slab);
+			memset(slab,0,sizeof(tcslab));
+			slab->next = tc->head;
+			tc->head = slab;
+		}
+		slab->inuse = 1;
+		zassert(pthread_mutex_unlock(&(tc->lock)));
+		zassert(pthread_setspecific(tc->key,slab));
+	}
+	return slab;
+}
+
+// returns pointer to counter 'id' of current thread - next counters (up to the end of block) follow it
+uint64_t* tc_get(void *tcp,uint32_t id) {
+	tcounters *tc = (tcounters*)tcp;
+	tcslab *slab;
+	uint64_t *block;
+	uint32_t b;
+
+	b = id / TC_BLOCKSIZE;
+	sassert(b<TC_MAXBLOCKS);
+	slab = tc_slab_get(tc);
+	block = slab->blocks[b];
+	if (block==NULL) {
+		block = malloc(sizeof(uint64_t)*TC_BLOCKSIZE);
+		passert(block);
+		memset(block,0,sizeof(uint64_t)*TC_BLOCKSIZE);
+#ifdef HAVE___SYNC_OP_AND_FETCH
+		__sync_synchronize();	// block has to be zeroed before readers can see it
+#endif
+		slab->blocks[b] = block;
+	}
+	return block + (id % TC_BLOCKSIZE);
+}
+
+void tc_add(void *tcp,uint32_t id,uint64_t value) {
+	*(tc_get(tcp,id)) += value;
+}
+
+// sums of 'cnt' counters starting from 'id' (all of them have to be in the same block)
+void tc_sums(void *tcp,uint32_t id,uint32_t cnt,uint64_t *sums) {
+	tcounters *tc = (tcounters*)tcp;
+	tcslab *slab;
+	uint64_t *block;
+	uint32_t b,i;
+
+	b = id / TC_BLOCKSIZE;
+	sassert(b<TC_MAXBLOCKS && (id % TC_BLOCKSIZE) + cnt <= TC_BLOCKSIZE);
+	memset(sums,0,sizeof(uint64_t)*cnt);
+	zassert(pthread_mutex_lock(&(tc->lock)));
+	for (slab=tc->head ; slab ; slab=slab->next) {
+		block = slab->blocks[b];
+		if (block) {
+			block += id % TC_BLOCKSIZE;
+			for (i=0 ; i<cnt ; i++) {
+				sums[i] += block[i];
+			}
+		}
+	}
+	zassert(pthread_mutex_unlock(&(tc->lock)));
+}
+
+uint64_t tc_sum(void *tcp,uint32_t id) {
+	uint64_t s;
+	tc_sums(tcp,id,1,&s);
+	return s;
+}
+
+// maximum of counter 'id' over all threads - counter is zeroed
+uint64_t tc_maxreset(void *tcp,uint32_t id) {
+	tcounters *tc = (tcounters*)tcp;
+	tcslab *slab;
+	uint64_t *block;
+	uint64_t v,m;
+	uint32_t b;
+
+	b = id / TC_BLOCKSIZE;
+	sassert(b<TC_MAXBLOCKS);
+	m = 0;
+	zassert(pthread_mutex_lock(&(tc->lock)));
+	for (slab=tc->head ; slab ; slab=slab->next) {
+		block = slab->blocks[b];
+		if (block) {
+#ifdef HAVE___SYNC_FETCH_AND_OP
+			v = __sync_fetch_and_and(block + (id % TC_BLOCKSIZE),0);
+#else
+			v = block[id % TC_BLOCKSIZE];
+			block[id % TC_BLOCKSIZE] = 0;
+#endif
+			if (v>m) {
+				m = v;
+			}
+		}
+	}
+	zassert(pthread_mutex_unlock(&(tc->lock)));
+	return m;
+}
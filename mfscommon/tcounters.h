@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef _TCOUNTERS_H_
+#define _TCOUNTERS_H_
+
+#include <inttypes.h>
+
+/* per-thread counters - every thread updates only its own copy (no locks, no shared cache lines), readers sum copies of all threads */
+/* counters are monotonic (readers remember previous sums to get deltas) ; 'max' counters are reset by reader */
+/* ids are grouped in blocks of TC_BLOCKSIZE - counters with ids in the same block are contiguous in memory (tc_get) */
+
+#define TC_BLOCKSIZE 64
+#define TC_MAXBLOCKS 256
+
+void* tc_new(void);
+void tc_delete(void *tcp);
+uint64_t* tc_get(void *tcp,uint32_t id);
+void tc_add(void *tcp,uint32_t id,uint64_t value);
+uint64_t tc_sum(void *tcp,uint32_t id);
+void tc_sums(void *tcp,uint32_t id,uint32_t cnt,uint64_t *sums);
+uint64_t tc_maxreset(void *tcp,uint32_t id);
+
+#endif
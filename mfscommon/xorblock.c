@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include "crc.h"
+#include "xorblock.h"
+
+/* vector variants: x86-64 - SSE2 (always available), AVX2 and AVX-512 (chosen at run time) ; aarch64 - NEON (always available) */
+#if defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define XOR_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define XOR_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* data is xored and checksummed in such pieces, so all sources of one piece stay in L1/L2 cache */
+#define XOR_CRC_STRIP 4096
+
+/* kernels process data from pos to end (dst[x] = srcs[0][x] ^ ... for x in pos..end-1) and return position where they stopped */
+typedef uint32_t (*xorkernel)(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t pos,uint32_t end);
+
+static uint8_t xor_variant = XOR_VARIANT_GENERIC;
+
+/* every kernel xors all sources at given position before anything is stored at this position in dst - that is why dst can be one of sources */
+
+static void xorblock_multi_generic(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t pos,uint32_t end) {
+	uint64_t x0,x1,x2,x3,y;
+	uint32_t i;
+	uint8_t xb;
+
+	while (pos+32<=end) {
+		memcpy(&x0,srcs[0]+pos,8);
+		memcpy(&x1,srcs[0]+pos+8,8);
+		memcpy(&x2,srcs[0]+pos+16,8);
+		memcpy(&x3,srcs[0]+pos+24,8);
+		for (i=1 ; i<srccnt ; i++) {
+			memcpy(&y,srcs[i]+pos,8);
+			x0 ^= y;
+			memcpy(&y,srcs[i]+pos+8,8);
+			x1 ^= y;
+			memcpy(&y,srcs[i]+pos+16,8);
+			x2 ^= y;
+			memcpy(&y,srcs[i]+pos+24,8);
+			x3 ^= y;
+		}
+		memcpy(dst+pos,&x0,8);
+		memcpy(dst+pos+8,&x1,8);
+		memcpy(dst+pos+16,&x2,8);
+		memcpy(dst+pos+24,&x3,8);
+		pos += 32;
+	}
+	while (pos<end) {
+		xb = srcs[0][pos];
+		for (i=1 ; i<srccnt ; i++) {
+			xb ^= srcs[i][pos];
+		}
+		dst[pos] = xb;
+		pos++;
+	}
+}
+
+#ifdef XOR_X86
+static uint32_t xorblock_multi_sse2(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t pos,uint32_t end) {
+	__m128i x0,x1,x2,x3;
+	const uint8_t *s;
+	uint32_t i;
+
+	for ( ; pos+64<=end ; pos+=64) {
+		s = srcs[0]+pos;
+		x0 = _mm_loadu_si128((const __m128i*)s);
+		x1 = _mm_loadu_si128((const __m128i*)(s+16));
+		x2 = _mm_loadu_si128((const __m128i*)(s+32));
+		x3 = _mm_loadu_si128((const __m128i*)(s+48));
+		for (i=1 ; i<srccnt ; i++) {
+			s = srcs[i]+pos;
+			x0 = _mm_xor_si128(x0,_mm_loadu_si128((const __m128i*)s));
+			x1 = _mm_xor_si128(x1,_mm_loadu_si128((const __m128i*)(s+16)));
+			x2 = _mm_xor_si128(x2,_mm_loadu_si128((const __m128i*)(s+32)));
+			x3 = _mm_xor_si128(x3,_mm_loadu_si128((const __m128i*)(s+48)));
+		}
+		_mm_storeu_si128((__m128i*)(dst+pos),x0);
+		_mm_storeu_si128((__m128i*)(dst+pos+16),x1);
+		_mm_storeu_si128((__m128i*)(dst+pos+32),x2);
+		_mm_storeu_si128((__m128i*)(dst+pos+48),x3);
+	}
+	return pos;
+}
+
+static __attribute__((target("avx2"))) uint32_t xorblock_multi_avx2(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t pos,uint32_t end) {
+	__m256i x0,x1,x2,x3;
+	const uint8_t *s;
+	uint32_t i;
+
+	for ( ; pos+128<=end ; pos+=128) {
+		s = srcs[0]+pos;
+		x0 = _mm256_loadu_si256((const __m256i*)s);
+		x1 = _mm256_loadu_si256((const __m256i*)(s+32));
+		x2 = _mm256_loadu_si256((const __m256i*)(s+64));
+		x3 = _mm256_loadu_si256((const __m256i*)(s+96));
+		for (i=1 ; i<srccnt ; i++) {
+			s = srcs[i]+pos;
+			x0 = _mm256_xor_si256(x0,_mm256_loadu_si256((const __m256i*)s));
+			x1 = _mm256_xor_si256(x1,_mm256_loadu_si256((const __m256i*)(s+32)));
+			x2 = _mm256_xor_si256(x2,_mm256_loadu_si256((const __m256i*)(s+64)));
+			x3 = _mm256_xor_si256(x3,_mm256_loadu_si256((const __m256i*)(s+96)));
+		}
+		_mm256_storeu_si256((__m256i*)(dst+pos),x0);
+		_mm256_storeu_si256((__m256i*)(dst+pos+32),x1);
+		_mm256_storeu_si256((__m256i*)(dst+pos+64),x2);
+		_mm256_storeu_si256((__m256i*)(dst+pos+96),x3);
+	}
+	_mm256_zeroupper();
+	return pos;
+}
+
+static __attribute__((target("avx512f"))) uint32_t xorblock_multi_avx512(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t pos,uint32_t end) {
+	__m512i x0,x1,x2,x3;
+	const uint8_t *s;
+	uint32_t i;
+
+	for ( ; pos+256<=end ; pos+=256) {
+		s = srcs[0]+pos;
+		x0 = _mm512_loadu_si512((const void*)s);
+		x1 = _mm512_loadu_si512((const void*)(s+64));
+		x2 = _mm512_loadu_si512((const void*)(s+128));
+		x3 = _mm512_loadu_si512((const void*)(s+192));
+		for (i=1 ; i<srccnt ; i++) {
+			s = srcs[i]+pos;
+			x0 = _mm512_xor_si512(x0,_mm512_loadu_si512((const void*)s));
+			x1 = _mm512_xor_si512(x1,_mm512_loadu_si512((const void*)(s+64)));
+			x2 = _mm512_xor_si512(x2,_mm512_loadu_si512((const void*)(s+128)));
+			x3 = _mm512_xor_si512(x3,_mm512_loadu_si512((const void*)(s+192)));
+		}
+		_mm512_storeu_si512((void*)(dst+pos),x0);
+		_mm512_storeu_si512((void*)(dst+pos+64),x1);
+		_mm512_storeu_si512((void*)(dst+pos+128),x2);
+		_mm512_storeu_si512((void*)(dst+pos+192),x3);
+	}
+	_mm256_zeroupper();
+	return pos;
+}
+
+/* AVX state has to be enabled by OS (XCR0) - not only reported by CPU */
+static uint64_t xor_x86_xcr0(void) {
+	unsigned int eax,ebx,ecx,edx;
+	if (__get_cpuid(1,&eax,&ebx,&ecx,&edx)==0 || (ecx & bit_OSXSAVE)==0) {
+		return 0;
+	}
+	__asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx<<32) | eax;
+}
+
+static uint8_t xor_avx2_supported(void) {
+	unsigned int eax,ebx,ecx,edx;
+	if (__get_cpuid_max(0,NULL)<7 || (xor_x86_xcr0() & 0x6)!=0x6) {
+		return 0;
+	}
+	__cpuid_count(7,0,eax,ebx,ecx,edx);
+	return (ebx & (1<<5))?1:0;
+}
+
+static uint8_t xor_avx512_supported(void) {
+	unsigned int eax,ebx,ecx,edx;
+	if (__get_cpuid_max(0,NULL)<7 || (xor_x86_xcr0() & 0xE6)!=0xE6) {
+		return 0;
+	}
+	__cpuid_count(7,0,eax,ebx,ecx,edx);
+	return (ebx & (1<<16))?1:0;
+}
+#endif /* XOR_X86 */
+
+#ifdef XOR_NEON
+static uint32_t xorblock_multi_neon(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t pos,uint32_t end) {
+	uint8x16_t x0,x1,x2,x3;
+	const uint8_t *s;
+	uint32_t i;
+
+	for ( ; pos+64<=end ; pos+=64) {
+		s = srcs[0]+pos;
+		x0 = vld1q_u8(s);
+		x1 = vld1q_u8(s+16);
+		x2 = vld1q_u8(s+32);
+		x3 = vld1q_u8(s+48);
+		for (i=1 ; i<srccnt ; i++) {
+			s = srcs[i]+pos;
+			x0 = veorq_u8(x0,vld1q_u8(s));
+			x1 = veorq_u8(x1,vld1q_u8(s+16));
+			x2 = veorq_u8(x2,vld1q_u8(s+32));
+			x3 = veorq_u8(x3,vld1q_u8(s+48));
+		}
+		vst1q_u8(dst+pos,x0);
+		vst1q_u8(dst+pos+16,x1);
+		vst1q_u8(dst+pos+32,x2);
+		vst1q_u8(dst+pos+48,x3);
+	}
+	return pos;
+}
+#endif /* XOR_NEON */
+
+static inline void xorblock_multi_range(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t pos,uint32_t end) {
+	xorkernel kernel;
+
+	switch (xor_variant) {
+#ifdef XOR_X86
+		case XOR_VARIANT_SSE2:
+			kernel = xorblock_multi_sse2;
+			break;
+		case XOR_VARIANT_AVX2:
+			kernel = xorblock_multi_avx2;
+			break;
+		case XOR_VARIANT_AVX512:
+			kernel = xorblock_multi_avx512;
+			break;
+#endif
+#ifdef XOR_NEON
+		case XOR_VARIANT_NEON:
+			kernel = xorblock_multi_neon;
+			break;
+#endif
+		default:
+			kernel = NULL;
+	}
+	if (kernel!=NULL) {
+		pos = kernel(dst,srcs,srccnt,pos,end);
+	}
+	if (pos<end) {
+		xorblock_multi_generic(dst,srcs,srccnt,pos,end);
+	}
+}
+
+void xorblock_multi(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t leng) {
+	if (srccnt==0) {
+		memset(dst,0,leng);
+		return;
+	}
+	xorblock_multi_range(dst,srcs,srccnt,0,leng);
+}
+
+void xorblock(uint8_t *dst,const uint8_t *src,uint32_t leng) {
+	const uint8_t *srcs[2];
+
+	srcs[0] = dst;
+	srcs[1] = src;
+	xorblock_multi_range(dst,srcs,2,0,leng);
+}
+
+void xorblock_multi_crc(uint8_t *dst,const uint8_t * const *srcs,uint32_t * const *crcs,uint32_t srccnt,uint32_t leng) {
+	uint32_t i,pos,end;
+
+	if (srccnt==0) {
+		memset(dst,0,leng);
+		return;
+	}
+	for (pos=0 ; pos<leng ; pos=end) {
+		end = (leng-pos>XOR_CRC_STRIP)?pos+XOR_CRC_STRIP:leng;
+		for (i=0 ; i<srccnt ; i++) {
+			if (crcs[i]!=NULL) {
+				*(crcs[i]) = mycrc32(*(crcs[i]),srcs[i]+pos,end-pos);
+			}
+		}
+		xorblock_multi_range(dst,srcs,srccnt,pos,end);
+	}
+}
+
+uint8_t xorblock_variant_supported(uint8_t variant) {
+	switch (variant) {
+		case XOR_VARIANT_GENERIC:
+			return 1;
+#ifdef XOR_X86
+		case XOR_VARIANT_SSE2:
+			return 1;
+		case XOR_VARIANT_AVX2:
+			return xor_avx2_supported();
+		case XOR_VARIANT_AVX512:
+			return xor_avx512_supported();
+#endif
+#ifdef XOR_NEON
+		case XOR_VARIANT_NEON:
+			return 1;
+#endif
+	}
+	return 0;
+}
+
+int xorblock_set_variant(uint8_t variant) {
+	if (xorblock_variant_supported(variant)==0) {
+		return -1;
+	}
+	xor_variant = variant;
+	return 0;
+}
+
+uint8_t xorblock_get_variant(void) {
+	return xor_variant;
+}
+
+const char* xorblock_variant_name(uint8_t variant) {
+	switch (variant) {
+		case XOR_VARIANT_GENERIC:
+			return "generic";
+		case XOR_VARIANT_SSE2:
+			return "sse2";
+		case XOR_VARIANT_AVX2:
+			return "avx2";
+		case XOR_VARIANT_AVX512:
+			return "avx512";
+		case XOR_VARIANT_NEON:
+			return "neon";
+	}
+	return "unknown";
+}
+
+void xorblock_init(void) {
+	if (xorblock_set_variant(XOR_VARIANT_AVX512)<0 && xorblock_set_variant(XOR_VARIANT_AVX2)<0 && xorblock_set_variant(XOR_VARIANT_SSE2)<0 && xorblock_set_variant(XOR_VARIANT_NEON)<0) {
+		xor_variant = XOR_VARIANT_GENERIC;
+	}
+}
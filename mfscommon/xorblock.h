@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef _XORBLOCK_H_
+#define _XORBLOCK_H_
+#include <inttypes.h>
+
+/* dst ^= src */
+void xorblock(uint8_t *dst,const uint8_t *src,uint32_t leng);
+/* dst = srcs[0] ^ srcs[1] ^ ... ^ srcs[srccnt-1] - done in one pass, dst can be the same buffer as srcs[0] */
+void xorblock_multi(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t leng);
+/* as above, but also updates checksums of sources (*crcs[i] = mycrc32(*crcs[i],srcs[i],leng)) while data is still in cache ; crcs[i] can be NULL */
+void xorblock_multi_crc(uint8_t *dst,const uint8_t * const *srcs,uint32_t * const *crcs,uint32_t srccnt,uint32_t leng);
+
+#define XOR_VARIANT_GENERIC 0
+#define XOR_VARIANT_SSE2 1
+#define XOR_VARIANT_AVX2 2
+#define XOR_VARIANT_AVX512 3
+#define XOR_VARIANT_NEON 4
+
+/* xorblock_init chooses the fastest supported variant - the others are used only by tests */
+uint8_t xorblock_variant_supported(uint8_t variant);
+int xorblock_set_variant(uint8_t variant);
+uint8_t xorblock_get_variant(void);
+const char* xorblock_variant_name(uint8_t variant);
+
+void xorblock_init(void);
+
+#endif
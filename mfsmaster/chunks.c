@@ -667,6 +667,20 @@ static inline chunk* chunk_hash_find(uint64_t chunkid) {
 	return NULL;
 }
 
+// bucket of given chunk without advancing incremental rehash - used only for prefetching
+static inline chunk** chunk_hash_bucket(uint64_t chunkid) {
+	uint32_t hash;
+
+	if (chunkhashsize==0) {
+		return NULL;
+	}
+	hash = hash32(chunkid) & (chunkhashsize-1);
+	if (chunkrehashpos<chunkhashsize && hash >= chunkrehashpos) {
+		hash -= chunkhashsize/2;
+	}
+	return chunkhashtab[hash>>HASHTAB_LOBITS] + (hash&HASHTAB_MASK);
+}
+
 static inline void chunk_hash_delete(chunk *c) {
 	chunk **chptr,*cit;
 	uint32_t hash;
@@ -2454,6 +2468,34 @@ void chunk_server_has_chunk(uint16_t csid,uint64_t chunkid,uint32_t version) {
 	}
 }
 
+// chunks from one registration packet - hash buckets (and then chunks) of next entries are prefetched, so the merge doesn't stall on every lookup
+#define HAS_CHUNKS_PREFETCH 16
+
+void chunk_server_has_chunks(uint16_t csid,const uint64_t *chunkids,const uint32_t *versions,uint32_t count) {
+	uint32_t i;
+	chunk **bucket;
+
+	for (i=0 ; i<count ; i++) {
+#ifdef __GNUC__
+		if (i+HAS_CHUNKS_PREFETCH<count) {
+			bucket = chunk_hash_bucket(chunkids[i+HAS_CHUNKS_PREFETCH]);
+			if (bucket) {
+				__builtin_prefetch(bucket);
+			}
+		}
+		if (i+HAS_CHUNKS_PREFETCH/2<count) {
+			bucket = chunk_hash_bucket(chunkids[i+HAS_CHUNKS_PREFETCH/2]);
+			if (bucket && *bucket) {
+				__builtin_prefetch(*bucket);
+			}
+		}
+#else
+		(void)bucket;
+#endif
+		chunk_server_has_chunk(csid,chunkids[i],versions[i]);
+	}
+}
+
 void chunk_damaged(uint16_t csid,uint64_t chunkid) {
 	chunk *c;
 	slist *s;
@@ -101,6 +101,7 @@ uint8_t chunk_get_mfrstatus(uint16_t csid);
 uint16_t chunk_server_connected(void *ptr);
 
 void chunk_server_has_chunk(uint16_t csid,uint64_t chunkid,uint32_t version);
+void chunk_server_has_chunks(uint16_t csid,const uint64_t *chunkids,const uint32_t *versions,uint32_t count);
 void chunk_damaged(uint16_t csid,uint64_t chunkid);
 void chunk_lost(uint16_t csid,uint64_t chunkid);
 void chunk_server_register_end(uint16_t csid);
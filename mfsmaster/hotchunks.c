@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "chunks.h"
+#include "datapack.h"
+#include "massert.h"
+
+// chunkservers send their hottest chunks every minute - reports from the last full minute are kept for queries
+#define HOT_CHUNKS_PERIOD 60
+#define HOT_CHUNKS_CAPACITY 10000
+#define HOT_CHUNKS_HASHSIZE 16384
+
+typedef struct hotentry {
+	uint64_t chunkid;
+	uint32_t heat;		// sum of heats reported by all servers
+	uint16_t servers;	// number of reporting servers
+} hotentry;
+
+static hotentry *hothash;
+static hotentry *hothashprev;
+static uint32_t hothashelements;
+static uint32_t hothashprevelements;
+
+void hot_chunks_insert(uint64_t chunkid,uint8_t heat) {
+	uint32_t hash,disp;
+	if (chunkid==0 || heat==0) {
+		return;
+	}
+	hash = (chunkid * 0x9E3779B1) % HOT_CHUNKS_HASHSIZE;
+	disp = ((chunkid >> 32) * 0x85EBCA6B + chunkid) % HOT_CHUNKS_HASHSIZE;
+	disp |= 1;
+	while (hothash[hash].chunkid!=0) {
+		if (hothash[hash].chunkid==chunkid) {
+			hothash[hash].heat += heat;
+			if (hothash[hash].servers<65535) {
+				hothash[hash].servers++;
+			}
+			return;
+		}
+		hash += disp;
+		hash %= HOT_CHUNKS_HASHSIZE;
+	}
+	if (hothashelements>=HOT_CHUNKS_CAPACITY) {
+		return;
+	}
+	hothash[hash].chunkid = chunkid;
+	hothash[hash].heat = heat;
+	hothash[hash].servers = 1;
+	hothashelements++;
+}
+
+void hot_chunks_swap(void) {
+	hotentry *hothashtmp;
+
+	hothashtmp = hothashprev;
+	hothashprev = hothash;
+	hothash = hothashtmp;
+	memset(hothash,0,sizeof(hotentry)*HOT_CHUNKS_HASHSIZE);
+	hothashprevelements = hothashelements;
+	hothashelements = 0;
+}
+
+uint32_t hot_chunks_getdata(uint8_t *buff) {
+	uint32_t i,j;
+	uint8_t vcopies;
+	if (buff==NULL) {
+		return hothashprevelements*15;
+	} else {
+		j = 0;
+		for (i=0 ; i<HOT_CHUNKS_HASHSIZE && j<hothashprevelements ; i++) {
+			if (hothashprev[i].chunkid!=0) {
+				chunk_get_validcopies(hothashprev[i].chunkid,&vcopies);
+				put64bit(&buff,hothashprev[i].chunkid);
+				put32bit(&buff,hothashprev[i].heat);
+				put16bit(&buff,hothashprev[i].servers);
+				put8bit(&buff,vcopies);
+				j++;
+			}
+		}
+		return 0;
+	}
+}
+
+int hot_chunks_init(void) {
+	hothash = malloc(sizeof(hotentry)*HOT_CHUNKS_HASHSIZE);
+	passert(hothash);
+	hothashprev = malloc(sizeof(hotentry)*HOT_CHUNKS_HASHSIZE);
+	passert(hothashprev);
+	memset(hothash,0,sizeof(hotentry)*HOT_CHUNKS_HASHSIZE);
+	memset(hothashprev,0,sizeof(hotentry)*HOT_CHUNKS_HASHSIZE);
+	hothashelements = 0;
+	hothashprevelements = 0;
+	main_time_register(HOT_CHUNKS_PERIOD,0,hot_chunks_swap);
+	return 1;
+}
@@ -35,6 +35,7 @@
 #include "changelog.h"
 #include "chartsdata.h"
 #include "missinglog.h"
+#include "hotchunks.h"
 #include "bgsaver.h"
 
 #define STR_AUX(x) #x
@@ -65,6 +66,7 @@ struct {
 	{changelog_init,"change log"},
 	{rnd_init,"random generator"},
 	{missing_log_init,"missing chunks/files log"}, // has to be before 'fs_init'
+	{hot_chunks_init,"hot chunks log"},
 	{dcm_init,"data cache manager"}, // has to be before 'fs_init' and 'matoclserv_init'
 	{exports_init,"exports manager"},
 	{topology_init,"net topology module"},
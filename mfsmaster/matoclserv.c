@@ -68,6 +68,7 @@
 #include "massert.h"
 #include "clocks.h"
 #include "missinglog.h"
+#include "hotchunks.h"
 #include "mfsstrerr.h"
 #include "iptosesid.h"
 #include "mfsalloc.h"
@@ -1319,6 +1320,20 @@ void matoclserv_missing_chunks(matoclserventry *eptr, const uint8_t *data, uint3
 	missing_log_getdata(ptr, mode);
 }
 
+void matoclserv_hot_chunks(matoclserventry *eptr, const uint8_t *data, uint32_t length)
+{
+	uint8_t *ptr;
+	(void)data;
+	if (length != 0)
+	{
+		syslog(LOG_NOTICE, "CLTOMA_HOT_CHUNKS - wrong size (%" PRIu32 "/0)", length);
+		eptr->mode = KILL;
+		return;
+	}
+	ptr = matoclserv_createpacket(eptr, MATOCL_HOT_CHUNKS, hot_chunks_getdata(NULL));
+	hot_chunks_getdata(ptr);
+}
+
 void matoclserv_node_info(matoclserventry *eptr, const uint8_t *data, uint32_t length)
 {
 	uint8_t *ptr;
@@ -6062,6 +6077,9 @@ void matoclserv_gotpacket(matoclserventry *eptr, uint32_t type, const uint8_t *d
 		case CLTOMA_MISSING_CHUNKS:
 			matoclserv_missing_chunks(eptr, data, length);
 			break;
+		case CLTOMA_HOT_CHUNKS:
+			matoclserv_hot_chunks(eptr, data, length);
+			break;
 		case CLTOMA_NODE_INFO:
 			matoclserv_node_info(eptr, data, length);
 			break;
@@ -6327,6 +6345,9 @@ void matoclserv_gotpacket(matoclserventry *eptr, uint32_t type, const uint8_t *d
 		case CLTOMA_MISSING_CHUNKS:
 			matoclserv_missing_chunks(eptr, data, length);
 			break;
+		case CLTOMA_HOT_CHUNKS:
+			matoclserv_hot_chunks(eptr, data, length);
+			break;
 		case CLTOMA_NODE_INFO:
 			matoclserv_node_info(eptr, data, length);
 			break;
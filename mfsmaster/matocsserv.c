@@ -50,6 +50,7 @@
 #include "main.h"
 #include "sockets.h"
 #include "chunks.h"
+#include "hotchunks.h"
 #include "random.h"
 #include "sizestr.h"
 #include "slogger.h"
@@ -65,6 +66,10 @@
 
 #define MANAGER_SWITCH_CONST 5
 
+// max number of create/delete operations sent in one MATOCS_CHUNKOPS packet (packet has to be smaller than MATOCS_MAXPACKETSIZE)
+#define CHUNKOPS_MAX 512
+#define CHUNKOPS_ENTRYSIZE (1 + 8 + 4)
+
 // ReserveSpaceMode
 enum
 {
@@ -118,9 +123,12 @@ typedef struct matocsserventry
 	in_packetstruct *input_packet;
 	in_packetstruct *inputhead, **inputtail;
 	out_packetstruct *outputhead, **outputtail;
+	uint8_t *chunkopsbuff; // create/delete operations not sent yet (MATOCS_CHUNKOPS)
+	uint32_t chunkopscnt;
 
 	char *servstrip;	 // human readable version of servip
 	uint32_t version;	 // chunkserver version
+	uint32_t cscaps;	 // CSCAP_* flags received in CSTOMA_CAPABILITIES
 	uint32_t servip;	 // ip to coonnect to
 	uint16_t servport;	 // port to connect to
 	uint16_t timeout;	 // communication timeout
@@ -1568,12 +1576,19 @@ char *matocsserv_makestrip(uint32_t ip)
 	return optr;
 }
 
+static void matocsserv_chunkops_flush(matocsserventry *eptr);
+
 uint8_t *matocsserv_createpacket(matocsserventry *eptr, uint32_t type, uint32_t size)
 {
 	out_packetstruct *outpacket;
 	uint8_t *ptr;
 	uint32_t psize;
 
+	// pending batch goes first - keeps order of commands sent to chunkserver
+	if (eptr->chunkopscnt > 0)
+	{
+		matocsserv_chunkops_flush(eptr);
+	}
 	psize = size + 8;
 	//给outpaccket分配空间
 	//offsetof(out_packetstruct, data) 返回data相对于out_packetstruct结构体的偏移量
@@ -1597,6 +1612,47 @@ uint8_t *matocsserv_createpacket(matocsserventry *eptr, uint32_t type, uint32_t
 	return ptr;
 }
 
+static void matocsserv_chunkops_flush(matocsserventry *eptr)
+{
+	uint8_t *ptr;
+	uint32_t cnt;
+
+	cnt = eptr->chunkopscnt;
+	if (cnt == 0)
+	{
+		return;
+	}
+	eptr->chunkopscnt = 0;
+	ptr = matocsserv_createpacket(eptr, MATOCS_CHUNKOPS, cnt * CHUNKOPS_ENTRYSIZE);
+	memcpy(ptr, eptr->chunkopsbuff, cnt * CHUNKOPS_ENTRYSIZE);
+}
+
+// chunkservers with CSCAP_CHUNKOPS get creates and deletes in batches - they are sent before any other packet or before next poll
+static inline uint8_t matocsserv_chunkops_batched(matocsserventry *eptr)
+{
+	return (eptr->cscaps & CSCAP_CHUNKOPS) ? 1 : 0;
+}
+
+static void matocsserv_chunkops_add(matocsserventry *eptr, uint8_t op, uint64_t chunkid, uint32_t version)
+{
+	uint8_t *ptr;
+
+	if (eptr->chunkopsbuff == NULL)
+	{
+		eptr->chunkopsbuff = malloc(CHUNKOPS_MAX * CHUNKOPS_ENTRYSIZE);
+		passert(eptr->chunkopsbuff);
+	}
+	ptr = eptr->chunkopsbuff + eptr->chunkopscnt * CHUNKOPS_ENTRYSIZE;
+	put8bit(&ptr, op);
+	put64bit(&ptr, chunkid);
+	put32bit(&ptr, version);
+	eptr->chunkopscnt++;
+	if (eptr->chunkopscnt >= CHUNKOPS_MAX)
+	{
+		matocsserv_chunkops_flush(eptr);
+	}
+}
+
 /* for future use */
 int matocsserv_send_chunk_checksum(void *e, uint64_t chunkid, uint32_t version)
 {
@@ -1648,9 +1704,16 @@ int matocsserv_send_createchunk(void *e, uint64_t chunkid, uint32_t version)
  
 	if (eptr->mode != KILL)
 	{
-		data = matocsserv_createpacket(eptr, MATOCS_CREATE, 8 + 4);
-		put64bit(&data, chunkid);
-		put32bit(&data, version);
+		if (matocsserv_chunkops_batched(eptr))
+		{
+			matocsserv_chunkops_add(eptr, CHUNKOPS_CREATE, chunkid, version);
+		}
+		else
+		{
+			data = matocsserv_createpacket(eptr, MATOCS_CREATE, 8 + 4);
+			put64bit(&data, chunkid);
+			put32bit(&data, version);
+		}
 	}
 	return 0;
 }
@@ -1682,9 +1745,16 @@ int matocsserv_send_deletechunk(void *e, uint64_t chunkid, uint32_t version)
 
 	if (eptr->mode != KILL)
 	{
-		data = matocsserv_createpacket(eptr, MATOCS_DELETE, 8 + 4);
-		put64bit(&data, chunkid);
-		put32bit(&data, version);
+		if (matocsserv_chunkops_batched(eptr))
+		{
+			matocsserv_chunkops_add(eptr, CHUNKOPS_DELETE, chunkid, version);
+		}
+		else
+		{
+			data = matocsserv_createpacket(eptr, MATOCS_DELETE, 8 + 4);
+			put64bit(&data, chunkid);
+			put32bit(&data, version);
+		}
 		eptr->delcounter++;
 		eptr->del_total_counter++;
 	}
@@ -1712,6 +1782,48 @@ void matocsserv_got_deletechunk_status(matocsserventry *eptr, const uint8_t *dat
 	}
 }
 
+void matocsserv_got_chunkops_status(matocsserventry *eptr, const uint8_t *data, uint32_t length)
+{
+	uint64_t chunkid;
+	uint8_t op, status;
+	if (length % (1 + 8 + 1) != 0)
+	{
+		syslog(LOG_NOTICE, "CSTOMA_CHUNKOPS - wrong size (%" PRIu32 "/N*10)", length);
+		eptr->mode = KILL;
+		return;
+	}
+	while (length > 0)
+	{
+		op = get8bit(&data);
+		chunkid = get64bit(&data);
+		status = get8bit(&data);
+		length -= 1 + 8 + 1;
+		if (op == CHUNKOPS_DELETE)
+		{
+			eptr->delcounter--;
+			chunk_got_delete_status(eptr->csid, chunkid, status);
+			if (status != 0)
+			{
+				syslog(LOG_NOTICE, "(%s:%" PRIu16 ") chunk: %016" PRIX64 " deletion status: %s", eptr->servstrip, eptr->servport, chunkid, mfsstrerr(status));
+			}
+		}
+		else if (op == CHUNKOPS_CREATE)
+		{
+			chunk_got_create_status(eptr->csid, chunkid, status);
+			if (status != 0)
+			{
+				syslog(LOG_NOTICE, "(%s:%" PRIu16 ") chunk: %016" PRIX64 " creation status: %s", eptr->servstrip, eptr->servport, chunkid, mfsstrerr(status));
+			}
+		}
+		else
+		{
+			syslog(LOG_NOTICE, "CSTOMA_CHUNKOPS - unknown operation (%" PRIu8 ")", op);
+			eptr->mode = KILL;
+			return;
+		}
+	}
+}
+
 int matocsserv_send_replicatechunk(void *e, uint64_t chunkid, uint32_t version, void *src)
 {
 	matocsserventry *dsteptr = (matocsserventry *)e;
@@ -2095,6 +2207,74 @@ static uint32_t matocsserv_remap_ip(uint32_t csip)
 	return csip;
 }
 
+/* compact chunk list (ver 6:CHUNKS_COMPACT): count:32 then 'count' pairs of varints - chunkid delta from previous chunk and (version<<1 | 'mark for removal' flag) */
+/* one zero byte is added at the end when needed, because packets with even length are treated as old register packets */
+/* whole list is decoded first and then merged in one batch (chunk_server_has_chunks prefetches hash buckets) */
+static uint64_t *regchunkids = NULL;
+static uint32_t *regversions = NULL;
+static uint32_t regchunkssize = 0;
+
+static int matocsserv_compact_chunks(matocsserventry *eptr, const uint8_t *data, uint32_t length)
+{
+	const uint8_t *endptr;
+	uint64_t chunkid, delta, v;
+	uint32_t i, chunkcount;
+
+	if (length < 4)
+	{
+		syslog(LOG_NOTICE, "CSTOMA_REGISTER (ver 6:CHUNKS_COMPACT) - wrong size (%" PRIu32 "/5+)", length + 1);
+		return -1;
+	}
+	if (eptr->csptr == NULL)
+	{
+		syslog(LOG_NOTICE, "CSTOMA_REGISTER (ver 6:CHUNKS_COMPACT) - CHUNKS packet before proper BEGIN packet");
+		return -1;
+	}
+	endptr = data + length;
+	chunkcount = get32bit(&data);
+	if (chunkcount > (length - 4) / 2)
+	{ // at least two bytes per chunk
+		syslog(LOG_NOTICE, "CSTOMA_REGISTER (ver 6:CHUNKS_COMPACT) - wrong number of chunks (%" PRIu32 ")", chunkcount);
+		return -1;
+	}
+	if (chunkcount > regchunkssize)
+	{
+		if (regchunkids != NULL)
+		{
+			free(regchunkids);
+			free(regversions);
+		}
+		regchunkssize = chunkcount;
+		regchunkids = malloc(sizeof(uint64_t) * regchunkssize);
+		passert(regchunkids);
+		regversions = malloc(sizeof(uint32_t) * regchunkssize);
+		passert(regversions);
+	}
+	chunkid = 0;
+	for (i = 0; i < chunkcount; i++)
+	{
+		if (getvarint(&data, endptr, &delta) < 0 || getvarint(&data, endptr, &v) < 0 || (v >> 32) != 0)
+		{
+			syslog(LOG_NOTICE, "CSTOMA_REGISTER (ver 6:CHUNKS_COMPACT) - malformed chunk list");
+			return -1;
+		}
+		chunkid += delta;
+		regchunkids[i] = chunkid;
+		regversions[i] = (uint32_t)(v >> 1) | (uint32_t)((v & 1) << 31);
+	}
+	if (data + 1 == endptr && *data == 0)
+	{ // padding
+		data++;
+	}
+	if (data != endptr)
+	{
+		syslog(LOG_NOTICE, "CSTOMA_REGISTER (ver 6:CHUNKS_COMPACT) - wrong size (%" PRIu32 " bytes after last chunk)", (uint32_t)(endptr - data));
+		return -1;
+	}
+	chunk_server_has_chunks(eptr->csid, regchunkids, regversions, chunkcount);
+	return 0;
+}
+
 void matocsserv_register(matocsserventry *eptr, const uint8_t *data, uint32_t length)
 {
 	uint64_t chunkid;
@@ -2375,8 +2555,8 @@ void matocsserv_register(matocsserventry *eptr, const uint8_t *data, uint32_t le
 				else
 				{
 					uint8_t mode;
-					mode = (eptr->version >= VERSION2INT(2, 0, 33)) ? 1 : 0;
-					p = matocsserv_createpacket(eptr, MATOCS_MASTER_ACK, mode ? 17 : 9);
+					mode = (eptr->version >= VERSION2INT(3, 0, 112)) ? 2 : (eptr->version >= VERSION2INT(2, 0, 33)) ? 1 : 0;
+					p = matocsserv_createpacket(eptr, MATOCS_MASTER_ACK, (mode == 2) ? 33 : (mode == 1) ? 17 : 9);
 					put8bit(&p, 0);
 					put32bit(&p, VERSHEX);
 					put16bit(&p, eptr->timeout);
@@ -2385,6 +2565,11 @@ void matocsserv_register(matocsserventry *eptr, const uint8_t *data, uint32_t le
 					{
 						put64bit(&p, meta_get_id());
 					}
+					if (mode == 2)
+					{ // capabilities - chunkservers without them ignore the rest of this packet
+						put32bit(&p, MASTERCAP_HOTCHUNKS | MASTERCAP_COMPACTLIST | MASTERCAP_CSCAPS);
+						memset(p, 0, 12);
+					}
 				}
 			}
 			eptr->csid = chunk_server_connected(eptr);
@@ -2440,6 +2625,18 @@ void matocsserv_register(matocsserventry *eptr, const uint8_t *data, uint32_t le
 			}
 			return;
 		}
+		else if (rversion == 64)
+		{
+			uint8_t *p;
+			if (matocsserv_compact_chunks(eptr, data, length - 1) < 0)
+			{
+				eptr->mode = KILL;
+				return;
+			}
+			p = matocsserv_createpacket(eptr, MATOCS_MASTER_ACK, 1);
+			put8bit(&p, 0);
+			return;
+		}
 		else if (rversion == 52)
 		{
 			if (length != 41)
@@ -2559,6 +2756,18 @@ void matocsserv_register(matocsserventry *eptr, const uint8_t *data, uint32_t le
 	}
 }
 
+void matocsserv_capabilities(matocsserventry *eptr, const uint8_t *data, uint32_t length)
+{
+	if (length != 4)
+	{
+		syslog(LOG_NOTICE, "CSTOMA_CAPABILITIES - wrong size (%" PRIu32 "/4)", length);
+		eptr->mode = KILL;
+		return;
+	}
+	passert(data);
+	eptr->cscaps = get32bit(&data);
+}
+
 void matocsserv_labels(matocsserventry *eptr, const uint8_t *data, uint32_t length)
 {
 	uint32_t i, l;
@@ -2725,6 +2934,30 @@ void matocsserv_chunks_new(matocsserventry *eptr, const uint8_t *data, uint32_t
 	}
 }
 
+void matocsserv_hot_chunks(matocsserventry *eptr, const uint8_t *data, uint32_t length)
+{
+	uint64_t chunkid;
+	uint8_t heat;
+	uint32_t i;
+
+	if (length % 9 != 0)
+	{
+		syslog(LOG_NOTICE, "CSTOMA_HOT_CHUNKS - wrong size (%" PRIu32 "/N*9)", length);
+		eptr->mode = KILL;
+		return;
+	}
+	if (length > 0)
+	{
+		passert(data);
+	}
+	for (i = 0; i < length / 9; i++)
+	{
+		chunkid = get64bit(&data);
+		heat = get8bit(&data);
+		hot_chunks_insert(chunkid, heat);
+	}
+}
+
 void matocsserv_error_occurred(matocsserventry *eptr, const uint8_t *data, uint32_t length)
 {
 	(void)data;
@@ -2796,12 +3029,18 @@ void matocsserv_gotpacket(matocsserventry *eptr, uint32_t type, const uint8_t *d
 	case CSTOMA_CHUNK_NEW:
 		matocsserv_chunks_new(eptr, data, length);
 		break;
+	case CSTOMA_HOT_CHUNKS:
+		matocsserv_hot_chunks(eptr, data, length);
+		break;
 	case CSTOMA_ERROR_OCCURRED:
 		matocsserv_error_occurred(eptr, data, length);
 		break;
 	case CSTOMA_LABELS:
 		matocsserv_labels(eptr, data, length);
 		break;
+	case CSTOMA_CAPABILITIES:
+		matocsserv_capabilities(eptr, data, length);
+		break;
 	case CSTOAN_CHUNK_CHECKSUM:
 		matocsserv_got_chunk_checksum(eptr, data, length);
 		break;
@@ -2811,6 +3050,9 @@ void matocsserv_gotpacket(matocsserventry *eptr, uint32_t type, const uint8_t *d
 	case CSTOMA_DELETE:
 		matocsserv_got_deletechunk_status(eptr, data, length);
 		break;
+	case CSTOMA_CHUNKOPS:
+		matocsserv_got_chunkops_status(eptr, data, length);
+		break;
 	case CSTOMA_REPLICATE:
 		//replication消息 在master指 导下完成chunkserver间的块拷贝过程。
 		matocsserv_got_replicatechunk_status(eptr, data, length);
@@ -3171,6 +3413,10 @@ void matocsserv_desc(struct pollfd *pdesc, uint32_t *ndesc)
 	//遍历matocsservhead链表，
 	for (eptr = matocsservhead; eptr; eptr = eptr->next)
 	{
+		if (eptr->mode != KILL)
+		{
+			matocsserv_chunkops_flush(eptr);
+		}
 		events = 0;
 		if (eptr->mode != KILL && eptr->input_end == 0)
 		{
@@ -3238,6 +3484,12 @@ void matocsserv_disconnection_loop(void)
 				opptr = opptr->next;
 				free(opaptr);
 			}
+			if (eptr->chunkopsbuff)
+			{
+				free(eptr->chunkopsbuff);
+				eptr->chunkopsbuff = NULL;
+			}
+			eptr->chunkopscnt = 0;
 			*kptr = eptr->next;
 			eptr->next = NULL;
 			// if server has csid then do not free it here - it'll be freed after cleanup in chunk module - see matocsserv_disconnection_finished
@@ -3323,6 +3575,8 @@ void matocsserv_serve(struct pollfd *pdesc)
 			eptr->inputtail = &(eptr->inputhead);
 			eptr->outputhead = NULL;
 			eptr->outputtail = &(eptr->outputhead);
+			eptr->chunkopsbuff = NULL;
+			eptr->chunkopscnt = 0;
 
 			tcpgetpeer(eptr->sock, &peerip, NULL);
 			eptr->servstrip = matocsserv_makestrip(peerip);
@@ -3346,6 +3600,7 @@ void matocsserv_serve(struct pollfd *pdesc)
 
 			eptr->labelmask = 0;
 			eptr->labelstr = NULL;
+			eptr->cscaps = 0;
 
 			eptr->create_total_counter = 0;
 			eptr->rrep_total_counter = 0;
@@ -3389,6 +3644,10 @@ void matocsserv_serve(struct pollfd *pdesc)
 	//  write
 	for (eptr = matocsservhead; eptr; eptr = eptr->next)
 	{
+		if (eptr->mode != KILL)
+		{
+			matocsserv_chunkops_flush(eptr);
+		}
 		if ((eptr->lastwrite + (eptr->timeout / 3.0)) < now && eptr->outputhead == NULL)
 		{
 			//发送空包。该操作主要是为了保证client与master连接不会因为长时间空闲而断开。
@@ -3436,6 +3695,10 @@ void matocsserv_keep_alive(void)
 	// write
 	for (eptr = matocsservhead; eptr; eptr = eptr->next)
 	{
+		if (eptr->mode == DATA)
+		{
+			matocsserv_chunkops_flush(eptr);
+		}
 		if ((eptr->lastwrite + (eptr->timeout / 3.0)) < now && eptr->outputhead == NULL)
 		{
 			matocsserv_createpacket(eptr, ANTOAN_NOP, 0);
@@ -3487,6 +3750,10 @@ void matocsserv_term(void)
 			opptr = opptr->next;
 			free(opaptr);
 		}
+		if (eptr->chunkopsbuff)
+		{
+			free(eptr->chunkopsbuff);
+		}
 		if (eptr->servstrip)
 		{
 			free(eptr->servstrip);
@@ -3499,6 +3766,11 @@ void matocsserv_term(void)
 
 	matocsserv_read(NULL, 0.0); // free internal read buffer
 
+	if (regchunkids != NULL)
+	{
+		free(regchunkids);
+		free(regversions);
+	}
 	free(ListenHost);
 	free(ListenPort);
 }
@@ -3508,7 +3780,7 @@ int matocsserv_no_more_pending_jobs(void)
 	matocsserventry *eptr;
 	for (eptr = matocsservhead; eptr; eptr = eptr->next)
 	{
-		if (eptr->outputhead != NULL)
+		if (eptr->outputhead != NULL || eptr->chunkopscnt > 0)
 		{
 			return 0;
 		}
@@ -20,9 +20,11 @@
 {CSTOMA_CHUNK_LOST,"CSTOMA_CHUNK_LOST"},
 {CSTOMA_ERROR_OCCURRED,"CSTOMA_ERROR_OCCURRED"},
 {CSTOMA_CHUNK_NEW,"CSTOMA_CHUNK_NEW"},
+{CSTOMA_HOT_CHUNKS,"CSTOMA_HOT_CHUNKS"},
 {CSTOMA_LABELS,"CSTOMA_LABELS"},
 {MATOCS_CREATE,"MATOCS_CREATE"},
 {CSTOMA_CREATE,"CSTOMA_CREATE"},
+{CSTOMA_CAPABILITIES,"CSTOMA_CAPABILITIES"},
 {MATOCS_DELETE,"MATOCS_DELETE"},
 {CSTOMA_DELETE,"CSTOMA_DELETE"},
 {MATOCS_DUPLICATE,"MATOCS_DUPLICATE"},
@@ -201,6 +203,8 @@
 {MATOCL_LIST_ACQUIRED_LOCKS,"MATOCL_LIST_ACQUIRED_LOCKS"},
 {CLTOMA_MASS_RESOLVE_PATHS,"CLTOMA_MASS_RESOLVE_PATHS"},
 {MATOCL_MASS_RESOLVE_PATHS,"MATOCL_MASS_RESOLVE_PATHS"},
+{CLTOMA_HOT_CHUNKS,"CLTOMA_HOT_CHUNKS"},
+{MATOCL_HOT_CHUNKS,"MATOCL_HOT_CHUNKS"},
 {CLTOMA_SCLASS_INFO,"CLTOMA_SCLASS_INFO"},
 {MATOCL_SCLASS_INFO,"MATOCL_SCLASS_INFO"},
 {CLTOMA_MISSING_CHUNKS,"CLTOMA_MISSING_CHUNKS"},
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MFSCommunication.h"
+#include "clocks.h"
+#include "crc.h"
+
+#include "mfstest.h"
+
+#define BENCH_BLOCK 65536
+#define BENCH_LOOPS 2048
+#define BENCH_COMBINE_LOOPS 1000000
+
+/* original (bit by bit) crc32 code - reference for all variants */
+
+uint32_t crc32_reference(uint32_t crc,const uint8_t *block,uint32_t leng) {
+	uint32_t j;
+
+	crc^=0xFFFFFFFF;
+	while (leng>0) {
+		crc ^= *block++;
+		leng--;
+		for (j=0 ; j<8 ; j++) {
+			crc = (crc & 1) ? ((crc >> 1) ^ CRC_POLY) : (crc >> 1);
+		}
+	}
+	return crc^0xFFFFFFFF;
+}
+
+uint32_t simple_pseudo_random(void) {
+	static uint32_t u=1249853491;
+	static uint32_t v=3456394786;
+
+	v = 36969*(v & 65535) + (v >> 16);
+	u = 18000*(u & 65535) + (u >> 16);
+
+	return (v << 16) + u;
+}
+
+int main(void) {
+	uint8_t *block;
+	uint8_t variant;
+	uint32_t i,j,crc,crc1,crc2;
+	double st,en;
+
+	mfstest_init();
+
+	mycrc32_init();
+
+	mfstest_start(crc32bench);
+
+	printf("default variant: %s\n",mycrc32_variant_name(mycrc32_get_variant()));
+
+	block = malloc(BENCH_BLOCK+64);
+	if (block==NULL) {
+		return 99;
+	}
+	for (i=0 ; i<BENCH_BLOCK ; i++) {
+		block[i] = simple_pseudo_random();
+	}
+	memset(block+BENCH_BLOCK,0,64);
+
+	for (variant=CRC_VARIANT_TABLE ; variant<=CRC_VARIANT_ARMV8 ; variant++) {
+		if (mycrc32_variant_supported(variant)==0) {
+			printf("variant %s: not supported\n",mycrc32_variant_name(variant));
+			continue;
+		}
+		mfstest_assert_int32_eq(mycrc32_set_variant(variant),0);
+
+		printf("variant %s: correctness\n",mycrc32_variant_name(variant));
+		// all lengths around folding boundaries and all alignments
+		for (i=0 ; i<16 ; i++) {
+			for (j=0 ; j<300 ; j++) {
+				mfstest_assert_uint32_eq(mycrc32(i*j,block+i,j),crc32_reference(i*j,block+i,j));
+			}
+		}
+		mfstest_assert_uint32_eq(mycrc32(0,block,BENCH_BLOCK),crc32_reference(0,block,BENCH_BLOCK));
+		mfstest_assert_uint32_eq(mycrc32(0,block+3,BENCH_BLOCK-3),crc32_reference(0,block+3,BENCH_BLOCK-3));
+		for (i=1 ; i<BENCH_BLOCK ; i+=997) {
+			crc1 = crc32_reference(0,block,i);
+			crc2 = crc32_reference(0,block+i,BENCH_BLOCK-i);
+			mfstest_assert_uint32_eq(mycrc32_combine(crc1,crc2,BENCH_BLOCK-i),crc32_reference(0,block,BENCH_BLOCK));
+		}
+		for (i=0 ; i<=64 ; i++) {
+			crc = crc32_reference(i,block,i);
+			mfstest_assert_uint32_eq(mycrc32_zeroexpanded(0,block+64,BENCH_BLOCK-64,i),crc32_reference(0,block+64,BENCH_BLOCK-64+i));
+			mfstest_assert_uint32_eq(mycrc32_zeroblock(crc,i),crc32_reference(crc,block+BENCH_BLOCK,i));
+		}
+
+		crc = 0;
+		st = monotonic_seconds();
+		for (i=0 ; i<BENCH_LOOPS ; i++) {
+			crc = mycrc32(crc,block,BENCH_BLOCK);
+		}
+		en = monotonic_seconds();
+		printf("variant %s: mycrc32 (64k blocks): %.3lf GB/s (crc: %08"PRIX32")\n",mycrc32_variant_name(variant),(BENCH_LOOPS*(double)BENCH_BLOCK)/((en-st)*1000000000.0),crc);
+
+		crc = 0;
+		st = monotonic_seconds();
+		for (i=0 ; i<BENCH_COMBINE_LOOPS ; i++) {
+			crc = mycrc32_combine(crc,i,(i&0xFFFF)+1);
+		}
+		en = monotonic_seconds();
+		printf("variant %s: mycrc32_combine: %.3lf Mops/s (crc: %08"PRIX32")\n",mycrc32_variant_name(variant),BENCH_COMBINE_LOOPS/((en-st)*1000000.0),crc);
+	}
+	free(block);
+
+	mfstest_end();
+	mfstest_return();
+}
@@ -29,6 +29,7 @@ int main(void) {
 	uint64_t buff[2];
 	uint8_t *wp;
 	const uint8_t *rp;
+	uint64_t v;
 	uint32_t i;
 
 	mfstest_init();
@@ -89,6 +90,33 @@ int main(void) {
 		mfstest_assert_uint8_eq(rp[i],((15-i)*0x10)+i);
 	}
 	mfstest_end();
+
+	mfstest_start(varint);
+	wp = (uint8_t*)buff;
+	putvarint(&wp,0x7F);
+	putvarint(&wp,0x80);
+	putvarint(&wp,0x3FFF);
+	mfstest_assert_uint32_eq(wp-(uint8_t*)buff,5);
+	rp = (uint8_t*)buff;
+	mfstest_assert_uint8_eq(rp[0],0x7F);
+	mfstest_assert_uint8_eq(rp[1],0x80);
+	mfstest_assert_uint8_eq(rp[2],0x01);
+	mfstest_assert_int32_eq(getvarint(&rp,wp,&v),0);
+	mfstest_assert_uint64_eq(v,0x7F);
+	mfstest_assert_int32_eq(getvarint(&rp,wp,&v),0);
+	mfstest_assert_uint64_eq(v,0x80);
+	mfstest_assert_int32_eq(getvarint(&rp,wp,&v),0);
+	mfstest_assert_uint64_eq(v,0x3FFF);
+	mfstest_assert_int32_eq(getvarint(&rp,wp,&v),-1);
+	wp = (uint8_t*)buff;
+	putvarint(&wp,UINT64_C(0xFFFFFFFFFFFFFFFF));
+	mfstest_assert_uint32_eq(wp-(uint8_t*)buff,10);
+	rp = (uint8_t*)buff;
+	mfstest_assert_int32_eq(getvarint(&rp,wp-1,&v),-1);
+	rp = (uint8_t*)buff;
+	mfstest_assert_int32_eq(getvarint(&rp,wp,&v),0);
+	mfstest_assert_uint64_eq(v,UINT64_C(0xFFFFFFFFFFFFFFFF));
+	mfstest_end();
 	mfstest_return();
 }
 
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ *
+ * This file is part of MooseFS.
+ *
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ *
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "MFSCommunication.h"
+#include "datapack.h"
+#include "sockets.h"
+#include "hddspacemgr.h"
+#include "mainserv.h"
+#include "main.h"
+
+#include "mfstest.h"
+
+// threaded read path (mainserv_read) on top of fake chunk storage - every block prepared for sendfile has to be released together with its descriptor
+
+#define TEST_BLOCKS 4
+
+static int datafd;
+static uint32_t sfprepared;
+static uint32_t sfended;
+static uint32_t sfclosed;
+
+void main_destruct_register(void (*fun)(void)) {
+	(void)fun;
+}
+
+void hdd_precache_data(uint64_t chunkid,uint32_t offset,uint32_t size) {
+	(void)chunkid;
+	(void)offset;
+	(void)size;
+}
+
+int hdd_open(uint64_t chunkid,uint32_t version) {
+	(void)chunkid;
+	(void)version;
+	return MFS_STATUS_OK;
+}
+
+int hdd_close(uint64_t chunkid) {
+	(void)chunkid;
+	return MFS_STATUS_OK;
+}
+
+int hdd_read_range(uint64_t chunkid,uint32_t version,uint32_t offset,uint32_t size,uint8_t * const *buffers,uint8_t * const *crcbuffs) {
+	uint32_t i,blocks;
+	uint8_t *wptr;
+	(void)chunkid;
+	(void)version;
+	blocks = ((offset+size-1)>>MFSBLOCKBITS) - (offset>>MFSBLOCKBITS) + 1;
+	for (i=0 ; i<blocks ; i++) {
+		memset(buffers[i],0,(size<MFSBLOCKSIZE)?size:MFSBLOCKSIZE);
+		wptr = crcbuffs[i];
+		put32bit(&wptr,0);
+	}
+	return MFS_STATUS_OK;
+}
+
+int hdd_write(uint64_t chunkid,uint32_t version,uint16_t blocknum,const uint8_t *buffer,uint32_t offset,uint32_t size,const uint8_t *crcbuff) {
+	(void)chunkid;
+	(void)version;
+	(void)blocknum;
+	(void)buffer;
+	(void)offset;
+	(void)size;
+	(void)crcbuff;
+	return MFS_ERROR_IO;
+}
+
+int hdd_read_sendfile_prepare(uint64_t chunkid,uint32_t version,uint16_t blocknum,int *fd,uint64_t *fileoffset,uint8_t *crcbuff) {
+	(void)chunkid;
+	(void)version;
+#if defined(__linux__)
+	*fd = dup(datafd);
+	*fileoffset = ((uint64_t)blocknum)<<MFSBLOCKBITS;
+	put32bit(&crcbuff,0);
+	sfprepared++;
+	return MFS_STATUS_OK;
+#else
+	(void)blocknum;
+	(void)fd;
+	(void)fileoffset;
+	(void)crcbuff;
+	return MFS_ERROR_ENOTSUP;
+#endif
+}
+
+void hdd_read_sendfile_end(uint64_t chunkid,int fd) {
+	(void)chunkid;
+	if (fd!=datafd && close(fd)==0) {
+		sfclosed++;
+	}
+	sfended++;
+}
+
+void* drain_thread(void *arg) {
+	int sock = *((int*)arg);
+	uint8_t buff[65536];
+	while (read(sock,buff,65536)>0) {}
+	return NULL;
+}
+
+static void mkrequest(uint8_t *buff,uint32_t size) {
+	put64bit(&buff,1);	// chunkid
+	put32bit(&buff,1);	// version
+	put32bit(&buff,0);	// offset
+	put32bit(&buff,size);
+}
+
+int main(void) {
+	char fname[] = "/tmp/mfstest_mainserv.XXXXXX";
+	uint8_t req[20];
+	uint8_t *zeros;
+	int sp[2];
+	pthread_t th;
+	mfstest_init();
+
+	mfstest_start(mainserv_read_sendfile);
+
+	signal(SIGPIPE,SIG_IGN);
+	datafd = mkstemp(fname);
+	unlink(fname);
+	zeros = calloc(TEST_BLOCKS,MFSBLOCKSIZE);
+	mfstest_assert_int32_eq(write(datafd,zeros,TEST_BLOCKS*MFSBLOCKSIZE),TEST_BLOCKS*MFSBLOCKSIZE);
+	free(zeros);
+	mfstest_assert_int32_eq(mainserv_init(),1);
+
+	// all blocks sent
+	sfprepared = sfended = sfclosed = 0;
+	mfstest_assert_int32_eq(socketpair(AF_UNIX,SOCK_STREAM,0,sp),0);
+	tcpnonblock(sp[0]);	// client sockets are always non blocking (see csserv)
+	pthread_create(&th,NULL,drain_thread,sp+1);
+	mkrequest(req,TEST_BLOCKS*MFSBLOCKSIZE);
+	mfstest_assert_uint8_eq(mainserv_read(sp[0],req,20),1);
+	close(sp[0]);
+	pthread_join(th,NULL);
+	close(sp[1]);
+#if defined(__linux__)
+	mfstest_assert_uint32_eq(sfprepared,TEST_BLOCKS);
+#endif
+	mfstest_assert_uint32_eq(sfended,sfprepared);
+	mfstest_assert_uint32_eq(sfclosed,sfprepared);
+
+	// client gone - first block can't be sent
+	sfprepared = sfended = sfclosed = 0;
+	mfstest_assert_int32_eq(socketpair(AF_UNIX,SOCK_STREAM,0,sp),0);
+	tcpnonblock(sp[0]);
+	close(sp[1]);
+	mkrequest(req,TEST_BLOCKS*MFSBLOCKSIZE);
+	mfstest_assert_uint8_eq(mainserv_read(sp[0],req,20),0);
+	close(sp[0]);
+	mfstest_assert_uint32_eq(sfended,sfprepared);
+	mfstest_assert_uint32_eq(sfclosed,sfprepared);
+
+	close(datafd);
+
+	mfstest_end();
+	mfstest_return();
+}
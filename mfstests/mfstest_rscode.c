@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MFSCommunication.h"
+#include "clocks.h"
+#include "crc.h"
+#include "rscode.h"
+
+#include "mfstest.h"
+
+#define TEST_PART 1000
+#define BENCH_K 8
+#define BENCH_M 3
+#define BENCH_PART (MFSBLOCKSIZE/4)
+#define BENCH_LOOPS 2048
+
+uint32_t simple_pseudo_random(void) {
+	static uint32_t u=1249853491;
+	static uint32_t v=3456394786;
+
+	v = 36969*(v & 65535) + (v >> 16);
+	u = 18000*(u & 65535) + (u >> 16);
+
+	return (v << 16) + u;
+}
+
+/* byte by byte combination using only rs_gf_mul - reference for all variants */
+void rs_reference(uint8_t *dst,const uint8_t * const *srcs,const uint8_t *coefs,uint32_t srccnt,uint32_t leng) {
+	uint32_t i,j;
+
+	memset(dst,0,leng);
+	for (i=0 ; i<srccnt ; i++) {
+		for (j=0 ; j<leng ; j++) {
+			dst[j] ^= rs_gf_mul(coefs[i],srcs[i][j]);
+		}
+	}
+}
+
+int main(void) {
+	uint8_t *parts[RS_MAXDATA+RS_MAXPARITY];
+	uint8_t *res,*ref;
+	const uint8_t *srcs[RS_MAXDATA];
+	uint8_t srcparts[RS_MAXDATA];
+	uint8_t coefs[RS_MAXDATA];
+	uint32_t crcs[RS_MAXDATA];
+	uint32_t *crcptrs[RS_MAXDATA];
+	uint8_t variant,k,m,lost,p,i,n;
+	uint32_t j,leng;
+	double st,en;
+
+	mfstest_init();
+
+	mycrc32_init();
+	rs_init();
+
+	mfstest_start(rscode);
+
+	printf("default variant: %s\n",rs_variant_name(rs_get_variant()));
+
+	for (i=0 ; i<RS_MAXDATA+RS_MAXPARITY ; i++) {
+		parts[i] = malloc(BENCH_PART+64);
+		if (parts[i]==NULL) {
+			return 99;
+		}
+	}
+	res = malloc(BENCH_PART+64);
+	ref = malloc(BENCH_PART+64);
+	if (res==NULL || ref==NULL) {
+		return 99;
+	}
+
+	mfstest_assert_int32_eq(rs_coefs(0,1,srcparts,0,coefs),-1);
+	mfstest_assert_int32_eq(rs_coefs(RS_MAXDATA+1,1,srcparts,0,coefs),-1);
+	srcparts[0] = 1;
+	srcparts[1] = 1;
+	mfstest_assert_int32_eq(rs_coefs(2,1,srcparts,0,coefs),-1);
+	srcparts[1] = 3;
+	mfstest_assert_int32_eq(rs_coefs(2,1,srcparts,0,coefs),-1);
+
+	for (variant=RS_VARIANT_GENERIC ; variant<=RS_VARIANT_NEON ; variant++) {
+		if (rs_variant_supported(variant)==0) {
+			printf("variant %s: not supported\n",rs_variant_name(variant));
+			continue;
+		}
+		mfstest_assert_int32_eq(rs_set_variant(variant),0);
+
+		printf("variant %s: correctness\n",rs_variant_name(variant));
+		// kernel against reference for all lengths around vector sizes and unaligned buffers
+		for (n=1 ; n<=8 ; n++) {
+			for (i=0 ; i<n ; i++) {
+				srcs[i] = parts[i]+((i*5+n)&63);
+				coefs[i] = simple_pseudo_random();
+				for (j=0 ; j<TEST_PART ; j++) {
+					parts[i][j] = simple_pseudo_random();
+				}
+			}
+			for (leng=0 ; leng<300 ; leng+=7) {
+				rs_reference(ref,srcs,coefs,n,leng);
+				rs_combine(res+n,srcs,coefs,n,leng);
+				mfstest_assert_int32_eq(memcmp(res+n,ref,leng),0);
+			}
+		}
+		// encode k+m and rebuild every part from other k parts (rotating choice of sources)
+		for (k=1 ; k<=10 ; k++) {
+			for (m=1 ; m<=4 ; m++) {
+				for (i=0 ; i<k ; i++) {
+					for (j=0 ; j<TEST_PART ; j++) {
+						parts[i][j] = simple_pseudo_random();
+					}
+					srcs[i] = parts[i];
+					srcparts[i] = i;
+				}
+				for (i=0 ; i<m ; i++) {
+					mfstest_assert_int32_eq(rs_coefs(k,m,srcparts,k+i,coefs),0);
+					rs_combine(parts[k+i],srcs,coefs,k,TEST_PART);
+				}
+				for (lost=0 ; lost<k+m ; lost++) {
+					// k parts following the lost one (cyclically) - different mixes of data and parity parts
+					p = lost;
+					for (n=0 ; n<k ; n++) {
+						p = (p+1)%(k+m);
+						srcparts[n] = p;
+						srcs[n] = parts[p];
+					}
+					mfstest_assert_int32_eq(rs_coefs(k,m,srcparts,lost,coefs),0);
+					rs_combine(res,srcs,coefs,k,TEST_PART);
+					mfstest_assert_int32_eq(memcmp(res,parts[lost],TEST_PART),0);
+				}
+			}
+		}
+		// checksums calculated in the same pass
+		for (i=0 ; i<BENCH_K ; i++) {
+			for (j=0 ; j<BENCH_PART ; j++) {
+				parts[i][j] = simple_pseudo_random();
+			}
+			srcs[i] = parts[i];
+			srcparts[i] = i;
+			crcs[i] = 0;
+			crcptrs[i] = (i&1)?NULL:crcs+i;
+		}
+		mfstest_assert_int32_eq(rs_coefs(BENCH_K,BENCH_M,srcparts,BENCH_K,coefs),0);
+		rs_reference(ref,srcs,coefs,BENCH_K,BENCH_PART);
+		rs_combine_crc(res,srcs,coefs,crcptrs,BENCH_K,BENCH_PART);
+		mfstest_assert_int32_eq(memcmp(res,ref,BENCH_PART),0);
+		for (i=0 ; i<BENCH_K ; i++) {
+			mfstest_assert_uint32_eq(crcs[i],(i&1)?0:mycrc32(0,srcs[i],BENCH_PART));
+		}
+
+		st = monotonic_seconds();
+		for (j=0 ; j<BENCH_LOOPS ; j++) {
+			rs_combine(res,srcs,coefs,BENCH_K,BENCH_PART);
+		}
+		en = monotonic_seconds();
+		printf("variant %s: rs_combine (%u+%u, one part from %u sources): %.3lf GB/s\n",rs_variant_name(variant),BENCH_K,BENCH_M,BENCH_K,(BENCH_LOOPS*(double)BENCH_K*BENCH_PART)/((en-st)*1000000000.0));
+	}
+	for (i=0 ; i<RS_MAXDATA+RS_MAXPARITY ; i++) {
+		free(parts[i]);
+	}
+	free(res);
+	free(ref);
+
+	mfstest_end();
+	mfstest_return();
+}
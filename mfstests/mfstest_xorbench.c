@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2020 Jakub Kruszona-Zawadzki, Core Technology Sp. z o.o.
+ * 
+ * This file is part of MooseFS.
+ * 
+ * MooseFS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (only).
+ * 
+ * MooseFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MooseFS; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02111-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MFSCommunication.h"
+#include "clocks.h"
+#include "crc.h"
+#include "xorblock.h"
+
+#include "mfstest.h"
+
+#define BENCH_SOURCES 8
+#define BENCH_PART (MFSBLOCKSIZE/4)
+#define BENCH_LOOPS 4096
+
+uint32_t simple_pseudo_random(void) {
+	static uint32_t u=1249853491;
+	static uint32_t v=3456394786;
+
+	v = 36969*(v & 65535) + (v >> 16);
+	u = 18000*(u & 65535) + (u >> 16);
+
+	return (v << 16) + u;
+}
+
+/* byte by byte xor of first srccnt sources - reference for all variants */
+void xor_reference(uint8_t *dst,const uint8_t * const *srcs,uint32_t srccnt,uint32_t leng) {
+	uint32_t i,j;
+
+	memset(dst,0,leng);
+	for (i=0 ; i<srccnt ; i++) {
+		for (j=0 ; j<leng ; j++) {
+			dst[j] ^= srcs[i][j];
+		}
+	}
+}
+
+int main(void) {
+	uint8_t *data,*ref,*res;
+	const uint8_t *srcs[BENCH_SOURCES];
+	uint32_t crcs[BENCH_SOURCES];
+	uint32_t *crcptrs[BENCH_SOURCES];
+	uint8_t variant;
+	uint32_t i,j,k,leng,xcrc;
+	double st,en;
+
+	mfstest_init();
+
+	mycrc32_init();
+	xorblock_init();
+
+	mfstest_start(xorbench);
+
+	printf("default variant: %s\n",xorblock_variant_name(xorblock_get_variant()));
+
+	data = malloc(BENCH_SOURCES*BENCH_PART+64);
+	ref = malloc(BENCH_PART+64);
+	res = malloc(BENCH_PART+64);
+	if (data==NULL || ref==NULL || res==NULL) {
+		return 99;
+	}
+	for (i=0 ; i<BENCH_SOURCES*BENCH_PART+64 ; i++) {
+		data[i] = simple_pseudo_random();
+	}
+
+	for (variant=XOR_VARIANT_GENERIC ; variant<=XOR_VARIANT_NEON ; variant++) {
+		if (xorblock_variant_supported(variant)==0) {
+			printf("variant %s: not supported\n",xorblock_variant_name(variant));
+			continue;
+		}
+		mfstest_assert_int32_eq(xorblock_set_variant(variant),0);
+
+		printf("variant %s: correctness\n",xorblock_variant_name(variant));
+		// all source counts, lengths around vector sizes and unaligned buffers
+		for (k=1 ; k<=BENCH_SOURCES ; k++) {
+			for (leng=0 ; leng<600 ; leng+=7) {
+				for (i=0 ; i<k ; i++) {
+					srcs[i] = data+i*BENCH_PART+((i*3+leng)&63);
+				}
+				xor_reference(ref,srcs,k,leng);
+				xorblock_multi(res+(k&15),srcs,k,leng);
+				mfstest_assert_int32_eq(memcmp(res+(k&15),ref,leng),0);
+			}
+		}
+		for (i=0 ; i<BENCH_SOURCES ; i++) {
+			srcs[i] = data+i*BENCH_PART+i;
+			crcs[i] = 0;
+			crcptrs[i] = (i&1)?NULL:crcs+i;
+		}
+		xor_reference(ref,srcs,BENCH_SOURCES,BENCH_PART);
+		xorblock_multi_crc(res,srcs,crcptrs,BENCH_SOURCES,BENCH_PART);
+		mfstest_assert_int32_eq(memcmp(res,ref,BENCH_PART),0);
+		xcrc = 0;
+		for (i=0 ; i<BENCH_SOURCES ; i++) {
+			if (i&1) {
+				mfstest_assert_uint32_eq(crcs[i],0);
+			} else {
+				mfstest_assert_uint32_eq(crcs[i],mycrc32(0,srcs[i],BENCH_PART));
+			}
+			xcrc ^= mycrc32(0,srcs[i],BENCH_PART);
+		}
+		// crc of xor of even number of parts = xor of their crcs and crc of zero part
+		mfstest_assert_uint32_eq(mycrc32(0,res,BENCH_PART),xcrc^mycrc32_zeroblock(0,BENCH_PART));
+		memcpy(res,srcs[0],BENCH_PART);
+		xorblock(res,srcs[1],BENCH_PART);
+		xor_reference(ref,srcs,2,BENCH_PART);
+		mfstest_assert_int32_eq(memcmp(res,ref,BENCH_PART),0);
+
+		st = monotonic_seconds();
+		for (j=0 ; j<BENCH_LOOPS ; j++) {
+			memcpy(res,srcs[0],BENCH_PART);
+			for (i=1 ; i<BENCH_SOURCES ; i++) {
+				xorblock(res,srcs[i],BENCH_PART);
+			}
+		}
+		en = monotonic_seconds();
+		printf("variant %s: xorblock (%u sources, pass per source): %.3lf GB/s\n",xorblock_variant_name(variant),BENCH_SOURCES,(BENCH_LOOPS*(double)BENCH_SOURCES*BENCH_PART)/((en-st)*1000000000.0));
+
+		st = monotonic_seconds();
+		for (j=0 ; j<BENCH_LOOPS ; j++) {
+			xorblock_multi(res,srcs,BENCH_SOURCES,BENCH_PART);
+		}
+		en = monotonic_seconds();
+		printf("variant %s: xorblock_multi (%u sources, one pass): %.3lf GB/s\n",xorblock_variant_name(variant),BENCH_SOURCES,(BENCH_LOOPS*(double)BENCH_SOURCES*BENCH_PART)/((en-st)*1000000000.0));
+
+		for (i=0 ; i<BENCH_SOURCES ; i++) {
+			crcptrs[i] = crcs+i;
+		}
+		st = monotonic_seconds();
+		for (j=0 ; j<BENCH_LOOPS ; j++) {
+			for (i=0 ; i<BENCH_SOURCES ; i++) {
+				crcs[i] = 0;
+			}
+			xorblock_multi_crc(res,srcs,crcptrs,BENCH_SOURCES,BENCH_PART);
+		}
+		en = monotonic_seconds();
+		printf("variant %s: xorblock_multi_crc (%u sources, one pass with checksums): %.3lf GB/s\n",xorblock_variant_name(variant),BENCH_SOURCES,(BENCH_LOOPS*(double)BENCH_SOURCES*BENCH_PART)/((en-st)*1000000000.0));
+	}
+	free(data);
+	free(ref);
+	free(res);
+
+	mfstest_end();
+	mfstest_return();
+}